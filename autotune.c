@@ -0,0 +1,279 @@
+#include "autotune.h"
+
+#include <string.h>
+
+#define AUTOTUNE_NAME_SIZE 64
+
+static const size_t autotune_shapes_1d[][2] = {
+	{ 0, 0 }, { 32, 1 }, { 64, 1 }, { 128, 1 }, { 256, 1 }, { 512, 1 }, { 1024, 1 }
+};
+
+// rows of a scanline against square blocks
+static const size_t autotune_shapes_2d[][2] = {
+	{ 0, 0 }, { 64, 1 }, { 128, 1 }, { 256, 1 }, { 8, 8 }, { 16, 8 }, { 32, 8 }, { 16, 16 }
+};
+
+#define autotune_count(shapes) (sizeof(shapes) / sizeof((shapes)[0]))
+
+static void autotune_profile_path(const char* dir, cl_device_id device, char* path) {
+	snprintf(path, AUTOTUNE_PATH_SIZE, "%s/map_color_%016llx.tune", dir,
+		(unsigned long long)program_cache_device_key(device));
+}
+
+static void autotune_kernel_name(cl_kernel kernel, char* name) {
+	name[0] = 0;
+	clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, AUTOTUNE_NAME_SIZE, name, NULL);
+	name[AUTOTUNE_NAME_SIZE - 1] = 0;
+}
+
+static int autotune_shape_fits(struct cl_data_t* cld, cl_kernel kernel, const size_t* shape) {
+	size_t group_size = 0, item_sizes[3] = { 0, 0, 0 };
+	if (clGetKernelWorkGroupInfo(kernel, cld->device, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(size_t), &group_size, NULL) != CL_SUCCESS) return 0;
+	if (clGetDeviceInfo(cld->device, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+		sizeof(item_sizes), item_sizes, NULL) != CL_SUCCESS) return 0;
+	return shape[0] * shape[1] <= group_size && shape[0] <= item_sizes[0] && shape[1] <= item_sizes[1];
+}
+
+int autotune_load(struct cl_data_t* cld) {
+	char path[AUTOTUNE_PATH_SIZE], line[256];
+	char name[AUTOTUNE_NAME_SIZE], kernel_name[AUTOTUNE_NAME_SIZE];
+	cl_kernel* k = (cl_kernel*)&cld->kernels;
+	unsigned long loaded = 0;
+
+	if (cld->options.program_cache_dir == NULL) return EXIT_FAILURE;
+	autotune_profile_path(cld->options.program_cache_dir, cld->device, path);
+	FILE* f = fopen(path, "r");
+	if (f == NULL) return EXIT_FAILURE;
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long lx = 0, ly = 0;
+		if (sscanf(line, "%63s %lu %lu", name, &lx, &ly) != 3 || lx == 0 || ly == 0) continue;
+		size_t shape[2] = { lx, ly };
+		for (size_t i = 0; i < KERNEL_COUNT; i++) {
+			if (k[i] == NULL) continue;
+			autotune_kernel_name(k[i], kernel_name);
+			// a profile from another build of the kernels may not fit any more
+			if (strcmp(name, kernel_name) != 0 || !autotune_shape_fits(cld, k[i], shape)) continue;
+			cld->launch_local[i][0] = shape[0];
+			cld->launch_local[i][1] = shape[1];
+			loaded++;
+		}
+	}
+	fclose(f);
+
+	printf("\n\t< Launch profile: %s (%lu kernels);\n", path, loaded);
+	return EXIT_SUCCESS;
+}
+
+int autotune_store(struct cl_data_t* cld, const char* dir) {
+	char path[AUTOTUNE_PATH_SIZE], name[AUTOTUNE_NAME_SIZE];
+	cl_kernel* k = (cl_kernel*)&cld->kernels;
+
+	autotune_profile_path(dir, cld->device, path);
+	FILE* f = fopen(path, "w");
+	check(f == NULL, "Cannot open launch profile", EXIT_FAILURE)
+
+	name[0] = 0;
+	clGetDeviceInfo(cld->device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+	name[AUTOTUNE_NAME_SIZE - 1] = 0;
+	fprintf(f, "# %s\n", name);
+	for (size_t i = 0; i < KERNEL_COUNT; i++) {
+		if (k[i] == NULL || cld->launch_local[i][0] == 0) continue;
+		autotune_kernel_name(k[i], name);
+		fprintf(f, "%s %lu %lu\n", name,
+			(unsigned long)cld->launch_local[i][0], (unsigned long)cld->launch_local[i][1]);
+	}
+	check(fclose(f) != 0, "Cannot write launch profile", EXIT_FAILURE)
+
+	printf("\n\t< Launch profile stored: %s;\n", path);
+	return EXIT_SUCCESS;
+}
+
+int autotune_preferred_device(const char* dir, cl_device_id* device) {
+	char path[AUTOTUNE_PATH_SIZE];
+	unsigned long long key = 0;
+	cl_device_id* list = NULL;
+	size_t count = 0;
+	int callres = EXIT_FAILURE;
+
+	if (dir == NULL) return EXIT_FAILURE;
+	snprintf(path, sizeof(path), "%s/" AUTOTUNE_DEVICE_FILE, dir);
+	FILE* f = fopen(path, "r");
+	if (f == NULL) return EXIT_FAILURE;
+	int found = fscanf(f, "%llx", &key) == 1;
+	fclose(f);
+
+	if (!found || list_devices(&list, &count) != EXIT_SUCCESS) return EXIT_FAILURE;
+	for (size_t i = 0; i < count && callres != EXIT_SUCCESS; i++) {
+		if (program_cache_device_key(list[i]) != key) continue;
+		*device = list[i];
+		callres = EXIT_SUCCESS;
+	}
+	free(list);
+	return callres;
+}
+
+// The whole pipeline once on a copy of the map: the device paints the copy,
+// never the output. A failed stage tears the environment down.
+static int autotune_pass(struct cl_data_t* cld, struct bmp_map* source, char* pixels,
+	struct profiler_t* profiler, double* wall
+) {
+	struct bmp_map copy = *source;
+	struct graph_as_row_t g;
+	int callres = EXIT_SUCCESS;
+
+	memset(&copy.map, 0, sizeof(struct host_file_map_t));
+	copy.linear_sequence = pixels;
+	memcpy(pixels, source->linear_sequence, source->image_row_pitch * source->image_height);
+
+	cld->options.profiler = profiler;
+	double start = host_wall_time();
+	if (setup_shared_buffers(cld, &copy) != EXIT_SUCCESS ||
+		parse_map(cld, &copy) != EXIT_SUCCESS ||
+		build_graph(&g, cld, &copy, 1) != EXIT_SUCCESS) callres = EXIT_FAILURE;
+	else {
+		if (graph_coloring(&g) != EXIT_SUCCESS ||
+			apply_colors_and_mask(cld, &copy, &g) != EXIT_SUCCESS) callres = EXIT_FAILURE;
+		release_map_graph(cld, &g);
+	}
+	*wall = host_wall_time() - start;
+	cld->options.profiler = NULL;
+	return callres;
+}
+
+// device time of one kernel over the recorded pass
+static double autotune_kernel_time(struct profiler_t* profiler, const char* name) {
+	double total = 0;
+	for (size_t i = 0; i < profiler->count; i++) {
+		struct profiler_span_t* s = profiler->spans + i;
+		if (s->recorded && s->track == PROFILER_DEVICE && strcmp(s->name, name) == 0)
+			total += s->end - s->start;
+	}
+	return total;
+}
+
+static const size_t* autotune_candidate(cl_uint dims, size_t pass) {
+	if (dims == 1) return pass < autotune_count(autotune_shapes_1d) ? autotune_shapes_1d[pass] : NULL;
+	return pass < autotune_count(autotune_shapes_2d) ? autotune_shapes_2d[pass] : NULL;
+}
+
+// every candidate pass sets one shape per kernel, a kernel keeps the shape of
+// its fastest pass; *wall is the pass time with all the winners
+static int autotune_device(cl_device_id device, struct bmp_map* source, char* pixels,
+	const struct map_options_t* options, double* wall
+) {
+	struct cl_data_t cld;
+	struct profiler_t profiler;
+	double best_time[KERNEL_COUNT];
+	size_t best_local[KERNEL_COUNT][2];
+	size_t pass_count = autotune_count(autotune_shapes_1d);
+	char name[AUTOTUNE_NAME_SIZE];
+	cl_kernel* k = NULL;
+	int callres = EXIT_SUCCESS;
+
+	if (autotune_count(autotune_shapes_2d) > pass_count) pass_count = autotune_count(autotune_shapes_2d);
+	check(setup_environment_on_device(options->kernel_file, &cld, device, options) != EXIT_SUCCESS,
+		"Cannot setup device", EXIT_FAILURE)
+	k = (cl_kernel*)&cld.kernels;
+
+	// from the driver defaults, not from an older profile; the warm-up pass
+	// also finds the kernels launched through cl_launch
+	memset(cld.launch_local, 0, sizeof(cld.launch_local));
+	check_goto_temp(autotune_pass(&cld, source, pixels, NULL, wall) != EXIT_SUCCESS,
+		"Autotune warm-up failed", EXIT_FAILURE)
+
+	memset(best_local, 0, sizeof(best_local));
+	for (size_t i = 0; i < KERNEL_COUNT; i++) best_time[i] = -1;
+
+	for (size_t pass = 0; pass < pass_count; pass++) {
+		for (size_t i = 0; i < KERNEL_COUNT; i++) {
+			const size_t* shape = autotune_candidate(cld.launch_dims[i], pass);
+			int fits = cld.launch_dims[i] && shape && shape[0] && autotune_shape_fits(&cld, k[i], shape);
+			cld.launch_local[i][0] = fits ? shape[0] : 0;
+			cld.launch_local[i][1] = fits ? shape[1] : 0;
+		}
+
+		profiler_init(&profiler);
+		callres = autotune_pass(&cld, source, pixels, &profiler, wall);
+		profiler_collect(&profiler);
+		for (size_t i = 0; i < KERNEL_COUNT && callres == EXIT_SUCCESS; i++) {
+			if (cld.launch_dims[i] == 0) continue;
+			autotune_kernel_name(k[i], name);
+			double t = autotune_kernel_time(&profiler, name);
+			if (t <= 0 || (best_time[i] >= 0 && t >= best_time[i])) continue;
+			best_time[i] = t;
+			best_local[i][0] = cld.launch_local[i][0];
+			best_local[i][1] = cld.launch_local[i][1];
+		}
+		distruct_profiler(&profiler);
+		check_goto_temp(callres != EXIT_SUCCESS, "Autotune pass failed", EXIT_FAILURE)
+	}
+
+	memcpy(cld.launch_local, best_local, sizeof(best_local));
+	for (size_t i = 0; i < KERNEL_COUNT; i++) {
+		if (cld.launch_dims[i] == 0 || best_time[i] < 0) continue;
+		autotune_kernel_name(k[i], name);
+		if (best_local[i][0]) printf("\n\t< %s: %lux%lu, %fs;\n", name,
+			(unsigned long)best_local[i][0], (unsigned long)best_local[i][1], best_time[i]);
+		else printf("\n\t< %s: default, %fs;\n", name, best_time[i]);
+	}
+
+	check_goto_temp(autotune_pass(&cld, source, pixels, NULL, wall) != EXIT_SUCCESS,
+		"Autotune final pass failed", EXIT_FAILURE)
+	check_goto_temp(autotune_store(&cld, options->program_cache_dir) != EXIT_SUCCESS,
+		"Cannot store launch profile", EXIT_FAILURE)
+
+free_temporary_resources:
+	distruct_environment(&cld, NULL);
+	return callres;
+}
+
+int autotune_map(struct bmp_map* bmp, const struct map_options_t* options) {
+	struct map_options_t tune_options = *options;
+	cl_device_id* devices = NULL;
+	size_t device_count = 0, best = SIZE_MAX;
+	double best_wall = 0;
+	char* pixels = NULL;
+	char path[AUTOTUNE_PATH_SIZE], name[AUTOTUNE_NAME_SIZE];
+	int callres = EXIT_SUCCESS;
+
+	check(options->program_cache_dir == NULL, "No directory for launch profiles", EXIT_FAILURE)
+	check(list_devices(&devices, &device_count) != EXIT_SUCCESS, "Cannot list devices", EXIT_FAILURE)
+	pixels = (char*)malloc(bmp->image_row_pitch * bmp->image_height);
+	check_goto_temp(pixels == NULL, "Cannot allocate memory for the autotune map", EXIT_FAILURE)
+	// each pass records into its own profiler and paints its private copy
+	tune_options.profiler = NULL;
+	tune_options.indexed_bits = 0;
+
+	for (size_t d = 0; d < device_count; d++) {
+		double wall = 0;
+		name[0] = 0;
+		clGetDeviceInfo(devices[d], CL_DEVICE_NAME, sizeof(name), name, NULL);
+		name[AUTOTUNE_NAME_SIZE - 1] = 0;
+		printf("\n\t< Autotune device %lu: %s;\n", (unsigned long)d, name);
+
+		if (autotune_device(devices[d], bmp, pixels, &tune_options, &wall) != EXIT_SUCCESS) {
+			printf("\n\t< Autotune device %lu: skipped;\n", (unsigned long)d);
+			continue;
+		}
+		printf("\n\t< Autotune device %lu: %fs;\n", (unsigned long)d, wall);
+		if (best == SIZE_MAX || wall < best_wall) {
+			best = d;
+			best_wall = wall;
+		}
+	}
+	check_goto_temp(best == SIZE_MAX, "No device could be tuned", EXIT_FAILURE)
+
+	snprintf(path, sizeof(path), "%s/" AUTOTUNE_DEVICE_FILE, options->program_cache_dir);
+	FILE* f = fopen(path, "w");
+	check_goto_temp(f == NULL, "Cannot open preferred device file", EXIT_FAILURE)
+	fprintf(f, "%016llx\n", (unsigned long long)program_cache_device_key(devices[best]));
+	check_goto_temp(fclose(f) != 0, "Cannot write preferred device file", EXIT_FAILURE)
+	printf("\n\t< Autotune: device %lu is the fastest;\n", (unsigned long)best);
+
+free_temporary_resources:
+	if (pixels) free(pixels);
+	free(devices);
+	return callres;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "ocl_map_to_graph.h"
+
+#define AUTOTUNE_PATH_SIZE 1024
+#define AUTOTUNE_DEVICE_FILE "map_color_device.tune"
+
+// Launch profiles: the work-group shape of every kernel launched through
+// cl_launch, per device, in <cache dir>/map_color_<device key>.tune as
+// "kernel lx ly" lines (device key: program_cache_device_key). The fastest
+// device of the last sweep is named in AUTOTUNE_DEVICE_FILE, setup_device
+// picks it while it is present.
+//
+// autotune_map runs the whole pipeline on a private copy of the map for every
+// device and every candidate shape: 1D kernels sweep group sizes, 2D kernels
+// sweep row shapes (n x 1) against square ones. Kernel times come from the
+// queue's profiling events, the device total from the best shapes' wall time.
+int autotune_map(struct bmp_map*, const struct map_options_t*);
+
+// the profile of cld->device, a missing file keeps the driver defaults
+int autotune_load(struct cl_data_t*);
+int autotune_store(struct cl_data_t*, const char* dir);
+
+// the device named by the last sweep, EXIT_FAILURE without one
+int autotune_preferred_device(const char* dir, cl_device_id*);
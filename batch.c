@@ -0,0 +1,241 @@
+#include "batch.h"
+
+#include <string.h>
+
+struct batch_list_t {
+	char** inputs;
+	size_t count;
+};
+
+// host side of one double buffer slot
+struct batch_io_t {
+	struct bmp_map* slot;
+	unsigned char has_result;
+	const char* next_input;
+	const char* next_output;
+	int read_result;
+	unsigned char indexed; // inputs only read, results written by write_indexed_map
+};
+
+static int batch_push(struct batch_list_t* l, size_t* capacity, const char* path) {
+	if (l->count == *capacity) {
+		size_t new_capacity = *capacity ? *capacity * 2 : 64;
+		char** grown = (char**)realloc(l->inputs, new_capacity * sizeof(char*));
+		check(grown == NULL, "Cannot allocate batch list", EXIT_FAILURE)
+		l->inputs = grown;
+		*capacity = new_capacity;
+	}
+	size_t len = strlen(path);
+	char* copy = (char*)malloc(len + 1);
+	check(copy == NULL, "Cannot allocate batch list", EXIT_FAILURE)
+	memcpy(copy, path, len + 1);
+	l->inputs[l->count++] = copy;
+	return EXIT_SUCCESS;
+}
+
+static int batch_collect(const char* source, struct batch_list_t* l) {
+	char path[batch_path_size];
+	size_t capacity = 0;
+	l->inputs = NULL;
+	l->count = 0;
+
+	if (host_is_directory(source)) {
+		char** names = NULL;
+		size_t count = 0;
+		check(host_list_directory(source, ".bmp", &names, &count) != EXIT_SUCCESS,
+			"Cannot list batch directory", EXIT_FAILURE)
+		for (size_t i = 0; i < count; i++) {
+			snprintf(path, sizeof(path), "%s/%s", source, names[i]);
+			if (batch_push(l, &capacity, path) != EXIT_SUCCESS) {
+				host_free_list(names, count);
+				return EXIT_FAILURE;
+			}
+		}
+		host_free_list(names, count);
+		return EXIT_SUCCESS;
+	}
+
+	FILE* list = fopen(source, "r");
+	check(list == NULL, "Cannot open batch list file", EXIT_FAILURE)
+	while (fgets(path, sizeof(path), list)) {
+		path[strcspn(path, "\r\n")] = 0;
+		if (path[0] == 0 || path[0] == '#') continue;
+		if (batch_push(l, &capacity, path) != EXIT_SUCCESS) {
+			fclose(list);
+			return EXIT_FAILURE;
+		}
+	}
+	fclose(list);
+	return EXIT_SUCCESS;
+}
+
+static void batch_output_path(char* dst, size_t size, const char* output_dir, const char* input) {
+	const char* name = input;
+	for (const char* p = input; *p; p++) {
+		if (*p == '/' || *p == '\\') name = p + 1;
+	}
+	snprintf(dst, size, "%s/%s", output_dir, name);
+}
+
+static int batch_open(struct bmp_map* slot, const char* input, const char* output, unsigned char indexed) {
+	return indexed ? bmp_map_open(slot, input, 0) : bmp_map_setup(slot, input, output);
+}
+
+static void batch_io_job(void* ctx) {
+	struct batch_io_t* io = (struct batch_io_t*)ctx;
+
+	if (io->has_result) {
+		if (!io->indexed) bmp_map_put_result(io->slot);
+		distruct_bmp_map(io->slot);
+		io->has_result = 0;
+	}
+
+	io->read_result = EXIT_FAILURE;
+	if (io->next_input)
+		io->read_result = batch_open(io->slot, io->next_input, io->next_output, io->indexed);
+}
+
+static int batch_process_map(struct cl_data_t* cld, struct band_set_t* bands, struct bmp_map* bmp,
+	const char* output
+) {
+	struct graph_as_row_t g;
+	struct profiler_t* profiler = cld->options.profiler;
+	size_t span = (size_t)-1;
+	int callres = EXIT_SUCCESS;
+
+	if (bands) {
+		span = profiler_begin(profiler, "bands");
+		callres = band_process_map(bands, bmp);
+		profiler_end(profiler, span);
+		return callres;
+	}
+
+	if (cld->options.tile_rows) {
+		span = profiler_begin(profiler, "strips");
+		callres = tiled_process_map(bmp, &cld->options, &cld->arena);
+		profiler_end(profiler, span);
+		// grows the block to this map's peak
+		host_arena_reset(&cld->arena);
+		return callres;
+	}
+
+	memset(&g, 0, sizeof(g));
+	span = profiler_begin(profiler, "labeling");
+	check_goto_temp(setup_shared_buffers(cld, bmp) != EXIT_SUCCESS, "Cannot setup map buffers", EXIT_FAILURE)
+	check_goto_temp(parse_map(cld, bmp) != EXIT_SUCCESS, "Cannot parse map", EXIT_FAILURE)
+	profiler_end(profiler, span);
+
+	span = profiler_begin(profiler, "graph init");
+	check_goto_temp(build_graph(&g, cld, bmp, 1) != EXIT_SUCCESS, "Cannot build graph", EXIT_FAILURE)
+	profiler_end(profiler, span);
+
+	span = profiler_begin(profiler, "coloring");
+	check_goto_temp((cld->options.parallel_coloring ?
+		graph_coloring_parallel(&g, cld->options.thread_count) : graph_coloring(&g)) != EXIT_SUCCESS,
+		"Cannot color graph", EXIT_FAILURE)
+	profiler_end(profiler, span);
+
+	span = profiler_begin(profiler, "apply colors");
+	check_goto_temp((cld->options.indexed_bits ?
+		write_indexed_map(cld, bmp, &g, output) : apply_colors_and_mask(cld, bmp, &g)) != EXIT_SUCCESS,
+		"Cannot apply colors", EXIT_FAILURE)
+
+free_temporary_resources:
+	// a failed stage ends its span too
+	profiler_end(profiler, span);
+	// the next map reuses this one's host memory, failed or not
+	release_map_graph(cld, &g);
+	// release this map's events instead of holding the whole batch
+	profiler_collect(profiler);
+	return callres;
+}
+
+int batch_run(const char* source, const char* output_dir, const struct map_options_t* options) {
+	struct batch_list_t list;
+	struct cl_data_t cld;
+	struct band_set_t bands;
+	unsigned char use_bands = options->device_bands && !options->tile_rows;
+	struct bmp_map slots[2];
+	unsigned char slot_ready[2] = { 0, 0 };
+	struct batch_io_t io;
+	struct host_thread_t io_thread = { NULL, NULL, NULL };
+	char output_paths[2][batch_path_size];
+	size_t maps_done = 0, pixels_done = 0;
+	int callres = EXIT_SUCCESS;
+
+	bmp_map_init(slots);
+	bmp_map_init(slots + 1);
+	memset(&io, 0, sizeof(io));
+	io.indexed = options->indexed_bits != 0;
+
+	check(batch_collect(source, &list) != EXIT_SUCCESS, "Cannot collect batch inputs", EXIT_FAILURE)
+	printf("\n\t< Batch: %lu maps;\n", (unsigned long)list.count);
+
+	// band sizes learn every device's rate over the batch
+	init_setup_environment(&cld);
+	cld.options = *options;
+	memset(&bands, 0, sizeof(struct band_set_t));
+	if (use_bands)
+		check_goto_temp(band_set_setup(&bands, options) != EXIT_SUCCESS, "Cannot setup device bands", EXIT_FAILURE)
+	else
+		check_goto_temp(setup_environment(options->kernel_file, &cld, NULL, options) != EXIT_SUCCESS,
+			"Cannot setup environment", EXIT_FAILURE)
+
+	double time_start = host_wall_time();
+
+	if (list.count) {
+		batch_output_path(output_paths[0], batch_path_size, output_dir, list.inputs[0]);
+		slot_ready[0] = batch_open(slots, list.inputs[0], output_paths[0], io.indexed) == EXIT_SUCCESS;
+	}
+
+	for (size_t i = 0; i < list.count; i++) {
+		size_t cur = i % 2, next = (i + 1) % 2;
+
+		// the other slot: write map i - 1, then read map i + 1 into it
+		io.slot = slots + next;
+		io.has_result = i > 0 && slot_ready[next];
+		io.next_input = NULL;
+		if (i + 1 < list.count) {
+			batch_output_path(output_paths[next], batch_path_size, output_dir, list.inputs[i + 1]);
+			io.next_input = list.inputs[i + 1];
+			io.next_output = output_paths[next];
+		}
+		if (host_thread_start(&io_thread, batch_io_job, &io) != EXIT_SUCCESS)
+			batch_io_job(&io);
+
+		if (slot_ready[cur]) {
+			printf("\n\t< [%lu/%lu] %s;\n", (unsigned long)(i + 1), (unsigned long)list.count, list.inputs[i]);
+			if (batch_process_map(&cld, use_bands ? &bands : NULL, slots + cur, output_paths[cur]) != EXIT_SUCCESS) {
+				host_thread_join(&io_thread);
+				check_goto_temp(1, "Batch stopped on a device failure", EXIT_FAILURE)
+			}
+			maps_done++;
+			pixels_done += slots[cur].mask_size;
+		}
+		else printf("\n\t< [%lu/%lu] %s: skipped;\n", (unsigned long)(i + 1), (unsigned long)list.count, list.inputs[i]);
+
+		host_thread_join(&io_thread);
+		slot_ready[next] = io.next_input && io.read_result == EXIT_SUCCESS;
+	}
+
+	if (list.count && slot_ready[(list.count - 1) % 2] && !io.indexed) {
+		bmp_map_put_result(slots + (list.count - 1) % 2);
+	}
+
+	double elapsed = host_wall_time() - time_start;
+	if (elapsed <= 0) elapsed = 1e-9;
+	printf("\n\t< Batch: %lu/%lu maps; %.3fs; %.2f maps/s; %.2f MP/s;\n",
+		(unsigned long)maps_done, (unsigned long)list.count, elapsed,
+		maps_done / elapsed, pixels_done / elapsed / 1e6);
+	if (!use_bands) printf("\n\t< Host arena: %.1f MB%s; device pool: %lu buffers;\n", cld.arena.size / 1e6,
+		cld.arena.huge_backed ? " on huge pages" : "", (unsigned long)cld.pool.count);
+
+free_temporary_resources:
+	distruct_environment(&cld, NULL);
+	distruct_band_set(&bands);
+	distruct_bmp_map(slots);
+	distruct_bmp_map(slots + 1);
+	for (size_t i = 0; i < list.count; i++) free(list.inputs[i]);
+	free(list.inputs);
+	return callres;
+}
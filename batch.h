@@ -0,0 +1,14 @@
+#pragma once
+
+#include "ocl_map_to_graph.h"
+#include "host_platform.h"
+#include "tiled_map.h"
+#include "device_bands.h"
+
+#define batch_path_size 1024
+
+// Colors every map of a directory (*.bmp) or a list file (one path per line)
+// into output_dir. The context, program, kernels and device buffers live for
+// the whole batch; reading the next map and writing the previous result run on
+// a host thread while the device works on the current one.
+int batch_run(const char* source, const char* output_dir, const struct map_options_t* options);
@@ -0,0 +1,290 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ocl_map_to_graph.h"
+
+// Stage benchmark over a set of maps (see mapgen):
+//	map_bench [options] <map.bmp>...
+// Every map runs -repeat times through the same stages as a batch run; the
+// best time of each stage is reported as MP/s and regions/s. Results are one
+// JSON object per line, so a stored result file is also a baseline.
+
+#define BENCH_STAGE_COUNT 6
+#define BENCH_NAME_SIZE 256
+#define BENCH_TOLERANCE 0.10
+
+enum bench_stage_t {
+	BENCH_READ, // copy and map the input
+	BENCH_UPLOAD, // setup_shared_buffers
+	BENCH_PARSE, // parse_map
+	BENCH_GRAPH, // build_graph
+	BENCH_COLORING, // graph_coloring
+	BENCH_APPLY // apply_colors_and_mask
+};
+
+static const char* bench_stage_names[BENCH_STAGE_COUNT] = {
+	"bmp_read", "upload", "parse_map", "build_graph", "graph_coloring", "apply_colors"
+};
+
+struct bench_options_t {
+	struct map_options_t map;
+	size_t repeat;
+	const char* output_file;
+	const char* json_file;
+	const char* baseline_file;
+	double tolerance;
+};
+
+struct bench_result_t {
+	char map[BENCH_NAME_SIZE];
+	double megapixels;
+	size_t regions;
+	size_t edges;
+	double best[BENCH_STAGE_COUNT];
+	double median[BENCH_STAGE_COUNT];
+};
+
+static const char* bench_base_name(const char* path) {
+	const char* name = path;
+	for (const char* p = path; *p; p++)
+		if (*p == '/' || *p == '\\') name = p + 1;
+	return name;
+}
+
+static int bench_compare_time(const void* a, const void* b) {
+	double da = *(const double*)a, db = *(const double*)b;
+	return da < db ? -1 : da > db;
+}
+
+static int bench_run_once(struct cl_data_t* cld, const char* input, const char* output,
+	struct bench_result_t* r, double* times
+) {
+	struct bmp_map bmp;
+	struct graph_as_row_t g;
+	int callres = EXIT_SUCCESS;
+	unsigned char graph_ready = 0;
+	double t;
+
+	// the output copy gets colored, so every run starts from the input again
+	t = host_wall_time();
+	check(bmp_map_setup(&bmp, input, output) != EXIT_SUCCESS, "Cannot read map", EXIT_FAILURE)
+	times[BENCH_READ] = host_wall_time() - t;
+
+	t = host_wall_time();
+	check_goto_temp(setup_shared_buffers(cld, &bmp) != EXIT_SUCCESS, "Cannot upload map", EXIT_FAILURE)
+	clFinish(cld->command_queue);
+	times[BENCH_UPLOAD] = host_wall_time() - t;
+
+	// the device labels on until build_graph waits for the area count
+	t = host_wall_time();
+	check_goto_temp(parse_map(cld, &bmp) != EXIT_SUCCESS, "Cannot parse map", EXIT_FAILURE)
+	times[BENCH_PARSE] = host_wall_time() - t;
+
+	t = host_wall_time();
+	check_goto_temp(build_graph(&g, cld, &bmp, 1) != EXIT_SUCCESS, "Cannot build graph", EXIT_FAILURE)
+	times[BENCH_GRAPH] = host_wall_time() - t;
+	graph_ready = 1;
+
+	t = host_wall_time();
+	check_goto_temp((cld->options.parallel_coloring ?
+		graph_coloring_parallel(&g, cld->options.thread_count) : graph_coloring(&g)) != EXIT_SUCCESS,
+		"Cannot color graph", EXIT_FAILURE)
+	times[BENCH_COLORING] = host_wall_time() - t;
+
+	t = host_wall_time();
+	check_goto_temp(apply_colors_and_mask(cld, &bmp, &g) != EXIT_SUCCESS, "Cannot apply colors", EXIT_FAILURE)
+	times[BENCH_APPLY] = host_wall_time() - t;
+
+	r->megapixels = bmp.mask_size / 1e6;
+	r->regions = cld->vertex_count;
+	r->edges = g.storage == GRAPH_SPARSE ? g.edge_count : 0;
+
+free_temporary_resources:
+	if (graph_ready) release_map_graph(cld, &g);
+	else host_arena_reset(&cld->arena);
+	distruct_bmp_map(&bmp);
+	return callres;
+}
+
+static int bench_run_map(struct cl_data_t* cld, const struct bench_options_t* o, const char* input,
+	struct bench_result_t* r
+) {
+	double* runs = (double*)calloc(o->repeat * BENCH_STAGE_COUNT, sizeof(double));
+	int callres = EXIT_SUCCESS;
+
+	check(runs == NULL, "Cannot allocate run times", EXIT_FAILURE)
+	memset(r, 0, sizeof(struct bench_result_t));
+	strncpy(r->map, bench_base_name(input), BENCH_NAME_SIZE - 1);
+
+	for (size_t i = 0; i < o->repeat; i++)
+		check_goto_temp(bench_run_once(cld, input, o->output_file, r, runs + i * BENCH_STAGE_COUNT) != EXIT_SUCCESS,
+			"Benchmark run failed", EXIT_FAILURE)
+
+	for (size_t s = 0; s < BENCH_STAGE_COUNT; s++) {
+		double* times = (double*)malloc(o->repeat * sizeof(double));
+		check_goto_temp(times == NULL, "Cannot allocate run times", EXIT_FAILURE)
+		for (size_t i = 0; i < o->repeat; i++) times[i] = runs[i * BENCH_STAGE_COUNT + s];
+		qsort(times, o->repeat, sizeof(double), bench_compare_time);
+		r->best[s] = times[0];
+		r->median[s] = times[o->repeat / 2];
+		free(times);
+	}
+
+free_temporary_resources:
+	free(runs);
+	return callres;
+}
+
+static double bench_rate(double amount, double seconds) {
+	return seconds > 0 ? amount / seconds : 0;
+}
+
+static void bench_write_results(FILE* f, const struct bench_result_t* results, size_t count) {
+	for (size_t m = 0; m < count; m++) {
+		const struct bench_result_t* r = results + m;
+		for (size_t s = 0; s < BENCH_STAGE_COUNT; s++)
+			fprintf(f, "{\"map\":\"%s\",\"stage\":\"%s\",\"megapixels\":%.3f,\"regions\":%lu,\"edges\":%lu,"
+				"\"best_s\":%.6f,\"median_s\":%.6f,\"mp_per_s\":%.3f,\"regions_per_s\":%.1f}\n",
+				r->map, bench_stage_names[s], r->megapixels, (unsigned long)r->regions, (unsigned long)r->edges,
+				r->best[s], r->median[s], bench_rate(r->megapixels, r->best[s]),
+				bench_rate((double)r->regions, r->best[s]));
+	}
+}
+
+// looks up "best_s" of map/stage in a result file written by bench_write_results
+static int bench_baseline_time(FILE* f, const char* map, const char* stage, double* best) {
+	char line[1024], key[BENCH_NAME_SIZE + 64];
+	snprintf(key, sizeof(key), "{\"map\":\"%s\",\"stage\":\"%s\",", map, stage);
+	rewind(f);
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, key, strlen(key)) != 0) continue;
+		const char* value = strstr(line, "\"best_s\":");
+		if (value == NULL) return EXIT_FAILURE;
+		*best = strtod(value + strlen("\"best_s\":"), NULL);
+		return EXIT_SUCCESS;
+	}
+	return EXIT_FAILURE;
+}
+
+static int bench_compare_baseline(const struct bench_options_t* o, const struct bench_result_t* results, size_t count) {
+	FILE* f = fopen(o->baseline_file, "r");
+	size_t regressions = 0;
+	check(f == NULL, "Cannot open baseline file", EXIT_FAILURE)
+
+	printf("\n\t< Baseline %s (tolerance %.0f%%):\n", o->baseline_file, o->tolerance * 100);
+	for (size_t m = 0; m < count; m++) {
+		for (size_t s = 0; s < BENCH_STAGE_COUNT; s++) {
+			double base = 0, cur = results[m].best[s];
+			if (bench_baseline_time(f, results[m].map, bench_stage_names[s], &base) != EXIT_SUCCESS || base <= 0) {
+				printf("\t  %-32s %-16s %10.6fs   (no baseline)\n", results[m].map, bench_stage_names[s], cur);
+				continue;
+			}
+			double ratio = cur / base;
+			unsigned char slower = ratio > 1 + o->tolerance;
+			regressions += slower;
+			printf("\t  %-32s %-16s %10.6fs %10.6fs %+7.1f%%%s\n", results[m].map, bench_stage_names[s],
+				cur, base, (ratio - 1) * 100, slower ? "  REGRESSION" : "");
+		}
+	}
+	fclose(f);
+
+	printf("\n\t< Regressions: %lu;\n", (unsigned long)regressions);
+	return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int bench_parse_arguments(int argc, char** argv, struct bench_options_t* o, int* first_map) {
+	memset(o, 0, sizeof(struct bench_options_t));
+	o->map.labeling_backend = LABELING_OPENCL;
+	o->map.program_cache = 1;
+	o->map.program_cache_dir = program_cache_default_dir();
+	o->repeat = 3;
+	o->output_file = "map_bench_out.bmp";
+	o->tolerance = BENCH_TOLERANCE;
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-cpu") == 0) o->map.labeling_backend = LABELING_CPU;
+		else if (strcmp(argv[i], "-legacy-labeling") == 0) o->map.labeling_backend = LABELING_OPENCL_LEGACY;
+		else if (strcmp(argv[i], "-border") == 0 && i + 1 < argc) {
+			if (border_predicate_parse(argv[++i], &o->map.border) != EXIT_SUCCESS) {
+				o->repeat = 0; // usage
+				break;
+			}
+		}
+		else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) o->map.thread_count = (size_t)strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "-parallel-color") == 0) o->map.parallel_coloring = 1;
+		else if (strcmp(argv[i], "-dense") == 0) o->map.graph_storage = GRAPH_DENSE;
+		else if (strcmp(argv[i], "-edge-limit") == 0 && i + 1 < argc) o->map.edge_search_limit = (size_t)strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "-no-cache") == 0) o->map.program_cache = 0;
+		else if (strcmp(argv[i], "-huge-pages") == 0) o->map.huge_pages = 1;
+		else if (strcmp(argv[i], "-kernels") == 0 && i + 1 < argc) o->map.kernel_file = argv[++i];
+		else if (strcmp(argv[i], "-repeat") == 0 && i + 1 < argc) o->repeat = (size_t)strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "-out") == 0 && i + 1 < argc) o->output_file = argv[++i];
+		else if (strcmp(argv[i], "-json") == 0 && i + 1 < argc) o->json_file = argv[++i];
+		else if (strcmp(argv[i], "-baseline") == 0 && i + 1 < argc) o->baseline_file = argv[++i];
+		else if (strcmp(argv[i], "-tolerance") == 0 && i + 1 < argc) o->tolerance = strtod(argv[++i], NULL) / 100;
+		else break;
+	}
+
+	if (i >= argc || argv[i][0] == '-' || o->repeat == 0) {
+		printf("Usage: %s [-cpu | -legacy-labeling] [-border MODE] [-threads N] [-parallel-color] [-dense] [-edge-limit N]"
+			" [-no-cache] [-huge-pages] [-kernels FILE] [-repeat N] [-out FILE] [-json FILE] [-baseline FILE]"
+			" [-tolerance PERCENT] <map.bmp>...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	*first_map = i;
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv) {
+	struct bench_options_t o;
+	struct cl_data_t cld;
+	struct bench_result_t* results = NULL;
+	size_t result_count = 0;
+	int first_map = 0;
+	int callres = EXIT_SUCCESS;
+
+	if (bench_parse_arguments(argc, argv, &o, &first_map) != EXIT_SUCCESS) return EXIT_FAILURE;
+
+	results = (struct bench_result_t*)calloc((size_t)(argc - first_map), sizeof(struct bench_result_t));
+	check(results == NULL, "Cannot allocate results", EXIT_FAILURE)
+
+	check_goto_temp(setup_environment(o.map.kernel_file, &cld, NULL, &o.map) != EXIT_SUCCESS,
+		"Cannot setup environment", EXIT_FAILURE)
+
+	for (int i = first_map; i < argc; i++) {
+		printf("\n\t< %s x%lu;\n", argv[i], (unsigned long)o.repeat);
+		check_goto_temp(bench_run_map(&cld, &o, argv[i], results + result_count) != EXIT_SUCCESS,
+			"Benchmark stopped", EXIT_FAILURE)
+		result_count++;
+	}
+
+	printf("\n\t< Best of %lu (MP/s, regions/s):\n", (unsigned long)o.repeat);
+	for (size_t m = 0; m < result_count; m++) {
+		const struct bench_result_t* r = results + m;
+		printf("\t  %s: %.1f MP, %lu regions\n", r->map, r->megapixels, (unsigned long)r->regions);
+		for (size_t s = 0; s < BENCH_STAGE_COUNT; s++)
+			printf("\t    %-16s %10.6fs %10.1f MP/s %12.0f regions/s\n", bench_stage_names[s], r->best[s],
+				bench_rate(r->megapixels, r->best[s]), bench_rate((double)r->regions, r->best[s]));
+	}
+
+	if (o.json_file) {
+		FILE* f = fopen(o.json_file, "w");
+		check_goto_temp(f == NULL, "Cannot open json file", EXIT_FAILURE)
+		bench_write_results(f, results, result_count);
+		fclose(f);
+	}
+	else bench_write_results(stdout, results, result_count);
+
+	if (o.baseline_file) callres = bench_compare_baseline(&o, results, result_count);
+
+free_temporary_resources:
+	distruct_environment(&cld, NULL);
+	free(results);
+	return callres;
+}
@@ -0,0 +1,556 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "region_state.h"
+#include "region_index.h"
+#include "tiled_map.h"
+
+// Host-only checks on a map (see mapgen), no OpenCL device needed:
+//	map_check [-threads N] <map.bmp>
+// round trips - the region state and the raw and RLE region index of a
+// colored map are read back by their documented layouts and compared with the
+// mask and graph they were written from.
+// incremental - a state saved from the map is updated by region_state_update
+// with two edits of it (a border line drawn with -dirty, a border patch erased
+// without), each update has to match a state saved from a full labeling of the
+// edited map: the same partition of the pixels, boxes, edges and walk counts;
+// the kept colors have to stay proper and the output has to show them.
+// Work files are written next to the map.
+
+#define VERIFY_PATH_SIZE 1024
+
+// a state file read back by its layout, see region_state.h
+struct verify_state_t {
+	unsigned char* data;
+	struct region_state_header_t header;
+	const mask_cell* mask;
+	const struct region_box_t* boxes;
+	const struct graph_edge_t* edges;
+	const uint32_t* walks;
+	const uint8_t* colors;
+};
+
+static void distruct_verify_state(struct verify_state_t* s) {
+	if (s->data) free(s->data);
+	memset(s, 0, sizeof(struct verify_state_t));
+}
+
+static int verify_read_file(const char* path, unsigned char** data, size_t* size) {
+	FILE* f = fopen(path, "rb");
+	long length = 0;
+	*data = NULL;
+	check(f == NULL, "Cannot open file", EXIT_FAILURE)
+	if (fseek(f, 0, SEEK_END) == 0) length = ftell(f);
+	*data = length > 0 ? (unsigned char*)malloc((size_t)length) : NULL;
+	int read = *data && fseek(f, 0, SEEK_SET) == 0 && fread(*data, 1, (size_t)length, f) == (size_t)length;
+	fclose(f);
+	if (!read && *data) {
+		free(*data);
+		*data = NULL;
+	}
+	check(!read, "Cannot read file", EXIT_FAILURE)
+	*size = (size_t)length;
+	return EXIT_SUCCESS;
+}
+
+static int verify_read_state(const char* path, struct verify_state_t* s) {
+	size_t size = 0;
+	int callres = EXIT_SUCCESS;
+	memset(s, 0, sizeof(struct verify_state_t));
+	check(verify_read_file(path, &s->data, &size) != EXIT_SUCCESS, "Cannot read region state", EXIT_FAILURE)
+	check_goto_temp(size < sizeof(s->header), "Region state is too short", EXIT_FAILURE)
+
+	memcpy(&s->header, s->data, sizeof(s->header));
+	size_t cells = (size_t)(s->header.width * s->header.height);
+	size_t vertices = (size_t)s->header.vertex_count + 1, edges = (size_t)s->header.edge_count;
+	size_t tail = vertices * (sizeof(struct region_box_t) + 1) + edges * (sizeof(struct graph_edge_t) + sizeof(uint32_t));
+	check_goto_temp(s->header.magic != REGION_STATE_MAGIC || s->header.version != REGION_STATE_VERSION,
+		"Not a region state of this version", EXIT_FAILURE)
+	check_goto_temp(s->header.tail_capacity != tail || size != sizeof(s->header) + cells * sizeof(mask_cell) + tail,
+		"Region state size does not match its header", EXIT_FAILURE)
+
+	const unsigned char* p = s->data + sizeof(s->header);
+	s->mask = (const mask_cell*)p;
+	p += cells * sizeof(mask_cell);
+	s->boxes = (const struct region_box_t*)p;
+	p += vertices * sizeof(struct region_box_t);
+	s->edges = (const struct graph_edge_t*)p;
+	p += edges * sizeof(struct graph_edge_t);
+	s->walks = (const uint32_t*)p;
+	p += edges * sizeof(uint32_t);
+	s->colors = p;
+
+free_temporary_resources:
+	if (callres != EXIT_SUCCESS) distruct_verify_state(s);
+	return callres;
+}
+
+static int verify_live(const struct verify_state_t* s, size_t v) {
+	return s->boxes[v].x1 != 0;
+}
+
+// a labeled map with the colored graph of its state edges
+struct verify_map_t {
+	size_t width;
+	size_t height;
+	mask_cell* mask;
+	struct graph_as_row_t g;
+	unsigned char graph_ready;
+};
+
+static void distruct_verify_map(struct verify_map_t* m) {
+	if (m->graph_ready) distruct_graph_as_row(&m->g);
+	if (m->mask) free(m->mask);
+	memset(m, 0, sizeof(struct verify_map_t));
+}
+
+static color_id_t verify_color(const struct graph_as_row_t* g, size_t v) {
+	return g->color_ids[v] ? (color_id_t)1 << bitfield_lowest_bit((bitfield_cell)g->color_ids[v]) : 0;
+}
+
+// a full run on the host: labels, a first state for the edges of its walks,
+// the colors of a graph built from them, then the state again with the colors
+static int verify_label(const char* map, const char* state, size_t thread_count, struct verify_map_t* m) {
+	struct bmp_map bmp;
+	struct border_predicate_t border;
+	struct verify_state_t s;
+	size_t vertex_count = 0;
+	int callres = EXIT_SUCCESS;
+
+	memset(m, 0, sizeof(struct verify_map_t));
+	memset(&border, 0, sizeof(border));
+	memset(&s, 0, sizeof(s));
+	bmp_map_init(&bmp);
+	check_goto_temp(bmp_map_open(&bmp, map, 0) != EXIT_SUCCESS, "Cannot open map", EXIT_FAILURE)
+	m->width = bmp.image_width;
+	m->height = bmp.image_height;
+	m->mask = (mask_cell*)malloc(bmp.mask_size * sizeof(mask_cell));
+	check_goto_temp(m->mask == NULL, "Cannot allocate mask", EXIT_FAILURE)
+	check_goto_temp(cpu_label_map(bmp.linear_sequence, m->width, m->height, m->mask, &vertex_count,
+		thread_count, &border, NULL) != EXIT_SUCCESS, "Cannot label map", EXIT_FAILURE)
+
+	check_goto_temp(graph_alloc_sparse(&m->g, vertex_count, NULL) != EXIT_SUCCESS, "Cannot allocate graph", EXIT_FAILURE)
+	m->graph_ready = 1;
+	check_goto_temp(region_state_save(state, m->width, m->height, m->mask, &m->g, EDGE_SEARCH_LIMIT, &border)
+		!= EXIT_SUCCESS, "Cannot save region state", EXIT_FAILURE)
+	distruct_graph_as_row(&m->g);
+	m->graph_ready = 0;
+
+	check_goto_temp(verify_read_state(state, &s) != EXIT_SUCCESS, "Cannot read region state", EXIT_FAILURE)
+	check_goto_temp(graph_init_sparse(&m->g, vertex_count, s.edges, (size_t)s.header.edge_count, NULL) != EXIT_SUCCESS,
+		"Cannot build graph", EXIT_FAILURE)
+	m->graph_ready = 1;
+	check_goto_temp(graph_coloring(&m->g) != EXIT_SUCCESS, "Cannot color graph", EXIT_FAILURE)
+	for (size_t v = 1; v < vertex_count + 1; v++)
+		check_goto_temp(m->g.color_ids[v] == 0 ||
+			bitfield_lowest_bit((bitfield_cell)m->g.color_ids[v]) >= graph_color_palette,
+			"Map needs more colors than the palette", EXIT_FAILURE)
+	check_goto_temp(region_state_save(state, m->width, m->height, m->mask, &m->g, EDGE_SEARCH_LIMIT, &border)
+		!= EXIT_SUCCESS, "Cannot save region state", EXIT_FAILURE)
+
+free_temporary_resources:
+	distruct_bmp_map(&bmp);
+	distruct_verify_state(&s);
+	if (callres != EXIT_SUCCESS) distruct_verify_map(m);
+	return callres;
+}
+
+// the state of verify_label and an output painted from it
+static int verify_full_run(const char* map, const char* state, const char* output, size_t thread_count) {
+	struct verify_map_t m;
+	struct bmp_map bmp;
+	int callres = EXIT_SUCCESS;
+
+	bmp_map_init(&bmp);
+	check(verify_label(map, state, thread_count, &m) != EXIT_SUCCESS, "Cannot run full map", EXIT_FAILURE)
+	check_goto_temp(host_copy_file(map, output) != EXIT_SUCCESS, "Cannot copy map", EXIT_FAILURE)
+	check_goto_temp(bmp_map_open(&bmp, output, 1) != EXIT_SUCCESS, "Cannot open output", EXIT_FAILURE)
+	for (size_t y = 0, i = 0; y < bmp.image_height; y++) {
+		unsigned char* px = (unsigned char*)bmp.linear_sequence + y * bmp.image_row_pitch;
+		for (size_t x = 0; x < bmp.image_width; x++, i++, px += 4)
+			tiled_color_pixel(px, m.mask[i] ? verify_color(&m.g, m.mask[i]) : 0);
+	}
+	check_goto_temp(bmp_map_put_result(&bmp) != EXIT_SUCCESS, "Cannot write output", EXIT_FAILURE)
+
+free_temporary_resources:
+	distruct_bmp_map(&bmp);
+	distruct_verify_map(&m);
+	return callres;
+}
+
+// [x0, x1) x [y0, y1) of a copy of the map set to border (blue 0) or erased to white
+static int verify_edit(const char* map, const char* edited, const size_t* box, unsigned char border) {
+	struct bmp_map bmp;
+	int callres = EXIT_SUCCESS;
+
+	bmp_map_init(&bmp);
+	check(host_copy_file(map, edited) != EXIT_SUCCESS, "Cannot copy map", EXIT_FAILURE)
+	check(bmp_map_open(&bmp, edited, 1) != EXIT_SUCCESS, "Cannot open edited map", EXIT_FAILURE)
+	for (size_t y = box[1]; y < box[3]; y++) {
+		unsigned char* px = (unsigned char*)bmp.linear_sequence + y * bmp.image_row_pitch + box[0] * 4;
+		for (size_t x = box[0]; x < box[2]; x++, px += 4) memset(px, border ? 0 : 0xFF, 3);
+	}
+	check_goto_temp(bmp_map_put_result(&bmp) != EXIT_SUCCESS, "Cannot write edited map", EXIT_FAILURE)
+
+free_temporary_resources:
+	distruct_bmp_map(&bmp);
+	return callres;
+}
+
+static int verify_compare_edges(const void* a, const void* b) {
+	const struct graph_edge_t* x = (const struct graph_edge_t*)a;
+	const struct graph_edge_t* y = (const struct graph_edge_t*)b;
+	if (x->lv != y->lv) return x->lv < y->lv ? -1 : 1;
+	return x->rv < y->rv ? -1 : x->rv > y->rv;
+}
+
+static void verify_report(const char* name, size_t mismatches, size_t* failed) {
+	printf("\t  %-40s %s", name, mismatches ? "FAILED" : "ok");
+	if (mismatches) printf(" (%lu mismatches)", (unsigned long)mismatches);
+	printf("\n");
+	*failed += mismatches != 0;
+}
+
+// ids of an updated state differ from a full run, regions are matched through the mask
+static int verify_incremental_state(const char* updated, const char* full, const char* output, size_t* failed) {
+	struct verify_state_t u, f;
+	struct bmp_map bmp;
+	gid_t* to_full = NULL; // updated id -> full id
+	gid_t* to_updated = NULL;
+	size_t mismatches = 0;
+	int callres = EXIT_SUCCESS;
+
+	memset(&u, 0, sizeof(u));
+	memset(&f, 0, sizeof(f));
+	bmp_map_init(&bmp);
+	check_goto_temp(verify_read_state(updated, &u) != EXIT_SUCCESS || verify_read_state(full, &f) != EXIT_SUCCESS,
+		"Cannot read region states", EXIT_FAILURE)
+	check_goto_temp(u.header.width != f.header.width || u.header.height != f.header.height,
+		"Region states differ in size", EXIT_FAILURE)
+	size_t cells = (size_t)(u.header.width * u.header.height);
+	size_t uv = (size_t)u.header.vertex_count, fv = (size_t)f.header.vertex_count;
+	size_t edge_count = (size_t)u.header.edge_count;
+	to_full = (gid_t*)calloc(uv + 1, sizeof(gid_t));
+	to_updated = (gid_t*)calloc(fv + 1, sizeof(gid_t));
+	check_goto_temp(!to_full || !to_updated, "Cannot allocate id maps", EXIT_FAILURE)
+
+	mismatches = u.header.search_limit != f.header.search_limit || u.header.border_mode != f.header.border_mode;
+	verify_report("header", mismatches, failed);
+
+	// the same partition: a one to one map between the labels of the two masks
+	mismatches = 0;
+	for (size_t i = 0; i < cells; i++) {
+		mask_cell a = u.mask[i], b = f.mask[i];
+		if ((a == 0) != (b == 0) || a > uv || b > fv) { mismatches++; continue; }
+		if (a == 0) continue;
+		if (to_full[a] == 0 && to_updated[b] == 0) { to_full[a] = b; to_updated[b] = a; }
+		else mismatches += to_full[a] != b || to_updated[b] != a;
+	}
+	verify_report("mask", mismatches, failed);
+
+	// live ids are the regions of the mask with their boxes, free ids are empty
+	mismatches = 0;
+	for (size_t v = 1; v < uv + 1; v++) {
+		if (!verify_live(&u, v)) { mismatches += to_full[v] != 0; continue; }
+		mismatches += to_full[v] == 0 || memcmp(u.boxes + v, f.boxes + to_full[v], sizeof(struct region_box_t)) != 0;
+	}
+	for (size_t v = 1; v < fv + 1; v++) mismatches += to_updated[v] == 0;
+	verify_report("boxes", mismatches, failed);
+
+	// every edge of the full run in updated ids, with the same walk count;
+	// as many edges on both sides, so nothing is left over either
+	mismatches = edge_count != (size_t)f.header.edge_count;
+	for (size_t e = 0; e < (size_t)f.header.edge_count; e++) {
+		gid_t lv = to_updated[f.edges[e].lv], rv = to_updated[f.edges[e].rv];
+		struct graph_edge_t key;
+		key.lv = lv < rv ? lv : rv;
+		key.rv = lv < rv ? rv : lv;
+		const struct graph_edge_t* hit = (const struct graph_edge_t*)bsearch(&key, u.edges, edge_count,
+			sizeof(struct graph_edge_t), verify_compare_edges);
+		mismatches += hit == NULL || u.walks[hit - u.edges] != f.walks[e];
+	}
+	verify_report("edges and walk counts", mismatches, failed);
+
+	// colors stay proper on the updated graph
+	mismatches = 0;
+	for (size_t e = 0; e < edge_count; e++)
+		mismatches += u.colors[u.edges[e].lv] == u.colors[u.edges[e].rv];
+	for (size_t v = 1; v < uv + 1; v++)
+		mismatches += verify_live(&u, v) && u.colors[v] >= graph_color_palette;
+	verify_report("colors", mismatches, failed);
+
+	// the output shows the colors of the state
+	mismatches = 0;
+	check_goto_temp(bmp_map_open(&bmp, output, 0) != EXIT_SUCCESS, "Cannot open output", EXIT_FAILURE)
+	for (size_t y = 0, i = 0; y < bmp.image_height; y++) {
+		const unsigned char* px = (const unsigned char*)bmp.linear_sequence + y * bmp.image_row_pitch;
+		for (size_t x = 0; x < bmp.image_width; x++, i++, px += 4) {
+			unsigned char expected[4];
+			mask_cell v = u.mask[i];
+			tiled_color_pixel(expected, v && u.colors[v] != REGION_COLOR_NONE ? (color_id_t)1 << u.colors[v] : 0);
+			mismatches += memcmp(px, expected, 4) != 0;
+		}
+	}
+	verify_report("output", mismatches, failed);
+
+free_temporary_resources:
+	distruct_bmp_map(&bmp);
+	distruct_verify_state(&u);
+	distruct_verify_state(&f);
+	if (to_full) free(to_full);
+	if (to_updated) free(to_updated);
+	return callres;
+}
+
+// pixel counts and boxes of every label, the border (label 0) too
+static int verify_regions(const struct verify_map_t* m, uint64_t** pixels, struct region_box_t** boxes) {
+	size_t vertex_count = m->g.vertex_count;
+	*pixels = (uint64_t*)calloc(vertex_count + 1, sizeof(uint64_t));
+	*boxes = (struct region_box_t*)calloc(vertex_count + 1, sizeof(struct region_box_t));
+	check(!*pixels || !*boxes, "Cannot allocate regions", EXIT_FAILURE)
+	for (size_t y = 0, i = 0; y < m->height; y++) {
+		for (size_t x = 0; x < m->width; x++, i++) {
+			mask_cell v = m->mask[i];
+			check(v > vertex_count, "Label past the region count", EXIT_FAILURE)
+			struct region_box_t* b = *boxes + v;
+			if ((*pixels)[v]++ == 0) {
+				b->x0 = (uint32_t)x; b->y0 = (uint32_t)y;
+				b->x1 = (uint32_t)(x + 1); b->y1 = (uint32_t)(y + 1);
+				continue;
+			}
+			if (x < b->x0) b->x0 = (uint32_t)x;
+			if (x + 1 > b->x1) b->x1 = (uint32_t)(x + 1);
+			b->y1 = (uint32_t)(y + 1);
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+static int verify_linked(const struct graph_as_row_t* g, gid_t lv, gid_t rv) {
+	if (lv == 0 || lv > g->vertex_count) return 0;
+	size_t degree = g->adjacency_offsets[lv + 1] - g->adjacency_offsets[lv];
+	const gid_t* row = g->adjacency + g->adjacency_offsets[lv];
+	for (size_t i = 0; i < degree; i++)
+		if (row[i] == rv) return 1;
+	return 0;
+}
+
+// region_state_save of a colored map read back by the layout of region_state.h
+static int verify_state_round_trip(const struct verify_map_t* m, const char* path,
+	const struct region_box_t* boxes, size_t* failed
+) {
+	struct verify_state_t s;
+	size_t vertex_count = m->g.vertex_count, mismatches = 0;
+
+	check(verify_read_state(path, &s) != EXIT_SUCCESS, "Cannot read region state", EXIT_FAILURE)
+	size_t edge_count = (size_t)s.header.edge_count;
+
+	mismatches = s.header.width != m->width || s.header.height != m->height ||
+		s.header.search_limit != EDGE_SEARCH_LIMIT || s.header.border_mode != BORDER_CHANNEL ||
+		s.header.vertex_count != vertex_count || edge_count != m->g.edge_count;
+	verify_report("state header", mismatches, failed);
+
+	mismatches = 0;
+	for (size_t i = 0; i < m->width * m->height; i++) mismatches += s.mask[i] != m->mask[i];
+	verify_report("state mask", mismatches, failed);
+
+	mismatches = 0;
+	for (size_t v = 1; v < vertex_count + 1; v++)
+		mismatches += memcmp(s.boxes + v, boxes + v, sizeof(struct region_box_t)) != 0;
+	verify_report("state boxes", mismatches, failed);
+
+	// ascending, each one a link of the graph and found by a walk at least
+	mismatches = 0;
+	for (size_t e = 0; e < edge_count; e++) {
+		const struct graph_edge_t* edge = s.edges + e;
+		mismatches += edge->lv >= edge->rv || !verify_linked(&m->g, edge->lv, edge->rv) || s.walks[e] == 0 ||
+			(e && verify_compare_edges(edge - 1, edge) >= 0);
+	}
+	verify_report("state edges", mismatches, failed);
+
+	mismatches = 0;
+	for (size_t v = 1; v < vertex_count + 1; v++)
+		mismatches += s.colors[v] != bitfield_lowest_bit((bitfield_cell)m->g.color_ids[v]);
+	verify_report("state colors", mismatches, failed);
+
+	distruct_verify_state(&s);
+	return EXIT_SUCCESS;
+}
+
+// region_index_write read back by the layout of region_index.h
+static int verify_index_round_trip(const struct verify_map_t* m, const char* path, unsigned char rle,
+	const uint64_t* pixels, const struct region_box_t* boxes, size_t* failed
+) {
+	struct region_index_header_t h;
+	unsigned char* data = NULL;
+	size_t size = 0, mismatches = 0;
+	size_t vertex_count = m->g.vertex_count, cells = m->width * m->height;
+	const size_t* offsets = m->g.adjacency_offsets;
+	int callres = EXIT_SUCCESS;
+
+	check(region_index_write(path, m->width, m->height, m->mask, (struct graph_as_row_t*)&m->g, rle) != EXIT_SUCCESS,
+		"Cannot write region index", EXIT_FAILURE)
+	check(verify_read_file(path, &data, &size) != EXIT_SUCCESS, "Cannot read region index", EXIT_FAILURE)
+	check_goto_temp(size < sizeof(h), "Region index is too short", EXIT_FAILURE)
+	memcpy(&h, data, sizeof(h));
+	printf("\n\t< %s raster:\n", rle ? "RLE" : "raw");
+
+	mismatches = h.magic != REGION_INDEX_MAGIC || h.version != REGION_INDEX_VERSION ||
+		h.flags != (rle ? REGION_INDEX_RLE : 0u) || h.header_size != sizeof(h) || h.width != m->width ||
+		h.height != m->height || h.vertex_count != vertex_count || h.adjacency_count != offsets[vertex_count + 1] ||
+		h.file_size != size || h.raster_offset + h.raster_size != size ||
+		(h.regions_offset | h.adjacency_offsets_offset | h.raster_offset) % 8 != 0;
+	verify_report("index header", mismatches, failed);
+	check_goto_temp(mismatches, "Region index sections cannot be found", EXIT_FAILURE)
+
+	const struct region_index_region_t* regions = (const struct region_index_region_t*)(data + h.regions_offset);
+	mismatches = 0;
+	for (size_t v = 0; v < vertex_count + 1; v++) {
+		const struct region_index_region_t* r = regions + v;
+		size_t degree = v ? offsets[v + 1] - offsets[v] : 0;
+		color_id_t color_id = v ? m->g.color_ids[v] : 0;
+		mismatches += r->pixel_count != pixels[v] || r->x0 != boxes[v].x0 || r->y0 != boxes[v].y0 ||
+			r->x1 != boxes[v].x1 || r->y1 != boxes[v].y1 || (v && r->degree != degree) ||
+			r->color != (color_id ? bitfield_lowest_bit((bitfield_cell)color_id) + 1 : 0);
+	}
+	verify_report("index regions", mismatches, failed);
+
+	const uint64_t* adjacency_offsets = (const uint64_t*)(data + h.adjacency_offsets_offset);
+	const uint32_t* adjacency = (const uint32_t*)(data + h.adjacency_offset);
+	mismatches = 0;
+	for (size_t v = 0; v < vertex_count + 2; v++) mismatches += adjacency_offsets[v] != offsets[v];
+	for (size_t i = 0; i < h.adjacency_count; i++) mismatches += adjacency[i] != m->g.adjacency[i];
+	verify_report("index adjacency", mismatches, failed);
+
+	// runs expanded back to labels
+	mismatches = 0;
+	const unsigned char* raster = data + h.raster_offset;
+	if (rle) {
+		const uint64_t* row_runs = (const uint64_t*)raster;
+		const struct region_index_run_t* runs = (const struct region_index_run_t*)(row_runs + m->height + 1);
+		mismatches += row_runs[0] != 0 || row_runs[m->height] != h.run_count ||
+			h.raster_size != (m->height + 1) * sizeof(uint64_t) + h.run_count * sizeof(struct region_index_run_t);
+		for (size_t y = 0; y < m->height && mismatches == 0; y++) {
+			const mask_cell* row = m->mask + y * m->width;
+			uint64_t first = row_runs[y], last = row_runs[y + 1];
+			if (first >= last || runs[first].x != 0) { mismatches++; continue; }
+			for (uint64_t r = first; r < last; r++) {
+				size_t x1 = r + 1 < last ? runs[r + 1].x : m->width;
+				for (size_t x = runs[r].x; x < x1 && x < m->width; x++) mismatches += row[x] != runs[r].label;
+			}
+		}
+	}
+	else {
+		const mask_cell* labels = (const mask_cell*)raster;
+		mismatches += h.raster_size != cells * sizeof(mask_cell);
+		for (size_t i = 0; i < cells && mismatches == 0; i++) mismatches += labels[i] != m->mask[i];
+	}
+	verify_report("index raster", mismatches, failed);
+
+free_temporary_resources:
+	if (data) free(data);
+	return callres;
+}
+
+static int verify_round_trip(const char* map, size_t thread_count, size_t* failed) {
+	char state[VERIFY_PATH_SIZE], raw_index[VERIFY_PATH_SIZE], rle_index[VERIFY_PATH_SIZE];
+	struct verify_map_t m;
+	uint64_t* pixels = NULL;
+	struct region_box_t* boxes = NULL;
+	int callres = EXIT_SUCCESS;
+
+	snprintf(state, sizeof(state), "%s.check.round.state", map);
+	snprintf(raw_index, sizeof(raw_index), "%s.check.raw.idx", map);
+	snprintf(rle_index, sizeof(rle_index), "%s.check.rle.idx", map);
+
+	printf("\n\t< Region state and index round trips:\n");
+	check(verify_label(map, state, thread_count, &m) != EXIT_SUCCESS, "Cannot run full map", EXIT_FAILURE)
+	check_goto_temp(verify_regions(&m, &pixels, &boxes) != EXIT_SUCCESS, "Cannot count regions", EXIT_FAILURE)
+	check_goto_temp(verify_state_round_trip(&m, state, boxes, failed) != EXIT_SUCCESS,
+		"Cannot check region state", EXIT_FAILURE)
+	check_goto_temp(verify_index_round_trip(&m, raw_index, 0, pixels, boxes, failed) != EXIT_SUCCESS,
+		"Cannot check region index", EXIT_FAILURE)
+	check_goto_temp(verify_index_round_trip(&m, rle_index, 1, pixels, boxes, failed) != EXIT_SUCCESS,
+		"Cannot check region index", EXIT_FAILURE)
+
+free_temporary_resources:
+	if (pixels) free(pixels);
+	if (boxes) free(boxes);
+	distruct_verify_map(&m);
+	return callres;
+}
+
+static int verify_incremental(const char* map, size_t thread_count, size_t* failed) {
+	char state[VERIFY_PATH_SIZE], output[VERIFY_PATH_SIZE], full_state[VERIFY_PATH_SIZE];
+	char full_output[VERIFY_PATH_SIZE], edited[2][VERIFY_PATH_SIZE];
+	struct map_options_t options;
+	struct bmp_map bmp;
+	size_t width, height;
+
+	snprintf(state, sizeof(state), "%s.check.state", map);
+	snprintf(output, sizeof(output), "%s.check.out.bmp", map);
+	snprintf(full_state, sizeof(full_state), "%s.check.full.state", map);
+	snprintf(full_output, sizeof(full_output), "%s.check.full.bmp", map);
+	snprintf(edited[0], sizeof(edited[0]), "%s.check.edit1.bmp", map);
+	snprintf(edited[1], sizeof(edited[1]), "%s.check.edit2.bmp", map);
+
+	bmp_map_init(&bmp);
+	check(bmp_map_open(&bmp, map, 0) != EXIT_SUCCESS, "Cannot open map", EXIT_FAILURE)
+	width = bmp.image_width;
+	height = bmp.image_height;
+	distruct_bmp_map(&bmp);
+	check(width < 64 || height < 64, "Map is too small for the edits", EXIT_FAILURE)
+
+	// a line across the middle splits regions, an erased patch merges them
+	size_t line[4] = { width / 4, height / 2, width * 3 / 4, height / 2 + 2 };
+	size_t patch[4] = { width / 8, height / 8, width / 8 + 32, height / 8 + 32 };
+
+	memset(&options, 0, sizeof(options));
+	options.state_file = state;
+	options.thread_count = thread_count;
+	options.incremental = 1;
+
+	printf("\n\t< Incremental update against full runs:\n");
+	check(verify_full_run(map, state, output, thread_count) != EXIT_SUCCESS, "Cannot run full map", EXIT_FAILURE)
+
+	for (size_t step = 0; step < 2; step++) {
+		const char* source = step ? edited[0] : map;
+		check(verify_edit(source, edited[step], step ? patch : line, step == 0) != EXIT_SUCCESS,
+			"Cannot edit map", EXIT_FAILURE)
+		if (step == 0) memcpy(options.dirty_box, line, sizeof(line));
+		else memset(options.dirty_box, 0, sizeof(options.dirty_box));
+
+		check(region_state_update(edited[step], output, &options) != EXIT_SUCCESS, "Cannot update region state", EXIT_FAILURE)
+		check(verify_full_run(edited[step], full_state, full_output, thread_count) != EXIT_SUCCESS,
+			"Cannot run full map", EXIT_FAILURE)
+		printf("\n\t< %s:\n", step ? "erased patch, whole map compared" : "drawn line, dirty box");
+		check(verify_incremental_state(state, full_state, output, failed) != EXIT_SUCCESS,
+			"Cannot compare region states", EXIT_FAILURE)
+	}
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv) {
+	size_t thread_count = 0, failed = 0;
+	int i = 1;
+
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) thread_count = (size_t)strtoul(argv[++i], NULL, 10);
+		else break;
+	}
+	if (i + 1 != argc || argv[i][0] == '-') {
+		printf("Usage: %s [-threads N] <map.bmp>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	check(verify_round_trip(argv[i], thread_count, &failed) != EXIT_SUCCESS, "Round trip check stopped", EXIT_FAILURE)
+	check(verify_incremental(argv[i], thread_count, &failed) != EXIT_SUCCESS, "Incremental check stopped", EXIT_FAILURE)
+
+	printf("\n\t< Failed checks: %lu;\n", (unsigned long)failed);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
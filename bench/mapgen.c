@@ -0,0 +1,298 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+// Synthetic 32-bit maps for map_bench:
+//	mapgen <out.bmp> [-kind voronoi|polygons|grid] [-size WxH | -mp N] [-regions N] [-border N] [-seed N]
+// voronoi  - euclidean cells, convex polygons
+// polygons - manhattan cells, irregular polygons with long diagonal borders
+// grid     - rectangles
+// A pixel is border (blue 0) when a region change lies within -border pixels
+// to its right or below it, so -border 1 draws thin and -border 4 thick borders.
+// Rows are generated as they are written, memory is O(width * border).
+
+enum mapgen_kind_t {
+	MAPGEN_VORONOI,
+	MAPGEN_POLYGONS,
+	MAPGEN_GRID
+};
+
+struct mapgen_t {
+	enum mapgen_kind_t kind;
+	size_t width;
+	size_t height;
+	size_t regions;
+	size_t border;
+	uint64_t seed;
+
+	// seed points bucketed on a grid of bucket_size cells
+	int64_t* seed_x;
+	int64_t* seed_y;
+	uint32_t* bucket_offsets; // seeds of bucket b: bucket_seeds[bucket_offsets[b] .. bucket_offsets[b + 1])
+	uint32_t* bucket_seeds;
+	size_t bucket_size;
+	size_t buckets_x;
+	size_t buckets_y;
+
+	// grid
+	size_t columns;
+	size_t rows;
+};
+
+static uint64_t mapgen_random(uint64_t* state) {
+	// xorshift64*, same maps on every platform
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static int mapgen_setup_seeds(struct mapgen_t* m) {
+	uint64_t state = m->seed * 0x9E3779B97F4A7C15ULL + 1;
+	size_t bucket_count, b;
+
+	m->bucket_size = (size_t)sqrt((double)m->width * (double)m->height / (double)m->regions);
+	if (m->bucket_size == 0) m->bucket_size = 1;
+	m->buckets_x = (m->width + m->bucket_size - 1) / m->bucket_size;
+	m->buckets_y = (m->height + m->bucket_size - 1) / m->bucket_size;
+	bucket_count = m->buckets_x * m->buckets_y;
+
+	m->seed_x = (int64_t*)malloc(m->regions * sizeof(int64_t));
+	m->seed_y = (int64_t*)malloc(m->regions * sizeof(int64_t));
+	m->bucket_offsets = (uint32_t*)calloc(bucket_count + 1, sizeof(uint32_t));
+	m->bucket_seeds = (uint32_t*)malloc(m->regions * sizeof(uint32_t));
+	if (!m->seed_x || !m->seed_y || !m->bucket_offsets || !m->bucket_seeds) return EXIT_FAILURE;
+
+	for (size_t i = 0; i < m->regions; i++) {
+		m->seed_x[i] = (int64_t)(mapgen_random(&state) % m->width);
+		m->seed_y[i] = (int64_t)(mapgen_random(&state) % m->height);
+		b = (size_t)m->seed_y[i] / m->bucket_size * m->buckets_x + (size_t)m->seed_x[i] / m->bucket_size;
+		m->bucket_offsets[b + 1]++;
+	}
+	for (b = 0; b < bucket_count; b++) m->bucket_offsets[b + 1] += m->bucket_offsets[b];
+
+	uint32_t* fill = (uint32_t*)malloc(bucket_count * sizeof(uint32_t));
+	if (fill == NULL) return EXIT_FAILURE;
+	memcpy(fill, m->bucket_offsets, bucket_count * sizeof(uint32_t));
+	for (size_t i = 0; i < m->regions; i++) {
+		b = (size_t)m->seed_y[i] / m->bucket_size * m->buckets_x + (size_t)m->seed_x[i] / m->bucket_size;
+		m->bucket_seeds[fill[b]++] = (uint32_t)i;
+	}
+	free(fill);
+	return EXIT_SUCCESS;
+}
+
+static int64_t mapgen_distance(const struct mapgen_t* m, int64_t dx, int64_t dy) {
+	if (m->kind == MAPGEN_POLYGONS) return (dx < 0 ? -dx : dx) + (dy < 0 ? -dy : dy);
+	return dx * dx + dy * dy;
+}
+
+// nearest seed, searched ring by ring of buckets around the pixel
+static uint32_t mapgen_nearest(const struct mapgen_t* m, size_t x, size_t y) {
+	int64_t bx = (int64_t)(x / m->bucket_size), by = (int64_t)(y / m->bucket_size);
+	int64_t best = INT64_MAX;
+	uint32_t best_seed = 0;
+
+	for (int64_t r = 0; ; r++) {
+		for (int64_t cy = by - r; cy <= by + r; cy++) {
+			if (cy < 0 || cy >= (int64_t)m->buckets_y) continue;
+			for (int64_t cx = bx - r; cx <= bx + r; cx++) {
+				if (cx < 0 || cx >= (int64_t)m->buckets_x) continue;
+				if (cy != by - r && cy != by + r && cx != bx - r && cx != bx + r) continue;
+				size_t b = (size_t)cy * m->buckets_x + (size_t)cx;
+				for (uint32_t i = m->bucket_offsets[b]; i < m->bucket_offsets[b + 1]; i++) {
+					uint32_t s = m->bucket_seeds[i];
+					int64_t d = mapgen_distance(m, m->seed_x[s] - (int64_t)x, m->seed_y[s] - (int64_t)y);
+					if (d < best || (d == best && s < best_seed)) {
+						best = d;
+						best_seed = s;
+					}
+				}
+			}
+		}
+		// every bucket of the next ring is at least r * bucket_size away
+		if (best != INT64_MAX && best < mapgen_distance(m, r * (int64_t)m->bucket_size, 0)) break;
+		if (r > (int64_t)(m->buckets_x + m->buckets_y)) break;
+	}
+	return best_seed;
+}
+
+static void mapgen_row(const struct mapgen_t* m, size_t y, uint32_t* ids) {
+	if (m->kind == MAPGEN_GRID) {
+		size_t row = y * m->rows / m->height;
+		for (size_t x = 0; x < m->width; x++)
+			ids[x] = (uint32_t)(row * m->columns + x * m->columns / m->width);
+		return;
+	}
+	for (size_t x = 0; x < m->width; x++) ids[x] = mapgen_nearest(m, x, y);
+}
+
+static void mapgen_put_u16(unsigned char* p, uint16_t v) {
+	p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8);
+}
+
+static void mapgen_put_u32(unsigned char* p, uint32_t v) {
+	for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static int mapgen_write(const struct mapgen_t* m, const char* path) {
+	size_t window = m->border + 1; // rows y .. y + border
+	uint32_t* ids = (uint32_t*)malloc(window * m->width * sizeof(uint32_t));
+	unsigned char* row = (unsigned char*)malloc(m->width * 4);
+	unsigned char header[54];
+	FILE* f = NULL;
+	int callres = EXIT_SUCCESS;
+
+	if (ids == NULL || row == NULL) {
+		printf("Cannot allocate row buffers\n");
+		callres = EXIT_FAILURE;
+		goto free_temporary_resources;
+	}
+
+	uint64_t file_size = 54 + (uint64_t)m->width * m->height * 4;
+	memset(header, 0, sizeof(header));
+	header[0] = 'B'; header[1] = 'M';
+	mapgen_put_u32(header + 2, file_size > UINT32_MAX ? 0 : (uint32_t)file_size);
+	mapgen_put_u32(header + 10, 54);
+	mapgen_put_u32(header + 14, 40);
+	mapgen_put_u32(header + 18, (uint32_t)m->width);
+	mapgen_put_u32(header + 22, (uint32_t)m->height);
+	mapgen_put_u16(header + 26, 1);
+	mapgen_put_u16(header + 28, 32);
+
+	f = fopen(path, "wb");
+	if (f == NULL || fwrite(header, 1, sizeof(header), f) != sizeof(header)) {
+		printf("Cannot write %s\n", path);
+		callres = EXIT_FAILURE;
+		goto free_temporary_resources;
+	}
+
+	for (size_t y = 0; y < window - 1 && y < m->height; y++)
+		mapgen_row(m, y, ids + (y % window) * m->width);
+
+	for (size_t y = 0; y < m->height; y++) {
+		if (y + window - 1 < m->height)
+			mapgen_row(m, y + window - 1, ids + ((y + window - 1) % window) * m->width);
+		const uint32_t* cur = ids + (y % window) * m->width;
+
+		for (size_t x = 0; x < m->width; x++) {
+			uint32_t id = cur[x];
+			unsigned char border = 0;
+			for (size_t d = 1; d <= m->border && !border; d++) {
+				if (x + d < m->width && cur[x + d] != id) border = 1;
+				if (y + d < m->height && ids[((y + d) % window) * m->width + x] != id) border = 1;
+			}
+			unsigned char* px = row + x * 4;
+			if (border) {
+				px[0] = 0; px[1] = 0; px[2] = 0;
+			}
+			else {
+				uint32_t h = id * 0x9E3779B1u;
+				px[0] = 0xFF; px[1] = (unsigned char)(h >> 8); px[2] = (unsigned char)(h >> 16);
+			}
+			px[3] = 0xFF;
+		}
+		if (fwrite(row, 1, m->width * 4, f) != m->width * 4) {
+			printf("Cannot write %s\n", path);
+			callres = EXIT_FAILURE;
+			goto free_temporary_resources;
+		}
+	}
+
+free_temporary_resources:
+	if (f && fclose(f) != 0) callres = EXIT_FAILURE;
+	free(ids);
+	free(row);
+	return callres;
+}
+
+static void distruct_mapgen(struct mapgen_t* m) {
+	free(m->seed_x);
+	free(m->seed_y);
+	free(m->bucket_offsets);
+	free(m->bucket_seeds);
+}
+
+int main(int argc, char** argv) {
+	struct mapgen_t m;
+	const char* path = NULL;
+	unsigned char wrong = 0;
+	int callres = EXIT_SUCCESS;
+
+	memset(&m, 0, sizeof(m));
+	m.kind = MAPGEN_VORONOI;
+	m.width = 1024;
+	m.height = 1024;
+	m.regions = 1000;
+	m.border = 1;
+	m.seed = 1;
+
+	for (int i = 1; i < argc && !wrong; i++) {
+		if (strcmp(argv[i], "-kind") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "voronoi") == 0) m.kind = MAPGEN_VORONOI;
+			else if (strcmp(argv[i], "polygons") == 0) m.kind = MAPGEN_POLYGONS;
+			else if (strcmp(argv[i], "grid") == 0) m.kind = MAPGEN_GRID;
+			else wrong = 1;
+		}
+		else if (strcmp(argv[i], "-size") == 0 && i + 1 < argc) {
+			unsigned long w = 0, h = 0;
+			if (sscanf(argv[++i], "%lux%lu", &w, &h) != 2) wrong = 1;
+			m.width = w;
+			m.height = h;
+		}
+		else if (strcmp(argv[i], "-mp") == 0 && i + 1 < argc) {
+			double side = sqrt(strtod(argv[++i], NULL) * 1e6);
+			m.width = m.height = (size_t)side;
+		}
+		else if (strcmp(argv[i], "-regions") == 0 && i + 1 < argc) {
+			m.regions = (size_t)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "-border") == 0 && i + 1 < argc) {
+			m.border = (size_t)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+			m.seed = (uint64_t)strtoull(argv[++i], NULL, 10);
+		}
+		else if (argv[i][0] != '-' && path == NULL) {
+			path = argv[i];
+		}
+		else {
+			wrong = 1;
+		}
+	}
+
+	if (wrong || path == NULL || m.width == 0 || m.height == 0 || m.regions == 0 || m.border == 0 ||
+		m.width > INT32_MAX || m.height > INT32_MAX) {
+		printf("Usage: %s <out.bmp> [-kind voronoi|polygons|grid] [-size WxH | -mp N]"
+			" [-regions N] [-border N] [-seed N]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (m.kind == MAPGEN_GRID) {
+		m.columns = (size_t)ceil(sqrt((double)m.regions * (double)m.width / (double)m.height));
+		if (m.columns == 0) m.columns = 1;
+		if (m.columns > m.width) m.columns = m.width;
+		m.rows = (m.regions + m.columns - 1) / m.columns;
+		if (m.rows > m.height) m.rows = m.height;
+	}
+	else if (m.regions > UINT32_MAX || mapgen_setup_seeds(&m) != EXIT_SUCCESS) {
+		printf("Cannot place %lu seeds\n", (unsigned long)m.regions);
+		distruct_mapgen(&m);
+		return EXIT_FAILURE;
+	}
+
+	callres = mapgen_write(&m, path);
+	if (callres == EXIT_SUCCESS)
+		printf("%s: %lux%lu, %.1f MP, %lu regions, border %lu\n", path,
+			(unsigned long)m.width, (unsigned long)m.height, m.width * (double)m.height / 1e6,
+			(unsigned long)m.regions, (unsigned long)m.border);
+	distruct_mapgen(&m);
+	return callres;
+}
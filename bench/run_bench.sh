@@ -0,0 +1,51 @@
+#!/bin/sh
+# Generates the benchmark maps once and runs map_bench over them:
+#	bench/run_bench.sh <build dir> [map_bench options]
+# Results go to <build dir>/bench.json and are checked against
+# bench/baseline.json; without it the script fails before running anything.
+# BENCH_RECORD=1 writes bench/baseline.json instead, on the reference machine.
+# BENCH_LARGE=1 adds the 100 and 500 MP maps.
+set -e
+
+BUILD=${1:?usage: $0 <build dir> [map_bench options]}
+shift
+ROOT=$(cd "$(dirname "$0")" && pwd)
+BASELINE="$ROOT/baseline.json"
+
+if [ -z "$BENCH_RECORD" ] && [ ! -f "$BASELINE" ]; then
+	echo "run_bench.sh: ERROR: no baseline at $BASELINE, there is nothing to check against." >&2
+	echo "run_bench.sh: record it on the reference machine: BENCH_RECORD=1 $0 $BUILD" >&2
+	exit 1
+fi
+
+MAPS="$BUILD/bench_maps"
+mkdir -p "$MAPS"
+
+gen() {
+	name=$1
+	shift
+	[ -f "$MAPS/$name.bmp" ] || "$BUILD/mapgen" "$MAPS/$name.bmp" "$@"
+	LIST="$LIST $MAPS/$name.bmp"
+}
+
+LIST=""
+gen voronoi_1mp_10       -kind voronoi  -mp 1   -regions 10
+gen voronoi_16mp_10k     -kind voronoi  -mp 16  -regions 10000
+gen voronoi_16mp_10k_b4  -kind voronoi  -mp 16  -regions 10000  -border 4
+gen polygons_16mp_10k    -kind polygons -mp 16  -regions 10000
+gen grid_64mp_100k       -kind grid     -mp 64  -regions 100000
+gen voronoi_64mp_1m      -kind voronoi  -mp 64  -regions 1000000
+if [ -n "$BENCH_LARGE" ]; then
+	gen voronoi_100mp_100k   -kind voronoi  -mp 100 -regions 100000 -border 2
+	gen polygons_500mp_1m    -kind polygons -mp 500 -regions 1000000
+fi
+
+if [ -n "$BENCH_RECORD" ]; then
+	# shellcheck disable=SC2086
+	"$BUILD/map_bench" -out "$BUILD/bench_out.bmp" -json "$BASELINE" "$@" $LIST
+	echo "run_bench.sh: baseline recorded: $BASELINE"
+	exit 0
+fi
+
+# shellcheck disable=SC2086
+"$BUILD/map_bench" -out "$BUILD/bench_out.bmp" -json "$BUILD/bench.json" -baseline "$BASELINE" "$@" $LIST
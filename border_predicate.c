@@ -0,0 +1,197 @@
+#include "border_predicate.h"
+
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BORDER_X86_SIMD
+#define border_target(isa) __attribute__((target(isa)))
+#endif
+
+static int border_parse_color(const char* s, size_t length, uint8_t color[3]) {
+	if (length != 6) return EXIT_FAILURE;
+	for (size_t i = 0; i < 6; i++) {
+		char c = s[i];
+		int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+			c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+		if (v < 0) return EXIT_FAILURE;
+		if (i % 2 == 0) color[i / 2] = (uint8_t)(v << 4);
+		else color[i / 2] |= (uint8_t)v;
+	}
+	return EXIT_SUCCESS;
+}
+
+static int border_parse_number(const char* s, uint32_t max, uint32_t* value) {
+	char* end = NULL;
+	unsigned long v = strtoul(s, &end, 10);
+	if (end == s || *end != 0 || v > max) return EXIT_FAILURE;
+	*value = (uint32_t)v;
+	return EXIT_SUCCESS;
+}
+
+int border_predicate_parse(const char* spec, struct border_predicate_t* p) {
+	const char* arg = strchr(spec, ':');
+	size_t name = arg ? (size_t)(arg - spec) : strlen(spec);
+	memset(p, 0, sizeof(struct border_predicate_t));
+
+	if (name == 7 && strncmp(spec, "channel", 7) == 0) {
+		p->mode = BORDER_CHANNEL;
+		return arg ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	if (name == 5 && strncmp(spec, "exact", 5) == 0) {
+		p->mode = BORDER_EXACT;
+		return arg ? border_parse_color(arg + 1, strlen(arg + 1), p->color) : EXIT_SUCCESS;
+	}
+	if (name == 4 && strncmp(spec, "luma", 4) == 0) {
+		p->mode = BORDER_LUMA;
+		return arg ? border_parse_number(arg + 1, 255, &p->tolerance) : EXIT_FAILURE;
+	}
+	if (name == 8 && strncmp(spec, "distance", 8) == 0 && arg) {
+		const char* last = strrchr(spec, ':');
+		p->mode = BORDER_DISTANCE;
+		if (last != arg && border_parse_color(arg + 1, (size_t)(last - arg - 1), p->color) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+		// 442 covers the whole RGB cube
+		return border_parse_number(last + 1, 442, &p->tolerance);
+	}
+	return EXIT_FAILURE;
+}
+
+void border_predicate_test(const struct border_predicate_t* p, struct border_test_t* t) {
+	static const int32_t luma[3] = { BORDER_LUMA_WEIGHTS };
+	memset(t, 0, sizeof(struct border_test_t));
+
+	switch (p ? p->mode : BORDER_CHANNEL) {
+	case BORDER_EXACT:
+	case BORDER_DISTANCE:
+		t->distance = 1;
+		for (size_t k = 0; k < 3; k++) t->ref[k] = p->color[2 - k]; // pixels are b, g, r
+		t->limit = p->mode == BORDER_EXACT ? 0 : (int32_t)(p->tolerance * p->tolerance);
+		break;
+	case BORDER_LUMA:
+		for (size_t k = 0; k < 3; k++) t->weight[k] = luma[k];
+		t->limit = (int32_t)(p->tolerance << 8 | 0xFF);
+		break;
+	default:
+		t->weight[0] = 1;
+		t->limit = 0xFE;
+		break;
+	}
+}
+
+const char* border_predicate_name(const struct border_predicate_t* p) {
+	static const char* names[] = { "channel", "exact", "distance", "luma" };
+	return p && (size_t)p->mode < sizeof(names) / sizeof(names[0]) ? names[p->mode] : names[0];
+}
+
+int border_pixel(const struct border_test_t* t, const unsigned char* px) {
+	int32_t sum = 0;
+	for (size_t k = 0; k < 3; k++) {
+		int32_t c = px[k];
+		sum += t->distance ? (c - t->ref[k]) * (c - t->ref[k]) : c * t->weight[k];
+	}
+	return sum <= t->limit;
+}
+
+// pixels from x on, into the words from x / 32 on; x is a multiple of 32
+static void border_pack_tail(const struct border_test_t* t, const unsigned char* px, size_t x, size_t width,
+	uint32_t* bits
+) {
+	for (; x < width; x += 32) {
+		uint32_t word = 0;
+		for (size_t b = 0; b < 32 && x + b < width; b++)
+			word |= (uint32_t)border_pixel(t, px + (x + b) * 4) << b;
+		bits[x / 32] = word;
+	}
+}
+
+#ifdef BORDER_X86_SIMD
+
+// Channels and weights fit 16 bits, so madd_epi16 on 32-bit lanes with a zero
+// high half is an exact product; distances are taken absolute first.
+// 8 pixels per vector, their 8 bits from the sign of the area compare
+border_target("avx2")
+static void border_pack_row_avx2(const struct border_test_t* t, const unsigned char* px, size_t width,
+	uint32_t* bits
+) {
+	const __m256i low = _mm256_set1_epi32(0xFF), limit = _mm256_set1_epi32(t->limit);
+	const __m256i w0 = _mm256_set1_epi32(t->weight[0]), r0 = _mm256_set1_epi32(t->ref[0]);
+	const __m256i w1 = _mm256_set1_epi32(t->weight[1]), r1 = _mm256_set1_epi32(t->ref[1]);
+	const __m256i w2 = _mm256_set1_epi32(t->weight[2]), r2 = _mm256_set1_epi32(t->ref[2]);
+	size_t x = 0;
+
+	for (; x + 32 <= width; x += 32) {
+		uint32_t word = 0;
+		for (unsigned k = 0; k < 4; k++) {
+			__m256i p = _mm256_loadu_si256((const __m256i*)(px + (x + k * 8) * 4));
+			__m256i c0 = _mm256_and_si256(p, low);
+			__m256i c1 = _mm256_and_si256(_mm256_srli_epi32(p, 8), low);
+			__m256i c2 = _mm256_and_si256(_mm256_srli_epi32(p, 16), low);
+			__m256i sum;
+			if (t->distance) {
+				c0 = _mm256_abs_epi32(_mm256_sub_epi32(c0, r0));
+				c1 = _mm256_abs_epi32(_mm256_sub_epi32(c1, r1));
+				c2 = _mm256_abs_epi32(_mm256_sub_epi32(c2, r2));
+				sum = _mm256_add_epi32(_mm256_add_epi32(
+					_mm256_madd_epi16(c0, c0), _mm256_madd_epi16(c1, c1)), _mm256_madd_epi16(c2, c2));
+			}
+			else sum = _mm256_add_epi32(_mm256_add_epi32(
+				_mm256_madd_epi16(c0, w0), _mm256_madd_epi16(c1, w1)), _mm256_madd_epi16(c2, w2));
+			__m256i area = _mm256_cmpgt_epi32(sum, limit);
+			word |= (uint32_t)(~_mm256_movemask_ps(_mm256_castsi256_ps(area)) & 0xFF) << (k * 8);
+		}
+		bits[x / 32] = word;
+	}
+	border_pack_tail(t, px, x, width, bits);
+}
+
+// 16 pixels per vector, the compare gives their bits directly
+border_target("avx512f,avx512bw")
+static void border_pack_row_avx512(const struct border_test_t* t, const unsigned char* px, size_t width,
+	uint32_t* bits
+) {
+	const __m512i low = _mm512_set1_epi32(0xFF), limit = _mm512_set1_epi32(t->limit);
+	const __m512i w0 = _mm512_set1_epi32(t->weight[0]), r0 = _mm512_set1_epi32(t->ref[0]);
+	const __m512i w1 = _mm512_set1_epi32(t->weight[1]), r1 = _mm512_set1_epi32(t->ref[1]);
+	const __m512i w2 = _mm512_set1_epi32(t->weight[2]), r2 = _mm512_set1_epi32(t->ref[2]);
+	size_t x = 0;
+
+	for (; x + 32 <= width; x += 32) {
+		uint32_t word = 0;
+		for (unsigned k = 0; k < 2; k++) {
+			__m512i p = _mm512_loadu_si512((const void*)(px + (x + k * 16) * 4));
+			__m512i c0 = _mm512_and_si512(p, low);
+			__m512i c1 = _mm512_and_si512(_mm512_srli_epi32(p, 8), low);
+			__m512i c2 = _mm512_and_si512(_mm512_srli_epi32(p, 16), low);
+			__m512i sum;
+			if (t->distance) {
+				c0 = _mm512_abs_epi32(_mm512_sub_epi32(c0, r0));
+				c1 = _mm512_abs_epi32(_mm512_sub_epi32(c1, r1));
+				c2 = _mm512_abs_epi32(_mm512_sub_epi32(c2, r2));
+				sum = _mm512_add_epi32(_mm512_add_epi32(
+					_mm512_madd_epi16(c0, c0), _mm512_madd_epi16(c1, c1)), _mm512_madd_epi16(c2, c2));
+			}
+			else sum = _mm512_add_epi32(_mm512_add_epi32(
+				_mm512_madd_epi16(c0, w0), _mm512_madd_epi16(c1, w1)), _mm512_madd_epi16(c2, w2));
+			word |= (uint32_t)_mm512_cmple_epi32_mask(sum, limit) << (k * 16);
+		}
+		bits[x / 32] = word;
+	}
+	border_pack_tail(t, px, x, width, bits);
+}
+
+#endif
+
+void border_pack_row(const struct border_test_t* t, const unsigned char* px, size_t width, uint32_t* bits) {
+#ifdef BORDER_X86_SIMD
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+		border_pack_row_avx512(t, px, width, bits);
+		return;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		border_pack_row_avx2(t, px, width, bits);
+		return;
+	}
+#endif
+	border_pack_tail(t, px, 0, width, bits);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+// Which pixels of the map are borders. BORDER_CHANNEL is the original test:
+// every pixel whose first byte is not 0xFF. The others compare the color:
+// BORDER_EXACT - the border color only, BORDER_DISTANCE - colors within an
+// RGB distance of it (anti-aliased borders), BORDER_LUMA - pixels at or below
+// a luminance (near-black and scanned borders).
+enum border_mode_t {
+	BORDER_CHANNEL,
+	BORDER_EXACT,
+	BORDER_DISTANCE,
+	BORDER_LUMA
+};
+
+struct border_predicate_t {
+	enum border_mode_t mode;
+	uint8_t color[3]; // r, g, b of BORDER_EXACT and BORDER_DISTANCE
+	uint32_t tolerance; // BORDER_DISTANCE: RGB distance, BORDER_LUMA: luminance 0..255
+};
+
+// Every mode as one test on the bytes b, g, r of a pixel (c0, c1, c2):
+//	distance ? sum((ck - ref[k])^2) <= limit : sum(weight[k] * ck) <= limit
+// weights stay below 2^15; the same numbers go to the pack_border kernel.
+struct border_test_t {
+	int32_t distance;
+	int32_t weight[4];
+	int32_t ref[4];
+	int32_t limit;
+};
+
+#define BORDER_LUMA_WEIGHTS 29, 150, 77 // b, g, r of BT.601 luminance, sum 256
+
+// "channel", "exact[:RRGGBB]", "distance[:RRGGBB]:T" or "luma:T",
+// the color is black when left out
+int border_predicate_parse(const char* spec, struct border_predicate_t*);
+void border_predicate_test(const struct border_predicate_t*, struct border_test_t*); // NULL - BORDER_CHANNEL
+const char* border_predicate_name(const struct border_predicate_t*);
+
+int border_pixel(const struct border_test_t*, const unsigned char* px);
+
+// one bit per pixel of a 32-bit row, bit x % 32 of bits[x / 32], the last
+// word is zero-filled; AVX-512 or AVX2 when the CPU has them
+void border_pack_row(const struct border_test_t*, const unsigned char* px, size_t width, uint32_t* bits);
@@ -0,0 +1,193 @@
+#include "cpu_labeling.h"
+
+#define cpu_parent_border UINT32_MAX
+
+struct cpu_labeling_t {
+	const unsigned char* pixels;
+	size_t width;
+	size_t height;
+	struct border_test_t border;
+	uint32_t* border_rows; // one packed row per band
+	size_t border_words;
+
+	mask_cell* mask;
+	volatile uint32_t* parent;
+	size_t* band_roots; // roots per band, then first id of the band
+};
+
+// bands are the threads of host_parallel_run, one each
+static void cpu_band_rows(struct cpu_labeling_t* l, size_t band, size_t band_count, size_t* y0, size_t* y1) {
+	*y0 = l->height * band / band_count;
+	*y1 = l->height * (band + 1) / band_count;
+}
+
+static uint32_t cpu_find(volatile uint32_t* parent, uint32_t idx) {
+	uint32_t p = host_atomic_load_u32(parent + idx);
+	while (p != idx) {
+		idx = p;
+		p = host_atomic_load_u32(parent + idx);
+	}
+	return idx;
+}
+
+// band local union: only the owner thread touches the band
+static void cpu_union_local(volatile uint32_t* parent, uint32_t a, uint32_t b) {
+	while (parent[a] != a) {
+		parent[a] = parent[parent[a]];
+		a = parent[a];
+	}
+	while (parent[b] != b) {
+		parent[b] = parent[parent[b]];
+		b = parent[b];
+	}
+	if (a < b) parent[b] = a;
+	else if (b < a) parent[a] = b;
+}
+
+// seam union: larger root is hooked under the smaller one with CAS
+static void cpu_union_shared(volatile uint32_t* parent, uint32_t a, uint32_t b) {
+	for (;;) {
+		a = cpu_find(parent, a);
+		b = cpu_find(parent, b);
+		if (a == b) return;
+		if (a < b) {
+			uint32_t t = a; a = b; b = t;
+		}
+		if (host_atomic_cas_u32(parent + a, a, b) == a) return;
+	}
+}
+
+static void cpu_scan_band(void* ctx, size_t band, size_t band_count) {
+	struct cpu_labeling_t* l = (struct cpu_labeling_t*)ctx;
+	size_t y0 = 0, y1 = 0;
+	uint32_t* bits = l->border_rows + band * l->border_words;
+	cpu_band_rows(l, band, band_count, &y0, &y1);
+
+	for (size_t y = y0; y < y1; y++) {
+		size_t row = y * l->width;
+		// the same test as the pack_border kernel, a row at a time
+		border_pack_row(&l->border, l->pixels + row * 4, l->width, bits);
+		for (size_t x = 0; x < l->width; x++) {
+			uint32_t idx = (uint32_t)(row + x);
+			if ((bits[x >> 5] >> (x & 31)) & 1) {
+				l->parent[idx] = cpu_parent_border;
+				continue;
+			}
+			l->parent[idx] = idx;
+			if (x > 0 && l->parent[idx - 1] != cpu_parent_border)
+				cpu_union_local(l->parent, idx - 1, idx);
+			if (y > y0 && l->parent[idx - l->width] != cpu_parent_border)
+				cpu_union_local(l->parent, (uint32_t)(idx - l->width), idx);
+		}
+	}
+}
+
+static void cpu_merge_seam(void* ctx, size_t band, size_t band_count) {
+	struct cpu_labeling_t* l = (struct cpu_labeling_t*)ctx;
+	size_t y0 = 0, y1 = 0;
+	cpu_band_rows(l, band, band_count, &y0, &y1);
+	if (y0 == 0 || y0 == y1) return;
+
+	size_t row = y0 * l->width;
+	for (size_t x = 0; x < l->width; x++) {
+		uint32_t idx = (uint32_t)(row + x);
+		if (l->parent[idx] == cpu_parent_border ||
+			l->parent[idx - l->width] == cpu_parent_border) continue;
+		cpu_union_shared(l->parent, (uint32_t)(idx - l->width), idx);
+	}
+}
+
+static void cpu_flatten_band(void* ctx, size_t band, size_t band_count) {
+	struct cpu_labeling_t* l = (struct cpu_labeling_t*)ctx;
+	size_t y0 = 0, y1 = 0, roots = 0;
+	cpu_band_rows(l, band, band_count, &y0, &y1);
+
+	for (size_t idx = y0 * l->width; idx < y1 * l->width; idx++) {
+		if (l->parent[idx] == cpu_parent_border) continue;
+		uint32_t r = cpu_find(l->parent, (uint32_t)idx);
+		host_atomic_store_u32(l->parent + idx, r);
+		if (r == idx) roots++;
+	}
+	l->band_roots[band] = roots;
+}
+
+static void cpu_number_roots(void* ctx, size_t band, size_t band_count) {
+	struct cpu_labeling_t* l = (struct cpu_labeling_t*)ctx;
+	size_t y0 = 0, y1 = 0;
+	cpu_band_rows(l, band, band_count, &y0, &y1);
+
+	mask_cell next = (mask_cell)l->band_roots[band];
+	for (size_t idx = y0 * l->width; idx < y1 * l->width; idx++) {
+		if (l->parent[idx] == idx) l->mask[idx] = next++;
+	}
+}
+
+static void cpu_finalize_band(void* ctx, size_t band, size_t band_count) {
+	struct cpu_labeling_t* l = (struct cpu_labeling_t*)ctx;
+	size_t y0 = 0, y1 = 0;
+	cpu_band_rows(l, band, band_count, &y0, &y1);
+
+	for (size_t idx = y0 * l->width; idx < y1 * l->width; idx++) {
+		uint32_t p = l->parent[idx];
+		if (p == cpu_parent_border) l->mask[idx] = 0;
+		else if (p != idx) l->mask[idx] = l->mask[p];
+	}
+}
+
+int cpu_label_map(
+	const char* pixels,
+	size_t width,
+	size_t height,
+	mask_cell* mask,
+	size_t* vertex_count,
+	size_t thread_count,
+	const struct border_predicate_t* border,
+	struct host_arena_t* arena
+) {
+	struct cpu_labeling_t l;
+	struct host_arena_mark_t mark = host_arena_mark(arena);
+	size_t mask_size = width * height;
+	int callres = EXIT_SUCCESS;
+
+	check(mask_size >= cpu_parent_border, "Map is too large for 32-bit labels", EXIT_FAILURE)
+
+	if (thread_count == 0) thread_count = host_cpu_count();
+	if (thread_count > height) thread_count = height ? height : 1;
+
+	l.pixels = (const unsigned char*)pixels;
+	l.width = width;
+	l.height = height;
+	border_predicate_test(border, &l.border);
+	l.border_words = (width + 31) / 32;
+	l.mask = mask;
+	l.parent = (volatile uint32_t*)host_arena_alloc(arena, mask_size * sizeof(uint32_t));
+	l.band_roots = (size_t*)host_arena_calloc(arena, thread_count, sizeof(size_t));
+	l.border_rows = (uint32_t*)host_arena_alloc(arena, (thread_count * l.border_words + 1) * sizeof(uint32_t));
+	check_goto_temp(l.parent == NULL || l.band_roots == NULL || l.border_rows == NULL,
+		"Cannot allocate labeling buffers", EXIT_FAILURE)
+
+	callres |= host_parallel_run(thread_count, cpu_scan_band, &l);
+	callres |= host_parallel_run(thread_count, cpu_merge_seam, &l);
+	callres |= host_parallel_run(thread_count, cpu_flatten_band, &l);
+	check_goto_temp(callres != EXIT_SUCCESS, "Cannot run labeling threads", EXIT_FAILURE)
+
+	// ids are 1-based and follow band order, so the result does not depend on threads
+	size_t next = 1;
+	for (size_t band = 0; band < thread_count; band++) {
+		size_t roots = l.band_roots[band];
+		l.band_roots[band] = next;
+		next += roots;
+	}
+	*vertex_count = next - 1;
+
+	callres |= host_parallel_run(thread_count, cpu_number_roots, &l);
+	callres |= host_parallel_run(thread_count, cpu_finalize_band, &l);
+	check_goto_temp(callres != EXIT_SUCCESS, "Cannot run labeling threads", EXIT_FAILURE)
+
+free_temporary_resources:
+	host_arena_free(arena, (void*)l.parent);
+	host_arena_free(arena, l.band_roots);
+	host_arena_free(arena, l.border_rows);
+	host_arena_rewind(arena, mark);
+	return callres;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "host_platform.h"
+#include "map_file.h"
+#include "border_predicate.h"
+
+// Native host labeling: block (row band) based two-pass connected component
+// labeling with a lock-free union-find merging the band seams.
+// Output contract is the same as parse_map: mask is 0 on borders and
+// 1..vertex_count inside areas, numbered in order of their first pixel.
+// border NULL - BORDER_CHANNEL; the scratch comes from arena (NULL - the
+// heap) and goes back before returning
+int cpu_label_map(
+	const char* pixels,
+	size_t width,
+	size_t height,
+	mask_cell* mask,
+	size_t* vertex_count,
+	size_t thread_count,
+	const struct border_predicate_t* border,
+	struct host_arena_t* arena
+);
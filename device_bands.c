@@ -0,0 +1,392 @@
+#include "device_bands.h"
+
+#include <string.h>
+
+static int band_push_device(cl_device_id** list, size_t* count, size_t* capacity, cl_device_id device) {
+	if (*count == *capacity) {
+		size_t new_capacity = *capacity ? *capacity * 2 : 8;
+		cl_device_id* grown = (cl_device_id*)realloc(*list, new_capacity * sizeof(cl_device_id));
+		check(grown == NULL, "Cannot allocate device list", EXIT_FAILURE)
+		*list = grown;
+		*capacity = new_capacity;
+	}
+	(*list)[(*count)++] = device;
+	return EXIT_SUCCESS;
+}
+
+// the NUMA nodes of a CPU device, 0 parts if it does not partition that way
+static cl_uint band_split_numa(cl_device_id device, cl_device_id** parts) {
+	cl_device_type type = 0;
+	cl_device_affinity_domain domains = 0;
+	cl_device_partition_property properties[] = {
+		CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0
+	};
+	cl_uint part_count = 0;
+	*parts = NULL;
+
+	if (clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL) != CL_SUCCESS ||
+		!(type & CL_DEVICE_TYPE_CPU)) return 0;
+	if (clGetDeviceInfo(device, CL_DEVICE_PARTITION_AFFINITY_DOMAIN, sizeof(domains), &domains, NULL) != CL_SUCCESS ||
+		!(domains & CL_DEVICE_AFFINITY_DOMAIN_NUMA)) return 0;
+	if (clCreateSubDevices(device, properties, 0, NULL, &part_count) != CL_SUCCESS || part_count < 2) return 0;
+
+	*parts = (cl_device_id*)malloc(part_count * sizeof(cl_device_id));
+	if (*parts == NULL) return 0;
+	if (clCreateSubDevices(device, properties, part_count, *parts, NULL) != CL_SUCCESS) {
+		free(*parts);
+		*parts = NULL;
+		return 0;
+	}
+	return part_count;
+}
+
+// all devices of all platforms, NUMA parts in place of their CPU device
+static int band_collect_devices(struct band_set_t* s, cl_device_id** list, size_t* count) {
+	cl_device_id* found = NULL;
+	size_t found_count = 0, capacity = 0, sub_capacity = 0;
+	int callres = EXIT_SUCCESS;
+	*list = NULL;
+	*count = 0;
+
+	check(list_devices(&found, &found_count) != EXIT_SUCCESS, "No devices detected", EXIT_FAILURE)
+
+	for (size_t d = 0; d < found_count; d++) {
+		cl_device_id* parts = NULL;
+		cl_uint part_count = s->options.numa_bands ? band_split_numa(found[d], &parts) : 0;
+		if (part_count == 0) {
+			check_goto_temp(band_push_device(list, count, &capacity, found[d]) != EXIT_SUCCESS,
+				"Cannot collect devices", EXIT_FAILURE)
+			continue;
+		}
+		for (cl_uint i = 0; i < part_count; i++) {
+			// a part in sub_devices is released with the set, the ones after it here
+			cl_uint released = i;
+			if (band_push_device(&s->sub_devices, &s->sub_device_count, &sub_capacity, parts[i]) == EXIT_SUCCESS) {
+				released = i + 1;
+				if (band_push_device(list, count, &capacity, parts[i]) == EXIT_SUCCESS) continue;
+			}
+			for (cl_uint j = released; j < part_count; j++) clReleaseDevice(parts[j]);
+			free(parts);
+			check_goto_temp(1, "Cannot collect devices", EXIT_FAILURE)
+		}
+		free(parts);
+	}
+
+free_temporary_resources:
+	free(found);
+	return callres;
+}
+
+static int band_compare_estimate(const void* a, const void* b) {
+	double x = ((const struct band_device_t*)a)->estimate, y = ((const struct band_device_t*)b)->estimate;
+	return (x < y) - (x > y);
+}
+
+int band_set_setup(struct band_set_t* s, const struct map_options_t* options) {
+	cl_device_id* ids = NULL;
+	size_t id_count = 0;
+	int callres = EXIT_SUCCESS;
+
+	memset(s, 0, sizeof(struct band_set_t));
+	s->options = *options;
+	host_arena_init(&s->arena, options->huge_pages);
+	// one profiler cannot align several device clocks, devices record nothing
+	s->options.profiler = NULL;
+
+	check_goto_temp(band_collect_devices(s, &ids, &id_count) != EXIT_SUCCESS, "Cannot collect devices", EXIT_FAILURE)
+	s->devices = (struct band_device_t*)calloc(id_count, sizeof(struct band_device_t));
+	check_goto_temp(s->devices == NULL, "Cannot allocate band devices", EXIT_FAILURE)
+
+	for (size_t i = 0; i < id_count; i++) {
+		struct band_device_t* d = s->devices + i;
+		cl_uint units = 0, clock = 0;
+		d->device = ids[i];
+		clGetDeviceInfo(d->device, CL_DEVICE_NAME, BAND_NAME_SIZE, d->name, NULL);
+		d->name[BAND_NAME_SIZE - 1] = 0;
+		clGetDeviceInfo(d->device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &units, NULL);
+		clGetDeviceInfo(d->device, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(cl_uint), &clock, NULL);
+		d->estimate = (double)(units ? units : 1) * (clock ? clock : 1);
+	}
+
+	// the strongest devices first, a limit keeps those
+	qsort(s->devices, id_count, sizeof(struct band_device_t), band_compare_estimate);
+	if (id_count > options->device_bands) id_count = options->device_bands;
+
+	// a device that cannot build the program is left out
+	for (size_t i = 0; i < id_count; i++) {
+		struct band_device_t* d = s->devices + s->count;
+		*d = s->devices[i];
+		if (setup_environment_on_device(s->options.kernel_file, &d->cld, d->device, &s->options) != EXIT_SUCCESS) {
+			printf("\n\t< Band device %s: skipped;\n", d->name);
+			continue;
+		}
+		printf("\n\t< Band device %lu: %s;\n", (unsigned long)s->count, d->name);
+		s->count++;
+	}
+	check_goto_temp(s->count == 0, "No usable devices", EXIT_FAILURE)
+
+free_temporary_resources:
+	free(ids);
+	if (callres != EXIT_SUCCESS) distruct_band_set(s);
+	return callres;
+}
+
+void distruct_band_set(struct band_set_t* s) {
+	for (size_t i = 0; i < s->count; i++) distruct_environment(&s->devices[i].cld, NULL);
+	for (size_t i = 0; i < s->sub_device_count; i++) clReleaseDevice(s->sub_devices[i]);
+	if (s->devices) free(s->devices);
+	if (s->sub_devices) free(s->sub_devices);
+	distruct_host_arena(&s->arena);
+	memset(s, 0, sizeof(struct band_set_t));
+}
+
+// rows [y0, y0 + rows) as a map of their own, the file mapping stays with bmp
+static void band_window(struct bmp_map* bmp, size_t y0, size_t rows, struct bmp_map* window) {
+	*window = *bmp;
+	memset(&window->map, 0, sizeof(struct host_file_map_t));
+	window->linear_sequence = bmp->linear_sequence + y0 * bmp->image_row_pitch;
+	window->linear_sequence_size = rows * bmp->image_row_pitch;
+	window->image_height = rows;
+	window->mask_size = rows * bmp->image_width;
+}
+
+// heights in proportion to the device rates, unmeasured devices scaled like
+// the measured ones; a band under min_rows goes to the next device
+static void band_split(struct band_set_t* s, size_t height, size_t min_rows) {
+	double scale = 0, total = 0, sum = 0;
+	size_t measured = 0, y = 0, last = s->count;
+
+	for (size_t i = 0; i < s->count; i++) {
+		if (s->devices[i].throughput == 0) continue;
+		scale += s->devices[i].throughput / s->devices[i].estimate;
+		measured++;
+	}
+	scale = measured ? scale / measured : 1;
+	for (size_t i = 0; i < s->count; i++) {
+		struct band_device_t* d = s->devices + i;
+		total += d->throughput ? d->throughput : d->estimate * scale;
+	}
+
+	for (size_t i = 0; i < s->count; i++) {
+		struct band_device_t* d = s->devices + i;
+		sum += d->throughput ? d->throughput : d->estimate * scale;
+		size_t end = i + 1 == s->count ? height : (size_t)(height * sum / total + 0.5);
+		d->y0 = y;
+		d->rows = 0;
+		d->halo = 0;
+		if (end > y && end - y >= min_rows) {
+			d->rows = end - y;
+			y = end;
+			last = i;
+		}
+	}
+	if (y < height) {
+		if (last == s->count) last = 0;
+		s->devices[last].rows += height - y;
+	}
+}
+
+// the labeling time on every device's own clock, averaged over the maps
+static void band_measure(struct band_set_t* s, size_t width) {
+	for (size_t i = 0; i < s->count; i++) {
+		struct band_device_t* d = s->devices + i;
+		cl_ulong start = 0, end = 0;
+		if (!d->rows || d->started == NULL || d->labeled == NULL) continue;
+		if (clGetEventProfilingInfo(d->started, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL) != CL_SUCCESS ||
+			clGetEventProfilingInfo(d->labeled, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL) != CL_SUCCESS ||
+			end <= start) continue;
+		double rate = (double)(width * (d->rows + d->halo)) / ((double)(end - start) * 1e-9);
+		d->throughput = d->throughput ? (d->throughput + rate) / 2 : rate;
+	}
+}
+
+// provisional ids per window, joined over the shared rows, compacted to 1..V
+static int band_merge(struct band_set_t* s, size_t width, uint32_t** parent, size_t* vertex_count) {
+	struct band_device_t* prev = NULL;
+	size_t provisional = 0;
+
+	for (size_t i = 0; i < s->count; i++) {
+		struct band_device_t* d = s->devices + i;
+		if (!d->rows) continue;
+		d->base = provisional;
+		provisional += d->cld.vertex_count;
+	}
+	check(provisional >= UINT32_MAX, "Map has too many areas for 32-bit ids", EXIT_FAILURE)
+
+	*parent = (uint32_t*)host_arena_alloc(&s->arena, (provisional + 1) * sizeof(uint32_t));
+	check(*parent == NULL, "Cannot allocate union-find", EXIT_FAILURE)
+	for (size_t p = 0; p <= provisional; p++) (*parent)[p] = (uint32_t)p;
+
+	for (size_t i = 0; i < s->count; i++) {
+		struct band_device_t* d = s->devices + i;
+		if (!d->rows) continue;
+		if (prev) {
+			for (size_t c = 0; c < prev->halo * width; c++) {
+				if (prev->tail[c] && d->head[c])
+					tiled_union(*parent, (uint32_t)(prev->base + prev->tail[c]), (uint32_t)(d->base + d->head[c]));
+			}
+		}
+		prev = d;
+	}
+
+	// roots come before their members, so one ascending pass numbers them
+	*vertex_count = 0;
+	for (size_t p = 1; p <= provisional; p++) {
+		uint32_t r = (*parent)[p];
+		(*parent)[p] = r == p ? (uint32_t)++*vertex_count : (*parent)[r];
+	}
+	return EXIT_SUCCESS;
+}
+
+// window edges in area ids, repeats are left to graph_init_sparse
+static int band_collect_edges(struct band_set_t* s, const uint32_t* parent,
+	struct graph_edge_t** edges, size_t* edge_count
+) {
+	size_t total = 0;
+	for (size_t i = 0; i < s->count; i++) total += s->devices[i].rows ? s->devices[i].edge_count : 0;
+
+	*edge_count = 0;
+	*edges = (struct graph_edge_t*)host_arena_alloc(&s->arena, (total + 1) * sizeof(struct graph_edge_t));
+	check(*edges == NULL, "Cannot allocate memory for edges", EXIT_FAILURE)
+
+	for (size_t i = 0; i < s->count; i++) {
+		struct band_device_t* d = s->devices + i;
+		if (!d->rows) continue;
+		for (size_t e = 0; e < d->edge_count; e++) {
+			uint32_t lv = parent[d->base + d->edges[e].lv], rv = parent[d->base + d->edges[e].rv];
+			if (lv == rv) continue;
+			(*edges)[*edge_count].lv = lv;
+			(*edges)[*edge_count].rv = rv;
+			(*edge_count)++;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+// the seams and edges come from the device's arena, reset here
+static void band_release(struct band_device_t* d) {
+	d->head = d->tail = NULL;
+	d->edges = NULL;
+	d->edge_count = 0;
+	if (d->started) clReleaseEvent(d->started);
+	if (d->labeled) clReleaseEvent(d->labeled);
+	d->started = d->labeled = NULL;
+	host_arena_reset(&d->cld.arena);
+}
+
+int band_process_map(struct band_set_t* s, struct bmp_map* bmp) {
+	struct graph_as_row_t g;
+	struct graph_edge_t* edges = NULL;
+	uint32_t* parent = NULL;
+	uint8_t* vertex_color = NULL;
+	size_t width = bmp->image_width, vertex_count = 0, edge_count = 0;
+	size_t search_limit = s->options.edge_search_limit ? s->options.edge_search_limit : EDGE_SEARCH_LIMIT;
+	size_t min_rows = search_limit > BAND_ROWS_MIN ? search_limit : BAND_ROWS_MIN;
+	struct band_device_t* prev = NULL;
+	int callres = EXIT_SUCCESS;
+
+	memset(&g, 0, sizeof(struct graph_as_row_t));
+	band_split(s, bmp->image_height, min_rows);
+	for (size_t i = 0; i < s->count; i++) {
+		struct band_device_t* d = s->devices + i;
+		if (!d->rows) continue;
+		if (prev) prev->halo = search_limit < d->rows ? search_limit : d->rows;
+		prev = d;
+	}
+
+	// labeling runs on every device at once
+	for (size_t i = 0; i < s->count; i++) {
+		struct band_device_t* d = s->devices + i;
+		if (!d->rows) continue;
+		printf("\n\t< Band %lu: rows %lu..%lu on %s;\n", (unsigned long)i,
+			(unsigned long)d->y0, (unsigned long)(d->y0 + d->rows), d->name);
+		band_window(bmp, d->y0, d->rows + d->halo, &d->window);
+		// the halo rows are the next window's too: a copy, so no two images wrap them
+		d->cld.private_image = d->halo != 0;
+		if (clEnqueueMarkerWithWaitList(d->cld.command_queue, 0, NULL, &d->started) != CL_SUCCESS) d->started = NULL;
+		check_goto_temp(setup_shared_buffers(&d->cld, &d->window) != EXIT_SUCCESS ||
+			parse_map(&d->cld, &d->window) != EXIT_SUCCESS, "Cannot label band", EXIT_FAILURE)
+		if (d->cld.label_total_ready) {
+			clRetainEvent(d->cld.label_total_ready);
+			d->labeled = d->cld.label_total_ready;
+		}
+		clFlush(d->cld.command_queue);
+	}
+
+	for (size_t i = 0; i < s->count; i++) {
+		struct band_device_t* d = s->devices + i;
+		if (!d->rows) continue;
+		check_goto_temp(enqueue_edge_list(&d->cld, &d->window) != EXIT_SUCCESS, "Cannot build band edges", EXIT_FAILURE)
+	}
+
+	prev = NULL;
+	for (size_t i = 0; i < s->count; i++) {
+		struct band_device_t* d = s->devices + i;
+		if (!d->rows) continue;
+		check_goto_temp(read_edge_list(&d->cld, &d->window, &d->edges, &d->edge_count) != EXIT_SUCCESS,
+			"Cannot read band edges", EXIT_FAILURE)
+		if (d->halo) {
+			d->tail = (mask_cell*)host_arena_alloc(&d->cld.arena, d->halo * width * sizeof(mask_cell));
+			check_goto_temp(d->tail == NULL, "Cannot allocate band seam", EXIT_FAILURE)
+			check_goto_temp(read_mask_rows(&d->cld, &d->window, d->rows, d->halo, d->tail) != EXIT_SUCCESS,
+				"Cannot read band seam", EXIT_FAILURE)
+		}
+		if (prev) {
+			d->head = (mask_cell*)host_arena_alloc(&d->cld.arena, prev->halo * width * sizeof(mask_cell));
+			check_goto_temp(d->head == NULL, "Cannot allocate band seam", EXIT_FAILURE)
+			check_goto_temp(read_mask_rows(&d->cld, &d->window, 0, prev->halo, d->head) != EXIT_SUCCESS,
+				"Cannot read band seam", EXIT_FAILURE)
+		}
+		prev = d;
+	}
+	band_measure(s, width);
+
+	check_goto_temp(band_merge(s, width, &parent, &vertex_count) != EXIT_SUCCESS, "Cannot merge bands", EXIT_FAILURE)
+	check_goto_temp(band_collect_edges(s, parent, &edges, &edge_count) != EXIT_SUCCESS,
+		"Cannot merge band edges", EXIT_FAILURE)
+	printf("\n\t< Areas found: %lu;\n", (unsigned long)vertex_count);
+
+	check_goto_temp(graph_init_sparse(&g, vertex_count, edges, edge_count, &s->arena) != EXIT_SUCCESS,
+		"Cannot init graph", EXIT_FAILURE)
+	host_arena_free(&s->arena, edges);
+	edges = NULL;
+	graph_calc_links(&g, 1);
+
+	callres = s->options.parallel_coloring ?
+		graph_coloring_parallel(&g, s->options.thread_count) : graph_coloring(&g);
+	check_goto_temp(callres != EXIT_SUCCESS, "Cannot color graph", EXIT_FAILURE)
+
+	// every device paints its band only, the halo rows belong to the next one
+	for (size_t i = 0; i < s->count; i++) {
+		struct band_device_t* d = s->devices + i;
+		if (!d->rows) continue;
+		vertex_color = (uint8_t*)host_arena_calloc(&s->arena, d->cld.vertex_count + 1, sizeof(uint8_t));
+		check_goto_temp(vertex_color == NULL, "Cannot allocate vertex to color buffer", EXIT_FAILURE)
+		for (size_t l = 1; l <= d->cld.vertex_count; l++)
+			vertex_color[l] = g.color_ids[parent[d->base + l]];
+
+		band_window(bmp, d->y0, d->rows, &d->window);
+		check_goto_temp(apply_color_table(&d->cld, &d->window, vertex_color, d->cld.vertex_count) != EXIT_SUCCESS,
+			"Cannot paint band", EXIT_FAILURE)
+		host_arena_free(&s->arena, vertex_color);
+		vertex_color = NULL;
+	}
+	for (size_t i = 0; i < s->count; i++) {
+		struct band_device_t* d = s->devices + i;
+		if (!d->rows) continue;
+		check_goto_temp(read_colored_map(&d->cld, &d->window) != EXIT_SUCCESS, "Cannot read band", EXIT_FAILURE)
+	}
+
+free_temporary_resources:
+	// nothing may still be reading into the host buffers freed below
+	for (size_t i = 0; i < s->count; i++) {
+		if (s->devices[i].cld.command_queue) clFinish(s->devices[i].cld.command_queue);
+		band_release(s->devices + i);
+	}
+	host_arena_free(&s->arena, vertex_color);
+	host_arena_free(&s->arena, edges);
+	host_arena_free(&s->arena, parent);
+	distruct_graph_as_row(&g);
+	host_arena_reset(&s->arena);
+	return callres;
+}
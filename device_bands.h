@@ -0,0 +1,49 @@
+#pragma once
+
+#include "ocl_map_to_graph.h"
+#include "tiled_map.h"
+#include "host_platform.h"
+
+#define BAND_ROWS_MIN 64
+#define BAND_NAME_SIZE 64
+
+// One device of the split and its band of the current map. The window is the
+// band plus the first halo rows of the next band: edge walks starting in the
+// band reach as far down as in the whole map, and the rows both windows label
+// join their areas across the seam.
+struct band_device_t {
+	struct cl_data_t cld;
+	cl_device_id device;
+	char name[BAND_NAME_SIZE];
+	double estimate; // compute units x clock, until measured
+	double throughput; // labeled pixels per second, 0 - not measured yet
+
+	struct bmp_map window;
+	size_t y0, rows, halo;
+	size_t base; // provisional id of the window's label 0
+	mask_cell* head; // first rows, the previous window's halo
+	mask_cell* tail; // halo rows
+	struct graph_edge_t* edges;
+	size_t edge_count;
+	cl_event started; // marker before the upload
+	cl_event labeled; // area count read back
+};
+
+// Splits one map into row bands over several devices: every device of every
+// platform, CPU devices optionally partitioned per NUMA node. Each band is
+// labeled and its edges found on its own device, a union-find over the shared
+// rows merges the labels into one graph, which is colored on the host and
+// painted back band by band. Band heights follow the labeling rate measured on
+// every device, so they settle over a batch.
+struct band_set_t {
+	struct band_device_t* devices;
+	size_t count;
+	cl_device_id* sub_devices; // created here, released with the set
+	size_t sub_device_count;
+	struct map_options_t options;
+	struct host_arena_t arena; // merge, graph and color tables of the current map
+};
+
+int band_set_setup(struct band_set_t*, const struct map_options_t*);
+void distruct_band_set(struct band_set_t*);
+int band_process_map(struct band_set_t*, struct bmp_map*);
@@ -0,0 +1,801 @@
+#include "graph_essentials.h"
+#include "macros.h"
+#include "host_platform.h"
+
+#define color_index_none UINT8_MAX
+#define coloring_block_size 4096 // vertices, ids are in raster order so a block is a band of the map
+#define coloring_ball_size 256
+#define coloring_kempe_rounds 4 // speculative rounds allowed to swap kempe chains
+#define coloring_repair_passes 4
+#define coloring_subset_rings 2 // neighbour rings a subset takes in to keep within the palette
+
+// working state of one coloring run, every array indexed by vertex id
+struct coloring_t {
+	size_t vertex_count;
+	const size_t* offsets;
+	const gid_t* adjacency;
+
+	uint8_t* color;		// color index, color_index_none - not colored yet
+	gid_t* order;		// smallest-last order, colored back to front
+	gid_t* queue;		// kempe chain
+	uint32_t* visited;	// kempe chain stamp
+
+	// smallest-last buckets, parallel blocks use their own id ranges
+	size_t* bucket_degree;
+	gid_t* bucket_next;
+	gid_t* bucket_prev;
+	gid_t* bucket_head;
+
+	size_t* dense_offsets;
+	gid_t* dense_adjacency;
+
+	// the graph's, every array above comes from it and goes back on
+	// distruct_coloring
+	struct host_arena_t* arena;
+	struct host_arena_mark_t mark;
+};
+
+// Vertices in [begin, end) may be recolored, the others are read from outer
+// and never change. Scopes of parallel blocks do not overlap, so each of them
+// owns its part of color, queue and visited.
+struct coloring_scope_t {
+	gid_t begin;
+	gid_t end;
+	const uint8_t* outer;
+	uint32_t stamp;
+	size_t kempe_swaps;
+
+	// old colors of every kempe swap while set, so a failed repair can undo it
+	struct coloring_undo_t* undo;
+};
+
+// grows in the coloring arena, a full journal stops any further swap
+struct coloring_undo_t {
+	gid_t* vertex;
+	uint8_t* color;
+	size_t count;
+	size_t capacity;
+	struct host_arena_t* arena;
+	unsigned char overflow;
+};
+
+// Matula-Beck bucket queue: repeatedly remove a vertex of minimal remaining
+// degree, lowest bucket first and most recently moved vertex within it.
+// Planar graphs never leave a vertex with more than 5 uncolored neighbours.
+// Only links inside [begin, end) count, so a degree stays below end - begin
+// and the buckets of the range fit head[begin ..]; lists link vertex ids.
+static void coloring_smallest_last(const struct coloring_t* c, gid_t begin, gid_t end, gid_t* order) {
+	size_t n = end - begin, max_degree = 0;
+	size_t* degree = c->bucket_degree;
+	gid_t* next = c->bucket_next;
+	gid_t* prev = c->bucket_prev;
+	gid_t* head = c->bucket_head + begin;
+
+	for (gid_t v = begin; v < end; v++) {
+		size_t d = 0;
+		for (size_t i = c->offsets[v]; i < c->offsets[v + 1]; i++)
+			d += c->adjacency[i] >= begin && c->adjacency[i] < end;
+		degree[v] = d;
+		if (d > max_degree) max_degree = d;
+	}
+	memset(head, 0, (max_degree + 1) * sizeof(gid_t));
+
+	// push in descending id order so equal degrees pop lowest id first, 0 ends a list
+	for (gid_t v = end; v-- > begin; ) {
+		prev[v] = 0;
+		next[v] = head[degree[v]];
+		if (next[v]) prev[next[v]] = v;
+		head[degree[v]] = v;
+	}
+
+	size_t low = 0;
+	for (size_t removed = 0; removed < n; removed++) {
+		while (head[low] == 0) low++;
+
+		gid_t v = head[low];
+		head[low] = next[v];
+		if (next[v]) prev[next[v]] = 0;
+		degree[v] = SIZE_MAX; // removed
+		order[n - 1 - removed] = v;
+
+		for (size_t i = c->offsets[v]; i < c->offsets[v + 1]; i++) {
+			gid_t u = c->adjacency[i];
+			if (u < begin || u >= end || degree[u] == SIZE_MAX) continue;
+
+			// unlink u from its bucket and push it one bucket lower
+			if (prev[u]) next[prev[u]] = next[u];
+			else head[degree[u]] = next[u];
+			if (next[u]) prev[next[u]] = prev[u];
+
+			degree[u]--;
+			prev[u] = 0;
+			next[u] = head[degree[u]];
+			if (next[u]) prev[next[u]] = u;
+			head[degree[u]] = u;
+		}
+		if (low > 0) low--;
+	}
+}
+
+// room for extra more entries, EXIT_FAILURE leaves the journal full
+static int coloring_undo_reserve(struct coloring_undo_t* undo, size_t extra) {
+	if (undo == NULL) return EXIT_SUCCESS;
+	if (undo->overflow) return EXIT_FAILURE;
+	if (undo->count + extra <= undo->capacity) return EXIT_SUCCESS;
+
+	size_t capacity = undo->capacity ? undo->capacity : 1024;
+	while (capacity < undo->count + extra) capacity *= 2;
+	gid_t* vertex = (gid_t*)host_arena_realloc(undo->arena, undo->vertex,
+		undo->capacity * sizeof(gid_t), capacity * sizeof(gid_t));
+	if (vertex) undo->vertex = vertex;
+	uint8_t* color = vertex ? (uint8_t*)host_arena_realloc(undo->arena, undo->color, undo->capacity, capacity) : NULL;
+	if (color) undo->color = color;
+	if (!vertex || !color) {
+		undo->overflow = 1;
+		return EXIT_FAILURE;
+	}
+	undo->capacity = capacity;
+	return EXIT_SUCCESS;
+}
+
+static void coloring_undo_push(struct coloring_undo_t* undo, gid_t v, uint8_t color) {
+	if (undo == NULL) return;
+	undo->vertex[undo->count] = v;
+	undo->color[undo->count] = color;
+	undo->count++;
+}
+
+static uint8_t coloring_color(const struct coloring_t* c, const struct coloring_scope_t* s, gid_t u) {
+	return (u >= s->begin && u < s->end) ? c->color[u] : s->outer[u];
+}
+
+static uint32_t coloring_neighbours_mask(const struct coloring_t* c, const struct coloring_scope_t* s, gid_t v) {
+	uint32_t used = 0;
+	for (size_t i = c->offsets[v]; i < c->offsets[v + 1]; i++) {
+		uint8_t nc = coloring_color(c, s, c->adjacency[i]);
+		if (nc != color_index_none) used |= (uint32_t)1 << nc;
+	}
+	return used;
+}
+
+static uint8_t coloring_first_free(uint32_t used, uint8_t limit) {
+	for (uint8_t k = 0; k < limit; k++)
+		if (!(used & ((uint32_t)1 << k))) return k;
+	return color_index_none;
+}
+
+// Tries to free color a or b around v. The a/b chains grown from the
+// a-coloured and from the b-coloured neighbours grow one vertex at a time;
+// meeting means one component and no swap, otherwise the chain that ends
+// first swaps its two colors, so the work is bounded by the smaller chain.
+// A chain leaving the scope can not be swapped.
+static uint8_t coloring_kempe_free(struct coloring_t* c, struct coloring_scope_t* s, gid_t v, uint8_t a, uint8_t b) {
+	gid_t* queue = c->queue + s->begin;
+	size_t capacity = s->end - s->begin;
+	size_t size[2] = { 0, 0 }, head[2] = { 0, 0 };
+	unsigned char blocked[2] = { 0, 0 };
+	uint8_t side_color[2] = { a, b };
+
+	if (s->stamp >= UINT32_MAX - 2) {
+		memset(c->visited + s->begin, 0, capacity * sizeof(uint32_t));
+		s->stamp = 0;
+	}
+	s->stamp += 2;
+	uint32_t stamp[2] = { s->stamp - 1, s->stamp };
+
+	// side 0 fills the queue from the front, side 1 from the back
+#define kempe_slot(SIDE, I) queue[(SIDE) ? capacity - 1 - (I) : (I)]
+
+	for (size_t i = c->offsets[v]; i < c->offsets[v + 1]; i++) {
+		gid_t u = c->adjacency[i];
+		uint8_t uc = coloring_color(c, s, u);
+		if (uc != a && uc != b) continue;
+		int side = uc == b;
+		if (u < s->begin || u >= s->end) { blocked[side] = 1; continue; }
+		if (c->visited[u] == stamp[side]) continue;
+		c->visited[u] = stamp[side];
+		kempe_slot(side, size[side]) = u;
+		size[side]++;
+	}
+
+	for (;;) {
+		for (int side = 0; side < 2; side++) {
+			if (head[side] == size[side]) {
+				if (blocked[side]) continue;
+				if (coloring_undo_reserve(s->undo, size[side]) != EXIT_SUCCESS) return color_index_none;
+				for (size_t i = 0; i < size[side]; i++) {
+					gid_t u = kempe_slot(side, i);
+					coloring_undo_push(s->undo, u, c->color[u]);
+					c->color[u] = c->color[u] == a ? b : a;
+				}
+				s->kempe_swaps++;
+				return side_color[side];
+			}
+
+			gid_t u = kempe_slot(side, head[side]);
+			head[side]++;
+			for (size_t i = c->offsets[u]; i < c->offsets[u + 1]; i++) {
+				gid_t w = c->adjacency[i];
+				if (w == v) continue;
+				uint8_t wc = coloring_color(c, s, w);
+				if (wc != a && wc != b) continue;
+				if (w < s->begin || w >= s->end) { blocked[side] = 1; continue; }
+				if (c->visited[w] == stamp[!side]) return color_index_none;
+				if (c->visited[w] == stamp[side]) continue;
+				c->visited[w] = stamp[side];
+				kempe_slot(side, size[side]) = w;
+				size[side]++;
+			}
+		}
+		if (blocked[0] && blocked[1]) return color_index_none;
+	}
+#undef kempe_slot
+}
+
+// color for v within limit colors, recoloring one kempe chain when needed
+static uint8_t coloring_pick(struct coloring_t* c, struct coloring_scope_t* s, gid_t v, uint8_t limit) {
+	uint8_t k = coloring_first_free(coloring_neighbours_mask(c, s, v), limit);
+	if (k != color_index_none) return k;
+
+	for (uint8_t a = 0; a < limit; a++) {
+		for (uint8_t b = a + 1; b < limit; b++) {
+			k = coloring_kempe_free(c, s, v, a, b);
+			if (k != color_index_none) return k;
+		}
+	}
+	return color_index_none;
+}
+
+// target colors, then one more, then any free one
+static uint8_t coloring_pick_any(struct coloring_t* c, struct coloring_scope_t* s, gid_t v) {
+	uint8_t k = coloring_pick(c, s, v, graph_color_target);
+	if (k == color_index_none) k = coloring_pick(c, s, v, graph_color_target + 1);
+	if (k == color_index_none) k = coloring_first_free(coloring_neighbours_mask(c, s, v), graph_color_max);
+	return k;
+}
+
+// v keeps a color past the target: the only neighbour u holding color a moves
+// to another color (first fit or a kempe chain without a), then v takes a
+static uint8_t coloring_repair_neighbour(struct coloring_t* c, struct coloring_scope_t* s, gid_t v) {
+	uint8_t own = c->color[v];
+	c->color[v] = color_index_none;
+
+	for (size_t i = c->offsets[v]; i < c->offsets[v + 1]; i++) {
+		gid_t u = c->adjacency[i];
+		uint8_t a = c->color[u], k = color_index_none;
+		if (a >= graph_color_target || u < s->begin || u >= s->end) continue;
+
+		size_t holders = 0;
+		for (size_t j = c->offsets[v]; j < c->offsets[v + 1]; j++)
+			holders += c->color[c->adjacency[j]] == a;
+		if (holders != 1) continue;
+
+		k = coloring_first_free(coloring_neighbours_mask(c, s, u) | ((uint32_t)1 << a), graph_color_target);
+		for (uint8_t x = 0; x < graph_color_target && k == color_index_none; x++) {
+			for (uint8_t y = x + 1; y < graph_color_target && k == color_index_none; y++) {
+				if (x == a || y == a) continue;
+				k = coloring_kempe_free(c, s, u, x, y);
+			}
+		}
+		if (k == color_index_none) continue;
+
+		c->color[u] = k;
+		return a;
+	}
+
+	c->color[v] = own;
+	return color_index_none;
+}
+
+// last resort for v: the ball of radius 2 around v is uncolored and colored
+// again in smallest-last order of the ball, so every vertex of it sees few
+// colored neighbours when it is picked. Any ball vertex past the target puts
+// the old colors back.
+static uint8_t coloring_repair_ball(struct coloring_t* c, struct coloring_scope_t* s, gid_t v) {
+	gid_t ball[coloring_ball_size], order[coloring_ball_size];
+	size_t degree[coloring_ball_size];
+	size_t count = 0;
+
+	ball[count++] = v;
+	for (size_t head = 0, ring_end = 1, ring = 0; head < count && ring < 2; ring++) {
+		for (; head < ring_end; head++) {
+			gid_t u = ball[head];
+			for (size_t i = c->offsets[u]; i < c->offsets[u + 1]; i++) {
+				gid_t w = c->adjacency[i];
+				if (w < s->begin || w >= s->end) return color_index_none;
+				size_t k = 0;
+				while (k < count && ball[k] != w) k++;
+				if (k < count) continue;
+				if (count == coloring_ball_size) return color_index_none;
+				ball[count++] = w;
+			}
+		}
+		ring_end = count;
+	}
+
+	struct host_arena_mark_t mark = host_arena_mark(c->arena);
+	struct coloring_undo_t undo = { NULL, NULL, 0, 0, c->arena, 0 };
+	if (coloring_undo_reserve(&undo, count) != EXIT_SUCCESS) return color_index_none;
+	for (size_t i = 0; i < count; i++) {
+		coloring_undo_push(&undo, ball[i], c->color[ball[i]]);
+		c->color[ball[i]] = color_index_none;
+	}
+	s->undo = &undo;
+
+	// smallest-last inside the ball by a plain scan, the ball is small
+	for (size_t i = 0; i < count; i++) {
+		degree[i] = 0;
+		for (size_t a = c->offsets[ball[i]]; a < c->offsets[ball[i] + 1]; a++)
+			degree[i] += c->color[c->adjacency[a]] == color_index_none;
+	}
+	for (size_t removed = 0; removed < count; removed++) {
+		size_t best = SIZE_MAX;
+		for (size_t i = 0; i < count; i++)
+			if (degree[i] != SIZE_MAX && (best == SIZE_MAX || degree[i] < degree[best])) best = i;
+		order[count - 1 - removed] = ball[best];
+		degree[best] = SIZE_MAX;
+		for (size_t i = 0; i < count; i++) {
+			if (degree[i] == SIZE_MAX) continue;
+			for (size_t a = c->offsets[ball[i]]; a < c->offsets[ball[i] + 1]; a++)
+				if (c->adjacency[a] == ball[best]) degree[i]--;
+		}
+	}
+
+	uint8_t k = color_index_none;
+	for (size_t i = 0; i < count; i++) {
+		k = coloring_pick(c, s, order[i], graph_color_target);
+		if (k == color_index_none || undo.overflow) break;
+		c->color[order[i]] = k;
+	}
+	s->undo = NULL;
+
+	// walk the journal back, latest change first
+	if (k == color_index_none || undo.overflow) {
+		for (size_t i = undo.count; i > 0; i--) c->color[undo.vertex[i - 1]] = undo.color[i - 1];
+		k = color_index_none;
+	}
+	else k = c->color[v];
+	host_arena_free(c->arena, undo.vertex);
+	host_arena_free(c->arena, undo.color);
+	host_arena_rewind(c->arena, mark);
+	return k;
+}
+
+// moves every vertex past the target back into it where a kempe chain allows,
+// returns how many are still past it
+static size_t coloring_repair(struct coloring_t* c, struct coloring_scope_t* s, const gid_t* order, size_t count) {
+	size_t left = 0;
+	for (size_t i = 0; i < count; i++) {
+		gid_t v = order[i];
+		if (c->color[v] < graph_color_target) continue;
+		uint8_t k = coloring_pick(c, s, v, graph_color_target);
+		if (k == color_index_none) k = coloring_repair_neighbour(c, s, v);
+		if (k == color_index_none) k = coloring_repair_ball(c, s, v);
+		if (k == color_index_none && c->color[v] > graph_color_target)
+			k = coloring_pick(c, s, v, graph_color_target + 1);
+		if (k != color_index_none) c->color[v] = k;
+		left += c->color[v] >= graph_color_target;
+	}
+	return left;
+}
+
+static uint8_t coloring_commit(struct graph_as_row_t* g, const struct coloring_t* c, const gid_t* order,
+	size_t kempe_swaps
+) {
+	uint8_t used_colors_count = 0;
+	for (size_t i = 0; i < c->vertex_count; i++) {
+		gid_t v = order[i];
+		g->order[i] = g->vertex_row + v;
+		g->color_ids[v] = (uint8_t)(1u << c->color[v]);
+		if (c->color[v] + 1 > used_colors_count) used_colors_count = c->color[v] + 1;
+	}
+
+	printf("\n\t< Colors used: %d; Kempe swaps: %lu;\n", used_colors_count, (unsigned long)kempe_swaps);
+	g->used_colors_count = used_colors_count;
+	return used_colors_count;
+}
+
+// the per vertex state of n vertices, nothing colored
+static int coloring_alloc(struct coloring_t* c, struct host_arena_t* arena, size_t n) {
+	c->arena = arena;
+	c->mark = host_arena_mark(arena);
+	c->color = (uint8_t*)host_arena_alloc(arena, n + 1);
+	c->order = (gid_t*)host_arena_alloc(arena, (n + 1) * sizeof(gid_t));
+	c->queue = (gid_t*)host_arena_alloc(arena, (n + 1) * sizeof(gid_t));
+	c->visited = (uint32_t*)host_arena_calloc(arena, n + 1, sizeof(uint32_t));
+	c->bucket_degree = (size_t*)host_arena_alloc(arena, (n + 1) * sizeof(size_t));
+	c->bucket_next = (gid_t*)host_arena_alloc(arena, (n + 1) * sizeof(gid_t));
+	c->bucket_prev = (gid_t*)host_arena_alloc(arena, (n + 1) * sizeof(gid_t));
+	c->bucket_head = (gid_t*)host_arena_alloc(arena, (n + 2) * sizeof(gid_t));
+	check(!c->color || !c->order || !c->queue || !c->visited ||
+		!c->bucket_degree || !c->bucket_next || !c->bucket_prev || !c->bucket_head,
+		"Cannot allocate coloring state", EXIT_FAILURE)
+	memset(c->color, color_index_none, n + 1);
+	return EXIT_SUCCESS;
+}
+
+static int coloring_setup(struct graph_as_row_t* g, struct coloring_t* c) {
+	size_t n = g->vertex_count;
+
+	memset(c, 0, sizeof(struct coloring_t));
+	c->vertex_count = n;
+	check(coloring_alloc(c, g->arena, n) != EXIT_SUCCESS, "Cannot allocate coloring state", EXIT_FAILURE)
+
+	if (g->storage == GRAPH_DENSE) {
+		check(graph_dense_to_sparse(g, &c->dense_offsets, &c->dense_adjacency) != EXIT_SUCCESS,
+			"Cannot convert dense graph", EXIT_FAILURE)
+		c->offsets = c->dense_offsets;
+		c->adjacency = c->dense_adjacency;
+	}
+	else {
+		c->offsets = g->adjacency_offsets;
+		c->adjacency = g->adjacency;
+	}
+	return EXIT_SUCCESS;
+}
+
+static void distruct_coloring(struct coloring_t* c) {
+	struct host_arena_t* arena = c->arena;
+	host_arena_free(arena, c->dense_offsets);
+	host_arena_free(arena, c->dense_adjacency);
+	host_arena_free(arena, c->color);
+	host_arena_free(arena, c->order);
+	host_arena_free(arena, c->queue);
+	host_arena_free(arena, c->visited);
+	host_arena_free(arena, c->bucket_degree);
+	host_arena_free(arena, c->bucket_next);
+	host_arena_free(arena, c->bucket_prev);
+	host_arena_free(arena, c->bucket_head);
+	host_arena_rewind(arena, c->mark);
+	memset(c, 0, sizeof(struct coloring_t));
+}
+
+int graph_coloring(struct graph_as_row_t* g) {
+	struct coloring_t c;
+	size_t n = g->vertex_count;
+	struct coloring_scope_t scope = { 1, (gid_t)(n + 1), NULL, 0, 0, NULL };
+	int callres = EXIT_SUCCESS;
+
+	check_goto_temp(coloring_setup(g, &c) != EXIT_SUCCESS, "Cannot setup coloring", EXIT_FAILURE)
+	coloring_smallest_last(&c, 1, n + 1, c.order);
+
+	// every vertex sees at most 5 colored neighbours on a planar graph, so a
+	// failed 4 color pick always succeeds with 5; anything else is not planar
+	for (size_t i = 0; i < n; i++) {
+		gid_t v = c.order[i];
+		uint8_t k = coloring_pick_any(&c, &scope, v);
+		check_goto_temp(k == color_index_none, "Graph needs more colors than supported", EXIT_FAILURE)
+		c.color[v] = k;
+	}
+
+	// one repair pass over the fifth color now that the whole graph is colored
+	coloring_repair(&c, &scope, c.order, n);
+	coloring_commit(g, &c, c.order, scope.kempe_swaps);
+
+free_temporary_resources:
+	distruct_coloring(&c);
+	return callres;
+}
+
+// One try of graph_coloring_subset. The list and its outside neighbours form
+// a small graph of their own, numbered list first, so the list is the scope
+// and the neighbours are its outer colors. Colors go back to g only when
+// every listed vertex keeps within the palette, *fits tells which.
+static int coloring_subset(struct graph_as_row_t* g, const gid_t* vertices, size_t count,
+	gid_t* local, gid_t* global, unsigned char* fits
+) {
+	struct coloring_t c;
+	size_t local_count = count, total = 0, past_target = 0;
+	struct coloring_scope_t scope = { 1, (gid_t)(count + 1), NULL, 0, 0, NULL };
+	int callres = EXIT_SUCCESS;
+
+	memset(&c, 0, sizeof(c));
+	*fits = 0;
+	for (size_t i = 0; i < count; i++) {
+		local[vertices[i]] = (gid_t)(i + 1);
+		global[i + 1] = vertices[i];
+	}
+	for (size_t i = 0; i < count; i++) {
+		gid_t v = vertices[i];
+		for (size_t a = g->adjacency_offsets[v]; a < g->adjacency_offsets[v + 1]; a++) {
+			gid_t u = g->adjacency[a];
+			if (!local[u]) {
+				local[u] = (gid_t)++local_count;
+				global[local_count] = u;
+			}
+			total++;
+		}
+	}
+
+	// outside neighbours have no links, chains stop at them anyway
+	c.vertex_count = local_count;
+	check_goto_temp(coloring_alloc(&c, g->arena, local_count) != EXIT_SUCCESS, "Cannot allocate subset coloring", EXIT_FAILURE)
+	c.dense_offsets = (size_t*)host_arena_calloc(g->arena, local_count + 2, sizeof(size_t));
+	c.dense_adjacency = (gid_t*)host_arena_alloc(g->arena, (total + 1) * sizeof(gid_t));
+	check_goto_temp(!c.dense_offsets || !c.dense_adjacency, "Cannot allocate subset coloring", EXIT_FAILURE)
+	c.offsets = c.dense_offsets;
+	c.adjacency = c.dense_adjacency;
+
+	total = 0;
+	for (size_t l = 1; l < local_count + 2; l++) {
+		c.dense_offsets[l] = total;
+		if (l > count) continue;
+		gid_t v = global[l];
+		for (size_t a = g->adjacency_offsets[v]; a < g->adjacency_offsets[v + 1]; a++)
+			c.dense_adjacency[total++] = local[g->adjacency[a]];
+	}
+
+	for (size_t l = count + 1; l < local_count + 1; l++) {
+		color_id_t color_id = g->color_ids[global[l]];
+		if (color_id) c.color[l] = (uint8_t)bitfield_lowest_bit((bitfield_cell)color_id);
+	}
+	scope.outer = c.color;
+
+	// fixed neighbours block kempe chains, so the palette may run out here
+	coloring_smallest_last(&c, 1, (gid_t)(count + 1), c.order);
+	for (size_t i = 0; i < count; i++) {
+		gid_t v = c.order[i];
+		uint8_t k = coloring_pick(&c, &scope, v, graph_color_target);
+		if (k == color_index_none) k = coloring_pick(&c, &scope, v, graph_color_target + 1);
+		if (k == color_index_none) k = coloring_pick(&c, &scope, v, graph_color_palette);
+		if (k == color_index_none) temp
+		c.color[v] = k;
+	}
+	past_target = coloring_repair(&c, &scope, c.order, count);
+	*fits = 1;
+
+	for (size_t l = 1; l < count + 1; l++) {
+		g->color_ids[global[l]] = (uint8_t)(1u << c.color[l]);
+		if ((size_t)c.color[l] + 1 > g->used_colors_count) g->used_colors_count = c.color[l] + 1;
+	}
+	printf("\n\t< Recolored: %lu regions; %lu past %d colors; Kempe swaps: %lu;\n", (unsigned long)count,
+		(unsigned long)past_target, graph_color_target, (unsigned long)scope.kempe_swaps);
+
+free_temporary_resources:
+	distruct_coloring(&c);
+	for (size_t l = 1; l < local_count + 1; l++) local[global[l]] = 0;
+	return callres;
+}
+
+// Recolors the listed vertices only, every other vertex keeps its color
+// unless a listed one finds no palette color: then the fixed neighbours of the
+// list join it and the whole list is colored again, at most
+// coloring_subset_rings times.
+int graph_coloring_subset(struct graph_as_row_t* g, const gid_t* vertices, size_t count) {
+	size_t n = g->vertex_count, list_count = count;
+	gid_t* list = NULL; // the vertices, then the rings taken in
+	gid_t* local = NULL; // graph id -> subgraph id, 0 - not in it
+	gid_t* global = NULL; // subgraph id -> graph id
+	unsigned char* listed = NULL;
+	unsigned char fits = 0;
+	struct host_arena_mark_t mark = host_arena_mark(g->arena);
+	int callres = EXIT_SUCCESS;
+
+	if (count == 0) return EXIT_SUCCESS;
+	check(g->storage != GRAPH_SPARSE, "Subset coloring needs a sparse graph", EXIT_FAILURE)
+
+	list = (gid_t*)host_arena_alloc(g->arena, (n + 1) * sizeof(gid_t));
+	local = (gid_t*)host_arena_calloc(g->arena, n + 1, sizeof(gid_t));
+	global = (gid_t*)host_arena_alloc(g->arena, (n + 1) * sizeof(gid_t));
+	listed = (unsigned char*)host_arena_calloc(g->arena, n + 1, 1);
+	check_goto_temp(!list || !local || !global || !listed, "Cannot allocate subset coloring", EXIT_FAILURE)
+
+	for (size_t i = 0; i < count; i++) {
+		list[i] = vertices[i];
+		listed[vertices[i]] = 1;
+	}
+	for (size_t ring = 0; ; ring++) {
+		check_goto_temp(coloring_subset(g, list, list_count, local, global, &fits) != EXIT_SUCCESS,
+			"Cannot color subset", EXIT_FAILURE)
+		if (fits) break;
+		check_goto_temp(ring == coloring_subset_rings, "Regions need more colors than the palette has", EXIT_FAILURE)
+
+		size_t ring_end = list_count;
+		for (size_t i = 0; i < ring_end; i++) {
+			gid_t v = list[i];
+			for (size_t a = g->adjacency_offsets[v]; a < g->adjacency_offsets[v + 1]; a++) {
+				gid_t u = g->adjacency[a];
+				if (listed[u]) continue;
+				listed[u] = 1;
+				list[list_count++] = u;
+			}
+		}
+		check_goto_temp(list_count == ring_end, "Regions need more colors than the palette has", EXIT_FAILURE)
+		printf("\n\t< No palette color left: recoloring %lu neighbours too;\n", (unsigned long)(list_count - ring_end));
+	}
+
+free_temporary_resources:
+	host_arena_free(g->arena, list);
+	host_arena_free(g->arena, local);
+	host_arena_free(g->arena, global);
+	host_arena_free(g->arena, listed);
+	host_arena_rewind(g->arena, mark);
+	return callres;
+}
+
+struct coloring_parallel_t {
+	struct coloring_t* c;
+	struct coloring_scope_t* scopes;	// one per block, outer is color_prev
+	unsigned char* boundary;			// has a neighbour in another block
+	uint8_t* color_prev;	// boundary colors as of the last round, read across blocks
+	gid_t* work;			// block b owns work[begin - 1 ..]
+	size_t* work_count;
+	size_t block_count;
+	size_t round;
+	unsigned char failed;
+};
+
+// higher degree, then lower id keeps its color
+static int coloring_wins(const struct coloring_t* c, gid_t u, gid_t v) {
+	size_t du = c->offsets[u + 1] - c->offsets[u], dv = c->offsets[v + 1] - c->offsets[v];
+	if (du != dv) return du > dv;
+	return u < v;
+}
+
+static void coloring_order_task(void* ctx, size_t thread_index, size_t thread_count) {
+	struct coloring_parallel_t* p = (struct coloring_parallel_t*)ctx;
+	struct coloring_t* c = p->c;
+	for (size_t b = thread_index; b < p->block_count; b += thread_count) {
+		struct coloring_scope_t* s = p->scopes + b;
+		const gid_t* order = c->order + s->begin - 1;
+		gid_t* work = p->work + s->begin - 1;
+
+		coloring_smallest_last(c, s->begin, s->end, c->order + s->begin - 1);
+		for (gid_t v = s->begin; v < s->end; v++) {
+			p->boundary[v] = 0;
+			for (size_t a = c->offsets[v]; a < c->offsets[v + 1]; a++)
+				if (c->adjacency[a] < s->begin || c->adjacency[a] >= s->end) p->boundary[v] = 1;
+		}
+
+		p->work_count[b] = 0;
+		for (size_t i = 0; i < (size_t)(s->end - s->begin); i++)
+			if (p->boundary[order[i]]) work[p->work_count[b]++] = order[i];
+	}
+}
+
+// interior vertices only touch their own block and the boundary is still
+// uncolored, so these kempe chains never leave the block either
+static void coloring_interior_task(void* ctx, size_t thread_index, size_t thread_count) {
+	struct coloring_parallel_t* p = (struct coloring_parallel_t*)ctx;
+	struct coloring_t* c = p->c;
+	for (size_t b = thread_index; b < p->block_count; b += thread_count) {
+		struct coloring_scope_t* s = p->scopes + b;
+		const gid_t* order = c->order + s->begin - 1;
+		for (size_t i = 0; i < (size_t)(s->end - s->begin); i++) {
+			gid_t v = order[i];
+			if (p->boundary[v]) continue;
+			uint8_t k = coloring_pick_any(c, s, v);
+			if (k == color_index_none) { p->failed = 1; k = 0; }
+			c->color[v] = k;
+		}
+	}
+}
+
+// Boundary vertices are colored speculatively: other blocks are read as of
+// the last round and a kempe chain stops at them. The first rounds may swap
+// chains inside the block, later ones recolor the losers by first fit only,
+// so nothing else moves and the strongest loser always settles.
+static void coloring_speculate_task(void* ctx, size_t thread_index, size_t thread_count) {
+	struct coloring_parallel_t* p = (struct coloring_parallel_t*)ctx;
+	struct coloring_t* c = p->c;
+	for (size_t b = thread_index; b < p->block_count; b += thread_count) {
+		struct coloring_scope_t* s = p->scopes + b;
+		const gid_t* work = p->work + s->begin - 1;
+		for (size_t i = 0; i < p->work_count[b]; i++) {
+			gid_t v = work[i];
+			uint8_t k = p->round < coloring_kempe_rounds ? coloring_pick_any(c, s, v) :
+				coloring_first_free(coloring_neighbours_mask(c, s, v), graph_color_max);
+			if (k == color_index_none) { p->failed = 1; k = 0; }
+			c->color[v] = k;
+		}
+	}
+}
+
+// a block keeps only the boundary vertices that lost a clash with another block;
+// kempe chains may have moved any of them, not only the work
+static void coloring_conflict_task(void* ctx, size_t thread_index, size_t thread_count) {
+	struct coloring_parallel_t* p = (struct coloring_parallel_t*)ctx;
+	struct coloring_t* c = p->c;
+	for (size_t b = thread_index; b < p->block_count; b += thread_count) {
+		struct coloring_scope_t* s = p->scopes + b;
+		const gid_t* order = c->order + s->begin - 1;
+		gid_t* work = p->work + s->begin - 1;
+		size_t losers = 0;
+		for (size_t i = 0; i < (size_t)(s->end - s->begin); i++) {
+			gid_t v = order[i];
+			if (!p->boundary[v]) continue;
+			unsigned char lost = 0;
+			for (size_t a = c->offsets[v]; a < c->offsets[v + 1] && !lost; a++) {
+				gid_t u = c->adjacency[a];
+				if (u >= s->begin && u < s->end) continue;
+				lost = c->color[u] == c->color[v] && coloring_wins(c, u, v);
+			}
+			p->color_prev[v] = c->color[v];
+			if (lost) work[losers++] = v;
+		}
+		p->work_count[b] = losers;
+	}
+}
+
+int graph_coloring_parallel(struct graph_as_row_t* g, size_t thread_count) {
+	struct coloring_t c;
+	struct coloring_parallel_t p;
+	size_t n = g->vertex_count, kempe_swaps = 0;
+	struct coloring_scope_t scope = { 1, (gid_t)(n + 1), NULL, 0, 0, NULL };
+	int callres = EXIT_SUCCESS;
+
+	memset(&c, 0, sizeof(c));
+	memset(&p, 0, sizeof(p));
+	if (thread_count == 0) thread_count = host_cpu_count();
+	if (thread_count < 2 || n < 2 * coloring_block_size) return graph_coloring(g);
+
+	check_goto_temp(coloring_setup(g, &c) != EXIT_SUCCESS, "Cannot setup coloring", EXIT_FAILURE)
+
+	p.c = &c;
+	p.block_count = (n + coloring_block_size - 1) / coloring_block_size;
+	p.scopes = (struct coloring_scope_t*)host_arena_calloc(g->arena, p.block_count, sizeof(struct coloring_scope_t));
+	p.boundary = (unsigned char*)host_arena_calloc(g->arena, n + 1, 1);
+	p.color_prev = (uint8_t*)host_arena_alloc(g->arena, n + 1);
+	p.work = (gid_t*)host_arena_alloc(g->arena, (n + 1) * sizeof(gid_t));
+	p.work_count = (size_t*)host_arena_calloc(g->arena, p.block_count, sizeof(size_t));
+	check_goto_temp(!p.scopes || !p.boundary || !p.color_prev || !p.work || !p.work_count,
+		"Cannot allocate coloring state", EXIT_FAILURE)
+	memset(p.color_prev, color_index_none, n + 1);
+
+	for (size_t b = 0; b < p.block_count; b++) {
+		size_t end = (b + 1) * coloring_block_size + 1;
+		p.scopes[b].begin = (gid_t)(b * coloring_block_size + 1);
+		p.scopes[b].end = (gid_t)(end > n + 1 ? n + 1 : end);
+		p.scopes[b].outer = p.color_prev;
+	}
+
+	check_goto_temp(host_parallel_run(thread_count, coloring_order_task, &p) != EXIT_SUCCESS,
+		"Cannot order vertices", EXIT_FAILURE)
+	check_goto_temp(host_parallel_run(thread_count, coloring_interior_task, &p) != EXIT_SUCCESS,
+		"Cannot run coloring threads", EXIT_FAILURE)
+
+	for (p.round = 0; !p.failed; p.round++) {
+		size_t pending = 0;
+		for (size_t b = 0; b < p.block_count; b++) pending += p.work_count[b];
+		if (pending == 0) break;
+
+		check_goto_temp(host_parallel_run(thread_count, coloring_speculate_task, &p) != EXIT_SUCCESS,
+			"Cannot run coloring threads", EXIT_FAILURE)
+		if (p.failed) break;
+		check_goto_temp(host_parallel_run(thread_count, coloring_conflict_task, &p) != EXIT_SUCCESS,
+			"Cannot run coloring threads", EXIT_FAILURE)
+	}
+	for (size_t b = 0; b < p.block_count; b++) kempe_swaps += p.scopes[b].kempe_swaps;
+
+	printf("\n\t< Coloring: %lu threads; %lu blocks; %lu rounds;", (unsigned long)thread_count,
+		(unsigned long)p.block_count, (unsigned long)p.round);
+
+	// vertices past the target are repaired with the whole graph in scope. The
+	// serial engine keeps the 5 color bound when this still ends above it
+	if (!p.failed) {
+		size_t left = n + 1, still_left = 0;
+		memset(c.visited, 0, (n + 1) * sizeof(uint32_t));
+		for (size_t v = 1; v < n + 1; v++) c.order[v - 1] = v;
+		for (size_t pass = 0; pass < coloring_repair_passes; pass++) {
+			still_left = coloring_repair(&c, &scope, c.order, n);
+			if (still_left == 0 || still_left >= left) break;
+			left = still_left;
+		}
+		kempe_swaps += scope.kempe_swaps;
+		if (coloring_commit(g, &c, c.order, kempe_swaps) <= graph_color_target + 1) temp
+	}
+
+	printf("\n\t< Coloring serially;\n");
+	distruct_coloring(&c);
+	callres = graph_coloring(g);
+
+free_temporary_resources:
+	// the arena takes these back with the coloring state, allocated after it
+	host_arena_free(g->arena, p.scopes);
+	host_arena_free(g->arena, p.boundary);
+	host_arena_free(g->arena, p.color_prev);
+	host_arena_free(g->arena, p.work);
+	host_arena_free(g->arena, p.work_count);
+	distruct_coloring(&c);
+	return callres;
+}
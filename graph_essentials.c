@@ -3,37 +3,52 @@
 const gid_t gr_gid_reserver_undefinded = 0;
 const gid_t gr_gid_reserver_border = 1;
 
-int graph_init_grid_row(struct gid_row_t* r) {
-	r->gid_row = (gid_t*)calloc(r->gid_row_size, sizeof(gid_t));
+int graph_init_grid_row(struct gid_row_t* r, struct host_arena_t* arena) {
+	r->gid_row = (gid_t*)host_arena_calloc(arena, r->gid_row_size, sizeof(gid_t));
 	if (r->gid_row == NULL) return EXIT_FAILURE;
 	return EXIT_SUCCESS;
 }
 
 
 void distruct_graph_as_row(struct graph_as_row_t* g) {
-	if (g->matrix) free(g->matrix);
-
+	struct host_arena_t* arena = g->arena;
+	host_arena_free(arena, g->vertex_row);
+	host_arena_free(arena, g->order);
+	host_arena_free(arena, g->color_ids);
+	host_arena_free(arena, g->degree);
+	host_arena_free(arena, g->matrix);
+	host_arena_free(arena, g->adjacency_offsets);
+	host_arena_free(arena, g->adjacency);
+	host_arena_free(arena, g->adjacency_border);
+	host_arena_free(arena, g->region_stats);
+	memset(g, 0, sizeof(struct graph_as_row_t));
 }
 
 int graph_init_as_row(struct graph_as_row_t* g, size_t vertex_count, 
-	unsigned char matrix_link_flag_value
+	unsigned char matrix_link_flag_value, struct host_arena_t* arena
 ) {
+	memset(g, 0, sizeof(struct graph_as_row_t));
+	g->storage = GRAPH_DENSE;
+	g->arena = arena;
 
-	g->vertex_row = (struct vertex_t*)calloc(vertex_count, sizeof(struct vertex_t));
+	g->vertex_row = (struct vertex_t*)host_arena_calloc(arena, vertex_count + 1, sizeof(struct vertex_t)); // ids start at 1
 	if (g->vertex_row == NULL) return EXIT_FAILURE;
 	size_t matrix_column_size = (vertex_count + 1) / bitfield_cell_flags_count;
 	if ((vertex_count + 1) % bitfield_cell_flags_count)
 		matrix_column_size++;
 
-	g->order = (struct vertex_t**)calloc(vertex_count, sizeof(struct vertex_t*));
-	if (g->order == NULL) return EXIT_FAILURE;
+	g->order = (struct vertex_t**)host_arena_calloc(arena, vertex_count, sizeof(struct vertex_t*));
+	g->color_ids = (uint8_t*)host_arena_calloc(arena,
+		(vertex_count + 1) + matrix_column_size * bitfield_cell_flags_count, 1);
+	g->degree = (uint32_t*)host_arena_calloc(arena, vertex_count + 1, sizeof(uint32_t));
+	if (!g->order || !g->color_ids || !g->degree) return EXIT_FAILURE;
 
 	g->matrix_size = (vertex_count + 1) * matrix_column_size * sizeof(bitfield_cell);
 
 	/*g->matrix = (bitfield_cell*)calloc(
 		(vertex_count + 1) * matrix_column_size,
 		sizeof(bitfield_cell));*/
-	g->matrix = (bitfield_cell*)malloc(g->matrix_size);
+	g->matrix = (bitfield_cell*)host_arena_alloc(arena, g->matrix_size);
 	
 	if (g->matrix == NULL) return EXIT_FAILURE;
 
@@ -50,190 +65,292 @@ int graph_init_as_row(struct graph_as_row_t* g, size_t vertex_count,
 	for (size_t i = 1; i < vertex_count + 1; i++) {
 		(g->vertex_row + i)->id = i;
 		(g->vertex_row + i)->edges = p;
-		(g->vertex_row + i)->links_count = 0;
 		*p &= zero_pos;
-		(g->vertex_row + i)->color_id = color_undefined;
 		p += matrix_column_size;
 		g->order[i - 1] = (g->vertex_row + i);
 	}
 
 	g->matrix_column_size = matrix_column_size;
+	g->matrix_link_flag_value = matrix_link_flag_value;
 	g->vertex_count = vertex_count;
 
 	return EXIT_SUCCESS;
 }
 
 
-int graph_calc_links(struct graph_as_row_t* g, unsigned char matrix_link_flag_value) {
-	for (size_t i = 1; i < g->vertex_count + 1; i++) {
-		size_t lc = 0;
-		for (size_t a = 1; a < g->vertex_count + 1; a++) {
-			size_t pos = i * g->matrix_column_size + a / bitfield_cell_flags_count;
-			bitfield_cell flag = 1 << (a % bitfield_cell_flags_count);
-			if (!matrix_link_flag_value) {
-				if (~g->matrix[pos] & flag) {
-					lc++;
-				}
-			}
-			else {
-				if (g->matrix[pos] & flag) {
-					lc++;
-				}
-			}
-		}
-		(g->vertex_row + i)->links_count = lc;
-	}
-	return EXIT_SUCCESS;
+int graph_compare_gid(const void* a, const void* b) {
+	gid_t l = *(const gid_t*)a, r = *(const gid_t*)b;
+	return (l > r) - (l < r);
 }
 
+int graph_alloc_sparse(struct graph_as_row_t* g, size_t vertex_count, struct host_arena_t* arena) {
+	memset(g, 0, sizeof(struct graph_as_row_t));
+	g->storage = GRAPH_SPARSE;
+	g->arena = arena;
 
-void display_colors(struct graph_as_row_t* g) {
-	printf("\n");
-	for (size_t b_index = 1; b_index < g->vertex_count + 1; b_index++) {
-		printf("%2d: color: %2d;\n", b_index, (g->vertex_row + b_index)->color_id);
-	}
-}
-
-int graph_compare_vertex_links_count(const void* a, const void* b) {
-	return (*((struct vertex_t**)b))->links_count - (*((struct vertex_t**)a))->links_count;
-}
+	g->vertex_row = (struct vertex_t*)host_arena_calloc(arena, vertex_count + 1, sizeof(struct vertex_t));
+	g->order = (struct vertex_t**)host_arena_calloc(arena, vertex_count + 1, sizeof(struct vertex_t*));
+	g->adjacency_offsets = (size_t*)host_arena_calloc(arena, vertex_count + 2, sizeof(size_t));
+	g->color_ids = (uint8_t*)host_arena_calloc(arena, vertex_count + 1, 1);
+	g->degree = (uint32_t*)host_arena_calloc(arena, vertex_count + 1, sizeof(uint32_t));
+	if (!g->vertex_row || !g->order || !g->adjacency_offsets || !g->color_ids || !g->degree) return EXIT_FAILURE;
 
-int graph_sort_vertex_order(struct graph_as_row_t* g, enum SORT_GRAPH_TYPE type) {
-	
-	switch (type)
-	{
-	case BY_LINKS_COUNT:
-		qsort(g->order, g->vertex_count, sizeof(struct vertex_t*), graph_compare_vertex_links_count);
-		break;
-	default:
-		return EXIT_FAILURE;
-		break;
+	for (size_t i = 1; i < vertex_count + 1; i++) {
+		(g->vertex_row + i)->id = i;
+		(g->vertex_row + i)->edges = NULL;
+		g->order[i - 1] = (g->vertex_row + i);
 	}
 
+	g->vertex_count = vertex_count;
 	return EXIT_SUCCESS;
 }
 
-void graph_reset_colors(struct graph_as_row_t* g) {
-	for (size_t i = 1; i < g->vertex_count + 1; i++) {
-		(g->vertex_row + i)->color_id = color_undefined;
+int graph_link_sparse(struct graph_as_row_t* g, const struct graph_edge_t* edges, size_t edge_count) {
+	size_t vertex_count = g->vertex_count;
+	size_t* offsets = g->adjacency_offsets;
+
+	// degrees, shifted by one so the prefix sum gives row starts
+	for (size_t e = 0; e < edge_count; e++) {
+		gid_t lv = edges[e].lv, rv = edges[e].rv;
+		if (lv == rv || lv == 0 || rv == 0 || lv > vertex_count || rv > vertex_count) continue;
+		offsets[lv + 1]++;
+		offsets[rv + 1]++;
 	}
-}
+	for (size_t v = 1; v < vertex_count + 2; v++) offsets[v] += offsets[v - 1];
 
+	g->adjacency = (gid_t*)host_arena_alloc(g->arena, (offsets[vertex_count + 1] + 1) * sizeof(gid_t));
+	struct host_arena_mark_t mark = host_arena_mark(g->arena);
+	size_t* cursor = (size_t*)host_arena_alloc(g->arena, (vertex_count + 2) * sizeof(size_t));
+	if (!g->adjacency || !cursor) {
+		host_arena_free(g->arena, cursor);
+		return EXIT_FAILURE;
+	}
+	memcpy(cursor, offsets, (vertex_count + 2) * sizeof(size_t));
 
-color_id_t vertex_get_neighbours_color(struct graph_as_row_t* g, size_t vid) {
-	size_t n_index = 0;
-	color_id_t res = color_undefined;
-	for (size_t cell_index = 0; cell_index < g->matrix_column_size; cell_index++) {
-		bitfield_cell mask = g->vertex_row[vid].edges[cell_index];
-		size_t cell_offset = cell_index * bitfield_cell_flags_count;
-		while (_BitScanForward(&n_index, mask)) {
-			res |= g->vertex_row[cell_offset + n_index].color_id;
-			mask ^= (1 << n_index);
+	for (size_t e = 0; e < edge_count; e++) {
+		gid_t lv = edges[e].lv, rv = edges[e].rv;
+		if (lv == rv || lv == 0 || rv == 0 || lv > vertex_count || rv > vertex_count) continue;
+		g->adjacency[cursor[lv]++] = rv;
+		g->adjacency[cursor[rv]++] = lv;
+	}
+	host_arena_free(g->arena, cursor);
+	host_arena_rewind(g->arena, mark);
+
+	// sort every row and drop repeated links, rows move left in place
+	size_t w = 0;
+	for (size_t v = 1; v < vertex_count + 1; v++) {
+		size_t begin = offsets[v], end = offsets[v + 1];
+		offsets[v] = w;
+		qsort(g->adjacency + begin, end - begin, sizeof(gid_t), graph_compare_gid);
+		for (size_t i = begin; i < end; i++) {
+			if (i == begin || g->adjacency[i] != g->adjacency[i - 1])
+				g->adjacency[w++] = g->adjacency[i];
 		}
 	}
-	return res;
+	offsets[vertex_count + 1] = w;
+	g->edge_count = w / 2;
+
+	for (size_t i = 1; i < vertex_count + 1; i++)
+		g->degree[i] = (uint32_t)(offsets[i + 1] - offsets[i]);
+
+	return EXIT_SUCCESS;
 }
 
-color_id_t vertex_get_available_color(struct graph_as_row_t* g, size_t vid, color_id_t* used_colors) {
-	struct vertex_t* v = (g->vertex_row + vid);
-	color_id_t allowed = ~vertex_get_neighbours_color(g, vid), c = 0;
-	size_t bit_index = 0;
+static void graph_add_border(struct graph_as_row_t* g, gid_t lv, gid_t rv, uint32_t walks) {
+	size_t begin = g->adjacency_offsets[lv], end = g->adjacency_offsets[lv + 1];
+	gid_t* n = (gid_t*)bsearch(&rv, g->adjacency + begin, end - begin, sizeof(gid_t), graph_compare_gid);
+	if (n) g->adjacency_border[n - g->adjacency] += walks;
+}
 
-	/*
-	_BitScanForward(&bit_index, allowed);
-	c <<= bit_index;
-	*used_colors |= c;
-	*/
-	
-	__asm {
-		mov ecx, used_colors;
-		bsf	ebx, allowed;
-		bts [ecx], ebx;
-		bts c, ebx;
+int graph_link_borders(struct graph_as_row_t* g, const struct graph_edge_t* edges, const uint32_t* walks,
+	size_t edge_count
+) {
+	size_t vertex_count = g->vertex_count;
+
+	host_arena_free(g->arena, g->adjacency_border);
+	g->adjacency_border = (uint32_t*)host_arena_calloc(g->arena,
+		g->adjacency_offsets[vertex_count + 1] + 1, sizeof(uint32_t));
+	if (g->adjacency_border == NULL) return EXIT_FAILURE;
+
+	for (size_t e = 0; e < edge_count; e++) {
+		gid_t lv = edges[e].lv, rv = edges[e].rv;
+		if (lv == rv || lv == 0 || rv == 0 || lv > vertex_count || rv > vertex_count) continue;
+		graph_add_border(g, lv, rv, walks ? walks[e] : 1);
+		graph_add_border(g, rv, lv, walks ? walks[e] : 1);
 	}
-	return c;
+	return EXIT_SUCCESS;
 }
 
-void mix_order(struct graph_as_row_t* g) {
-	
+int graph_init_sparse(struct graph_as_row_t* g, size_t vertex_count,
+	const struct graph_edge_t* edges, size_t edge_count, struct host_arena_t* arena
+) {
+	if (graph_alloc_sparse(g, vertex_count, arena) != EXIT_SUCCESS) return EXIT_FAILURE;
+	return graph_link_sparse(g, edges, edge_count);
+}
+
+void graph_set_link(struct graph_as_row_t* g, gid_t lv, gid_t rv, unsigned char matrix_link_flag_value) {
+	size_t pos = lv * g->matrix_column_size + rv / bitfield_cell_flags_count;
+	bitfield_cell flag = (bitfield_cell)1 << (rv % bitfield_cell_flags_count);
+	if (matrix_link_flag_value) g->matrix[pos] |= flag;
+	else g->matrix[pos] &= ~flag;
+}
 
-	/*for (int i = 0; i < g->vertex_count; i++) {
-		printf("%2d; ", g->order[i]->id);
+void graph_set_links(struct graph_as_row_t* g, const struct graph_edge_t* edges, size_t edge_count,
+	unsigned char matrix_link_flag_value
+) {
+	for (size_t e = 0; e < edge_count; e++) {
+		gid_t lv = edges[e].lv, rv = edges[e].rv;
+		if (lv == rv || lv == 0 || rv == 0 || lv > g->vertex_count || rv > g->vertex_count) continue;
+		graph_set_link(g, lv, rv, matrix_link_flag_value);
+		graph_set_link(g, rv, lv, matrix_link_flag_value);
 	}
-	printf("\n");*/
+}
 
-	for (int j = 0; j < 1 + g->vertex_count / 3; j++) {
+// links of a matrix word as set bits, vertex 0 and the padding past vertex_count cleared
+static inline bitfield_cell graph_dense_links(const struct graph_as_row_t* g, const bitfield_cell* row, size_t cell) {
+	bitfield_cell links = g->matrix_link_flag_value ? row[cell] : ~row[cell];
+	if (cell == 0) links &= ~(bitfield_cell)1;
+	if (cell == g->matrix_column_size - 1 && (g->vertex_count + 1) % bitfield_cell_flags_count)
+		links &= ((bitfield_cell)1 << (g->vertex_count + 1) % bitfield_cell_flags_count) - 1;
+	return links;
+}
 
-		int i1 = 0, i2 = 0;
-		while (i1 == i2) {
-			i1 = rand() % g->vertex_count;
-			i2 = rand() % g->vertex_count;
-		}
-		struct vertex_t* tmp = g->order[i1];
-		g->order[i1] = g->order[i2];
-		g->order[i2] = tmp;
+// set links of a row: a popcount per non-empty word, the edge words fixed after
+static size_t graph_dense_degree(const struct graph_as_row_t* g, const bitfield_cell* row) {
+	bitfield_cell flip = g->matrix_link_flag_value ? 0 : ~(bitfield_cell)0;
+	size_t last = g->matrix_column_size - 1, degree = 0;
+	for (size_t cell = 0; cell < last; cell++) {
+		bitfield_cell links = row[cell] ^ flip;
+		if (links) degree += bitfield_popcount(links);
+	}
+	degree += bitfield_popcount(graph_dense_links(g, row, last));
+	if (last) degree -= bitfield_popcount(row[0] ^ flip) - bitfield_popcount(graph_dense_links(g, row, 0));
+	return degree;
+}
 
+int graph_calc_links(struct graph_as_row_t* g, unsigned char matrix_link_flag_value) {
+	if (g->storage == GRAPH_SPARSE) {
+		for (size_t i = 1; i < g->vertex_count + 1; i++)
+			g->degree[i] = (uint32_t)(g->adjacency_offsets[i + 1] - g->adjacency_offsets[i]);
+		return EXIT_SUCCESS;
 	}
-	/*for (int i = 0; i < g->vertex_count; i++) {
-		printf("%2d; ", g->order[i]->id);
+
+	g->matrix_link_flag_value = matrix_link_flag_value;
+	for (size_t i = 1; i < g->vertex_count + 1; i++) {
+		g->degree[i] = (uint32_t)graph_dense_degree(g, g->vertex_row[i].edges);
 	}
-	printf("\n");*/
+	return EXIT_SUCCESS;
 }
 
 
-int graph_coloring(struct graph_as_row_t* g) {
-
-	graph_sort_vertex_order(g, BY_LINKS_COUNT);
+void display_colors(struct graph_as_row_t* g) {
+	printf("\n");
+	for (size_t b_index = 1; b_index < g->vertex_count + 1; b_index++) {
+		printf("%2lu: color: %2d;\n", (unsigned long)b_index, g->color_ids[b_index]);
+	}
+}
 
-	color_id_t used_colors = 0; size_t used_colors_count = 0;
+void graph_reset_colors(struct graph_as_row_t* g) {
+	memset(g->color_ids, color_undefined, g->vertex_count + 1);
+}
 
+// 8 bits of a matrix word to 8 bytes of 0xFF or 0, byte k for bit k
+static inline uint64_t graph_byte_mask(unsigned bits) {
+	uint64_t m = ((uint64_t)bits * 0x0101010101010101ull) & 0x8040201008040201ull;
+	m = ((m + 0x7F7F7F7F7F7F7F7Full) | m) & 0x8080808080808080ull;
+	return (m >> 7) * 0xFF;
+}
 
+color_id_t vertex_get_neighbours_color(struct graph_as_row_t* g, size_t vid) {
+	color_id_t res = color_undefined;
 
-	while(used_colors_count > 4 || !used_colors_count) {
-		
-		graph_reset_colors(g);
+	if (g->storage == GRAPH_SPARSE) {
+		for (size_t i = g->adjacency_offsets[vid]; i < g->adjacency_offsets[vid + 1]; i++)
+			res |= g->color_ids[g->adjacency[i]];
+		return res;
+	}
 
-		used_colors = 0; used_colors_count = 0;
-		struct vertex_t* cv = NULL;
-		for (size_t vid = 0; vid < g->vertex_count; vid++) {
-			cv = g->order[vid];
-			cv->color_id = vertex_get_available_color(g, cv->id, &used_colors);
+	// the color ids of a word's 32 vertices are masked and OR-ed 8 at a time,
+	// color_ids is padded to whole rows; byte k of a load is vertex k on
+	// little-endian hosts, the others take the bits one by one
+	const uint16_t endian = 1;
+	uint64_t acc = 0;
+	for (size_t cell_index = 0; cell_index < g->matrix_column_size; cell_index++) {
+		bitfield_cell mask = graph_dense_links(g, g->vertex_row[vid].edges, cell_index);
+		const uint8_t* colors = g->color_ids + cell_index * bitfield_cell_flags_count;
+		if (!mask) continue;
+		if (*(const uint8_t*)&endian == 0) {
+			for (; mask; mask &= mask - 1) res |= colors[bitfield_lowest_bit(mask)];
+			continue;
 		}
-		/*
-		_BitScanForward(&used_colors_count, ~used_colors);
-		*/
-		__asm {
-			not used_colors;
-			bsf	ebx, used_colors;
-			mov used_colors_count, ebx;
+		for (size_t k = 0; k < bitfield_cell_flags_count; k += 8) {
+			uint64_t c;
+			memcpy(&c, colors + k, sizeof(c));
+			acc |= c & graph_byte_mask((mask >> k) & 0xFF);
 		}
-		
-		mix_order(g);
 	}
-
-	printf("\n\t< Colors used: %d;\n", used_colors_count);
-	g->used_colors_count = used_colors_count;
-	return EXIT_SUCCESS;
+	acc |= acc >> 32;
+	acc |= acc >> 16;
+	acc |= acc >> 8;
+	return res | (color_id_t)(acc & 0xFF);
 }
 
 void graph_display(struct graph_as_row_t* g, unsigned char matrix_link_flag_value) {
 	for (size_t i = 1; i < g->vertex_count + 1; i++) {
-		printf("\n%3d (%3d/%3d):", i, (g->vertex_row + i)->id, (g->vertex_row + i)->links_count);
+		printf("\n%3lu (%3lu/%3lu):", (unsigned long)i, (unsigned long)(g->vertex_row + i)->id, (unsigned long)g->degree[i]);
+		if (g->storage == GRAPH_SPARSE) {
+			for (size_t a = g->adjacency_offsets[i]; a < g->adjacency_offsets[i + 1]; a++)
+				printf(" %2lu;", (unsigned long)g->adjacency[a]);
+			continue;
+		}
 		for (size_t a = 1; a < g->vertex_count + 1; a++) {
 			size_t pos = i * g->matrix_column_size + a / bitfield_cell_flags_count;
 			bitfield_cell flag = 1 << (a % bitfield_cell_flags_count);
 			if (!matrix_link_flag_value) {
 				if (~g->matrix[pos] & flag) {
-					printf(" %2d;", a);
+					printf(" %2lu;", (unsigned long)a);
 				}
 			}
 			else {
 				if (g->matrix[pos] & flag) {
-					printf(" %2d;", a);
+					printf(" %2lu;", (unsigned long)a);
 				}
 			}
 		}
 		//printf("\n\t0x(%8x"/* %8x*/")\n", g->matrix[i * g->matrix_column_size]);// , g->matrix[i * g->matrix_column_size + 1]);
 	}
 	printf("\n");
-}
\ No newline at end of file
+}
+
+int graph_dense_to_sparse(struct graph_as_row_t* g, size_t** offsets, gid_t** adjacency) {
+	size_t vertex_count = g->vertex_count, total = 0, capacity = 8 * vertex_count + 1;
+	bitfield_cell flip = g->matrix_link_flag_value ? 0 : ~(bitfield_cell)0;
+
+	*offsets = (size_t*)host_arena_calloc(g->arena, vertex_count + 2, sizeof(size_t));
+	*adjacency = (gid_t*)host_arena_alloc(g->arena, capacity * sizeof(gid_t));
+	if (*offsets == NULL || *adjacency == NULL) return EXIT_FAILURE;
+
+	// one pass over the matrix, the rows only grow the list: skip empty
+	// words, take the set bits lowest first, a row's popcount makes room
+	for (size_t v = 1; v < vertex_count + 1; v++) {
+		const bitfield_cell* row = g->vertex_row[v].edges;
+		(*offsets)[v] = total;
+		for (size_t cell_index = 0; cell_index < g->matrix_column_size; cell_index++) {
+			bitfield_cell mask = row[cell_index] ^ flip;
+			if (!mask) continue;
+			if (total + bitfield_popcount(mask) > capacity) {
+				gid_t* grown = (gid_t*)host_arena_realloc(g->arena, *adjacency,
+					capacity * sizeof(gid_t), 2 * capacity * sizeof(gid_t));
+				if (grown == NULL) return EXIT_FAILURE;
+				*adjacency = grown;
+				capacity *= 2;
+			}
+			for (; mask; mask &= mask - 1) {
+				gid_t n = cell_index * bitfield_cell_flags_count + bitfield_lowest_bit(mask);
+				if (n != v && n != 0 && n <= vertex_count) (*adjacency)[total++] = n;
+			}
+		}
+	}
+	(*offsets)[vertex_count + 1] = total;
+	return EXIT_SUCCESS;
+}
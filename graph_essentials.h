@@ -1,9 +1,15 @@
+#pragma once
+
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "host_platform.h"
+
+#ifdef _MSC_VER
 #include <intrin.h>
+#endif
 
 typedef unsigned long gid_t;
 typedef unsigned long color_id_t;
@@ -13,26 +19,81 @@ typedef unsigned long color_id_t;
 #define color_undefined		0
 #define color_start_value	1
 
+#define graph_color_target	4 // planar maps, kempe chains keep it in most cases
+#define graph_color_max		8 // color ids go to the device as uchar bitmasks
+#define graph_color_palette	6 // colors apply_colors and tiled_color_pixel paint, others come out black
+
 typedef uint32_t bitfield_cell;
 #define bitfield_cell_flags_count (sizeof(bitfield_cell) * 8)
 
-enum SORT_GRAPH_TYPE {
-	BY_LINKS_COUNT
+// index of the lowest set bit, cell != 0
+static inline unsigned bitfield_lowest_bit(bitfield_cell cell) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, cell);
+	return (unsigned)index;
+#else
+	return (unsigned)__builtin_ctz(cell);
+#endif
+}
+
+static inline unsigned bitfield_popcount(bitfield_cell cell) {
+#ifdef _MSC_VER
+	return (unsigned)__popcnt(cell);
+#else
+	return (unsigned)__builtin_popcount(cell);
+#endif
+}
+
+enum GRAPH_STORAGE {
+	GRAPH_SPARSE,	// CSR adjacency, O(V + E)
+	GRAPH_DENSE		// bitfield matrix, O(V^2)
+};
+
+// one adjacency as emitted by the device (uint2)
+struct graph_edge_t {
+	uint32_t lv;
+	uint32_t rv;
+};
+
+// per area, from the region_stats kernel (map_options_t.region_stats)
+struct region_stats_t {
+	uint64_t area; // pixels
+	uint32_t x0, y0, x1, y1; // bounding box [x0, x1) x [y0, y1)
+	double cx, cy; // centroid: mean pixel x, y
 };
 
 struct vertex_t {
 	gid_t id; // is it needed
-	color_id_t color_id;
-	int links_count;
-	bitfield_cell* edges;
+	bitfield_cell* edges; // GRAPH_DENSE: the matrix row
 };
 
 struct graph_as_row_t {
+	enum GRAPH_STORAGE storage;
 	struct vertex_t* vertex_row;
 	struct vertex_t** order;
+
+	// per vertex id, apart from vertex_row so the hot loops read bytes:
+	// color_ids as the device takes them (0 - none), padded to whole matrix
+	// rows on dense graphs; degree from graph_calc_links or graph_link_sparse
+	uint8_t* color_ids;
+	uint32_t* degree;
+
+	// GRAPH_DENSE
 	bitfield_cell* matrix;
 	size_t matrix_size;
 	size_t matrix_column_size;
+	unsigned char matrix_link_flag_value;
+
+	// GRAPH_SPARSE: neighbours of v are adjacency[adjacency_offsets[v] .. adjacency_offsets[v + 1])
+	size_t* adjacency_offsets;
+	gid_t* adjacency;
+	size_t edge_count;
+	uint32_t* adjacency_border; // shared border per adjacency entry (build_edges walks), NULL - not collected
+
+	struct region_stats_t* region_stats; // per vertex, NULL - not collected
+
+	struct host_arena_t* arena; // holds the arrays above, NULL - the heap
 	size_t vertex_count;
 	size_t used_colors_count;
 };
@@ -43,16 +104,55 @@ struct gid_row_t {
 	size_t gid_row_size;
 };
 
-int graph_init_grid_row(struct gid_row_t*);
+int graph_init_grid_row(struct gid_row_t*, struct host_arena_t*);
+
+// arena NULL - the heap; otherwise the arrays go with the arena and
+// distruct_graph_as_row only forgets them
+int graph_init_as_row(struct graph_as_row_t*, size_t, unsigned char, struct host_arena_t*);
 
-int graph_init_as_row(struct graph_as_row_t*, size_t, unsigned char);
+// edges may repeat and come in any order, self links are dropped
+int graph_init_sparse(struct graph_as_row_t*, size_t, const struct graph_edge_t*, size_t, struct host_arena_t*);
+
+// graph_init_sparse in two steps: the vertices, then the adjacency from an edge list
+int graph_alloc_sparse(struct graph_as_row_t*, size_t, struct host_arena_t*);
+int graph_link_sparse(struct graph_as_row_t*, const struct graph_edge_t*, size_t);
 
 void distruct_graph_as_row(struct graph_as_row_t*);
 
+// adds the walks of every edge to both adjacency entries, walks NULL - one
+// per listed edge; sparse graphs after graph_link_sparse
+int graph_link_borders(struct graph_as_row_t*, const struct graph_edge_t*, const uint32_t* walks, size_t);
+
+// CSR copy of a dense matrix in the GRAPH_SPARSE layout, both from the graph
+// arena: the caller frees them with host_arena_free(g->arena, ...)
+int graph_dense_to_sparse(struct graph_as_row_t*, size_t** offsets, gid_t** adjacency);
+
+// fills the dense matrix from an edge list
+void graph_set_links(struct graph_as_row_t*, const struct graph_edge_t*, size_t, unsigned char);
+
+// degrees, a popcount per matrix word on dense graphs
 int graph_calc_links(struct graph_as_row_t*, unsigned char);
 
 void graph_reset_colors(struct graph_as_row_t*);
 
+// the color ids of the neighbours of v OR-ed; dense rows take 8 neighbours a step
+color_id_t vertex_get_neighbours_color(struct graph_as_row_t*, size_t);
+
+// graph_coloring.c: smallest-last order, greedy pick and kempe chain
+// recoloring; at most 5 colors on planar graphs, same graph - same colors
 int graph_coloring(struct graph_as_row_t*);
 
+// Threads color fixed blocks of vertex ids: block interiors first, then the
+// block boundaries speculatively, recoloring only the losers of clashes between
+// blocks in rounds; the same kempe repair runs last. thread_count 0 - all
+// cores, the result does not depend on it. Usually a few regions more than the
+// serial engine stay on a fifth color.
+int graph_coloring_parallel(struct graph_as_row_t*, size_t thread_count);
+
+// recolors only the listed vertices around the fixed colors of all the others
+// (incremental edits, region_state.h); sparse graphs only. A vertex left
+// without a palette color takes its neighbours in, ring by ring, and they are
+// recolored with it: the caller compares color_ids to find them.
+int graph_coloring_subset(struct graph_as_row_t*, const gid_t* vertices, size_t count);
+
 void graph_display(struct graph_as_row_t*, unsigned char);
\ No newline at end of file
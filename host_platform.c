@@ -0,0 +1,525 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS, MAP_HUGETLB and MADV_HUGEPAGE
+#endif
+
+#include "host_platform.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
+
+#define host_copy_chunk ((size_t)1 << 20)
+#define host_arena_align ((size_t)64)
+#define host_huge_page ((size_t)2 << 20)
+
+struct host_thread_arg_t {
+	host_task_fn task;
+	void* ctx;
+	size_t thread_index;
+	size_t thread_count;
+};
+
+size_t host_cpu_count(void) {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors ? (size_t)info.dwNumberOfProcessors : 1;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (size_t)n : 1;
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI host_thread_entry(LPVOID p) {
+#else
+static void* host_thread_entry(void* p) {
+#endif
+	struct host_thread_arg_t* a = (struct host_thread_arg_t*)p;
+	a->task(a->ctx, a->thread_index, a->thread_count);
+	return 0;
+}
+
+int host_parallel_run(size_t thread_count, host_task_fn task, void* ctx) {
+	if (thread_count == 0) thread_count = host_cpu_count();
+
+	if (thread_count == 1) {
+		task(ctx, 0, 1);
+		return EXIT_SUCCESS;
+	}
+
+	struct host_thread_arg_t* args = (struct host_thread_arg_t*)calloc(
+		thread_count, sizeof(struct host_thread_arg_t));
+	if (args == NULL) return EXIT_FAILURE;
+
+#ifdef _WIN32
+	HANDLE* threads = (HANDLE*)calloc(thread_count, sizeof(HANDLE));
+#else
+	pthread_t* threads = (pthread_t*)calloc(thread_count, sizeof(pthread_t));
+#endif
+	if (threads == NULL) {
+		free(args);
+		return EXIT_FAILURE;
+	}
+
+	// thread 0 is the caller itself
+	size_t started = 1;
+	for (size_t i = 0; i < thread_count; i++) {
+		args[i].task = task;
+		args[i].ctx = ctx;
+		args[i].thread_index = i;
+		args[i].thread_count = thread_count;
+	}
+	for (; started < thread_count; started++) {
+#ifdef _WIN32
+		threads[started] = CreateThread(NULL, 0, host_thread_entry, args + started, 0, NULL);
+		if (threads[started] == NULL) break;
+#else
+		if (pthread_create(threads + started, NULL, host_thread_entry, args + started) != 0) break;
+#endif
+	}
+
+	// could not spawn everyone: the caller takes over the rest
+	if (started != thread_count) {
+		for (size_t i = started; i < thread_count; i++)
+			task(ctx, i, thread_count);
+	}
+	task(ctx, 0, thread_count);
+
+	for (size_t i = 1; i < started; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i], NULL);
+#endif
+	}
+
+	free(threads);
+	free(args);
+	return EXIT_SUCCESS;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI host_single_thread_entry(LPVOID p) {
+#else
+static void* host_single_thread_entry(void* p) {
+#endif
+	struct host_thread_t* t = (struct host_thread_t*)p;
+	t->job(t->ctx);
+	return 0;
+}
+
+int host_thread_start(struct host_thread_t* t, host_job_fn job, void* ctx) {
+	t->job = job;
+	t->ctx = ctx;
+#ifdef _WIN32
+	t->handle = CreateThread(NULL, 0, host_single_thread_entry, t, 0, NULL);
+	if (t->handle == NULL) return EXIT_FAILURE;
+#else
+	pthread_t* thread = (pthread_t*)malloc(sizeof(pthread_t));
+	t->handle = thread;
+	if (thread == NULL) return EXIT_FAILURE;
+	if (pthread_create(thread, NULL, host_single_thread_entry, t) != 0) {
+		free(thread);
+		t->handle = NULL;
+		return EXIT_FAILURE;
+	}
+#endif
+	return EXIT_SUCCESS;
+}
+
+void host_thread_join(struct host_thread_t* t) {
+	if (t->handle == NULL) return;
+#ifdef _WIN32
+	WaitForSingleObject((HANDLE)t->handle, INFINITE);
+	CloseHandle((HANDLE)t->handle);
+#else
+	pthread_join(*(pthread_t*)t->handle, NULL);
+	free(t->handle);
+#endif
+	t->handle = NULL;
+}
+
+double host_wall_time(void) {
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+int host_is_directory(const char* path) {
+#ifdef _WIN32
+	DWORD attributes = GetFileAttributesA(path);
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+static int host_has_extension(const char* name, const char* extension) {
+	size_t nl = strlen(name), el = strlen(extension);
+	if (nl <= el) return 0;
+	name += nl - el;
+	for (size_t i = 0; i < el; i++) {
+		char a = name[i], b = extension[i];
+		if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+		if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+		if (a != b) return 0;
+	}
+	return 1;
+}
+
+static int host_compare_names(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int host_push_name(char*** names, size_t* count, size_t* capacity, const char* name) {
+	if (*count == *capacity) {
+		size_t new_capacity = *capacity ? *capacity * 2 : 64;
+		char** grown = (char**)realloc(*names, new_capacity * sizeof(char*));
+		if (grown == NULL) return EXIT_FAILURE;
+		*names = grown;
+		*capacity = new_capacity;
+	}
+	size_t len = strlen(name);
+	char* copy = (char*)malloc(len + 1);
+	if (copy == NULL) return EXIT_FAILURE;
+	memcpy(copy, name, len + 1);
+	(*names)[(*count)++] = copy;
+	return EXIT_SUCCESS;
+}
+
+int host_list_directory(const char* dir, const char* extension, char*** names, size_t* count) {
+	size_t capacity = 0;
+	int callres = EXIT_SUCCESS;
+	*names = NULL;
+	*count = 0;
+
+#ifdef _WIN32
+	char pattern[MAX_PATH];
+	WIN32_FIND_DATAA data;
+	snprintf(pattern, sizeof(pattern), "%s\\*", dir);
+	HANDLE h = FindFirstFileA(pattern, &data);
+	if (h == INVALID_HANDLE_VALUE) return EXIT_FAILURE;
+	do {
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+		if (!host_has_extension(data.cFileName, extension)) continue;
+		callres = host_push_name(names, count, &capacity, data.cFileName);
+	} while (callres == EXIT_SUCCESS && FindNextFileA(h, &data));
+	FindClose(h);
+#else
+	DIR* d = opendir(dir);
+	if (d == NULL) return EXIT_FAILURE;
+	struct dirent* e = NULL;
+	while (callres == EXIT_SUCCESS && (e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.') continue;
+		if (!host_has_extension(e->d_name, extension)) continue;
+		callres = host_push_name(names, count, &capacity, e->d_name);
+	}
+	closedir(d);
+#endif
+
+	if (callres != EXIT_SUCCESS) {
+		host_free_list(*names, *count);
+		*names = NULL;
+		*count = 0;
+		return EXIT_FAILURE;
+	}
+	if (*count) qsort(*names, *count, sizeof(char*), host_compare_names);
+	return EXIT_SUCCESS;
+}
+
+void host_free_list(char** names, size_t count) {
+	if (names == NULL) return;
+	for (size_t i = 0; i < count; i++) free(names[i]);
+	free(names);
+}
+
+int host_copy_file(const char* src, const char* dst) {
+#ifdef _WIN32
+	return CopyFileA(src, dst, FALSE) ? EXIT_SUCCESS : EXIT_FAILURE;
+#else
+	int callres = EXIT_FAILURE;
+	int in = -1, out = -1;
+	char* chunk = (char*)malloc(host_copy_chunk);
+	if (chunk == NULL) return EXIT_FAILURE;
+
+	in = open(src, O_RDONLY);
+	if (in < 0) goto free_temporary_resources;
+	out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) goto free_temporary_resources;
+
+	for (;;) {
+		ssize_t got = read(in, chunk, host_copy_chunk);
+		if (got < 0) goto free_temporary_resources;
+		if (got == 0) break;
+		for (ssize_t put = 0; put < got;) {
+			ssize_t n = write(out, chunk + put, (size_t)(got - put));
+			if (n <= 0) goto free_temporary_resources;
+			put += n;
+		}
+	}
+	callres = EXIT_SUCCESS;
+
+free_temporary_resources:
+	if (out >= 0 && close(out) != 0) callres = EXIT_FAILURE;
+	if (in >= 0) close(in);
+	free(chunk);
+	return callres;
+#endif
+}
+
+int host_map_file(const char* path, unsigned char mode, struct host_file_map_t* m) {
+	unsigned char shared_write = mode == HOST_MAP_WRITE;
+	memset(m, 0, sizeof(struct host_file_map_t));
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, shared_write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+		FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return EXIT_FAILURE;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return EXIT_FAILURE;
+	}
+	DWORD protect = mode == HOST_MAP_PRIVATE ? PAGE_WRITECOPY : shared_write ? PAGE_READWRITE : PAGE_READONLY;
+	DWORD access = mode == HOST_MAP_PRIVATE ? FILE_MAP_COPY : shared_write ? FILE_MAP_WRITE : FILE_MAP_READ;
+	HANDLE mapping = CreateFileMappingA(file, NULL, protect, 0, 0, NULL);
+	if (mapping == NULL) {
+		CloseHandle(file);
+		return EXIT_FAILURE;
+	}
+	m->data = (unsigned char*)MapViewOfFile(mapping, access, 0, 0, 0);
+	if (m->data == NULL) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return EXIT_FAILURE;
+	}
+	m->size = (size_t)size.QuadPart;
+	m->file = file;
+	m->mapping = mapping;
+#else
+	int fd = open(path, shared_write ? O_RDWR : O_RDONLY);
+	if (fd < 0) return EXIT_FAILURE;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	void* data = mmap(NULL, (size_t)st.st_size, mode == HOST_MAP_READ ? PROT_READ : PROT_READ | PROT_WRITE,
+		mode == HOST_MAP_PRIVATE ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+	close(fd); // the mapping keeps the file referenced
+	if (data == MAP_FAILED) return EXIT_FAILURE;
+	m->data = (unsigned char*)data;
+	m->size = (size_t)st.st_size;
+#endif
+	return EXIT_SUCCESS;
+}
+
+int host_flush_file(struct host_file_map_t* m) {
+	if (m->data == NULL) return EXIT_SUCCESS;
+#ifdef _WIN32
+	if (!FlushViewOfFile(m->data, 0)) return EXIT_FAILURE;
+#else
+	if (msync(m->data, m->size, MS_ASYNC) != 0) return EXIT_FAILURE;
+#endif
+	return EXIT_SUCCESS;
+}
+
+void host_unmap_file(struct host_file_map_t* m) {
+#ifdef _WIN32
+	if (m->data) UnmapViewOfFile(m->data);
+	if (m->mapping) CloseHandle((HANDLE)m->mapping);
+	if (m->file) CloseHandle((HANDLE)m->file);
+#else
+	if (m->data) munmap(m->data, m->size);
+#endif
+	memset(m, 0, sizeof(struct host_file_map_t));
+}
+
+// size is rounded up to whole huge pages when they are asked for
+static void* host_pages_alloc(size_t* size, unsigned char huge, unsigned char* huge_backed) {
+	void* p = NULL;
+	*huge_backed = 0;
+	if (huge) *size = (*size + host_huge_page - 1) & ~(host_huge_page - 1);
+#ifdef _WIN32
+	SIZE_T large = huge ? GetLargePageMinimum() : 0;
+	if (large && *size % large == 0) {
+		// needs the lock pages in memory privilege
+		p = VirtualAlloc(NULL, *size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		*huge_backed = p != NULL;
+	}
+	if (p == NULL) p = VirtualAlloc(NULL, *size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#elif defined(MAP_ANONYMOUS)
+#ifdef MAP_HUGETLB
+	if (huge) {
+		p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p == MAP_FAILED) p = NULL;
+		*huge_backed = p != NULL;
+	}
+#endif
+	if (p == NULL) {
+		p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+		if (huge) madvise(p, *size, MADV_HUGEPAGE);
+#endif
+	}
+#else
+	p = malloc(*size);
+#endif
+	return p;
+}
+
+static void host_pages_free(void* p, size_t size) {
+	if (p == NULL) return;
+#ifdef _WIN32
+	VirtualFree(p, 0, MEM_RELEASE);
+#elif defined(MAP_ANONYMOUS)
+	munmap(p, size);
+#else
+	free(p);
+#endif
+}
+
+void host_arena_init(struct host_arena_t* a, unsigned char huge_pages) {
+	memset(a, 0, sizeof(struct host_arena_t));
+	a->huge_pages = huge_pages;
+}
+
+void* host_arena_alloc(struct host_arena_t* a, size_t size) {
+	if (a == NULL) return malloc(size);
+	size = (size + host_arena_align - 1) & ~(host_arena_align - 1);
+	if (size == 0) size = host_arena_align;
+
+	unsigned char* p = NULL;
+	if (a->base && size <= a->size - a->used) {
+		p = a->base + a->used;
+		a->used += size;
+	}
+	else {
+		// overflow: the next word after the link, aligned
+		unsigned char* block = (unsigned char*)malloc(size + sizeof(void*) + host_arena_align - 1);
+		if (block == NULL) return NULL;
+		*(void**)block = a->spill;
+		a->spill = block;
+		p = (unsigned char*)(((uintptr_t)(block + sizeof(void*)) + host_arena_align - 1) & ~(uintptr_t)(host_arena_align - 1));
+	}
+	a->live += size;
+	if (a->live > a->peak) a->peak = a->live;
+	return p;
+}
+
+void* host_arena_calloc(struct host_arena_t* a, size_t count, size_t size) {
+	if (a == NULL) return calloc(count, size);
+	if (size && count > SIZE_MAX / size) return NULL;
+	void* p = host_arena_alloc(a, count * size);
+	if (p) memset(p, 0, count * size);
+	return p;
+}
+
+void host_arena_free(struct host_arena_t* a, void* p) {
+	if (a == NULL && p) free(p);
+}
+
+void* host_arena_realloc(struct host_arena_t* a, void* p, size_t size, size_t new_size) {
+	if (a == NULL) return realloc(p, new_size);
+	if (p && new_size <= size) return p;
+	size_t used = (size + host_arena_align - 1) & ~(host_arena_align - 1);
+	size_t grown_used = (new_size + host_arena_align - 1) & ~(host_arena_align - 1);
+	if (p && used && a->base && (unsigned char*)p + used == a->base + a->used &&
+		grown_used - used <= a->size - a->used
+	) {
+		a->used += grown_used - used;
+		a->live += grown_used - used;
+		if (a->live > a->peak) a->peak = a->live;
+		return p;
+	}
+	void* grown = host_arena_alloc(a, new_size);
+	if (grown && p && size) memcpy(grown, p, size);
+	return grown;
+}
+
+struct host_arena_mark_t host_arena_mark(struct host_arena_t* a) {
+	struct host_arena_mark_t mark = { 0, 0, NULL };
+	if (a) {
+		mark.used = a->used;
+		mark.live = a->live;
+		mark.spill = a->spill;
+	}
+	return mark;
+}
+
+void host_arena_rewind(struct host_arena_t* a, struct host_arena_mark_t mark) {
+	if (a == NULL) return;
+	while (a->spill != mark.spill) {
+		void* next = *(void**)a->spill;
+		free(a->spill);
+		a->spill = next;
+	}
+	a->used = mark.used;
+	a->live = mark.live;
+}
+
+void host_arena_reset(struct host_arena_t* a) {
+	struct host_arena_mark_t empty = { 0, 0, NULL };
+	host_arena_rewind(a, empty);
+	if (a->peak > a->size) {
+		size_t size = a->peak;
+		host_pages_free(a->base, a->size);
+		a->base = (unsigned char*)host_pages_alloc(&size, a->huge_pages, &a->huge_backed);
+		a->size = a->base ? size : 0;
+	}
+	a->peak = 0;
+}
+
+void distruct_host_arena(struct host_arena_t* a) {
+	a->peak = 0;
+	host_arena_reset(a);
+	host_pages_free(a->base, a->size);
+	host_arena_init(a, a->huge_pages);
+}
+
+uint32_t host_atomic_cas_u32(volatile uint32_t* dst, uint32_t expected, uint32_t desired) {
+#ifdef _MSC_VER
+	return (uint32_t)InterlockedCompareExchange((volatile LONG*)dst, (LONG)desired, (LONG)expected);
+#else
+	__atomic_compare_exchange_n(dst, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	return expected;
+#endif
+}
+
+uint32_t host_atomic_load_u32(volatile uint32_t* src) {
+#ifdef _MSC_VER
+	return *src; // aligned 32-bit reads are atomic on x86/x64
+#else
+	return __atomic_load_n(src, __ATOMIC_ACQUIRE);
+#endif
+}
+
+void host_atomic_store_u32(volatile uint32_t* dst, uint32_t value) {
+#ifdef _MSC_VER
+	InterlockedExchange((volatile LONG*)dst, (LONG)value);
+#else
+	__atomic_store_n(dst, value, __ATOMIC_RELEASE);
+#endif
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+// thread_index in [0, thread_count)
+typedef void (*host_task_fn)(void* ctx, size_t thread_index, size_t thread_count);
+
+size_t host_cpu_count(void);
+
+// runs task on thread_count threads (0 - all cores) and joins them
+int host_parallel_run(size_t thread_count, host_task_fn task, void* ctx);
+
+// single background job
+typedef void (*host_job_fn)(void* ctx);
+
+struct host_thread_t {
+	void* handle;
+	host_job_fn job;
+	void* ctx;
+};
+
+int host_thread_start(struct host_thread_t*, host_job_fn job, void* ctx);
+void host_thread_join(struct host_thread_t*);
+
+// monotonic wall clock, seconds
+double host_wall_time(void);
+
+int host_is_directory(const char* path);
+
+// sorted file names (not paths) in dir with the extension, free with host_free_list
+int host_list_directory(const char* dir, const char* extension, char*** names, size_t* count);
+void host_free_list(char** names, size_t count);
+
+// whole-file mapping: HOST_MAP_WRITE writes go straight to the file,
+// HOST_MAP_PRIVATE ones stay in this process and are dropped on unmap
+#define HOST_MAP_READ		0
+#define HOST_MAP_WRITE		1
+#define HOST_MAP_PRIVATE	2
+
+struct host_file_map_t {
+	unsigned char* data;
+	size_t size;
+	void* file;
+	void* mapping;
+};
+
+// copies src to dst through a small buffer, dst is created or truncated
+int host_copy_file(const char* src, const char* dst);
+int host_map_file(const char* path, unsigned char mode, struct host_file_map_t*);
+int host_flush_file(struct host_file_map_t*);
+void host_unmap_file(struct host_file_map_t*);
+
+// Bump allocator for the host buffers of one map, not thread-safe. Reset
+// drops them all at once and keeps the memory: the block grows to the most
+// any map asked for, so a batch stops allocating once its largest map has
+// been through (until then the overflow comes from the heap). huge_pages -
+// the block on 2 MB pages: reserved ones where the system has them, else
+// transparent huge pages on Linux and large pages on Windows.
+struct host_arena_t {
+	unsigned char* base;
+	size_t size;
+	size_t used;
+	size_t live; // bytes handed out, overflow included
+	size_t peak; // most live since the last reset
+	void* spill; // overflow blocks, linked through their first word
+	unsigned char huge_pages;
+	unsigned char huge_backed; // base is on reserved huge pages
+};
+
+struct host_arena_mark_t {
+	size_t used;
+	size_t live;
+	void* spill;
+};
+
+// a zeroed arena is a valid empty one
+void host_arena_init(struct host_arena_t*, unsigned char huge_pages);
+// NULL arena - malloc, calloc and free; arena memory is 64-byte aligned and
+// host_arena_free leaves it to the arena
+void* host_arena_alloc(struct host_arena_t*, size_t size);
+void* host_arena_calloc(struct host_arena_t*, size_t count, size_t size);
+void host_arena_free(struct host_arena_t*, void*);
+// NULL arena - realloc; the latest allocation grows in place while the block
+// has room, any other is copied and its old size left to the arena
+void* host_arena_realloc(struct host_arena_t*, void* p, size_t size, size_t new_size);
+// scratch of a single step: everything allocated after the mark is reused
+struct host_arena_mark_t host_arena_mark(struct host_arena_t*);
+void host_arena_rewind(struct host_arena_t*, struct host_arena_mark_t);
+void host_arena_reset(struct host_arena_t*);
+void distruct_host_arena(struct host_arena_t*);
+
+// returns previous value
+uint32_t host_atomic_cas_u32(volatile uint32_t* dst, uint32_t expected, uint32_t desired);
+uint32_t host_atomic_load_u32(volatile uint32_t* src);
+void host_atomic_store_u32(volatile uint32_t* dst, uint32_t value);
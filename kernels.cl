@@ -1,24 +1,65 @@
+#ifdef cl_khr_int64_base_atomics
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+#endif
+
 typedef int mask_cell;
 typedef uint4 color_t;
 typedef int gid_t;
 typedef uint bitfield_cell;
 
-__kernel void mask_border(
+typedef uint border_word;
+
+#define EDGE_SLOT_NONE 0xFFFFFFFFu // an edge appended without the table
+#define REGION_STAT_WORDS 9 // area, ~x0, ~y0, x1, y1, sum x (lo, hi), sum y (lo, hi)
+#define REGION_STAT_SLOTS 64 // regions one work-group folds in __local memory
+
+#ifndef LABEL_TILE
+#define LABEL_TILE 16 // the host passes its own size in the build options
+#endif
+
+// one bit per pixel in mask order: bit idx % 32 of word idx / 32
+bool is_border(__global const border_word* border, size_t idx){
+	return (border[idx >> 5] >> (idx & 31)) & 1;
+}
+
+// border_test_t of border_predicate.h, c is b, g, r, a
+bool border_pixel(uint4 c, uint distance, int4 weight, int4 ref, int limit){
+	int4 v = convert_int4(c);
+	int4 d = v - ref;
+	int4 s = distance ? d * d : v * weight;
+	return s.s0 + s.s1 + s.s2 <= limit;
+}
+
+// one work-item per 32 pixels; borders are never written to the mask,
+// they stay 0 from the host fill and every border test reads the bits
+__kernel void pack_border(
 	__read_only image2d_t map,
-	__global mask_cell* mask
+	__global border_word* border,
+	__const size_t width,
+	__const size_t mask_size,
+	__const uint border_distance,
+	__const int4 border_weight,
+	__const int4 border_ref,
+	__const int border_limit
 ){
 	const sampler_t bmpmap_sample = 
 	CLK_NORMALIZED_COORDS_FALSE |
 	CLK_ADDRESS_CLAMP_TO_EDGE 	|
 	CLK_FILTER_NEAREST;
-	const mask_cell mask_cell_border = 0x01;
-	color_t c_black = (0x00, 0x00, 0x00, 0xFF);
 
-	int2 mapcoord = (int2)(get_global_id(0), get_global_id(1));
-	int maskcoord = mapcoord.s1 * get_image_width(map) + mapcoord.s0;
-	
-	color_t c = read_imageui(map, bmpmap_sample, mapcoord);
-	if((c != c_black).s0) mask[maskcoord] = mask_cell_border;
+	size_t word = get_global_id(0), idx = word << 5;
+	int2 mapcoord = (int2)((int)(idx % width), (int)(idx / width)); // image may be wider than the map
+	border_word bits = 0;
+
+	for(uint b = 0; b < 32 && idx < mask_size; b++, idx++){
+		uint4 c = read_imageui(map, bmpmap_sample, mapcoord);
+		if(border_pixel(c, border_distance, border_weight, border_ref, border_limit)) bits |= 1u << b;
+		if(++mapcoord.s0 == width){
+			mapcoord.s0 = 0;
+			mapcoord.s1++;
+		}
+	}
+	border[word] = bits;
 }
 
 __kernel void set_gid_row(
@@ -31,22 +72,21 @@ __kernel void set_gid_row(
 int4 get_neighbours(
 	__const size_t width,
 	__const size_t height,
-	__global mask_cell* mask,
+	__global const border_word* border,
 	const int idx
 ){
-	const mask_cell mask_cell_border = 0x01;
 	int4 res = (int4)(-1, -1, -1, -1); // t0. l1. b2. r3
 	int c = idx / width;
-	if(c > 0 && mask[idx - width] != mask_cell_border) 
+	if(c > 0 && !is_border(border, idx - width)) 
 		res.s0 = idx - width;
-	if(c < height - 1 && mask[idx + width] != mask_cell_border) 
+	if(c < height - 1 && !is_border(border, idx + width)) 
 		res.s2 = idx + width;
 	
 	c = idx % width;
 	
-	if(c > 0 && mask[idx - 1] != mask_cell_border) 
+	if(c > 0 && !is_border(border, idx - 1)) 
 		res.s1 = idx - 1;
-	if(c < width - 1 && mask[idx + 1] != mask_cell_border) 
+	if(c < width - 1 && !is_border(border, idx + 1)) 
 		res.s3 = idx + 1;
 	return res;
 }
@@ -93,15 +133,15 @@ __kernel void premask_area(
 	__const size_t width,
 	__const size_t height,
 	__global mask_cell* mask,
+	__global const border_word* border,
 	__global size_t* gid_idx,
 	__const size_t spread_timeout
 ){
-	const mask_cell mask_cell_border = 0x01;
 	size_t idx = get_global_id(0);
 	
-	if(mask[idx] == mask_cell_border) return;
+	if(is_border(border, idx)) return;
 	
-	int4 n = get_neighbours(width, height, mask, idx); // t0. l1. b2. r3
+	int4 n = get_neighbours(width, height, border, idx); // t0. l1. b2. r3
 
 	bool start_point = is_start_point(n, idx, spread_timeout);
 
@@ -124,56 +164,36 @@ __kernel void premask_area(
 	}
 }
 
-gid_t get_parent_gid(
-	__global gid_t* row,
-	gid_t id
-){
-	//int i = 0;
-	while(id != row[id]) {
-		id = row[id];
-		//i++;
+// Concurrent union-find over a gid row: every link points to a smaller id of
+// the same set and only ever decreases (atomic_min), so a set's root is its
+// smallest id whatever order the work-items run in.
+
+// path halving: each visited entry is relinked to its grandparent
+gid_t find_label_root(__global gid_t* row, gid_t l){
+	for(;;){
+		gid_t p = row[l];
+		if(p == l) return l;
+		gid_t gp = row[p];
+		if(gp == p) return p;
+		atomic_min(row + l, gp);
+		l = gp;
 	}
-	return id;
-}
-
-
-
-
-
-void sema_down(__global int* semaphor){
-  int occupied = atom_xchg(semaphor, 1);
-  uint timeout = 0;
-  while(occupied > 0 && timeout < 50000)
-  {
-   occupied = atom_xchg(semaphor, 1);
-   timeout++;
-  }
 }
 
-void sema_up(__global int* semaphor){
-  int old_state = atom_xchg(semaphor, 0);
-}
-
-void normalize_neighbours(
-	__global gid_t* row,
-	mask_cell cv,
-	mask_cell pv
-){
-	
-
-	barrier(CLK_GLOBAL_MEM_FENCE);
-	gid_t old_id = get_parent_gid(row, cv), 
-		new_id = get_parent_gid(row, pv), t = 0;
-	if(new_id != old_id){	
-		if(new_id > old_id){
-			t = new_id; 
-			new_id = old_id;
-			old_id = t;
+// hooks the larger root under the smaller one; a lost race retries from
+// the root that won it
+void union_labels(__global gid_t* row, gid_t a, gid_t b){
+	for(;;){
+		a = find_label_root(row, a);
+		b = find_label_root(row, b);
+		if(a == b) return;
+		if(a > b){
+			gid_t t = a; a = b; b = t;
 		}
-		barrier(CLK_GLOBAL_MEM_FENCE);
-		row[old_id] = new_id;
+		gid_t old = atomic_min(row + b, a);
+		if(old == b) return;
+		b = old;
 	}
-
 }
 
 __kernel void normalise_mask_area(
@@ -182,7 +202,6 @@ __kernel void normalise_mask_area(
 	__const size_t width,
 	__const size_t height
 ){
-	const mask_cell mask_cell_border = 0x01;
 	size_t idx = get_global_id(0);
 	
 	//		vertical
@@ -202,13 +221,11 @@ __kernel void normalise_mask_area(
 		cv = mask[pos], pv = mask[pos - d];
 		if(cv == pv)
 			continue;
-		if(cv == mask_cell_border || pv == mask_cell_border)
-			continue;
-		if(cv == 0 || pv == 0)
+		if(cv == 0 || pv == 0) // border or not reached
 			continue;
 
 		//printf("\t (%2d | %4d) %d -> %d;\n", idx, pos, cv, pv);
-		normalize_neighbours(row, cv, pv);
+		union_labels(row, cv, pv);
 	
 	}
 	
@@ -219,7 +236,9 @@ __kernel void apply_parent_gid( // todo: ???
 	__global gid_t* row
 ){
 	size_t idx = get_global_id(0);
-	mask[idx] = get_parent_gid(row, mask[idx]);
+	mask_cell cv = mask[idx];
+	if(cv == 0) return;
+	mask[idx] = find_label_root(row, cv);
 }
 
 
@@ -227,7 +246,7 @@ __kernel void normalise_gid(
 	__global gid_t* row
 ){
 	size_t idx = get_global_id(0);
-	row[idx] = get_parent_gid(row, idx);
+	row[idx] = find_label_root(row, idx);
 }
 
 __kernel void fix_gid(
@@ -244,124 +263,252 @@ __kernel void finalize_mask(
 	__global mask_cell* mask,
 	__global gid_t* row
 ){
-	const mask_cell mask_cell_border = 0x01;
 	size_t idx = get_global_id(0);
 	mask_cell cv = mask[idx];
-	if(cv == mask_cell_border){
-		mask[idx] = 0;
-	}
-	else{
-		mask[idx] = row[cv];
-	}
+	if(cv != 0) mask[idx] = row[cv];
 
 }
 
 
+// label equivalence (Playne, Hawick): every area pixel starts with its own
+// label idx + 1, row[l] is the equivalence reference of label l. The host
+// repeats scan / analyse / relabel until scan_labels reports no change.
+__kernel void init_labels(
+	__global mask_cell* mask,
+	__global gid_t* row,
+	__global const border_word* border
+){
+	size_t idx = get_global_id(0);
+	mask_cell l = is_border(border, idx) ? 0 : (mask_cell)(idx + 1);
+	mask[idx] = l;
+	row[idx + 1] = l;
+}
 
-mask_cell reach_area(
+// the smallest neighbour label lowers the reference of the pixel's label
+__kernel void scan_labels(
+	__const size_t width,
+	__const size_t height,
 	__global mask_cell* mask,
-	int pos,
-	__const int d,
-	__const int limit
+	__global gid_t* row,
+	__global const border_word* border,
+	__global uint* changed
 ){
-	mask_cell res = 0;
-	int idx = pos;
-	int i = 0;
-	for(i; i < limit && mask[pos] == 0; i++){
-		pos += d;
-		res = mask[pos];
+	size_t idx = get_global_id(0);
+	mask_cell l = mask[idx];
+	if(l == 0) return;
+
+	int4 n = get_neighbours(width, height, border, idx); // t0. l1. b2. r3
+	mask_cell m = l;
+	if(n.s0 != -1) m = min(m, mask[n.s0]);
+	if(n.s1 != -1) m = min(m, mask[n.s1]);
+	if(n.s2 != -1) m = min(m, mask[n.s2]);
+	if(n.s3 != -1) m = min(m, mask[n.s3]);
+
+	if(m < l){
+		atomic_min(row + l, m);
+		*changed = 1;
 	}
-	return res;
 }
 
-#define bc_bits (sizeof(bitfield_cell) * 8)
+// owners of labels in use resolve the reference chain down to its root
+__kernel void analyse_labels(
+	__global mask_cell* mask,
+	__global gid_t* row
+){
+	size_t idx = get_global_id(0);
+	mask_cell l = mask[idx];
+	if(l != idx + 1) return;
+
+	gid_t r = row[l];
+	while(r != row[r]) r = row[r];
+	row[l] = r;
+}
 
-size_t get_matrix_idx (
-	__const size_t matrix_column_size,
-	__const gid_t lv,
-	__const gid_t rv
+__kernel void relabel_mask(
+	__global mask_cell* mask,
+	__global gid_t* row
 ){
-	return (lv * matrix_column_size) + rv / bc_bits;
+	size_t idx = get_global_id(0);
+	mask_cell l = mask[idx];
+	if(l != 0) mask[idx] = row[l];
 }
 
-bitfield_cell get_matrix_cell_mask(
-	__const gid_t v,
-	__const uchar matrix_link_flag_value
+// compaction in label order, so areas are numbered by their first pixel:
+// each work-item counts the roots of one block of labels, the host turns
+// the counts into block bases, then the same work-item numbers its roots
+__kernel void count_label_roots(
+	__global const gid_t* row,
+	__global uint* block_roots,
+	__const uint block_size,
+	__const size_t label_count
 ){
-	bitfield_cell mask = 1 << (v % bc_bits);
-	if(matrix_link_flag_value){
-		return mask;
+	size_t block = get_global_id(0);
+	size_t first = block * block_size + 1, last = min(first + block_size, label_count + 1);
+	uint roots = 0;
+	for(size_t l = first; l < last; l++)
+		if(row[l] == l) roots++;
+	block_roots[block] = roots;
+}
+
+// one work-group: block_roots becomes the exclusive prefix sum of the block
+// counts and label_total the root count, so the host never reads the blocks
+__kernel void scan_label_blocks(
+	__global uint* block_roots,
+	__const uint block_count,
+	__global uint* label_total,
+	__local uint* partial
+){
+	uint lid = get_local_id(0), group = get_local_size(0);
+	uint chunk = (block_count + group - 1) / group;
+	uint first = min(lid * chunk, block_count), last = min(first + chunk, block_count);
+	uint sum = 0;
+	for(uint b = first; b < last; b++) sum += block_roots[b];
+	partial[lid] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if(lid == 0){
+		uint run = 0;
+		for(uint i = 0; i < group; i++){
+			uint n = partial[i];
+			partial[i] = run;
+			run += n;
+		}
+		*label_total = run;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint run = partial[lid];
+	for(uint b = first; b < last; b++){
+		uint n = block_roots[b];
+		block_roots[b] = run;
+		run += n;
 	}
-	return ~mask;
 }
 
+__kernel void number_label_roots(
+	__global gid_t* row,
+	__global const uint* block_roots,
+	__const uint block_size,
+	__const size_t label_count
+){
+	size_t block = get_global_id(0);
+	size_t first = block * block_size + 1, last = min(first + block_size, label_count + 1);
+	gid_t next = block_roots[block] + 1;
+	for(size_t l = first; l < last; l++)
+		if(row[l] == l) row[l] = next++;
+}
+
+
 
-void set_link(
-	__global bitfield_cell* matrix,
-	__const size_t matrix_column_size,
-	gid_t lv,
-	gid_t rv,
-	__const uchar matrix_link_flag_value
+// walks over the border from pos, at most steps pixels;
+// returns the area met on the other side or 0
+mask_cell edge_search(
+	__global mask_cell* mask,
+	size_t pos,
+	__const size_t d,
+	uint steps
 ){
-	// add rv to lv
-	size_t idx = get_matrix_idx(matrix_column_size, lv, rv);
-	bitfield_cell mask = get_matrix_cell_mask(rv, matrix_link_flag_value);
-	if(matrix_link_flag_value) atomic_or(matrix + idx, mask);
-	else atomic_and(matrix + idx, mask);
+	for(uint i = 0; i < steps; i++, pos += d){
+		mask_cell v = mask[pos];
+		if(v != 0) return v;
+	}
+	return 0;
+}
 
-	// add lv to rv
-	idx = get_matrix_idx(matrix_column_size, rv, lv);
-	mask = get_matrix_cell_mask(lv, matrix_link_flag_value);
-	if(matrix_link_flag_value) atomic_or(matrix + idx, mask);
-	else atomic_and(matrix + idx, mask);
+// slot_walks / edge_slots are NULL unless border lengths are collected:
+// every walk counts in its table slot, an appended edge remembers the slot
+void insert_edge(
+	__global ulong* edge_table,
+	__const uint table_mask,
+	__global uint2* edges,
+	__global uint* edge_state, // 0: edge count, 1: table overflow
+	__const uint edge_capacity,
+	__global uint* slot_walks,
+	__global uint* edge_slots,
+	uint lv,
+	uint rv
+){
+	uint a = min(lv, rv), b = max(lv, rv);
+#ifdef cl_khr_int64_base_atomics
+	// open addressing set, the first inserter of a pair appends it
+	ulong key = ((ulong)a << 32) | b;
+	uint h = (a * 0x9E3779B1u) ^ (b * 0x85EBCA77u);
+	for(uint probe = 0; probe <= table_mask; probe++){
+		uint slot = (h + probe) & table_mask;
+		ulong old = edge_table[slot]; // hot pairs and taken slots skip the atomic
+		if(old == 0) old = atom_cmpxchg((volatile __global ulong*)(edge_table + slot), 0UL, key);
+		if(old != key && old != 0) continue;
+		if(slot_walks) atomic_inc(slot_walks + slot);
+		if(old == 0){
+			uint idx = atomic_inc(edge_state);
+			if(idx < edge_capacity){
+				edges[idx] = (uint2)(a, b);
+				if(edge_slots) edge_slots[idx] = slot;
+			}
+		}
+		return;
+	}
+	atomic_or(edge_state + 1, 1u);
+#else
+	// no 64-bit atomics: plain append, the host drops repeats (one walk each)
+	uint idx = atomic_inc(edge_state);
+	if(idx < edge_capacity){
+		edges[idx] = (uint2)(a, b);
+		if(edge_slots) edge_slots[idx] = EDGE_SLOT_NONE;
+	}
+#endif
 }
 
+// edge_walks holds the slot of every edge and gets its walk count in place
+__kernel void gather_edge_walks(
+	__global const uint* slot_walks,
+	__global uint* edge_walks
+){
+	size_t idx = get_global_id(0);
+	uint slot = edge_walks[idx];
+	edge_walks[idx] = slot == EDGE_SLOT_NONE ? 1 : slot_walks[slot];
+}
 
-__kernel void build_matrix(
+// one work-item per pixel; an area pixel followed by border to the right or
+// below searches at most search_limit pixels across it, so every border
+// crossing is walked once and only distinct pairs reach the edge list
+__kernel void build_edges(
 	__const size_t width,
 	__const size_t height,
 	__global mask_cell* mask,
-	__global bitfield_cell* matrix,
-	__const size_t matrix_column_size,
-	__const uchar matrix_link_flag_value
-){ 
-	
+	__global ulong* edge_table,
+	__const uint table_mask,
+	__global uint2* edges,
+	__global uint* edge_state,
+	__const uint edge_capacity,
+	__const uint search_limit,
+	__global uint* slot_walks,
+	__global uint* edge_slots
+){
 	size_t idx = get_global_id(0);
+	mask_cell v = mask[idx], nv = 0;
+	if(v == 0) return;
+
 	size_t px = idx % width,
 			py = idx / width;
-	if(mask[idx] != 0 || 
-		px == 0 || px == width - 1 ||
-		py == 0 || py == height - 1) return;
 
-	gid_t v = 0, nv = 0;
-
-	int mask_size = width * height;
-
-	// vert backward (down)
-	v = reach_area(mask, idx, -width, py); 
-	if(v != 0){
-		// vert forward (up)
-		nv = reach_area(mask, idx, width, height - py - 1);
-		if(nv != 0 && v != nv){
-			set_link(matrix, matrix_column_size, v, nv, 
-				matrix_link_flag_value);
-		}
+	if(px + 1 < width && mask[idx + 1] == 0){
+		nv = edge_search(mask, idx + 1, 1, min(search_limit, (uint)(width - px - 1)));
+		if(nv != 0 && nv != v)
+			insert_edge(edge_table, table_mask, edges, edge_state, edge_capacity, slot_walks, edge_slots, v, nv);
 	}
 
-	// hori backward (left)
-	v = reach_area(mask, idx, -1, px);
-	if(v != 0){
-		nv = reach_area(mask, idx, 1, width - px - 1);
-		if(nv != 0 && v != nv){
-			set_link(matrix, matrix_column_size, v, nv,
-				matrix_link_flag_value);
-		}
+	if(py + 1 < height && mask[idx + width] == 0){
+		nv = edge_search(mask, idx + width, width, min(search_limit, (uint)(height - py - 1)));
+		if(nv != 0 && nv != v)
+			insert_edge(edge_table, table_mask, edges, edge_state, edge_capacity, slot_walks, edge_slots, v, nv);
 	}
 }
 
 __kernel void debug_output(
 	__write_only image2d_t map,
-	__global mask_cell* mask
+	__global mask_cell* mask,
+	__const size_t width
 ){
 	const sampler_t bmpmap_sample = 
 	CLK_NORMALIZED_COORDS_FALSE |
@@ -371,7 +518,7 @@ __kernel void debug_output(
 	color_t c_black = (uint4)(0xAA, 0x00, 0x00, 0xFF);
 
 	int2 mapcoord = (int2)(get_global_id(0), get_global_id(1));
-	int maskcoord = mapcoord.s1 * get_image_width(map) + mapcoord.s0;
+	int maskcoord = mapcoord.s1 * width + mapcoord.s0;
 
 	uint v = mask[maskcoord];
 	uchar c = 20 + v % 0xF0;
@@ -386,10 +533,11 @@ __kernel void debug_output(
 __kernel void apply_colors(
 	__write_only image2d_t map,
 	__global mask_cell* mask,
-	__global uchar* color
+	__global uchar* color,
+	__const size_t width
 ){
 	int2 mapcoord = (int2)(get_global_id(0), get_global_id(1));
-	int maskcoord = mapcoord.s1 * get_image_width(map) + mapcoord.s0;
+	int maskcoord = mapcoord.s1 * width + mapcoord.s0;
 
 	uchar color_id = color[mask[maskcoord]];
 	uchar defvalue = 0xEE, secvalue = 0x55;
@@ -408,3 +556,204 @@ __kernel void apply_colors(
 	else
 		write_imageui(map, mapcoord, (uint4)(0x00, 0x00, 0x00, 0xFF));
 }
+
+// 64-bit add out of two 32-bit atomics, the carry goes to the high word
+void stat_add64(volatile __global uint* word, ulong value){
+	uint lo = (uint)value, old = atomic_add(word, lo);
+	uint hi = (uint)(value >> 32) + (old + lo < old);
+	if(hi) atomic_add(word + 1, hi);
+}
+
+// One work-item per pixel. A work-group folds its pixels into at most
+// REGION_STAT_SLOTS regions with __local atomics (coordinates relative to the
+// group), then one global update per region and group; pixels of regions
+// past the slots go to global memory directly. Minimums are kept inverted,
+// so a zero fill is the empty state.
+__kernel void region_stats(
+	__const size_t width,
+	__global mask_cell* mask,
+	__global uint* stats
+){
+	__local uint slot_label[REGION_STAT_SLOTS];
+	__local uint slot_area[REGION_STAT_SLOTS];
+	__local uint slot_x0[REGION_STAT_SLOTS], slot_y0[REGION_STAT_SLOTS];
+	__local uint slot_x1[REGION_STAT_SLOTS], slot_y1[REGION_STAT_SLOTS];
+	__local uint slot_sum_x[REGION_STAT_SLOTS], slot_sum_y[REGION_STAT_SLOTS];
+
+	size_t lid = get_local_id(1) * get_local_size(0) + get_local_id(0);
+	size_t lsize = get_local_size(0) * get_local_size(1);
+	size_t x = get_global_id(0), y = get_global_id(1);
+	uint gx = (uint)(x - get_local_id(0)), gy = (uint)(y - get_local_id(1));
+
+	for(size_t i = lid; i < REGION_STAT_SLOTS; i += lsize){
+		slot_label[i] = 0; slot_area[i] = 0;
+		slot_x0[i] = UINT_MAX; slot_y0[i] = UINT_MAX; slot_x1[i] = 0; slot_y1[i] = 0;
+		slot_sum_x[i] = 0; slot_sum_y[i] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint v = (uint)mask[y * width + x], lx = (uint)x - gx, ly = (uint)y - gy;
+	if(v != 0){
+		uint h = v * 0x9E3779B1u, probe = 0;
+		for(; probe < REGION_STAT_SLOTS; probe++){
+			uint slot = (h + probe) % REGION_STAT_SLOTS;
+			uint old = atomic_cmpxchg(slot_label + slot, 0u, v);
+			if(old != 0 && old != v) continue;
+			atomic_inc(slot_area + slot);
+			atomic_min(slot_x0 + slot, lx); atomic_min(slot_y0 + slot, ly);
+			atomic_max(slot_x1 + slot, lx + 1); atomic_max(slot_y1 + slot, ly + 1);
+			atomic_add(slot_sum_x + slot, lx); atomic_add(slot_sum_y + slot, ly);
+			break;
+		}
+		if(probe == REGION_STAT_SLOTS){
+			volatile __global uint* s = stats + (size_t)v * REGION_STAT_WORDS;
+			atomic_inc(s);
+			atomic_max(s + 1, ~(uint)x); atomic_max(s + 2, ~(uint)y);
+			atomic_max(s + 3, (uint)x + 1); atomic_max(s + 4, (uint)y + 1);
+			stat_add64(s + 5, x); stat_add64(s + 7, y);
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for(size_t i = lid; i < REGION_STAT_SLOTS; i += lsize){
+		uint r = slot_label[i], area = slot_area[i];
+		if(r == 0) continue;
+		volatile __global uint* s = stats + (size_t)r * REGION_STAT_WORDS;
+		atomic_add(s, area);
+		atomic_max(s + 1, ~(gx + slot_x0[i])); atomic_max(s + 2, ~(gy + slot_y0[i]));
+		atomic_max(s + 3, gx + slot_x1[i]); atomic_max(s + 4, gy + slot_y1[i]);
+		stat_add64(s + 5, slot_sum_x[i] + (ulong)area * gx);
+		stat_add64(s + 7, slot_sum_y[i] + (ulong)area * gy);
+	}
+}
+
+// palette index of apply_colors: 0 - black, 1..6 - color_id 1..32
+uchar palette_index(uchar color_id){
+	if(color_id == 0 || color_id > 32 || (color_id & (color_id - 1))) return 0;
+	return (uchar)(32 - clz((uint)color_id));
+}
+
+// one work-item per byte of a padded indexed bmp row: one pixel at 8 bits,
+// two at 4 bits (left pixel in the high nibble); padding bytes get 0
+__kernel void color_indices(
+	__global uchar* indices,
+	__global mask_cell* mask,
+	__global uchar* color,
+	__const size_t width,
+	__const size_t row_pitch,
+	__const uint bits
+){
+	size_t x = get_global_id(0), y = get_global_id(1);
+	__global mask_cell* row = mask + y * width;
+	uchar value = 0;
+
+	if(bits == 8){
+		if(x < width) value = palette_index(color[row[x]]);
+	}
+	else{
+		size_t px = x << 1;
+		if(px < width) value = palette_index(color[row[px]]) << 4;
+		if(px + 1 < width) value |= palette_index(color[row[px + 1]]);
+	}
+	indices[y * row_pitch + x] = value;
+}
+
+// one work-group per LABEL_TILE x LABEL_TILE tile: label equivalence runs
+// in __local memory until the tile converges, then the tile root (its first
+// pixel in raster order) becomes the global label of the whole component
+__kernel void label_tiles(
+	__const size_t width,
+	__const size_t height,
+	__global mask_cell* mask,
+	__global gid_t* row,
+	__global const border_word* border
+){
+	__local int label[LABEL_TILE * LABEL_TILE];
+	__local int ref[LABEL_TILE * LABEL_TILE];
+	__local int changed;
+
+	int lx = get_local_id(0), ly = get_local_id(1), lid = ly * LABEL_TILE + lx;
+	size_t x = get_global_id(0), y = get_global_id(1), idx = y * width + x;
+	bool inside = x < width && y < height; // padding items still reach every barrier
+
+	label[lid] = inside && !is_border(border, idx) ? lid : -1;
+	ref[lid] = lid;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for(;;){
+		if(lid == 0) changed = 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		int l = label[lid];
+		if(l >= 0){
+			int m = l;
+			if(lx > 0 && label[lid - 1] >= 0) m = min(m, label[lid - 1]);
+			if(lx < LABEL_TILE - 1 && label[lid + 1] >= 0) m = min(m, label[lid + 1]);
+			if(ly > 0 && label[lid - LABEL_TILE] >= 0) m = min(m, label[lid - LABEL_TILE]);
+			if(ly < LABEL_TILE - 1 && label[lid + LABEL_TILE] >= 0) m = min(m, label[lid + LABEL_TILE]);
+			if(m < l){
+				atomic_min(ref + l, m);
+				changed = 1;
+			}
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if(!changed) break;
+
+		if(l == lid){
+			int r = ref[l];
+			while(r != ref[r]) r = ref[r];
+			ref[l] = r;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if(l >= 0) label[lid] = ref[l];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if(!inside) return;
+	int l = label[lid];
+	mask_cell g = 0;
+	if(l >= 0){
+		size_t rx = get_group_id(0) * LABEL_TILE + l % LABEL_TILE,
+			ry = get_group_id(1) * LABEL_TILE + l / LABEL_TILE;
+		g = (mask_cell)(ry * width + rx + 1);
+	}
+	mask[idx] = g;
+	row[idx + 1] = g;
+}
+
+// one work-item per pixel pair across a tile seam: vertical seams first,
+// then horizontal ones; only these pairs reach the global union-find
+__kernel void merge_tile_seams(
+	__const size_t width,
+	__const size_t height,
+	__global mask_cell* mask,
+	__global gid_t* row
+){
+	size_t i = get_global_id(0), a = 0;
+	size_t seams_x = (width + LABEL_TILE - 1) / LABEL_TILE - 1;
+	size_t d = 1;
+
+	if(i < seams_x * height){
+		size_t y = i / seams_x, x = (i % seams_x + 1) * LABEL_TILE;
+		a = y * width + x - 1;
+	}
+	else{
+		i -= seams_x * height;
+		size_t y = (i / width + 1) * LABEL_TILE, x = i % width;
+		a = (y - 1) * width + x;
+		d = width;
+	}
+
+	mask_cell la = mask[a], lb = mask[a + d];
+	if(la == 0 || lb == 0 || la == lb) return;
+	union_labels(row, la, lb);
+}
+
+__kernel void resolve_labels(
+	__global mask_cell* mask,
+	__global gid_t* row
+){
+	size_t idx = get_global_id(0);
+	mask_cell l = mask[idx];
+	if(l != 0) mask[idx] = find_label_root(row, l);
+}
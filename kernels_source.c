@@ -0,0 +1,767 @@
+// Generated from kernels.cl by tools/embed_kernels.c, do not edit.
+
+#include "kernels_source.h"
+
+const char* kernels_source_lines[] = {
+	"#ifdef cl_khr_int64_base_atomics\n",
+	"#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable\n",
+	"#endif\n",
+	"\n",
+	"typedef int mask_cell;\n",
+	"typedef uint4 color_t;\n",
+	"typedef int gid_t;\n",
+	"typedef uint bitfield_cell;\n",
+	"\n",
+	"typedef uint border_word;\n",
+	"\n",
+	"#define EDGE_SLOT_NONE 0xFFFFFFFFu // an edge appended without the table\n",
+	"#define REGION_STAT_WORDS 9 // area, ~x0, ~y0, x1, y1, sum x (lo, hi), sum y (lo, hi)\n",
+	"#define REGION_STAT_SLOTS 64 // regions one work-group folds in __local memory\n",
+	"\n",
+	"#ifndef LABEL_TILE\n",
+	"#define LABEL_TILE 16 // the host passes its own size in the build options\n",
+	"#endif\n",
+	"\n",
+	"// one bit per pixel in mask order: bit idx % 32 of word idx / 32\n",
+	"bool is_border(__global const border_word* border, size_t idx){\n",
+	"	return (border[idx >> 5] >> (idx & 31)) & 1;\n",
+	"}\n",
+	"\n",
+	"// border_test_t of border_predicate.h, c is b, g, r, a\n",
+	"bool border_pixel(uint4 c, uint distance, int4 weight, int4 ref, int limit){\n",
+	"	int4 v = convert_int4(c);\n",
+	"	int4 d = v - ref;\n",
+	"	int4 s = distance ? d * d : v * weight;\n",
+	"	return s.s0 + s.s1 + s.s2 <= limit;\n",
+	"}\n",
+	"\n",
+	"// one work-item per 32 pixels; borders are never written to the mask,\n",
+	"// they stay 0 from the host fill and every border test reads the bits\n",
+	"__kernel void pack_border(\n",
+	"	__read_only image2d_t map,\n",
+	"	__global border_word* border,\n",
+	"	__const size_t width,\n",
+	"	__const size_t mask_size,\n",
+	"	__const uint border_distance,\n",
+	"	__const int4 border_weight,\n",
+	"	__const int4 border_ref,\n",
+	"	__const int border_limit\n",
+	"){\n",
+	"	const sampler_t bmpmap_sample = \n",
+	"	CLK_NORMALIZED_COORDS_FALSE |\n",
+	"	CLK_ADDRESS_CLAMP_TO_EDGE 	|\n",
+	"	CLK_FILTER_NEAREST;\n",
+	"\n",
+	"	size_t word = get_global_id(0), idx = word << 5;\n",
+	"	int2 mapcoord = (int2)((int)(idx % width), (int)(idx / width)); // image may be wider than the map\n",
+	"	border_word bits = 0;\n",
+	"\n",
+	"	for(uint b = 0; b < 32 && idx < mask_size; b++, idx++){\n",
+	"		uint4 c = read_imageui(map, bmpmap_sample, mapcoord);\n",
+	"		if(border_pixel(c, border_distance, border_weight, border_ref, border_limit)) bits |= 1u << b;\n",
+	"		if(++mapcoord.s0 == width){\n",
+	"			mapcoord.s0 = 0;\n",
+	"			mapcoord.s1++;\n",
+	"		}\n",
+	"	}\n",
+	"	border[word] = bits;\n",
+	"}\n",
+	"\n",
+	"__kernel void set_gid_row(\n",
+	"	__global gid_t* row\n",
+	"){\n",
+	"	size_t idx = get_global_id(0);\n",
+	"	row[idx] = idx;\n",
+	"}\n",
+	"\n",
+	"int4 get_neighbours(\n",
+	"	__const size_t width,\n",
+	"	__const size_t height,\n",
+	"	__global const border_word* border,\n",
+	"	const int idx\n",
+	"){\n",
+	"	int4 res = (int4)(-1, -1, -1, -1); // t0. l1. b2. r3\n",
+	"	int c = idx / width;\n",
+	"	if(c > 0 && !is_border(border, idx - width)) \n",
+	"		res.s0 = idx - width;\n",
+	"	if(c < height - 1 && !is_border(border, idx + width)) \n",
+	"		res.s2 = idx + width;\n",
+	"	\n",
+	"	c = idx % width;\n",
+	"	\n",
+	"	if(c > 0 && !is_border(border, idx - 1)) \n",
+	"		res.s1 = idx - 1;\n",
+	"	if(c < width - 1 && !is_border(border, idx + 1)) \n",
+	"		res.s3 = idx + 1;\n",
+	"	return res;\n",
+	"}\n",
+	"\n",
+	"bool is_start_point(\n",
+	"	const int4 n, 	// t0. l1. b2. r3\n",
+	"	gid_t idx,\n",
+	"	const size_t spread_timeout\n",
+	"){\n",
+	"	//if(idx % spread_timeout == 0) return true;\n",
+	"	//if(n.s0 == -1 && n.s1 == -1 || n.s2 == -1 && n.s3 == -1) return true;\n",
+	"	return (n.s0 == -1 && n.s1 == -1);\n",
+	"}\n",
+	"\n",
+	"size_t allocate_gid_idx(__global size_t* gid){\n",
+	"	return (size_t) atomic_inc(gid);\n",
+	"}\n",
+	"\n",
+	"mask_cell get_the_smallest(mask_cell r, __global mask_cell* mask, int nidx){\n",
+	"	mask_cell v = 0;\n",
+	"	if(nidx != -1){\n",
+	"		v = mask[nidx];\n",
+	"		if(v > 1){\n",
+	"			r = v;\n",
+	"		}\n",
+	"	}\n",
+	"	return r;\n",
+	"}\n",
+	"\n",
+	"mask_cell wait_for_the_smallest(__global mask_cell* mask, int4 n){\n",
+	"		// t0. l1. b2. r3\n",
+	"	mask_cell r = 0, t = 0;\n",
+	"	r = get_the_smallest(r, mask, n.s0);\n",
+	"	t = get_the_smallest(r, mask, n.s1);\n",
+	"	if(r < t) r = t;\n",
+	"	t = get_the_smallest(r, mask, n.s2);\n",
+	"	if(r < t) r = t;\n",
+	"	r = get_the_smallest(r, mask, n.s3);\n",
+	"	if(r < t) r = t;\n",
+	"	return r;\n",
+	"}\n",
+	"\n",
+	"__kernel void premask_area(\n",
+	"	__const size_t width,\n",
+	"	__const size_t height,\n",
+	"	__global mask_cell* mask,\n",
+	"	__global const border_word* border,\n",
+	"	__global size_t* gid_idx,\n",
+	"	__const size_t spread_timeout\n",
+	"){\n",
+	"	size_t idx = get_global_id(0);\n",
+	"	\n",
+	"	if(is_border(border, idx)) return;\n",
+	"	\n",
+	"	int4 n = get_neighbours(width, height, border, idx); // t0. l1. b2. r3\n",
+	"\n",
+	"	bool start_point = is_start_point(n, idx, spread_timeout);\n",
+	"\n",
+	"	if(start_point)\n",
+	"		mask[idx] = allocate_gid_idx(gid_idx);\n",
+	" \n",
+	"	barrier(CLK_GLOBAL_MEM_FENCE);\n",
+	"\n",
+	" 	mask_cell v = 0;\n",
+	"	if(!start_point){\n",
+	"		int i = 0;\n",
+	"		while(v < 1 && i < spread_timeout){ \n",
+	"			v = wait_for_the_smallest(mask, n);\n",
+	"			if(v > 1) {\n",
+	"				mask[idx] = v;\n",
+	"			}\n",
+	"			i++;\n",
+	"			barrier(CLK_GLOBAL_MEM_FENCE);\n",
+	"		}\n",
+	"	}\n",
+	"}\n",
+	"\n",
+	"// Concurrent union-find over a gid row: every link points to a smaller id of\n",
+	"// the same set and only ever decreases (atomic_min), so a set's root is its\n",
+	"// smallest id whatever order the work-items run in.\n",
+	"\n",
+	"// path halving: each visited entry is relinked to its grandparent\n",
+	"gid_t find_label_root(__global gid_t* row, gid_t l){\n",
+	"	for(;;){\n",
+	"		gid_t p = row[l];\n",
+	"		if(p == l) return l;\n",
+	"		gid_t gp = row[p];\n",
+	"		if(gp == p) return p;\n",
+	"		atomic_min(row + l, gp);\n",
+	"		l = gp;\n",
+	"	}\n",
+	"}\n",
+	"\n",
+	"// hooks the larger root under the smaller one; a lost race retries from\n",
+	"// the root that won it\n",
+	"void union_labels(__global gid_t* row, gid_t a, gid_t b){\n",
+	"	for(;;){\n",
+	"		a = find_label_root(row, a);\n",
+	"		b = find_label_root(row, b);\n",
+	"		if(a == b) return;\n",
+	"		if(a > b){\n",
+	"			gid_t t = a; a = b; b = t;\n",
+	"		}\n",
+	"		gid_t old = atomic_min(row + b, a);\n",
+	"		if(old == b) return;\n",
+	"		b = old;\n",
+	"	}\n",
+	"}\n",
+	"\n",
+	"__kernel void normalise_mask_area(\n",
+	"	__global mask_cell* mask,\n",
+	"	__global gid_t* row,\n",
+	"	__const size_t width,\n",
+	"	__const size_t height\n",
+	"){\n",
+	"	size_t idx = get_global_id(0);\n",
+	"	\n",
+	"	//		vertical\n",
+	"	size_t edge = height;\n",
+	"	size_t d = width;\n",
+	"	size_t pos = idx + d; // to skip first\n",
+	"\n",
+	"	//		horisontal	\n",
+	"	if(idx >= width){\n",
+	"		edge = width;\n",
+	"		d = 1;\n",
+	"		pos = (idx - width) * width + d; // to skip first\n",
+	"	}\n",
+	"	mask_cell cv = 0, pv = 0;\n",
+	"\n",
+	"	for(size_t i = 0; i < edge - 1; i++, pos += d){\n",
+	"		cv = mask[pos], pv = mask[pos - d];\n",
+	"		if(cv == pv)\n",
+	"			continue;\n",
+	"		if(cv == 0 || pv == 0) // border or not reached\n",
+	"			continue;\n",
+	"\n",
+	"		//printf(\"\\t (%2d | %4d) %d -> %d;\\n\", idx, pos, cv, pv);\n",
+	"		union_labels(row, cv, pv);\n",
+	"	\n",
+	"	}\n",
+	"	\n",
+	"}\n",
+	"\n",
+	"__kernel void apply_parent_gid( // todo: ???\n",
+	"	__global mask_cell* mask,\n",
+	"	__global gid_t* row\n",
+	"){\n",
+	"	size_t idx = get_global_id(0);\n",
+	"	mask_cell cv = mask[idx];\n",
+	"	if(cv == 0) return;\n",
+	"	mask[idx] = find_label_root(row, cv);\n",
+	"}\n",
+	"\n",
+	"\n",
+	"__kernel void normalise_gid(\n",
+	"	__global gid_t* row\n",
+	"){\n",
+	"	size_t idx = get_global_id(0);\n",
+	"	row[idx] = find_label_root(row, idx);\n",
+	"}\n",
+	"\n",
+	"__kernel void fix_gid(\n",
+	"	__global gid_t* row,\n",
+	"	__global size_t* gid_idx,\n",
+	"	__const size_t reserved_gids\n",
+	"){\n",
+	"	size_t idx = get_global_id(0);\n",
+	"	if(idx < reserved_gids) return;\n",
+	"	if(row[idx] == idx) row[idx] = atomic_inc(gid_idx);\n",
+	"}\n",
+	"\n",
+	"__kernel void finalize_mask(\n",
+	"	__global mask_cell* mask,\n",
+	"	__global gid_t* row\n",
+	"){\n",
+	"	size_t idx = get_global_id(0);\n",
+	"	mask_cell cv = mask[idx];\n",
+	"	if(cv != 0) mask[idx] = row[cv];\n",
+	"\n",
+	"}\n",
+	"\n",
+	"\n",
+	"// label equivalence (Playne, Hawick): every area pixel starts with its own\n",
+	"// label idx + 1, row[l] is the equivalence reference of label l. The host\n",
+	"// repeats scan / analyse / relabel until scan_labels reports no change.\n",
+	"__kernel void init_labels(\n",
+	"	__global mask_cell* mask,\n",
+	"	__global gid_t* row,\n",
+	"	__global const border_word* border\n",
+	"){\n",
+	"	size_t idx = get_global_id(0);\n",
+	"	mask_cell l = is_border(border, idx) ? 0 : (mask_cell)(idx + 1);\n",
+	"	mask[idx] = l;\n",
+	"	row[idx + 1] = l;\n",
+	"}\n",
+	"\n",
+	"// the smallest neighbour label lowers the reference of the pixel's label\n",
+	"__kernel void scan_labels(\n",
+	"	__const size_t width,\n",
+	"	__const size_t height,\n",
+	"	__global mask_cell* mask,\n",
+	"	__global gid_t* row,\n",
+	"	__global const border_word* border,\n",
+	"	__global uint* changed\n",
+	"){\n",
+	"	size_t idx = get_global_id(0);\n",
+	"	mask_cell l = mask[idx];\n",
+	"	if(l == 0) return;\n",
+	"\n",
+	"	int4 n = get_neighbours(width, height, border, idx); // t0. l1. b2. r3\n",
+	"	mask_cell m = l;\n",
+	"	if(n.s0 != -1) m = min(m, mask[n.s0]);\n",
+	"	if(n.s1 != -1) m = min(m, mask[n.s1]);\n",
+	"	if(n.s2 != -1) m = min(m, mask[n.s2]);\n",
+	"	if(n.s3 != -1) m = min(m, mask[n.s3]);\n",
+	"\n",
+	"	if(m < l){\n",
+	"		atomic_min(row + l, m);\n",
+	"		*changed = 1;\n",
+	"	}\n",
+	"}\n",
+	"\n",
+	"// owners of labels in use resolve the reference chain down to its root\n",
+	"__kernel void analyse_labels(\n",
+	"	__global mask_cell* mask,\n",
+	"	__global gid_t* row\n",
+	"){\n",
+	"	size_t idx = get_global_id(0);\n",
+	"	mask_cell l = mask[idx];\n",
+	"	if(l != idx + 1) return;\n",
+	"\n",
+	"	gid_t r = row[l];\n",
+	"	while(r != row[r]) r = row[r];\n",
+	"	row[l] = r;\n",
+	"}\n",
+	"\n",
+	"__kernel void relabel_mask(\n",
+	"	__global mask_cell* mask,\n",
+	"	__global gid_t* row\n",
+	"){\n",
+	"	size_t idx = get_global_id(0);\n",
+	"	mask_cell l = mask[idx];\n",
+	"	if(l != 0) mask[idx] = row[l];\n",
+	"}\n",
+	"\n",
+	"// compaction in label order, so areas are numbered by their first pixel:\n",
+	"// each work-item counts the roots of one block of labels, the host turns\n",
+	"// the counts into block bases, then the same work-item numbers its roots\n",
+	"__kernel void count_label_roots(\n",
+	"	__global const gid_t* row,\n",
+	"	__global uint* block_roots,\n",
+	"	__const uint block_size,\n",
+	"	__const size_t label_count\n",
+	"){\n",
+	"	size_t block = get_global_id(0);\n",
+	"	size_t first = block * block_size + 1, last = min(first + block_size, label_count + 1);\n",
+	"	uint roots = 0;\n",
+	"	for(size_t l = first; l < last; l++)\n",
+	"		if(row[l] == l) roots++;\n",
+	"	block_roots[block] = roots;\n",
+	"}\n",
+	"\n",
+	"// one work-group: block_roots becomes the exclusive prefix sum of the block\n",
+	"// counts and label_total the root count, so the host never reads the blocks\n",
+	"__kernel void scan_label_blocks(\n",
+	"	__global uint* block_roots,\n",
+	"	__const uint block_count,\n",
+	"	__global uint* label_total,\n",
+	"	__local uint* partial\n",
+	"){\n",
+	"	uint lid = get_local_id(0), group = get_local_size(0);\n",
+	"	uint chunk = (block_count + group - 1) / group;\n",
+	"	uint first = min(lid * chunk, block_count), last = min(first + chunk, block_count);\n",
+	"	uint sum = 0;\n",
+	"	for(uint b = first; b < last; b++) sum += block_roots[b];\n",
+	"	partial[lid] = sum;\n",
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n",
+	"\n",
+	"	if(lid == 0){\n",
+	"		uint run = 0;\n",
+	"		for(uint i = 0; i < group; i++){\n",
+	"			uint n = partial[i];\n",
+	"			partial[i] = run;\n",
+	"			run += n;\n",
+	"		}\n",
+	"		*label_total = run;\n",
+	"	}\n",
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n",
+	"\n",
+	"	uint run = partial[lid];\n",
+	"	for(uint b = first; b < last; b++){\n",
+	"		uint n = block_roots[b];\n",
+	"		block_roots[b] = run;\n",
+	"		run += n;\n",
+	"	}\n",
+	"}\n",
+	"\n",
+	"__kernel void number_label_roots(\n",
+	"	__global gid_t* row,\n",
+	"	__global const uint* block_roots,\n",
+	"	__const uint block_size,\n",
+	"	__const size_t label_count\n",
+	"){\n",
+	"	size_t block = get_global_id(0);\n",
+	"	size_t first = block * block_size + 1, last = min(first + block_size, label_count + 1);\n",
+	"	gid_t next = block_roots[block] + 1;\n",
+	"	for(size_t l = first; l < last; l++)\n",
+	"		if(row[l] == l) row[l] = next++;\n",
+	"}\n",
+	"\n",
+	"\n",
+	"\n",
+	"// walks over the border from pos, at most steps pixels;\n",
+	"// returns the area met on the other side or 0\n",
+	"mask_cell edge_search(\n",
+	"	__global mask_cell* mask,\n",
+	"	size_t pos,\n",
+	"	__const size_t d,\n",
+	"	uint steps\n",
+	"){\n",
+	"	for(uint i = 0; i < steps; i++, pos += d){\n",
+	"		mask_cell v = mask[pos];\n",
+	"		if(v != 0) return v;\n",
+	"	}\n",
+	"	return 0;\n",
+	"}\n",
+	"\n",
+	"// slot_walks / edge_slots are NULL unless border lengths are collected:\n",
+	"// every walk counts in its table slot, an appended edge remembers the slot\n",
+	"void insert_edge(\n",
+	"	__global ulong* edge_table,\n",
+	"	__const uint table_mask,\n",
+	"	__global uint2* edges,\n",
+	"	__global uint* edge_state, // 0: edge count, 1: table overflow\n",
+	"	__const uint edge_capacity,\n",
+	"	__global uint* slot_walks,\n",
+	"	__global uint* edge_slots,\n",
+	"	uint lv,\n",
+	"	uint rv\n",
+	"){\n",
+	"	uint a = min(lv, rv), b = max(lv, rv);\n",
+	"#ifdef cl_khr_int64_base_atomics\n",
+	"	// open addressing set, the first inserter of a pair appends it\n",
+	"	ulong key = ((ulong)a << 32) | b;\n",
+	"	uint h = (a * 0x9E3779B1u) ^ (b * 0x85EBCA77u);\n",
+	"	for(uint probe = 0; probe <= table_mask; probe++){\n",
+	"		uint slot = (h + probe) & table_mask;\n",
+	"		ulong old = edge_table[slot]; // hot pairs and taken slots skip the atomic\n",
+	"		if(old == 0) old = atom_cmpxchg((volatile __global ulong*)(edge_table + slot), 0UL, key);\n",
+	"		if(old != key && old != 0) continue;\n",
+	"		if(slot_walks) atomic_inc(slot_walks + slot);\n",
+	"		if(old == 0){\n",
+	"			uint idx = atomic_inc(edge_state);\n",
+	"			if(idx < edge_capacity){\n",
+	"				edges[idx] = (uint2)(a, b);\n",
+	"				if(edge_slots) edge_slots[idx] = slot;\n",
+	"			}\n",
+	"		}\n",
+	"		return;\n",
+	"	}\n",
+	"	atomic_or(edge_state + 1, 1u);\n",
+	"#else\n",
+	"	// no 64-bit atomics: plain append, the host drops repeats (one walk each)\n",
+	"	uint idx = atomic_inc(edge_state);\n",
+	"	if(idx < edge_capacity){\n",
+	"		edges[idx] = (uint2)(a, b);\n",
+	"		if(edge_slots) edge_slots[idx] = EDGE_SLOT_NONE;\n",
+	"	}\n",
+	"#endif\n",
+	"}\n",
+	"\n",
+	"// edge_walks holds the slot of every edge and gets its walk count in place\n",
+	"__kernel void gather_edge_walks(\n",
+	"	__global const uint* slot_walks,\n",
+	"	__global uint* edge_walks\n",
+	"){\n",
+	"	size_t idx = get_global_id(0);\n",
+	"	uint slot = edge_walks[idx];\n",
+	"	edge_walks[idx] = slot == EDGE_SLOT_NONE ? 1 : slot_walks[slot];\n",
+	"}\n",
+	"\n",
+	"// one work-item per pixel; an area pixel followed by border to the right or\n",
+	"// below searches at most search_limit pixels across it, so every border\n",
+	"// crossing is walked once and only distinct pairs reach the edge list\n",
+	"__kernel void build_edges(\n",
+	"	__const size_t width,\n",
+	"	__const size_t height,\n",
+	"	__global mask_cell* mask,\n",
+	"	__global ulong* edge_table,\n",
+	"	__const uint table_mask,\n",
+	"	__global uint2* edges,\n",
+	"	__global uint* edge_state,\n",
+	"	__const uint edge_capacity,\n",
+	"	__const uint search_limit,\n",
+	"	__global uint* slot_walks,\n",
+	"	__global uint* edge_slots\n",
+	"){\n",
+	"	size_t idx = get_global_id(0);\n",
+	"	mask_cell v = mask[idx], nv = 0;\n",
+	"	if(v == 0) return;\n",
+	"\n",
+	"	size_t px = idx % width,\n",
+	"			py = idx / width;\n",
+	"\n",
+	"	if(px + 1 < width && mask[idx + 1] == 0){\n",
+	"		nv = edge_search(mask, idx + 1, 1, min(search_limit, (uint)(width - px - 1)));\n",
+	"		if(nv != 0 && nv != v)\n",
+	"			insert_edge(edge_table, table_mask, edges, edge_state, edge_capacity, slot_walks, edge_slots, v, nv);\n",
+	"	}\n",
+	"\n",
+	"	if(py + 1 < height && mask[idx + width] == 0){\n",
+	"		nv = edge_search(mask, idx + width, width, min(search_limit, (uint)(height - py - 1)));\n",
+	"		if(nv != 0 && nv != v)\n",
+	"			insert_edge(edge_table, table_mask, edges, edge_state, edge_capacity, slot_walks, edge_slots, v, nv);\n",
+	"	}\n",
+	"}\n",
+	"\n",
+	"__kernel void debug_output(\n",
+	"	__write_only image2d_t map,\n",
+	"	__global mask_cell* mask,\n",
+	"	__const size_t width\n",
+	"){\n",
+	"	const sampler_t bmpmap_sample = \n",
+	"	CLK_NORMALIZED_COORDS_FALSE |\n",
+	"	CLK_ADDRESS_CLAMP_TO_EDGE 	|\n",
+	"	CLK_FILTER_NEAREST;\n",
+	"	const mask_cell mask_cell_border = 0x01;\n",
+	"	color_t c_black = (uint4)(0xAA, 0x00, 0x00, 0xFF);\n",
+	"\n",
+	"	int2 mapcoord = (int2)(get_global_id(0), get_global_id(1));\n",
+	"	int maskcoord = mapcoord.s1 * width + mapcoord.s0;\n",
+	"\n",
+	"	uint v = mask[maskcoord];\n",
+	"	uchar c = 20 + v % 0xF0;\n",
+	"	\n",
+	"	\n",
+	"\n",
+	"	if(v == 0) \n",
+	"		write_imageui(map, mapcoord, (uint4)(0xEE, 0x10, 0x88, 0xFF));\n",
+	"	else write_imageui(map, mapcoord, (uint4)(c, c, c, 0xFF));\n",
+	"}\n",
+	"\n",
+	"__kernel void apply_colors(\n",
+	"	__write_only image2d_t map,\n",
+	"	__global mask_cell* mask,\n",
+	"	__global uchar* color,\n",
+	"	__const size_t width\n",
+	"){\n",
+	"	int2 mapcoord = (int2)(get_global_id(0), get_global_id(1));\n",
+	"	int maskcoord = mapcoord.s1 * width + mapcoord.s0;\n",
+	"\n",
+	"	uchar color_id = color[mask[maskcoord]];\n",
+	"	uchar defvalue = 0xEE, secvalue = 0x55;\n",
+	"	if(color_id == 1) \n",
+	"		write_imageui(map, mapcoord, (uint4)(defvalue, secvalue, secvalue, 0xFF));\n",
+	"	else if(color_id == 2) \n",
+	"		write_imageui(map, mapcoord, (uint4)(secvalue, defvalue, secvalue, 0xFF));\n",
+	"	else if(color_id == 4) \n",
+	"		write_imageui(map, mapcoord, (uint4)(secvalue, secvalue, defvalue, 0xFF));\n",
+	"	else if(color_id == 8) \n",
+	"		write_imageui(map, mapcoord, (uint4)(secvalue, defvalue, defvalue, 0xFF));\n",
+	"	else if(color_id == 16) \n",
+	"		write_imageui(map, mapcoord, (uint4)(defvalue, defvalue, secvalue, 0xFF));\n",
+	"	else if(color_id == 32) \n",
+	"		write_imageui(map, mapcoord, (uint4)(defvalue, secvalue, defvalue, 0xFF));\n",
+	"	else\n",
+	"		write_imageui(map, mapcoord, (uint4)(0x00, 0x00, 0x00, 0xFF));\n",
+	"}\n",
+	"\n",
+	"// 64-bit add out of two 32-bit atomics, the carry goes to the high word\n",
+	"void stat_add64(volatile __global uint* word, ulong value){\n",
+	"	uint lo = (uint)value, old = atomic_add(word, lo);\n",
+	"	uint hi = (uint)(value >> 32) + (old + lo < old);\n",
+	"	if(hi) atomic_add(word + 1, hi);\n",
+	"}\n",
+	"\n",
+	"// One work-item per pixel. A work-group folds its pixels into at most\n",
+	"// REGION_STAT_SLOTS regions with __local atomics (coordinates relative to the\n",
+	"// group), then one global update per region and group; pixels of regions\n",
+	"// past the slots go to global memory directly. Minimums are kept inverted,\n",
+	"// so a zero fill is the empty state.\n",
+	"__kernel void region_stats(\n",
+	"	__const size_t width,\n",
+	"	__global mask_cell* mask,\n",
+	"	__global uint* stats\n",
+	"){\n",
+	"	__local uint slot_label[REGION_STAT_SLOTS];\n",
+	"	__local uint slot_area[REGION_STAT_SLOTS];\n",
+	"	__local uint slot_x0[REGION_STAT_SLOTS], slot_y0[REGION_STAT_SLOTS];\n",
+	"	__local uint slot_x1[REGION_STAT_SLOTS], slot_y1[REGION_STAT_SLOTS];\n",
+	"	__local uint slot_sum_x[REGION_STAT_SLOTS], slot_sum_y[REGION_STAT_SLOTS];\n",
+	"\n",
+	"	size_t lid = get_local_id(1) * get_local_size(0) + get_local_id(0);\n",
+	"	size_t lsize = get_local_size(0) * get_local_size(1);\n",
+	"	size_t x = get_global_id(0), y = get_global_id(1);\n",
+	"	uint gx = (uint)(x - get_local_id(0)), gy = (uint)(y - get_local_id(1));\n",
+	"\n",
+	"	for(size_t i = lid; i < REGION_STAT_SLOTS; i += lsize){\n",
+	"		slot_label[i] = 0; slot_area[i] = 0;\n",
+	"		slot_x0[i] = UINT_MAX; slot_y0[i] = UINT_MAX; slot_x1[i] = 0; slot_y1[i] = 0;\n",
+	"		slot_sum_x[i] = 0; slot_sum_y[i] = 0;\n",
+	"	}\n",
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n",
+	"\n",
+	"	uint v = (uint)mask[y * width + x], lx = (uint)x - gx, ly = (uint)y - gy;\n",
+	"	if(v != 0){\n",
+	"		uint h = v * 0x9E3779B1u, probe = 0;\n",
+	"		for(; probe < REGION_STAT_SLOTS; probe++){\n",
+	"			uint slot = (h + probe) % REGION_STAT_SLOTS;\n",
+	"			uint old = atomic_cmpxchg(slot_label + slot, 0u, v);\n",
+	"			if(old != 0 && old != v) continue;\n",
+	"			atomic_inc(slot_area + slot);\n",
+	"			atomic_min(slot_x0 + slot, lx); atomic_min(slot_y0 + slot, ly);\n",
+	"			atomic_max(slot_x1 + slot, lx + 1); atomic_max(slot_y1 + slot, ly + 1);\n",
+	"			atomic_add(slot_sum_x + slot, lx); atomic_add(slot_sum_y + slot, ly);\n",
+	"			break;\n",
+	"		}\n",
+	"		if(probe == REGION_STAT_SLOTS){\n",
+	"			volatile __global uint* s = stats + (size_t)v * REGION_STAT_WORDS;\n",
+	"			atomic_inc(s);\n",
+	"			atomic_max(s + 1, ~(uint)x); atomic_max(s + 2, ~(uint)y);\n",
+	"			atomic_max(s + 3, (uint)x + 1); atomic_max(s + 4, (uint)y + 1);\n",
+	"			stat_add64(s + 5, x); stat_add64(s + 7, y);\n",
+	"		}\n",
+	"	}\n",
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n",
+	"\n",
+	"	for(size_t i = lid; i < REGION_STAT_SLOTS; i += lsize){\n",
+	"		uint r = slot_label[i], area = slot_area[i];\n",
+	"		if(r == 0) continue;\n",
+	"		volatile __global uint* s = stats + (size_t)r * REGION_STAT_WORDS;\n",
+	"		atomic_add(s, area);\n",
+	"		atomic_max(s + 1, ~(gx + slot_x0[i])); atomic_max(s + 2, ~(gy + slot_y0[i]));\n",
+	"		atomic_max(s + 3, gx + slot_x1[i]); atomic_max(s + 4, gy + slot_y1[i]);\n",
+	"		stat_add64(s + 5, slot_sum_x[i] + (ulong)area * gx);\n",
+	"		stat_add64(s + 7, slot_sum_y[i] + (ulong)area * gy);\n",
+	"	}\n",
+	"}\n",
+	"\n",
+	"// palette index of apply_colors: 0 - black, 1..6 - color_id 1..32\n",
+	"uchar palette_index(uchar color_id){\n",
+	"	if(color_id == 0 || color_id > 32 || (color_id & (color_id - 1))) return 0;\n",
+	"	return (uchar)(32 - clz((uint)color_id));\n",
+	"}\n",
+	"\n",
+	"// one work-item per byte of a padded indexed bmp row: one pixel at 8 bits,\n",
+	"// two at 4 bits (left pixel in the high nibble); padding bytes get 0\n",
+	"__kernel void color_indices(\n",
+	"	__global uchar* indices,\n",
+	"	__global mask_cell* mask,\n",
+	"	__global uchar* color,\n",
+	"	__const size_t width,\n",
+	"	__const size_t row_pitch,\n",
+	"	__const uint bits\n",
+	"){\n",
+	"	size_t x = get_global_id(0), y = get_global_id(1);\n",
+	"	__global mask_cell* row = mask + y * width;\n",
+	"	uchar value = 0;\n",
+	"\n",
+	"	if(bits == 8){\n",
+	"		if(x < width) value = palette_index(color[row[x]]);\n",
+	"	}\n",
+	"	else{\n",
+	"		size_t px = x << 1;\n",
+	"		if(px < width) value = palette_index(color[row[px]]) << 4;\n",
+	"		if(px + 1 < width) value |= palette_index(color[row[px + 1]]);\n",
+	"	}\n",
+	"	indices[y * row_pitch + x] = value;\n",
+	"}\n",
+	"\n",
+	"// one work-group per LABEL_TILE x LABEL_TILE tile: label equivalence runs\n",
+	"// in __local memory until the tile converges, then the tile root (its first\n",
+	"// pixel in raster order) becomes the global label of the whole component\n",
+	"__kernel void label_tiles(\n",
+	"	__const size_t width,\n",
+	"	__const size_t height,\n",
+	"	__global mask_cell* mask,\n",
+	"	__global gid_t* row,\n",
+	"	__global const border_word* border\n",
+	"){\n",
+	"	__local int label[LABEL_TILE * LABEL_TILE];\n",
+	"	__local int ref[LABEL_TILE * LABEL_TILE];\n",
+	"	__local int changed;\n",
+	"\n",
+	"	int lx = get_local_id(0), ly = get_local_id(1), lid = ly * LABEL_TILE + lx;\n",
+	"	size_t x = get_global_id(0), y = get_global_id(1), idx = y * width + x;\n",
+	"	bool inside = x < width && y < height; // padding items still reach every barrier\n",
+	"\n",
+	"	label[lid] = inside && !is_border(border, idx) ? lid : -1;\n",
+	"	ref[lid] = lid;\n",
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n",
+	"\n",
+	"	for(;;){\n",
+	"		if(lid == 0) changed = 0;\n",
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n",
+	"\n",
+	"		int l = label[lid];\n",
+	"		if(l >= 0){\n",
+	"			int m = l;\n",
+	"			if(lx > 0 && label[lid - 1] >= 0) m = min(m, label[lid - 1]);\n",
+	"			if(lx < LABEL_TILE - 1 && label[lid + 1] >= 0) m = min(m, label[lid + 1]);\n",
+	"			if(ly > 0 && label[lid - LABEL_TILE] >= 0) m = min(m, label[lid - LABEL_TILE]);\n",
+	"			if(ly < LABEL_TILE - 1 && label[lid + LABEL_TILE] >= 0) m = min(m, label[lid + LABEL_TILE]);\n",
+	"			if(m < l){\n",
+	"				atomic_min(ref + l, m);\n",
+	"				changed = 1;\n",
+	"			}\n",
+	"		}\n",
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n",
+	"		if(!changed) break;\n",
+	"\n",
+	"		if(l == lid){\n",
+	"			int r = ref[l];\n",
+	"			while(r != ref[r]) r = ref[r];\n",
+	"			ref[l] = r;\n",
+	"		}\n",
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n",
+	"		if(l >= 0) label[lid] = ref[l];\n",
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n",
+	"	}\n",
+	"\n",
+	"	if(!inside) return;\n",
+	"	int l = label[lid];\n",
+	"	mask_cell g = 0;\n",
+	"	if(l >= 0){\n",
+	"		size_t rx = get_group_id(0) * LABEL_TILE + l % LABEL_TILE,\n",
+	"			ry = get_group_id(1) * LABEL_TILE + l / LABEL_TILE;\n",
+	"		g = (mask_cell)(ry * width + rx + 1);\n",
+	"	}\n",
+	"	mask[idx] = g;\n",
+	"	row[idx + 1] = g;\n",
+	"}\n",
+	"\n",
+	"// one work-item per pixel pair across a tile seam: vertical seams first,\n",
+	"// then horizontal ones; only these pairs reach the global union-find\n",
+	"__kernel void merge_tile_seams(\n",
+	"	__const size_t width,\n",
+	"	__const size_t height,\n",
+	"	__global mask_cell* mask,\n",
+	"	__global gid_t* row\n",
+	"){\n",
+	"	size_t i = get_global_id(0), a = 0;\n",
+	"	size_t seams_x = (width + LABEL_TILE - 1) / LABEL_TILE - 1;\n",
+	"	size_t d = 1;\n",
+	"\n",
+	"	if(i < seams_x * height){\n",
+	"		size_t y = i / seams_x, x = (i % seams_x + 1) * LABEL_TILE;\n",
+	"		a = y * width + x - 1;\n",
+	"	}\n",
+	"	else{\n",
+	"		i -= seams_x * height;\n",
+	"		size_t y = (i / width + 1) * LABEL_TILE, x = i % width;\n",
+	"		a = (y - 1) * width + x;\n",
+	"		d = width;\n",
+	"	}\n",
+	"\n",
+	"	mask_cell la = mask[a], lb = mask[a + d];\n",
+	"	if(la == 0 || lb == 0 || la == lb) return;\n",
+	"	union_labels(row, la, lb);\n",
+	"}\n",
+	"\n",
+	"__kernel void resolve_labels(\n",
+	"	__global mask_cell* mask,\n",
+	"	__global gid_t* row\n",
+	"){\n",
+	"	size_t idx = get_global_id(0);\n",
+	"	mask_cell l = mask[idx];\n",
+	"	if(l != 0) mask[idx] = find_label_root(row, l);\n",
+	"}\n",
+};
+
+const size_t kernels_source_line_count = 759;
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stddef.h>
+
+// kernels.cl embedded into the executable (see tools/embed_kernels.c)
+extern const char* kernels_source_lines[];
+extern const size_t kernels_source_line_count;
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <stdio.h>
 
 #define check(COND, MSG, CODE) { if(COND) {\
@@ -15,4 +17,7 @@ printf("\n\t< %s (%d).\n", MSG, CODE); callres = EXIT_FAILURE; goto free_tempora
 }\
 }
 
-#define temp {goto free_temporary_resources;}
\ No newline at end of file
+#define temp {goto free_temporary_resources;}
+
+#define stringify(V) #V
+#define stringify_value(V) stringify(V)
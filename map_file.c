@@ -4,108 +4,164 @@ void bmp_map_init(struct bmp_map* f) {
 	memset(f, 0, sizeof(struct bmp_map));
 }
 
-int read_bytes(FILE* f, void* dst, size_t size, long offset) {
-	fseek(f, offset, SEEK_SET);
-	return fread(dst, sizeof(char), size, f);
+static void read_field(const struct host_file_map_t* m, void* dst, size_t size, size_t offset) {
+	memset(dst, 0, size);
+	if (offset + size <= m->size) memcpy(dst, m->data + offset, size);
 }
 
-int bmp_map_read_data(struct bmp_map* f, const char* name) {
-	f->file = fopen(name, "r");
-	check(f->file == NULL, "Cannot open source bmp file", MF_SOURCE_OPEN)
-
-		MF_WORD type = 0;
-	read_bytes(f->file, &type, sizeof(MF_WORD), MF_POS_Type);
+// header is parsed straight from the mapping
+int bmp_map_read_header(struct bmp_map* f, const struct host_file_map_t* m) {
+	MF_WORD type = 0;
+	read_field(m, &type, sizeof(MF_WORD), MF_POS_Type);
 	//if (type != 0x4d42) return MF_SOURCE_TYPE; // 'MB' signature
 	check(type != 0x4d42, "Source bmp file has wrong signature", MF_SOURCE_TYPE)
 
 		MF_DWORD data_offset = 0;
-	read_bytes(f->file, &data_offset, sizeof(MF_DWORD), MF_POS_OffBits);
+	read_field(m, &data_offset, sizeof(MF_DWORD), MF_POS_OffBits);
 	//if (data_offset == 0) return MF_SOURCE_OFFS;
-	check(data_offset == 0, "Wrong bmp file data offset", MF_SOURCE_OFFS)
+	check(data_offset == 0 || data_offset >= m->size, "Wrong bmp file data offset", MF_SOURCE_OFFS)
 
 		f->data_offset = data_offset;
 
-	MF_DWORD size = 0;
-	read_bytes(f->file, &size, sizeof(MF_DWORD), MF_POS_Size);
-	if (size != 0) {
-		f->linear_sequence_size = (size_t)(size - data_offset);
-	}
-
 	MF_LONG width = 0;
-	read_bytes(f->file, &width, sizeof(MF_LONG), MF_POS_Width);
+	read_field(m, &width, sizeof(MF_LONG), MF_POS_Width);
 
 	MF_LONG height = 0;
-	read_bytes(f->file, &height, sizeof(MF_LONG), MF_POS_Height);
+	read_field(m, &height, sizeof(MF_LONG), MF_POS_Height);
 
 	f->image_width = (size_t)width;
 	f->image_height = (size_t)height;
 
 	MF_WORD bitsperpix = 0;
-	read_bytes(f->file, &bitsperpix, sizeof(MF_WORD), MF_POS_BitsPerPixel);
+	read_field(m, &bitsperpix, sizeof(MF_WORD), MF_POS_BitsPerPixel);
 	//if (bitsperpix != 32) return MF_SOURCE_BPPI;
 	check(bitsperpix != 32, "32-bit bmp files only", MF_SOURCE_BPPI)
 
-		size_t row_pitch = width;
-	if (row_pitch % 4) row_pitch = (row_pitch / 4 + 1) * 4; // aligning
-
-	check(f->linear_sequence_size == 0, "Wrong data size in bmp file", 0)
+		// 32-bit rows need no padding
+		f->image_row_pitch = f->image_width * 4;
+	f->mask_size = f->image_height * f->image_width;
 
-		f->linear_sequence = (char*)calloc(f->linear_sequence_size, sizeof(char));
-	check(f->linear_sequence == NULL, "Cannot allocate memory for image data", 0)
-
-		f->mask_size = f->image_height * f->image_width;
-
-	if (f->linear_sequence_size != read_bytes(
-		f->file,
-		f->linear_sequence,
-		f->linear_sequence_size,
-		f->data_offset)
-		)
-		return MF_SOURCE_LSRE;
+	// bfSize is 32-bit and often left 0, so the mapping size decides
+	f->linear_sequence_size = m->size - f->data_offset;
+	check(f->mask_size == 0, "Wrong data size in bmp file", MF_SOURCE_LSRE)
+	check(f->linear_sequence_size < f->image_row_pitch * f->image_height,
+		"Bmp file is shorter than its pixel data", MF_SOURCE_LSRE)
 
 	return EXIT_SUCCESS;
 }
 
 void distruct_bmp_map(struct bmp_map* f) {
-	if (f->file) fclose(f->file);
-	if (f->output) fclose(f->output);
-	if (f->linear_sequence) free(f->linear_sequence);
+	host_unmap_file(&f->map);
+	bmp_map_init(f);
 }
 
-int open_bmp_output(struct bmp_map* f, const char* out) {
+int bmp_map_setup(struct bmp_map* f, const char* name, const char* out) {
+	struct host_file_map_t source;
+	bmp_map_init(f);
+
+	// validate the source before anything is written
+	check(host_map_file(name, 0, &source) != EXIT_SUCCESS, "Cannot open source bmp file", MF_SOURCE_OPEN)
+	int callres = bmp_map_read_header(f, &source);
+	host_unmap_file(&source);
+	if (callres != EXIT_SUCCESS) return EXIT_FAILURE;
 
-	f->output = fopen(out, "w+");
-	if (f->output == NULL) {
-		printf("Cannot open output file.\n");
+	check(host_copy_file(name, out) != EXIT_SUCCESS, "Cannot open output file", MF_SOURCE_OPEN)
+	if (host_map_file(out, 1, &f->map) != EXIT_SUCCESS) {
+		printf("Cannot map output file.\n");
+		return EXIT_FAILURE;
+	}
+	if (bmp_map_read_header(f, &f->map) != EXIT_SUCCESS) {
+		distruct_bmp_map(f);
 		return EXIT_FAILURE;
 	}
+
+	f->linear_sequence = (char*)f->map.data + f->data_offset;
 	return EXIT_SUCCESS;
 }
 
-int bmp_map_setup(struct bmp_map* f, const char* name, const char* out) {
+int bmp_map_open(struct bmp_map* f, const char* name, unsigned char writable) {
 	bmp_map_init(f);
-	
-	if (bmp_map_read_data(f, name) != EXIT_SUCCESS) {
+	check(host_map_file(name, writable, &f->map) != EXIT_SUCCESS, "Cannot open bmp file", MF_SOURCE_OPEN)
+	if (bmp_map_read_header(f, &f->map) != EXIT_SUCCESS) {
 		distruct_bmp_map(f);
 		return EXIT_FAILURE;
 	}
+	f->linear_sequence = (char*)f->map.data + f->data_offset;
+	return EXIT_SUCCESS;
+}
 
-	if(open_bmp_output(f, out) != EXIT_SUCCESS){
-		distruct_bmp_map(f);
-		return EXIT_FAILURE;
+int bmp_map_put_result(struct bmp_map* bmp) {
+	check(host_flush_file(&bmp->map) != EXIT_SUCCESS, "Cannot flush output file", EXIT_FAILURE)
+	return EXIT_SUCCESS;
+}
+
+size_t bmp_indexed_row_pitch(size_t width, unsigned bits) {
+	return ((width * bits + 31) / 32) * 4;
+}
+
+static void put_field(unsigned char* dst, size_t offset, uint32_t value, size_t size) {
+	memcpy(dst + offset, &value, size);
+}
+
+int bmp_indexed_create(struct bmp_indexed_t* f, const char* name, const struct bmp_map* source,
+	unsigned bits, const unsigned char (*palette)[4], size_t colors
+) {
+	unsigned char header[MF_FILE_HEADER_SIZE + MF_INFO_HEADER_SIZE];
+	MF_LONG width = 0, height = 0, xppm = 0, yppm = 0;
+
+	memset(f, 0, sizeof(struct bmp_indexed_t));
+	check(bits != 8 && bits != 4, "Indexed bmp files are 8 or 4-bit", MF_SOURCE_BPPI)
+	check(colors == 0 || colors > ((size_t)1 << bits), "Palette does not fit the index size", MF_SOURCE_BPPI)
+
+	// size and orientation come from the source header as they are
+	read_field(&source->map, &width, sizeof(MF_LONG), MF_POS_Width);
+	read_field(&source->map, &height, sizeof(MF_LONG), MF_POS_Height);
+	read_field(&source->map, &xppm, sizeof(MF_LONG), MF_POS_XPelsPerMeter);
+	read_field(&source->map, &yppm, sizeof(MF_LONG), MF_POS_YPelsPerMeter);
+
+	f->row_pitch = bmp_indexed_row_pitch(source->image_width, bits);
+	f->height = source->image_height;
+	size_t data_offset = sizeof(header) + colors * 4;
+	uint64_t file_size = data_offset + (uint64_t)f->row_pitch * f->height;
+
+	memset(header, 0, sizeof(header));
+	header[0] = 'B'; header[1] = 'M';
+	put_field(header, MF_POS_Size, file_size > UINT32_MAX ? 0 : (uint32_t)file_size, sizeof(MF_DWORD));
+	put_field(header, MF_POS_OffBits, (uint32_t)data_offset, sizeof(MF_DWORD));
+	put_field(header, MF_FILE_HEADER_SIZE, MF_INFO_HEADER_SIZE, sizeof(MF_DWORD));
+	put_field(header, MF_POS_Width, width, sizeof(MF_LONG));
+	put_field(header, MF_POS_Height, height, sizeof(MF_LONG));
+	put_field(header, MF_POS_BitsPerPixel - 2, 1, sizeof(MF_WORD)); // planes
+	put_field(header, MF_POS_BitsPerPixel, bits, sizeof(MF_WORD));
+	put_field(header, MF_POS_BitsPerPixel + 6, file_size > UINT32_MAX ? 0 : (uint32_t)(file_size - data_offset),
+		sizeof(MF_DWORD)); // image size
+	put_field(header, MF_POS_XPelsPerMeter, xppm, sizeof(MF_LONG));
+	put_field(header, MF_POS_YPelsPerMeter, yppm, sizeof(MF_LONG));
+	put_field(header, MF_POS_YPelsPerMeter + 4, (uint32_t)colors, sizeof(MF_DWORD)); // colors used
+	put_field(header, MF_POS_YPelsPerMeter + 8, (uint32_t)colors, sizeof(MF_DWORD)); // colors important
+
+	f->file = fopen(name, "wb");
+	check(f->file == NULL, "Cannot open output file", MF_SOURCE_OPEN)
+	if (fwrite(header, 1, sizeof(header), f->file) != sizeof(header) ||
+		fwrite(palette, 4, colors, f->file) != colors) {
+		fclose(f->file);
+		f->file = NULL;
+		check(1, "Cannot write indexed bmp header", MF_SOURCE_OPEN)
 	}
+	return EXIT_SUCCESS;
+}
 
+int bmp_indexed_write_rows(struct bmp_indexed_t* f, const void* rows, size_t count) {
+	check(f->rows_written + count > f->height, "Too many indexed bmp rows", MF_SOURCE_LSRE)
+	check(fwrite(rows, f->row_pitch, count, f->file) != count, "Cannot write indexed bmp rows", MF_SOURCE_LSRE)
+	f->rows_written += count;
 	return EXIT_SUCCESS;
 }
 
-int bmp_map_put_result(struct bmp_map* bmp) {
-	char* head_buffer = (char*)calloc(bmp->data_offset, sizeof(char));
-	if (head_buffer) {
-		rewind(bmp->file);
-		fread(head_buffer, sizeof(char), bmp->data_offset, bmp->file);
-		fwrite(head_buffer, sizeof(char), bmp->data_offset, bmp->output);
-		free(head_buffer);
-		fwrite(bmp->linear_sequence, sizeof(char), bmp->linear_sequence_size, bmp->output);
-	}
+int bmp_indexed_close(struct bmp_indexed_t* f) {
+	int complete = f->file && f->rows_written == f->height;
+	int closed = f->file && fclose(f->file) == 0;
+	f->file = NULL;
+	check(!complete || !closed, "Cannot complete indexed bmp file", MF_SOURCE_LSRE)
 	return EXIT_SUCCESS;
 }
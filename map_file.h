@@ -1,3 +1,5 @@
+#pragma once
+
 
 #ifdef _WIN32
 #define _CRT_SECURE_NO_WARNINGS
@@ -8,6 +10,7 @@
 #include <string.h>
 #include <stdint.h>
 #include "macros.h"
+#include "host_platform.h"
 
 #define MF_SUCCESS		EXIT_SUCCESS
 #define MF_SOURCE_OPEN	((int) 0x01)
@@ -27,11 +30,17 @@ typedef uint32_t	mask_cell;
 #define MF_POS_Width 0x12
 #define MF_POS_Height 0x16
 #define MF_POS_BitsPerPixel 0x1C
+#define MF_POS_XPelsPerMeter 0x26
+#define MF_POS_YPelsPerMeter 0x2A
+
+#define MF_FILE_HEADER_SIZE 14
+#define MF_INFO_HEADER_SIZE 40
 
 
+// the output file is a copy of the input mapped in place:
+// linear_sequence points into the mapping and results land in the file
 struct bmp_map {
-	FILE* file;
-	FILE* output;
+	struct host_file_map_t map;
 
 	char* row;
 
@@ -49,6 +58,24 @@ struct bmp_map {
 
 void bmp_map_init(struct bmp_map*);
 int bmp_map_setup(struct bmp_map*, const char*, const char*); // check callocs
-int bmp_map_put_result(struct bmp_map*);
+int bmp_map_put_result(struct bmp_map*); // flushes the mapping
+// maps an existing bmp as it is, writes land in the file itself
+int bmp_map_open(struct bmp_map*, const char*, unsigned char writable);
+
+void distruct_bmp_map(struct bmp_map*);
+
+// palettized output of the size and row order of a source bmp,
+// rows are appended in file order as they arrive
+struct bmp_indexed_t {
+	FILE* file;
+	size_t row_pitch; // padded to 4 bytes
+	size_t height;
+	size_t rows_written;
+};
 
-void distruct_bmp_map(struct bmp_map*);
\ No newline at end of file
+size_t bmp_indexed_row_pitch(size_t width, unsigned bits);
+// bits: 8 or 4, palette: BGR0 quads
+int bmp_indexed_create(struct bmp_indexed_t*, const char* name, const struct bmp_map* source,
+	unsigned bits, const unsigned char (*palette)[4], size_t colors);
+int bmp_indexed_write_rows(struct bmp_indexed_t*, const void* rows, size_t count);
+int bmp_indexed_close(struct bmp_indexed_t*); // fails unless every row was written
\ No newline at end of file
@@ -1,6 +1,47 @@
 #include "ocl_map_to_graph.h"
+#include "autotune.h"
+#include "tiled_map.h"
+
+int list_devices(cl_device_id** list, size_t* count) {
+	cl_platform_id* platforms = NULL;
+	cl_uint platform_count = 0;
+	int callres = EXIT_SUCCESS;
+	*list = NULL;
+	*count = 0;
+
+	check(clGetPlatformIDs(0, NULL, &platform_count) != CL_SUCCESS || platform_count == 0,
+		"No platforms detected", EXIT_FAILURE)
+	platforms = (cl_platform_id*)malloc(platform_count * sizeof(cl_platform_id));
+	check(platforms == NULL, "Cannot allocate platform list", EXIT_FAILURE)
+	check_goto_temp(clGetPlatformIDs(platform_count, platforms, NULL) != CL_SUCCESS,
+		"No platforms detected", EXIT_FAILURE)
+
+	for (cl_uint p = 0; p < platform_count; p++) {
+		cl_uint found_count = 0;
+		if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &found_count) != CL_SUCCESS ||
+			found_count == 0) continue;
+		cl_device_id* grown = (cl_device_id*)realloc(*list, (*count + found_count) * sizeof(cl_device_id));
+		check_goto_temp(grown == NULL, "Cannot allocate device list", EXIT_FAILURE)
+		*list = grown;
+		if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, found_count, *list + *count, NULL) == CL_SUCCESS)
+			*count += found_count;
+	}
+	check_goto_temp(*count == 0, "No devices detected", EXIT_FAILURE)
+
+free_temporary_resources:
+	free(platforms);
+	if (callres != EXIT_SUCCESS && *list) {
+		free(*list);
+		*list = NULL;
+		*count = 0;
+	}
+	return callres;
+}
 
 int setup_device (struct cl_data_t* cld) {
+	// the fastest device of the last autotune run, when it is still there
+	if (autotune_preferred_device(cld->options.program_cache_dir, &cld->device) == EXIT_SUCCESS)
+		return setup_queue(cld);
 
 	cl_platform_id platforms;
 	cl_uint num_platforms;
@@ -25,6 +66,13 @@ int setup_device (struct cl_data_t* cld) {
 	check(callres != CL_SUCCESS, "No devices detected", callres)
 	//printf("Detected: %d devices;\n", num_devices);
 
+	return setup_queue(cld);
+}
+
+// context and queue for cld->device
+int setup_queue(struct cl_data_t* cld) {
+	cl_int callres = CL_SUCCESS;
+
 	cld->context = clCreateContext(
 		NULL,
 		usedcount,
@@ -36,64 +84,323 @@ int setup_device (struct cl_data_t* cld) {
 	check(callres != CL_SUCCESS, "Cannot create context", callres)
 	//printf("Context created.\n");
 
+	// out-of-order where the device has it, cl_data_t::chain orders the commands;
+	// the events are read back when profiling, see profiler.h
+	cl_queue_properties queue_properties[] = {
+		CL_QUEUE_PROPERTIES,
+		CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE |
+			(cld->options.profiler || cld->queue_profiling ? CL_QUEUE_PROFILING_ENABLE : 0),
+		0
+	};
 	cld->command_queue = clCreateCommandQueueWithProperties(
 		cld->context, 
 		cld->device,
-		NULL,
+		queue_properties,
 		&callres
 	);
+	cld->out_of_order = callres == CL_SUCCESS;
+	if (!cld->out_of_order) {
+		queue_properties[1] &= ~(cl_queue_properties)CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+		cld->command_queue = clCreateCommandQueueWithProperties(
+			cld->context,
+			cld->device,
+			queue_properties,
+			&callres
+		);
+	}
 	check(callres != CL_SUCCESS, "Cannot create command queue", callres)
 	//printf("Created command queue.\n");
 
 	return EXIT_SUCCESS;
 }
 
-int setup_program (const char* kernel_file_name, struct cl_data_t* cld) {
+char* read_kernel_file(const char* kernel_file_name) {
 	char* kernel_source = NULL;
 	FILE* kernel_file = NULL;
-	size_t kernel_file_size = 0;
-	cl_int cl_callres = CL_SUCCESS;
+	long kernel_file_size = 0;
 
-	kernel_file = fopen(kernel_file_name, "r");
-	check(kernel_file == NULL, "Cannot open kernel file", EXIT_FAILURE)
+	kernel_file = fopen(kernel_file_name, "rb");
+	if (kernel_file == NULL) return NULL;
 
-	kernel_source = (char*)calloc(MAX_KERNEL_FILE_SIZE, sizeof(char));
-	check(kernel_source == NULL, "Cannot allocate memory for kernel code", EXIT_FAILURE)
+	fseek(kernel_file, 0, SEEK_END);
+	kernel_file_size = ftell(kernel_file);
+	rewind(kernel_file);
 
-	kernel_file_size = fread(kernel_source, sizeof(char), MAX_KERNEL_FILE_SIZE, kernel_file);
+	if (kernel_file_size > 0) kernel_source = (char*)calloc((size_t)kernel_file_size + 1, sizeof(char));
+	if (kernel_source) fread(kernel_source, sizeof(char), (size_t)kernel_file_size, kernel_file);
 
-	cld->program = clCreateProgramWithSource(
-		cld->context, //context,
-		usedcount,
-		&kernel_source,
-		&kernel_file_size,
-		&cl_callres
-	);
-	check(cl_callres != CL_SUCCESS, "Cannot create program", cl_callres)
-	//printf("Created program.\n");
+	fclose(kernel_file);
+	return kernel_source;
+}
 
-	cl_callres = clBuildProgram(
-		cld->program, //program,
-		usedcount,
-		&cld->device, //&device,
-		NULL,
-		NULL,
-		NULL
+int setup_program (const char* kernel_file_name, struct cl_data_t* cld) {
+	char* kernel_source = NULL;
+	const char** sources = kernels_source_lines;
+	size_t source_count = kernels_source_line_count;
+	int callres = EXIT_SUCCESS;
+
+	// an explicit kernel file overrides the embedded source (kernel development)
+	if (kernel_file_name) {
+		kernel_source = read_kernel_file(kernel_file_name);
+		check(kernel_source == NULL, "Cannot read kernel file", EXIT_FAILURE)
+		sources = (const char**)&kernel_source;
+		source_count = 1;
+	}
+
+	callres = program_cache_build(
+		cld->context,
+		cld->device,
+		sources,
+		source_count,
+		KERNEL_BUILD_OPTIONS,
+		cld->options.program_cache ? cld->options.program_cache_dir : NULL,
+		&cld->program
 	);
-	check(cl_callres != CL_SUCCESS, "Cannot build program", cl_callres)
-	//printf("Builded program.\n");
-	
+
+	if (kernel_source) free(kernel_source);
+	return callres;
+}
+
+#define create_kernel(NAME) {\
+	cld->kernels.NAME = clCreateKernel(cld->program, #NAME, &cl_callres);\
+	check(cl_callres != CL_SUCCESS, "Cannot create " #NAME " kernel", cl_callres)\
+}
+
+int setup_kernels(struct cl_data_t* cld) {
+	cl_int cl_callres = CL_SUCCESS;
+
+	create_kernel(pack_border)
+	create_kernel(set_gid_row)
+	create_kernel(premask_area)
+	create_kernel(normalise_mask_area)
+	create_kernel(apply_parent_gid)
+	create_kernel(normalise_gid)
+	create_kernel(fix_gid)
+	create_kernel(finalize_mask)
+	create_kernel(init_labels)
+	create_kernel(scan_labels)
+	create_kernel(analyse_labels)
+	create_kernel(relabel_mask)
+	create_kernel(count_label_roots)
+	create_kernel(scan_label_blocks)
+	create_kernel(number_label_roots)
+	create_kernel(label_tiles)
+	create_kernel(merge_tile_seams)
+	create_kernel(resolve_labels)
+	create_kernel(build_edges)
+	create_kernel(debug_output)
+	create_kernel(apply_colors)
+	create_kernel(color_indices)
+	create_kernel(gather_edge_walks)
+	create_kernel(region_stats)
+
 	return EXIT_SUCCESS;
 }
 
-int setup_shared_buffers(struct cl_data_t* cld, struct bmp_map* bmp) {
+void release_kernels(struct cl_data_t* cld) {
+	cl_kernel* k = (cl_kernel*)&cld->kernels;
+	for (size_t i = 0; i < sizeof(struct cl_kernels_t) / sizeof(cl_kernel); i++) {
+		if (k[i]) clReleaseKernel(k[i]);
+		k[i] = NULL;
+	}
+}
+
+void release_mem_object(cl_mem* m) {
+	if (*m) clReleaseMemObject(*m);
+	*m = NULL;
+}
+
+void release_event(cl_event* e) {
+	if (*e) clReleaseEvent(*e);
+	*e = NULL;
+}
+
+// four classes per power of two, a buffer is at most a quarter larger than asked
+static size_t cl_size_class(size_t size) {
+	if (size <= CL_POOL_MIN_CLASS) return CL_POOL_MIN_CLASS;
+	size_t low = CL_POOL_MIN_CLASS; // low < size <= 2 * low
+	while (2 * low < size) low <<= 1;
+	size_t step = low / 4;
+	return (size + step - 1) / step * step;
+}
+
+// the smallest pooled buffer that fits, no more than twice the size
+static cl_mem cl_pool_take(struct cl_pool_t* pool, cl_mem_flags flags, size_t size, size_t* pooled_size) {
+	size_t best = pool->count;
+	for (size_t i = 0; i < pool->count; i++) {
+		if (pool->flags[i] != flags || pool->size[i] < size || pool->size[i] / 2 > size) continue;
+		if (best == pool->count || pool->size[i] < pool->size[best]) best = i;
+	}
+	if (best == pool->count) return NULL;
+
+	cl_mem buffer = pool->buffer[best];
+	*pooled_size = pool->size[best];
+	pool->count--;
+	pool->buffer[best] = pool->buffer[pool->count];
+	pool->size[best] = pool->size[pool->count];
+	pool->flags[best] = pool->flags[pool->count];
+	return buffer;
+}
+
+// a full pool drops its smallest buffer
+static void cl_pool_put(struct cl_pool_t* pool, cl_mem buffer, cl_mem_flags flags, size_t size) {
+	if (pool->count == CL_POOL_SIZE) {
+		size_t smallest = 0;
+		for (size_t i = 1; i < pool->count; i++)
+			if (pool->size[i] < pool->size[smallest]) smallest = i;
+		if (size <= pool->size[smallest]) {
+			clReleaseMemObject(buffer);
+			return;
+		}
+		clReleaseMemObject(pool->buffer[smallest]);
+		pool->count--;
+		pool->buffer[smallest] = pool->buffer[pool->count];
+		pool->size[smallest] = pool->size[pool->count];
+		pool->flags[smallest] = pool->flags[pool->count];
+	}
+	pool->buffer[pool->count] = buffer;
+	pool->size[pool->count] = size;
+	pool->flags[pool->count] = flags;
+	pool->count++;
+}
+
+static void release_pool(struct cl_pool_t* pool) {
+	for (size_t i = 0; i < pool->count; i++) clReleaseMemObject(pool->buffer[i]);
+	memset(pool, 0, sizeof(struct cl_pool_t));
+}
+
+// Grow-only slot: a buffer of count elements or more, capacity counts them.
+// Every command is chained, so the outgrown buffer can serve another slot
+// right away. Returns the clCreateBuffer error.
+static cl_int cl_reserve_buffer(struct cl_data_t* cld, cl_mem* buffer, size_t* capacity,
+	size_t count, size_t element_size, cl_mem_flags flags
+) {
+	cl_int cl_callres = CL_SUCCESS;
+	size_t size = 0;
+	if (*buffer && count <= *capacity) return CL_SUCCESS;
+
+	cl_mem grown = cl_pool_take(&cld->pool, flags, count * element_size, &size);
+	if (grown == NULL) {
+		size = cl_size_class(count * element_size);
+		grown = clCreateBuffer(cld->context, flags, size, NULL, &cl_callres);
+		if (cl_callres != CL_SUCCESS) return cl_callres;
+	}
+	if (*buffer) cl_pool_put(&cld->pool, *buffer, flags, *capacity * element_size);
+	*buffer = grown;
+	*capacity = size / element_size;
+	return CL_SUCCESS;
+}
+
+// wait list of a chained command: the tail
+#define cl_chain_wait(cld) (cl_uint)((cld)->chain != NULL), ((cld)->chain ? &(cld)->chain : NULL)
+
+static void cl_chain_set(struct cl_data_t* cld, cl_event event) {
+	release_event(&cld->chain);
+	cld->chain = event;
+}
+
+// an enqueued command becomes the tail
+static cl_int cl_chain_push(struct cl_data_t* cld, cl_int cl_callres, cl_event event, const char* name) {
+	if (cl_callres != CL_SUCCESS) return cl_callres;
+	profiler_add_event(cld->options.profiler, name, event);
+	cl_chain_set(cld, event);
+	return CL_SUCCESS;
+}
+
+static cl_int cl_chain_push_kernel(struct cl_data_t* cld, cl_int cl_callres, cl_event event, cl_kernel kernel) {
+	if (cl_callres != CL_SUCCESS) return cl_callres;
+	profiler_add_kernel_event(cld->options.profiler, kernel, event);
+	cl_chain_set(cld, event);
+	return CL_SUCCESS;
+}
+
+// a side command keeps its event in *branch, the tail stays
+static cl_int cl_branch_push(struct cl_data_t* cld, cl_int cl_callres, cl_event event, const char* name,
+	cl_event* branch
+) {
+	if (cl_callres != CL_SUCCESS) return cl_callres;
+	profiler_add_event(cld->options.profiler, name, event);
+	release_event(branch);
+	*branch = event;
+	return CL_SUCCESS;
+}
+
+// the tail becomes a marker after both the tail and the branch
+static cl_int cl_chain_join(struct cl_data_t* cld, cl_event* branch) {
+	cl_event events[2], marker = NULL;
+	cl_uint count = 0;
+	if (*branch == NULL) return CL_SUCCESS;
+	if (cld->chain) events[count++] = cld->chain;
+	events[count++] = *branch;
+	cl_int cl_callres = clEnqueueMarkerWithWaitList(cld->command_queue, count, events, &marker);
+	if (cl_callres != CL_SUCCESS) return cl_callres;
+	release_event(branch);
+	cl_chain_set(cld, marker);
+	return CL_SUCCESS;
+}
+
+static cl_int cl_branch_wait(cl_event* branch) {
+	if (*branch == NULL) return CL_SUCCESS;
+	cl_int cl_callres = clWaitForEvents(1, branch);
+	release_event(branch);
+	return cl_callres;
+}
+
+// after clFinish nothing is pending
+static void cl_chain_reset(struct cl_data_t* cld) {
+	release_event(&cld->chain);
+	release_event(&cld->label_total_ready);
+	release_event(&cld->edge_state_ready);
+}
+
+static size_t cl_kernel_index(struct cl_data_t* cld, cl_kernel kernel) {
+	cl_kernel* k = (cl_kernel*)&cld->kernels;
+	size_t i = 0;
+	while (i < KERNEL_COUNT && k[i] != kernel) i++;
+	return i;
+}
+
+static cl_int cl_launch_part(struct cl_data_t* cld, cl_kernel kernel, cl_uint dims,
+	const size_t* offset, const size_t* size, const size_t* local
+) {
+	cl_event event = NULL;
+	if (size[0] == 0 || (dims > 1 && size[1] == 0)) return CL_SUCCESS;
+	cl_int cl_callres = clEnqueueNDRangeKernel(cld->command_queue, kernel, dims, offset, size, local,
+		cl_chain_wait(cld), &event);
+	return cl_chain_push_kernel(cld, cl_callres, event, kernel);
+}
+
+// A chained launch with the kernel's tuned work-group shape. The kernels have
+// no bounds checks, so the groups cover only what divides evenly and the
+// remainder strips run as offset launches with the driver's choice.
+static cl_int cl_launch(struct cl_data_t* cld, cl_kernel kernel, cl_uint dims, const size_t* global) {
+	size_t index = cl_kernel_index(cld, kernel);
+	const size_t* local = NULL;
+	size_t height = dims > 1 ? global[1] : 1;
+	size_t body[2] = { global[0], height };
 	cl_int cl_callres = CL_SUCCESS;
 
+	if (index < KERNEL_COUNT) {
+		cld->launch_dims[index] = dims;
+		if (cld->launch_local[index][0]) local = cld->launch_local[index];
+	}
+	if (local == NULL) return cl_launch_part(cld, kernel, dims, NULL, global, NULL);
+
+	for (cl_uint d = 0; d < dims; d++) body[d] -= body[d] % local[d];
+	cl_callres = cl_launch_part(cld, kernel, dims, NULL, body, local);
+	cl_callres |= cl_launch_part(cld, kernel, dims, (size_t[2]) { body[0], 0 },
+		(size_t[2]) { global[0] - body[0], height }, NULL);
+	if (dims > 1) cl_callres |= cl_launch_part(cld, kernel, dims, (size_t[2]) { 0, body[1] },
+		(size_t[2]) { body[0], height - body[1] }, NULL);
+	return cl_callres;
+}
+
+static int setup_host_ptr_image(struct cl_data_t* cld, struct bmp_map* bmp) {
+	cl_int cl_callres = CL_SUCCESS;
 	cl_image_format map_format = {
 		CL_RGBA,
 		CL_UNSIGNED_INT8
 	};
-
 	cl_image_desc map_desc = {
 		CL_MEM_OBJECT_IMAGE2D,
 		bmp->image_width,
@@ -107,31 +414,109 @@ int setup_shared_buffers(struct cl_data_t* cld, struct bmp_map* bmp) {
 		NULL // buffer for 1D
 	};
 
-	cld->cl_image_map = clCreateImage(
+	// indexed output leaves the source mapped read-only
+	cl_mem image = clCreateImage(
 		cld->context,
-		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+		(cld->options.indexed_bits ? CL_MEM_READ_ONLY : CL_MEM_READ_WRITE) | CL_MEM_USE_HOST_PTR,
 		&map_format,
 		&map_desc,
 		bmp->linear_sequence,
 		&cl_callres
 	);
-	check(cl_callres != CL_SUCCESS, "Cannot create image", cl_callres)
-	//printf("Created image buffer.\n");
+	if (cl_callres != CL_SUCCESS) return EXIT_FAILURE;
+
+	release_mem_object(&cld->cl_image_map);
+	cld->cl_image_map = image;
+	cld->image_capacity_width = 0;
+	cld->image_capacity_height = 0;
+	cld->image_uses_host_ptr = 1;
+	return EXIT_SUCCESS;
+}
 
-	cld->mask_row = (mask_cell*)calloc(bmp->mask_size, sizeof(mask_cell));
-	check(cld->mask_row == NULL, "Cannot allocate memory for mask", EXIT_FAILURE)
+int setup_shared_buffers(struct cl_data_t* cld, struct bmp_map* bmp) {
+	cl_int cl_callres = CL_SUCCESS;
+	cl_event event = NULL, mask_cleared = NULL;
+
+	// zero-copy: the device works on the mapped output file directly,
+	// drivers that refuse the host pointer get a private image and a copy
+	if (cld->private_image || setup_host_ptr_image(cld, bmp) != EXIT_SUCCESS) {
+		cld->image_uses_host_ptr = 0;
+
+		if (bmp->image_width > cld->image_capacity_width ||
+			bmp->image_height > cld->image_capacity_height
+		) {
+			cl_image_format map_format = {
+				CL_RGBA,
+				CL_UNSIGNED_INT8
+			};
+
+			if (bmp->image_width > cld->image_capacity_width)
+				cld->image_capacity_width = bmp->image_width;
+			if (bmp->image_height > cld->image_capacity_height)
+				cld->image_capacity_height = bmp->image_height;
+
+			cl_image_desc map_desc = {
+				CL_MEM_OBJECT_IMAGE2D,
+				cld->image_capacity_width,
+				cld->image_capacity_height,
+				1, // depth
+				1, // images array size
+				0, // row pitch
+				0, // slice
+				0, // mip level?
+				0, // samples??
+				NULL // buffer for 1D
+			};
+
+			release_mem_object(&cld->cl_image_map);
+			cld->cl_image_map = clCreateImage(
+				cld->context,
+				CL_MEM_READ_WRITE,
+				&map_format,
+				&map_desc,
+				NULL,
+				&cl_callres
+			);
+			check(cl_callres != CL_SUCCESS, "Cannot create image", cl_callres)
+		}
+
+		cl_callres = clEnqueueWriteImage(
+			cld->command_queue,
+			cld->cl_image_map,
+			CL_FALSE,
+			(size_t[3]) { 0, 0, 0 },
+			(size_t[3]) { bmp->image_width, bmp->image_height, 1 },
+			bmp->image_row_pitch, 0,
+			bmp->linear_sequence, cl_chain_wait(cld), &event
+		);
+		cl_callres = cl_chain_push(cld, cl_callres, event, "write image");
+		check(cl_callres != CL_SUCCESS, "Cannot write image", cl_callres)
+	}
 
-	//printf("Allocated mask row.\n");
+	if (bmp->mask_size > cld->mask_capacity) {
+		cl_callres = cl_reserve_buffer(cld, &cld->cl_buffer_mask, &cld->mask_capacity,
+			bmp->mask_size, sizeof(mask_cell), CL_MEM_READ_WRITE);
+		check(cl_callres != CL_SUCCESS, "Cannot create mask buffer", cl_callres)
 
-	cld->cl_buffer_mask = clCreateBuffer(
-		cld->context,
-		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-		bmp->mask_size * sizeof(mask_cell),
-		cld->mask_row,
-		&cl_callres
+		// the host labels grow with the device ones
+		if (cld->mask_row) free(cld->mask_row);
+		cld->mask_row = (mask_cell*)calloc(cld->mask_capacity, sizeof(mask_cell));
+		check(cld->mask_row == NULL, "Cannot allocate memory for mask", EXIT_FAILURE)
+	}
+
+	// runs beside the image upload
+	mask_cell zero = 0;
+	cl_callres = clEnqueueFillBuffer(
+		cld->command_queue,
+		cld->cl_buffer_mask,
+		&zero, sizeof(mask_cell),
+		0, bmp->mask_size * sizeof(mask_cell),
+		0, NULL, &event
 	);
-	check(cl_callres != CL_SUCCESS, "Cannot create mask buffer", cl_callres)
-	//printf("Created mask buffer.\n");
+	cl_callres = cl_branch_push(cld, cl_callres, event, "fill mask", &mask_cleared);
+	cl_callres |= cl_chain_join(cld, &mask_cleared);
+	release_event(&mask_cleared);
+	check(cl_callres != CL_SUCCESS, "Cannot clear mask buffer", cl_callres)
 
 	return EXIT_SUCCESS;
 }
@@ -141,21 +526,47 @@ void init_setup_environment(struct cl_data_t* cld) {
 }
 
 void distruct_environment(struct cl_data_t* cld, struct bmp_map* bmp) {
-	distruct_bmp_map(bmp);
-	if (cld->device) clReleaseDevice(cld->device);
-	if (cld->context) clReleaseContext(cld->context);
-	//if (cld->command_queue) clReleaseCommandQueue(cld->command_queue);
+	if (cld->command_queue) clFinish(cld->command_queue);
+	cl_chain_reset(cld);
+	// the image may wrap the bmp mapping, so it goes first
+	release_mem_object(&cld->cl_image_map);
+	if (bmp) distruct_bmp_map(bmp);
+	release_kernels(cld);
+	release_mem_object(&cld->cl_buffer_mask);
+	release_mem_object(&cld->cl_buffer_border);
+	release_mem_object(&cld->cl_buffer_gid_row_index);
+	release_mem_object(&cld->cl_buffer_gid_row);
+	release_mem_object(&cld->cl_buffer_label_changed);
+	release_mem_object(&cld->cl_buffer_label_blocks);
+	release_mem_object(&cld->cl_buffer_label_total);
+	release_mem_object(&cld->cl_buffer_vertex_color);
+	release_mem_object(&cld->cl_buffer_edges);
+	release_mem_object(&cld->cl_buffer_edge_table);
+	release_mem_object(&cld->cl_buffer_edge_count);
+	release_mem_object(&cld->cl_buffer_indices);
+	release_mem_object(&cld->cl_buffer_slot_walks);
+	release_mem_object(&cld->cl_buffer_edge_walks);
+	release_mem_object(&cld->cl_buffer_region_stats);
+	release_pool(&cld->pool);
 	if (cld->program) clReleaseProgram(cld->program);
-	if (cld->cl_image_map) clReleaseMemObject(cld->cl_image_map);
-	if (cld->cl_buffer_mask) clReleaseMemObject(cld->cl_buffer_mask);
-	if (cld->cl_buffer_gid_row_index)clReleaseMemObject(cld->cl_buffer_gid_row_index);
-	if (cld->cl_buffer_gid_row) clReleaseMemObject(cld->cl_buffer_gid_row);
-	//if (cld->mask_row) free(cld->mask_row);
+	if (cld->command_queue) clReleaseCommandQueue(cld->command_queue);
+	if (cld->context) clReleaseContext(cld->context);
+	if (cld->device) clReleaseDevice(cld->device);
+	if (cld->mask_row) free(cld->mask_row);
+	distruct_host_arena(&cld->arena);
+
+	// safe to call again after a failed stage
+	struct map_options_t options = cld->options;
+	init_setup_environment(cld);
+	cld->options = options;
 }
 
-int setup_environment(const char* kernel_file_name, struct cl_data_t* cld, struct bmp_map* bmp) {
-	int callres = EXIT_SUCCESS;
+int setup_environment(const char* kernel_file_name, struct cl_data_t* cld, struct bmp_map* bmp,
+	const struct map_options_t* options
+) {
 	init_setup_environment(cld);
+	if (options) cld->options = *options;
+	host_arena_init(&cld->arena, cld->options.huge_pages);
 	// choose device
 	if (setup_device(cld) != EXIT_SUCCESS) {
 		distruct_environment(cld, bmp);
@@ -163,13 +574,15 @@ int setup_environment(const char* kernel_file_name, struct cl_data_t* cld, struc
 	}
 
 	// create and build program
-	if (setup_program(kernel_file_name, cld) != EXIT_SUCCESS) {
+	if (setup_program(kernel_file_name, cld) != EXIT_SUCCESS ||
+		setup_kernels(cld) != EXIT_SUCCESS) {
 		distruct_environment(cld, bmp);
 		return EXIT_FAILURE;
 	}
+	autotune_load(cld);
 
-	// create buffers
-	if (setup_shared_buffers(cld, bmp) != EXIT_SUCCESS) {
+	// create buffers, batch mode does it per map
+	if (bmp && setup_shared_buffers(cld, bmp) != EXIT_SUCCESS) {
 		distruct_environment(cld, bmp);
 		return EXIT_FAILURE;
 	}
@@ -177,92 +590,115 @@ int setup_environment(const char* kernel_file_name, struct cl_data_t* cld, struc
 	return EXIT_SUCCESS;
 }
 
-int cl_mask_border(struct cl_data_t* cld, struct bmp_map* bmp) {
+int setup_environment_on_device(const char* kernel_file_name, struct cl_data_t* cld, cl_device_id device,
+	const struct map_options_t* options
+) {
+	init_setup_environment(cld);
+	if (options) cld->options = *options;
+	host_arena_init(&cld->arena, cld->options.huge_pages);
+	// the band split times every device's labeling from its events
+	cld->queue_profiling = 1;
+
+	clRetainDevice(device);
+	cld->device = device;
+	if (setup_queue(cld) != EXIT_SUCCESS ||
+		setup_program(kernel_file_name, cld) != EXIT_SUCCESS ||
+		setup_kernels(cld) != EXIT_SUCCESS) {
+		distruct_environment(cld, NULL);
+		return EXIT_FAILURE;
+	}
+	autotune_load(cld);
+	return EXIT_SUCCESS;
+}
+
+int cl_pack_border(struct cl_data_t* cld, struct bmp_map* bmp) {
 	cl_int cl_callres = CL_SUCCESS;
-	cl_kernel mask_border = NULL;
+	cl_kernel pack_border = cld->kernels.pack_border;
 	int callres = EXIT_SUCCESS;
-
-	mask_border = clCreateKernel(cld->program, "mask_border", &cl_callres);
-	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot create mask_border kernel", cl_callres)
-
-	cl_callres |= clSetKernelArg(mask_border, 0, sizeof(cl_mem), (void*)&cld->cl_image_map);
-	cl_callres |= clSetKernelArg(mask_border, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
-	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot set mask_border kernel args", cl_callres)
-
-	cl_callres = clEnqueueNDRangeKernel(
-		cld->command_queue,//command_queue,
-		mask_border,
-		2, NULL, // offset
-		(size_t[2]) { bmp->image_width, bmp->image_height }, //g size
-		NULL, 0, NULL, NULL);
-	check_goto_temp(cl_callres != CL_SUCCESS, "Kernel mask_border execution error", cl_callres)
-	clFinish(cld->command_queue);
+	size_t word_count = (bmp->mask_size + 31) / 32;
+	struct border_test_t test;
+	border_predicate_test(&cld->options.border, &test);
+
+	cl_callres = cl_reserve_buffer(cld, &cld->cl_buffer_border, &cld->border_capacity,
+		word_count, sizeof(cl_uint), CL_MEM_READ_WRITE);
+	check(cl_callres != CL_SUCCESS, "Cannot create border buffer", cl_callres)
+
+	cl_callres |= clSetKernelArg(pack_border, 0, sizeof(cl_mem), (void*)&cld->cl_image_map);
+	cl_callres |= clSetKernelArg(pack_border, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_border);
+	cl_callres |= clSetKernelArg(pack_border, 2, sizeof(size_t), (void*)&bmp->image_width);
+	cl_callres |= clSetKernelArg(pack_border, 3, sizeof(size_t), (void*)&bmp->mask_size);
+	cl_callres |= clSetKernelArg(pack_border, 4, sizeof(cl_uint), (void*)&test.distance);
+	cl_callres |= clSetKernelArg(pack_border, 5, sizeof(test.weight), (void*)test.weight);
+	cl_callres |= clSetKernelArg(pack_border, 6, sizeof(test.ref), (void*)test.ref);
+	cl_callres |= clSetKernelArg(pack_border, 7, sizeof(cl_int), (void*)&test.limit);
+	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot set pack_border kernel args", cl_callres)
+
+	cl_callres = cl_launch(cld, pack_border, 1, &word_count);
+	check_goto_temp(cl_callres != CL_SUCCESS, "Kernel pack_border execution error", cl_callres)
 free_temporary_resources:
-	if (mask_border) clReleaseKernel(mask_border);
-
 	return callres;
 }
 
 int cl_premask_area(struct cl_data_t* cld, struct bmp_map* bmp, size_t spread_timeout) {
 	int callres = EXIT_SUCCESS;
 	cl_int cl_callres = CL_SUCCESS;
-	cl_kernel premask_area = NULL;
-
-	premask_area = clCreateKernel( cld->program, "premask_area", &cl_callres );
-	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot create premask_area kernel", cl_callres)
+	cl_kernel premask_area = cld->kernels.premask_area;
 
 	cl_callres |= clSetKernelArg(premask_area, 0, sizeof(size_t), (void*)&bmp->image_width);
 	cl_callres |= clSetKernelArg(premask_area, 1, sizeof(size_t), (void*)&bmp->image_height);
 	cl_callres |= clSetKernelArg(premask_area, 2, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
-	cl_callres |= clSetKernelArg(premask_area, 3, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row_index);
-	cl_callres |= clSetKernelArg(premask_area, 4, sizeof(size_t), (void*)&spread_timeout);
+	cl_callres |= clSetKernelArg(premask_area, 3, sizeof(cl_mem), (void*)&cld->cl_buffer_border);
+	cl_callres |= clSetKernelArg(premask_area, 4, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row_index);
+	cl_callres |= clSetKernelArg(premask_area, 5, sizeof(size_t), (void*)&spread_timeout);
 	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot set premask_area kernel args", cl_callres)
 
-	cl_callres = clEnqueueNDRangeKernel(
-		cld->command_queue,
-		premask_area,
-		1, // dims
-		NULL, // offset
-		&bmp->mask_size, //g size
-		NULL, // l size
-		0, // num events
-		NULL,
-		NULL
-	);
+	cl_callres = cl_launch(cld, premask_area, 1, &bmp->mask_size);
 	check_goto_temp(cl_callres != CL_SUCCESS, "Kernel premask_area execution error", cl_callres)
-	clFinish(cld->command_queue);
 
 free_temporary_resources:
-	if (premask_area) clReleaseKernel(premask_area);
 	return callres;
 }
 
 int init_gid_row_index(struct cl_data_t* cld, struct gid_row_t* r) {
 	cl_int cl_callres = CL_SUCCESS;
+	cl_event event = NULL;
 	r->gid_row_size = 0;
 	r->gid_row = NULL;
-	r->gid_row_index = (size_t*)calloc(1, sizeof(size_t));
+	r->gid_row_index = (size_t*)host_arena_calloc(&cld->arena, 1, sizeof(size_t));
 	check(r->gid_row_index == NULL, "Cannot allocate memory for gid row index", EXIT_FAILURE)
 
 	* (r->gid_row_index) = gid_reserved;
 
-	cld->cl_buffer_gid_row_index = clCreateBuffer(
-		cld->context,
-		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-		sizeof(gid_t),
+	if (cld->cl_buffer_gid_row_index == NULL) {
+		cld->cl_buffer_gid_row_index = clCreateBuffer(
+			cld->context,
+			CL_MEM_READ_WRITE,
+			sizeof(size_t),
+			NULL,
+			&cl_callres
+		);
+		check(cl_callres != CL_SUCCESS, "Cannot create gid_row_index buffer", cl_callres)
+	}
+
+	cl_callres = clEnqueueWriteBuffer(
+		cld->command_queue,
+		cld->cl_buffer_gid_row_index,
+		CL_TRUE, 0,
+		sizeof(size_t),
 		r->gid_row_index,
-		&cl_callres
+		cl_chain_wait(cld), &event
 	);
-	check(cl_callres != CL_SUCCESS, "Cannot create gid_row_index buffer", cl_callres)
-	
-	clFinish(cld->command_queue);
+	cl_callres = cl_chain_push(cld, cl_callres, event, "write gid_row_index");
+	check(cl_callres != CL_SUCCESS, "Cannot write to cl_buffer_gid_row_index buffer", cl_callres)
+
 	return EXIT_SUCCESS;
 }
 
 int cl_set_gid_row(struct cl_data_t* cld, struct gid_row_t* r) {
 	cl_int cl_callres = CL_SUCCESS;
+	cl_event event = NULL;
 	int callres = EXIT_SUCCESS;
-	cl_kernel set_gid_row = NULL;
+	cl_kernel set_gid_row = cld->kernels.set_gid_row;
 
 	cl_callres = clEnqueueReadBuffer(
 		cld->command_queue, //command_queue
@@ -271,49 +707,30 @@ int cl_set_gid_row(struct cl_data_t* cld, struct gid_row_t* r) {
 		0,
 		sizeof(size_t),
 		r->gid_row_index,
-		0,
-		NULL,
-		NULL
+		cl_chain_wait(cld),
+		&event
 	);
+	cl_callres = cl_chain_push(cld, cl_callres, event, "read gid_row_index");
 	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot read cl_buffer_gid_row_index buffer", cl_callres)
 
 	r->gid_row_size = *(r->gid_row_index);
 	//printf("Note: gid_row_size: %u;\n", r->gid_row_size);
-	callres = graph_init_grid_row(r);
+	callres = graph_init_grid_row(r, &cld->arena);
 	check_goto_temp(callres == EXIT_FAILURE, "Cannot init gid row", EXIT_FAILURE);
 
-	cld->cl_buffer_gid_row = clCreateBuffer(
-		cld->context,
-		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-		r->gid_row_size * sizeof(gid_t),
-		r->gid_row,
-		&cl_callres
-	);
+	// set_gid_row initializes every entry, no need to copy the host row
+	cl_callres = cl_reserve_buffer(cld, &cld->cl_buffer_gid_row, &cld->gid_row_capacity,
+		r->gid_row_size, sizeof(gid_t), CL_MEM_READ_WRITE);
 	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot create buffer for gid_row", cl_callres)
 
-	set_gid_row = clCreateKernel(cld->program, "set_gid_row", &cl_callres);
-	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot create set_gid_row kernel", cl_callres)
-
 	cl_callres |= clSetKernelArg(set_gid_row, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
 	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot set set_gid_row kernel args", cl_callres)
 	
 
-	cl_callres = clEnqueueNDRangeKernel(
-		cld->command_queue,//command_queue,
-		set_gid_row,
-		1, // dims
-		NULL, // offset
-		&r->gid_row_size, //g size
-		NULL, // l size
-		0, // num events
-		NULL,
-		NULL
-	);
+	cl_callres = cl_launch(cld, set_gid_row, 1, &r->gid_row_size);
 	check_goto_temp(cl_callres != CL_SUCCESS, "Kernel set_gid_row execution error", cl_callres)
-	clFinish(cld->command_queue);
 
 free_temporary_resources:
-	if (set_gid_row) clReleaseKernel(set_gid_row);
 	return callres;
 }
 
@@ -322,95 +739,39 @@ int cl_normalise_mask_area(struct cl_data_t* cld, struct bmp_map* bmp) {
 	int callres = EXIT_SUCCESS;
 	size_t normalize_size = bmp->image_width + bmp->image_height;
 
-	cl_kernel normalise_mask_area = NULL;
-	cl_kernel apply_parent_gid = NULL;
-
-	normalise_mask_area = clCreateKernel(
-		cld->program, //program,
-		"normalise_mask_area",
-		&cl_callres
-	);
-	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot create normalise_mask_area kernel", cl_callres)
-
-	apply_parent_gid = clCreateKernel(
-		cld->program, //program,
-		"apply_parent_gid",
-		&cl_callres
-	);
-	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot create apply_parent_gid kernel", cl_callres)
-
-	/*cl_mem cl_buffer_semaphor = clCreateBuffer(
-		cld->context,
-		CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
-		sizeof(int),
-		NULL,
-		&cl_callres
-	);
-	check(cl_callres != CL_SUCCESS, "Cannot create semaphore buffer", cl_callres)
-
-	int sema_default_value = 0;
-	cl_callres = clEnqueueWriteBuffer(
-		cld->command_queue,
-		cl_buffer_semaphor,
-		CL_TRUE,
-		0,
-		sizeof(int),
-		&sema_default_value,
-		0, NULL, NULL
-	);
+	cl_kernel normalise_mask_area = cld->kernels.normalise_mask_area;
+	cl_kernel apply_parent_gid = cld->kernels.apply_parent_gid;
 
-	check(cl_callres != CL_SUCCESS, "Cannot write to semaphore buffer", cl_callres)
-	*/
 	
 	cl_callres |= clSetKernelArg(normalise_mask_area, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
 	cl_callres |= clSetKernelArg(normalise_mask_area, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
 	cl_callres |= clSetKernelArg(normalise_mask_area, 2, sizeof(size_t), (void*)&bmp->image_width);
 	cl_callres |= clSetKernelArg(normalise_mask_area, 3, sizeof(size_t), (void*)&bmp->image_height);
-	//clSetKernelArg(normalise_mask_area, 4, sizeof(cl_mem), (void*)&cl_buffer_semaphor);
 	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot set normalise_mask_area kernel args", cl_callres)
 	
 
-	cl_callres = clEnqueueNDRangeKernel(
-		cld->command_queue,//command_queue,
-		normalise_mask_area,
-		1, // dims
-		NULL,
-		&normalize_size, //g size
-		NULL, // l size
-		0, NULL, NULL
-	);
+	cl_callres = cl_launch(cld, normalise_mask_area, 1, &normalize_size);
 	check_goto_temp(cl_callres != CL_SUCCESS, "Kernel normalise_mask_area execution error", cl_callres)
 	
 	cl_callres |= clSetKernelArg(apply_parent_gid, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
 	cl_callres |= clSetKernelArg(apply_parent_gid, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
 	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot set apply_parent_gid kernel args", cl_callres)
 
-	callres = clEnqueueNDRangeKernel(
-		cld->command_queue,//command_queue,
-		apply_parent_gid,
-		1, // dims
-		NULL,
-		&bmp->mask_size, //g size
-		NULL, // l size
-		0, NULL, NULL
-	);
+	cl_callres = cl_launch(cld, apply_parent_gid, 1, &bmp->mask_size);
 	check_goto_temp(cl_callres != CL_SUCCESS, "Kernel apply_parent_gid execution error", cl_callres)
-	clFinish(cld->command_queue);
 
 free_temporary_resources:
-	if (normalise_mask_area) clReleaseKernel(normalise_mask_area);
-	if (apply_parent_gid) clReleaseKernel(apply_parent_gid);
-
 	return callres;
 }
 
 int cl_fix_gid(struct cl_data_t* cld, struct gid_row_t* r) {
 	cl_int cl_callres = CL_SUCCESS;
+	cl_event event = NULL;
 	int callres = EXIT_SUCCESS;
 	size_t reserved_gids = gid_reserved;
 
-	cl_kernel normalise_gid = NULL;
-	cl_kernel fix_gid = NULL;
+	cl_kernel normalise_gid = cld->kernels.normalise_gid;
+	cl_kernel fix_gid = cld->kernels.fix_gid;
 
 	*(r->gid_row_index) = 1;
 	cl_callres = clEnqueueWriteBuffer(
@@ -419,39 +780,16 @@ int cl_fix_gid(struct cl_data_t* cld, struct gid_row_t* r) {
 		CL_TRUE, 0,
 		sizeof(size_t),
 		r->gid_row_index,
-		0, NULL, NULL
+		cl_chain_wait(cld), &event
 	);
+	cl_callres = cl_chain_push(cld, cl_callres, event, "write gid_row_index");
 	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot write to cl_buffer_gid_row_index buffer", cl_callres)
 
-	fix_gid = clCreateKernel(
-		cld->program,
-		"fix_gid",
-		&cl_callres
-	);
-	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot create fix_gid kernel", cl_callres)
-
-	normalise_gid = clCreateKernel(
-		cld->program,
-		"normalise_gid",
-		&cl_callres
-	);
-	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot create normalise_gid kernel", cl_callres)
-
 
 	cl_callres |= clSetKernelArg(normalise_gid, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
 	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot set normalise_gid kernel args", cl_callres)
 	
-		cl_callres = clEnqueueNDRangeKernel(
-		cld->command_queue,//command_queue,
-		normalise_gid,
-		1, // dims
-		NULL, // offset
-		&r->gid_row_size, //g size
-		NULL, // l size
-		0, // num events
-		NULL,
-		NULL
-	);
+	cl_callres = cl_launch(cld, normalise_gid, 1, &r->gid_row_size);
 	check_goto_temp(cl_callres != CL_SUCCESS, "Kernel normalise_gid execution error", cl_callres)
 
 	cl_callres |= clSetKernelArg(fix_gid, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
@@ -460,97 +798,290 @@ int cl_fix_gid(struct cl_data_t* cld, struct gid_row_t* r) {
 	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot set fix_gid kernel args", cl_callres)
 
 
-	cl_callres = clEnqueueNDRangeKernel(
-		cld->command_queue,
-		fix_gid, 1, NULL,
-		&r->gid_row_size,
-		NULL, 0, NULL, NULL
-	);
+	cl_callres = cl_launch(cld, fix_gid, 1, &r->gid_row_size);
 	check_goto_temp(cl_callres != CL_SUCCESS, "Kernel fix_gid execution error", cl_callres)
 
 	cl_callres = clEnqueueReadBuffer(
 		cld->command_queue, //command_queue
 		cld->cl_buffer_gid_row_index,
 		CL_TRUE, 0, sizeof(size_t),
-		r->gid_row_index, 0, NULL, NULL
+		r->gid_row_index, cl_chain_wait(cld), &event
 	);
+	cl_callres = cl_chain_push(cld, cl_callres, event, "read gid_row_index");
 	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot read cl_buffer_gid_row_index buffer", cl_callres)
 	
-	clFinish(cld->command_queue);
 	
-	printf("\n\t< Areas found: %u;\n", *r->gid_row_index - 1);
+	printf("\n\t< Areas found: %lu;\n", (unsigned long)(*r->gid_row_index - 1));
 	cld->vertex_count = *r->gid_row_index - 1;
 free_temporary_resources:
-	if (normalise_gid) clReleaseKernel(normalise_gid);
-	if (fix_gid) clReleaseKernel(fix_gid);
-
 	return callres;
 }
 
-int cl_finalize_mask(struct cl_data_t* cld, struct bmp_map* bmp, struct gid_row_t* r) {
+int cl_finalize_mask(struct cl_data_t* cld, struct bmp_map* bmp) {
 	cl_int cl_callres = CL_SUCCESS;
 	int callres = EXIT_SUCCESS;
 
-	cl_kernel finalize_mask = NULL;
-
-	finalize_mask = clCreateKernel(
-		cld->program, //program,
-		"finalize_mask",
-		&callres
-	);
-	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot create finalize_mask kernel", cl_callres)
+	cl_kernel finalize_mask = cld->kernels.finalize_mask;
 
 	cl_callres |= clSetKernelArg(finalize_mask, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
 	cl_callres |= clSetKernelArg(finalize_mask, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
 	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot set finalize_mask kernel args", cl_callres)
 
-	cl_callres = clEnqueueNDRangeKernel(
-		cld->command_queue,//command_queue,
-		finalize_mask,
-		1, // dims
-		NULL, // offset
-		&bmp->mask_size, //g size
-		NULL, // l size
-		0, // num events
-		NULL,
-		NULL
-	);
+	cl_callres = cl_launch(cld, finalize_mask, 1, &bmp->mask_size);
 	check_goto_temp(cl_callres != CL_SUCCESS, "Kernel finalize_mask execution error", cl_callres)
-	clFinish(cld->command_queue);
 free_temporary_resources:
-	if (finalize_mask) clReleaseKernel(finalize_mask);
-
 	return callres;
 }
 
+static cl_int cl_enqueue_pass(struct cl_data_t* cld, cl_kernel kernel, size_t size) {
+	return cl_launch(cld, kernel, 1, &size);
+}
+
+// border bits, one reference per label (labels are pixel index + 1), block counts
+static int cl_setup_label_buffers(struct cl_data_t* cld, struct bmp_map* bmp) {
+	cl_int cl_callres = CL_SUCCESS;
+	size_t label_count = bmp->mask_size;
+	size_t block_count = (label_count + LABEL_BLOCK_SIZE - 1) / LABEL_BLOCK_SIZE;
+
+	check(label_count >= INT32_MAX, "Map is too large for 32-bit labels", EXIT_FAILURE)
+	check(cl_pack_border(cld, bmp) != EXIT_SUCCESS, "Cannot pack border bits", EXIT_FAILURE)
+
+	cl_callres = cl_reserve_buffer(cld, &cld->cl_buffer_gid_row, &cld->gid_row_capacity,
+		label_count + 1, sizeof(cl_int), CL_MEM_READ_WRITE);
+	check(cl_callres != CL_SUCCESS, "Cannot create label reference buffer", cl_callres)
+	if (cld->cl_buffer_label_changed == NULL) {
+		cld->cl_buffer_label_changed = clCreateBuffer(cld->context, CL_MEM_READ_WRITE,
+			sizeof(cl_uint), NULL, &cl_callres);
+		check(cl_callres != CL_SUCCESS, "Cannot create label flag buffer", cl_callres)
+	}
+	if (cld->cl_buffer_label_total == NULL) {
+		cld->cl_buffer_label_total = clCreateBuffer(cld->context, CL_MEM_READ_WRITE,
+			sizeof(cl_uint), NULL, &cl_callres);
+		check(cl_callres != CL_SUCCESS, "Cannot create label total buffer", cl_callres)
+	}
+	cl_callres = cl_reserve_buffer(cld, &cld->cl_buffer_label_blocks, &cld->label_block_capacity,
+		block_count, sizeof(cl_uint), CL_MEM_READ_WRITE);
+	check(cl_callres != CL_SUCCESS, "Cannot create label block buffer", cl_callres)
+	return EXIT_SUCCESS;
+}
+
+// mask holds root labels: number the roots in label order and write the ids,
+// the root count is read back on the side (cl_vertex_count waits for it)
+static int cl_compact_labels(struct cl_data_t* cld, struct bmp_map* bmp) {
+	cl_int cl_callres = CL_SUCCESS;
+	cl_event event = NULL;
+	struct cl_kernels_t* k = &cld->kernels;
+	size_t label_count = bmp->mask_size;
+	size_t block_count = (label_count + LABEL_BLOCK_SIZE - 1) / LABEL_BLOCK_SIZE;
+	cl_uint block_size = LABEL_BLOCK_SIZE, scan_blocks = (cl_uint)block_count;
+	size_t scan_group = LABEL_SCAN_GROUP, group_size = 0;
+
+	if (clGetKernelWorkGroupInfo(k->scan_label_blocks, cld->device, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(size_t), &group_size, NULL) == CL_SUCCESS && group_size < scan_group) scan_group = group_size;
+
+	cl_callres |= clSetKernelArg(k->count_label_roots, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
+	cl_callres |= clSetKernelArg(k->count_label_roots, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_label_blocks);
+	cl_callres |= clSetKernelArg(k->count_label_roots, 2, sizeof(cl_uint), (void*)&block_size);
+	cl_callres |= clSetKernelArg(k->count_label_roots, 3, sizeof(size_t), (void*)&label_count);
+	cl_callres |= clSetKernelArg(k->scan_label_blocks, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_label_blocks);
+	cl_callres |= clSetKernelArg(k->scan_label_blocks, 1, sizeof(cl_uint), (void*)&scan_blocks);
+	cl_callres |= clSetKernelArg(k->scan_label_blocks, 2, sizeof(cl_mem), (void*)&cld->cl_buffer_label_total);
+	cl_callres |= clSetKernelArg(k->scan_label_blocks, 3, scan_group * sizeof(cl_uint), NULL);
+	cl_callres |= clSetKernelArg(k->number_label_roots, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
+	cl_callres |= clSetKernelArg(k->number_label_roots, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_label_blocks);
+	cl_callres |= clSetKernelArg(k->number_label_roots, 2, sizeof(cl_uint), (void*)&block_size);
+	cl_callres |= clSetKernelArg(k->number_label_roots, 3, sizeof(size_t), (void*)&label_count);
+	cl_callres |= clSetKernelArg(k->finalize_mask, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
+	cl_callres |= clSetKernelArg(k->finalize_mask, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
+	check(cl_callres != CL_SUCCESS, "Cannot set compaction kernel args", cl_callres)
+
+	cl_callres = cl_enqueue_pass(cld, k->count_label_roots, block_count);
+	check(cl_callres != CL_SUCCESS, "Kernel count_label_roots execution error", cl_callres)
+
+	cl_callres = clEnqueueNDRangeKernel(cld->command_queue, k->scan_label_blocks, 1, NULL,
+		&scan_group, &scan_group, cl_chain_wait(cld), &event);
+	cl_callres = cl_chain_push_kernel(cld, cl_callres, event, k->scan_label_blocks);
+	check(cl_callres != CL_SUCCESS, "Kernel scan_label_blocks execution error", cl_callres)
+
+	cl_callres = clEnqueueReadBuffer(cld->command_queue, cld->cl_buffer_label_total,
+		CL_FALSE, 0, sizeof(cl_uint), &cld->label_total, cl_chain_wait(cld), &event);
+	cl_callres = cl_branch_push(cld, cl_callres, event, "read label_total", &cld->label_total_ready);
+	check(cl_callres != CL_SUCCESS, "Cannot read label total", cl_callres)
+
+	cl_callres = cl_enqueue_pass(cld, k->number_label_roots, block_count);
+	cl_callres |= cl_enqueue_pass(cld, k->finalize_mask, label_count);
+	check(cl_callres != CL_SUCCESS, "Kernel number_label_roots execution error", cl_callres)
+
+	clFlush(cld->command_queue);
+	return EXIT_SUCCESS;
+}
+
+// the area count of the labeled map, waits only for its own readback
+static int cl_vertex_count(struct cl_data_t* cld) {
+	if (cld->label_total_ready == NULL) return EXIT_SUCCESS;
+	cl_int cl_callres = cl_branch_wait(&cld->label_total_ready);
+	check(cl_callres != CL_SUCCESS, "Cannot read label total", cl_callres)
+	cld->vertex_count = cld->label_total;
+	printf("\n\t< Areas found: %lu;\n", (unsigned long)cld->vertex_count);
+	return EXIT_SUCCESS;
+}
+
+int cl_label_equivalence(struct cl_data_t* cld, struct bmp_map* bmp) {
+	cl_int cl_callres = CL_SUCCESS;
+	cl_event event = NULL, pending = NULL, latest = NULL;
+	struct cl_kernels_t* k = &cld->kernels;
+	size_t label_count = bmp->mask_size, passes = 0;
+	cl_uint changed[2] = { 0, 0 }, zero = 0;
+	int callres = EXIT_SUCCESS;
+
+	check(cl_setup_label_buffers(cld, bmp) != EXIT_SUCCESS, "Cannot setup label buffers", EXIT_FAILURE)
+
+	cl_callres |= clSetKernelArg(k->init_labels, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
+	cl_callres |= clSetKernelArg(k->init_labels, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
+	cl_callres |= clSetKernelArg(k->init_labels, 2, sizeof(cl_mem), (void*)&cld->cl_buffer_border);
+
+	cl_callres |= clSetKernelArg(k->scan_labels, 0, sizeof(size_t), (void*)&bmp->image_width);
+	cl_callres |= clSetKernelArg(k->scan_labels, 1, sizeof(size_t), (void*)&bmp->image_height);
+	cl_callres |= clSetKernelArg(k->scan_labels, 2, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
+	cl_callres |= clSetKernelArg(k->scan_labels, 3, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
+	cl_callres |= clSetKernelArg(k->scan_labels, 4, sizeof(cl_mem), (void*)&cld->cl_buffer_border);
+	cl_callres |= clSetKernelArg(k->scan_labels, 5, sizeof(cl_mem), (void*)&cld->cl_buffer_label_changed);
+
+	cl_callres |= clSetKernelArg(k->analyse_labels, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
+	cl_callres |= clSetKernelArg(k->analyse_labels, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
+	cl_callres |= clSetKernelArg(k->relabel_mask, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
+	cl_callres |= clSetKernelArg(k->relabel_mask, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
+	check(cl_callres != CL_SUCCESS, "Cannot set labeling kernel args", cl_callres)
+
+	cl_callres = cl_enqueue_pass(cld, k->init_labels, label_count);
+	check(cl_callres != CL_SUCCESS, "Kernel init_labels execution error", cl_callres)
+
+	// one pass per iteration, stops on the first scan without a change; the flag
+	// of a scan is read while the next pass runs, the pass after convergence is a no-op
+	for (;;) {
+		cl_callres = clEnqueueFillBuffer(cld->command_queue, cld->cl_buffer_label_changed,
+			&zero, sizeof(cl_uint), 0, sizeof(cl_uint), cl_chain_wait(cld), &event);
+		cl_callres = cl_chain_push(cld, cl_callres, event, "fill label_changed");
+		cl_callres |= cl_enqueue_pass(cld, k->scan_labels, label_count);
+		check_goto_temp(cl_callres != CL_SUCCESS, "Kernel scan_labels execution error", cl_callres)
+
+		cl_callres = clEnqueueReadBuffer(cld->command_queue, cld->cl_buffer_label_changed,
+			CL_FALSE, 0, sizeof(cl_uint), changed + passes % 2, cl_chain_wait(cld), &event);
+		cl_callres = cl_chain_push(cld, cl_callres, event, "read label_changed");
+		check_goto_temp(cl_callres != CL_SUCCESS, "Cannot read label flag", cl_callres)
+		clRetainEvent(event);
+		latest = event;
+		passes++;
+		clFlush(cld->command_queue);
+
+		if (pending) {
+			cl_callres = cl_branch_wait(&pending);
+			check_goto_temp(cl_callres != CL_SUCCESS, "Cannot read label flag", cl_callres)
+			if (!changed[passes % 2]) break;
+		}
+		pending = latest;
+		latest = NULL;
+
+		cl_callres = cl_enqueue_pass(cld, k->analyse_labels, label_count);
+		cl_callres |= cl_enqueue_pass(cld, k->relabel_mask, label_count);
+		check_goto_temp(cl_callres != CL_SUCCESS, "Kernel relabel_mask execution error", cl_callres)
+	}
+	printf("\n\t< Label passes: %lu;\n", (unsigned long)(passes - 1));
+
+free_temporary_resources:
+	// the flag readbacks target this frame
+	cl_branch_wait(&pending);
+	cl_branch_wait(&latest);
+	if (callres != EXIT_SUCCESS) return callres;
+
+	check(cl_compact_labels(cld, bmp) != EXIT_SUCCESS, "Cannot compact labels", EXIT_FAILURE)
+	return EXIT_SUCCESS;
+}
+
+// the tile kernel needs a whole LABEL_TILE x LABEL_TILE work-group
+static int cl_label_tiles_supported(struct cl_data_t* cld) {
+	size_t group_size = 0;
+	if (clGetKernelWorkGroupInfo(cld->kernels.label_tiles, cld->device, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(size_t), &group_size, NULL) != CL_SUCCESS) return 0;
+	return group_size >= LABEL_TILE_SIZE * LABEL_TILE_SIZE;
+}
+
+int cl_label_tiles(struct cl_data_t* cld, struct bmp_map* bmp) {
+	cl_int cl_callres = CL_SUCCESS;
+	cl_event event = NULL;
+	struct cl_kernels_t* k = &cld->kernels;
+	size_t tiles_x = (bmp->image_width + LABEL_TILE_SIZE - 1) / LABEL_TILE_SIZE;
+	size_t tiles_y = (bmp->image_height + LABEL_TILE_SIZE - 1) / LABEL_TILE_SIZE;
+	size_t seam_count = (tiles_x - 1) * bmp->image_height + (tiles_y - 1) * bmp->image_width;
+
+	check(cl_setup_label_buffers(cld, bmp) != EXIT_SUCCESS, "Cannot setup label buffers", EXIT_FAILURE)
+
+	cl_callres |= clSetKernelArg(k->label_tiles, 0, sizeof(size_t), (void*)&bmp->image_width);
+	cl_callres |= clSetKernelArg(k->label_tiles, 1, sizeof(size_t), (void*)&bmp->image_height);
+	cl_callres |= clSetKernelArg(k->label_tiles, 2, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
+	cl_callres |= clSetKernelArg(k->label_tiles, 3, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
+	cl_callres |= clSetKernelArg(k->label_tiles, 4, sizeof(cl_mem), (void*)&cld->cl_buffer_border);
+
+	cl_callres |= clSetKernelArg(k->merge_tile_seams, 0, sizeof(size_t), (void*)&bmp->image_width);
+	cl_callres |= clSetKernelArg(k->merge_tile_seams, 1, sizeof(size_t), (void*)&bmp->image_height);
+	cl_callres |= clSetKernelArg(k->merge_tile_seams, 2, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
+	cl_callres |= clSetKernelArg(k->merge_tile_seams, 3, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
+
+	cl_callres |= clSetKernelArg(k->resolve_labels, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
+	cl_callres |= clSetKernelArg(k->resolve_labels, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_gid_row);
+	check(cl_callres != CL_SUCCESS, "Cannot set tile labeling kernel args", cl_callres)
+
+	cl_callres = clEnqueueNDRangeKernel(
+		cld->command_queue,
+		k->label_tiles,
+		2, NULL,
+		(size_t[2]) { tiles_x * LABEL_TILE_SIZE, tiles_y * LABEL_TILE_SIZE },
+		(size_t[2]) { LABEL_TILE_SIZE, LABEL_TILE_SIZE },
+		cl_chain_wait(cld), &event
+	);
+	cl_callres = cl_chain_push_kernel(cld, cl_callres, event, k->label_tiles);
+	check(cl_callres != CL_SUCCESS, "Kernel label_tiles execution error", cl_callres)
+
+	if (seam_count) {
+		cl_callres = cl_enqueue_pass(cld, k->merge_tile_seams, seam_count);
+		check(cl_callres != CL_SUCCESS, "Kernel merge_tile_seams execution error", cl_callres)
+	}
+	cl_callres = cl_enqueue_pass(cld, k->resolve_labels, bmp->mask_size);
+	check(cl_callres != CL_SUCCESS, "Kernel resolve_labels execution error", cl_callres)
+
+	check(cl_compact_labels(cld, bmp) != EXIT_SUCCESS, "Cannot compact labels", EXIT_FAILURE)
+	printf("\n\t< Tiles: %lux%lu;\n", (unsigned long)tiles_x, (unsigned long)tiles_y);
+	return EXIT_SUCCESS;
+}
+
 void display_mask(struct cl_data_t* cld, struct bmp_map* bmp, struct gid_row_t* r) {
-	clFinish(cld->command_queue);
+	cl_int cl_callres = CL_SUCCESS;
+	cl_event event = NULL;
 
-	clEnqueueReadBuffer(
+	cl_callres = clEnqueueReadBuffer(
 		cld->command_queue, //command_queue,
 		cld->cl_buffer_mask, //mask,
 		CL_TRUE,
 		0,
 		bmp->mask_size * sizeof(mask_cell),
 		cld->mask_row,
-		0,
-		NULL,
-		NULL
+		cl_chain_wait(cld),
+		&event
 	);
+	cl_chain_push(cld, cl_callres, event, "read mask");
 
-	clEnqueueReadBuffer(
+	cl_callres = clEnqueueReadBuffer(
 		cld->command_queue, //command_queue,
 		cld->cl_buffer_gid_row, //mask,
 		CL_TRUE,
 		0,
 		r->gid_row_size * sizeof(gid_t),
 		r->gid_row,
-		0,
-		NULL,
-		NULL
+		cl_chain_wait(cld),
+		&event
 	);
+	cl_chain_push(cld, cl_callres, event, "read gid_row");
 
-	clFinish(cld->command_queue);
 	printf("\t\t");
 	for (size_t i = 0; i < bmp->image_width; i++) printf("_%3d", i);
 
@@ -579,26 +1110,16 @@ void display_mask(struct cl_data_t* cld, struct bmp_map* bmp, struct gid_row_t*
 	
 int cl_debug_output(struct cl_data_t* cld, struct bmp_map* bmp) {
 	cl_int cl_callres = CL_SUCCESS;
-	cl_kernel debug_output = NULL;
+	cl_kernel debug_output = cld->kernels.debug_output;
 	
 	printf("\n\t< Debug output\n");
 
-	debug_output = clCreateKernel(cld->program, "debug_output", &cl_callres);
-	check(cl_callres != CL_SUCCESS, "Cannot create mask_border kernel", cl_callres)
-
 	clSetKernelArg(debug_output, 0, sizeof(cl_mem), (void*)&cld->cl_image_map);
 	clSetKernelArg(debug_output, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
+	clSetKernelArg(debug_output, 2, sizeof(size_t), (void*)&bmp->image_width);
 
-	cl_callres = clEnqueueNDRangeKernel(
-		cld->command_queue,//command_queue,
-		debug_output,
-		2, NULL, // offset
-		(size_t[2]) { bmp->image_width, bmp->image_height }, //g size
-		NULL, 0, NULL, NULL
-	);
+	cl_callres = cl_launch(cld, debug_output, 2, (size_t[2]) { bmp->image_width, bmp->image_height });
 	check(cl_callres != CL_SUCCESS, "Kernel debug_output execution error", cl_callres)
-
-	clFinish(cld->command_queue);
 	return EXIT_SUCCESS;
 }
 
@@ -608,13 +1129,52 @@ void distruct_parse_map(struct cl_data_t* cld, struct bmp_map* bmp) {
 	distruct_environment(cld, bmp);
 }
 
+int cpu_parse_map(struct cl_data_t* cld, struct bmp_map* bmp) {
+	cl_int cl_callres = CL_SUCCESS;
+	cl_event event = NULL;
+
+	if (cpu_label_map(bmp->linear_sequence, bmp->image_width, bmp->image_height,
+		cld->mask_row, &cld->vertex_count, cld->options.thread_count, &cld->options.border, &cld->arena) != EXIT_SUCCESS) {
+		distruct_parse_map(cld, bmp);
+		return EXIT_FAILURE;
+	}
+	printf("\n\t< Areas found: %lu;\n", (unsigned long)cld->vertex_count);
+
+	// build_graph and apply_colors read the labels from the device mask
+	cl_callres = clEnqueueWriteBuffer(
+		cld->command_queue,
+		cld->cl_buffer_mask,
+		CL_TRUE, 0,
+		bmp->mask_size * sizeof(mask_cell),
+		cld->mask_row,
+		cl_chain_wait(cld), &event
+	);
+	cl_callres = cl_chain_push(cld, cl_callres, event, "write mask");
+	check(cl_callres != CL_SUCCESS, "Cannot write labels to mask buffer", cl_callres)
+
+	return EXIT_SUCCESS;
+}
+
 int parse_map(struct cl_data_t* cld, struct bmp_map* bmp) {
 	struct gid_row_t gr = { NULL, NULL, 0 };
-
 	int callres = EXIT_SUCCESS;
+
+	if (cld->options.labeling_backend == LABELING_CPU)
+		return cpu_parse_map(cld, bmp);
+
+	if (cld->options.labeling_backend == LABELING_OPENCL) {
+		callres = cl_label_tiles_supported(cld) ?
+			cl_label_tiles(cld, bmp) : cl_label_equivalence(cld, bmp);
+		if (callres != EXIT_SUCCESS) {
+			distruct_parse_map(cld, bmp);
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
 	size_t spread_timeout = 1000;
 
-	callres = cl_mask_border(cld, bmp); //
+	callres = cl_pack_border(cld, bmp); //
 	if(callres != EXIT_SUCCESS) {
 		distruct_parse_map(cld, bmp);
 		temp
@@ -650,131 +1210,320 @@ int parse_map(struct cl_data_t* cld, struct bmp_map* bmp) {
 		temp
 	}
 
-	callres = cl_finalize_mask(cld, bmp, &gr); //
+	callres = cl_finalize_mask(cld, bmp); //
 	if (callres != EXIT_SUCCESS) {
 		distruct_parse_map(cld, bmp);
 		temp
 	}
 
-	clFinish(cld->command_queue);
-
-	if (cld->cl_buffer_gid_row_index)clReleaseMemObject(cld->cl_buffer_gid_row_index);
-	if (cld->cl_buffer_gid_row) clReleaseMemObject(cld->cl_buffer_gid_row);
-
 free_temporary_resources:
-	if (gr.gid_row) free(gr.gid_row);
-	if (gr.gid_row_index) free(gr.gid_row_index);
+	host_arena_free(&cld->arena, gr.gid_row);
+	host_arena_free(&cld->arena, gr.gid_row_index);
 	return callres;
 }
 
 
-int cl_build_matrix(struct graph_as_row_t* g, struct cl_data_t* cld, 
-	struct bmp_map* bmp, unsigned char matrix_link_flag_value) {
-	
+size_t next_power_of_two(size_t v) {
+	size_t p = 1;
+	while (p < v) p <<= 1;
+	return p;
+}
+
+// the edge pass with its state readback on the side, the host may work meanwhile
+static int cl_enqueue_edges(struct cl_data_t* cld, struct bmp_map* bmp, size_t table_size) {
 	cl_int cl_callres = CL_SUCCESS;
-	cl_kernel build_matrix;
-	
-	build_matrix = clCreateKernel(
-		cld->program, //program,
-		"build_matrix",
-		&cl_callres
-	);
-	check(cl_callres != CL_SUCCESS, "Cannot create fix_gid kernel", cl_callres)
-		//printf("Created build_matrix kernel.\n");
-
-	//cl_mem cl_buffer_matrix = clCreateBuffer(
-	//	cld->context,
-	//	CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-	//	g->matrix_size, //(g->vertex_count + 1) * g->matrix_column_size * sizeof(bitfield_cell),
-	//	g->matrix,
-	//	&cl_callres
-	//);
-
-	cl_mem cl_buffer_matrix = clCreateBuffer(
-		cld->context,
-		CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
-		g->matrix_size, //(g->vertex_count + 1) * g->matrix_column_size * sizeof(bitfield_cell),
-		g->matrix,
-		&cl_callres
-	);
-	clFinish(cld->command_queue);
+	cl_event event = NULL, table_cleared = NULL, state_cleared = NULL, walks_cleared = NULL;
+	cl_kernel build_edges = cld->kernels.build_edges;
+	cl_mem slot_walks = NULL, edge_slots = NULL;
+	cl_uint search_limit = (cl_uint)(cld->options.edge_search_limit ?
+		cld->options.edge_search_limit : EDGE_SEARCH_LIMIT);
+	cl_ulong empty_key = 0;
+	cl_uint zero = 0;
+
+	if (cld->cl_buffer_edge_count == NULL) {
+		cld->cl_buffer_edge_count = clCreateBuffer(
+			cld->context, CL_MEM_READ_WRITE, sizeof(cld->edge_state), NULL, &cl_callres);
+		check(cl_callres != CL_SUCCESS, "Cannot create edge state buffer", cl_callres)
+	}
+	cl_callres = cl_reserve_buffer(cld, &cld->cl_buffer_edge_table, &cld->edge_table_capacity,
+		table_size, sizeof(cl_ulong), CL_MEM_READ_WRITE);
+	check(cl_callres != CL_SUCCESS, "Cannot create edge table buffer", cl_callres)
+	cl_callres = cl_reserve_buffer(cld, &cld->cl_buffer_edges, &cld->edges_capacity,
+		table_size, sizeof(struct graph_edge_t), CL_MEM_READ_WRITE);
+	check(cl_callres != CL_SUCCESS, "Cannot create edges buffer", cl_callres)
+	cld->edge_table_size = table_size;
+
+	if (cld->options.region_stats) {
+		cl_callres = cl_reserve_buffer(cld, &cld->cl_buffer_slot_walks, &cld->slot_walks_capacity,
+			table_size, sizeof(cl_uint), CL_MEM_READ_WRITE);
+		check(cl_callres != CL_SUCCESS, "Cannot create slot walks buffer", cl_callres)
+		cl_callres = cl_reserve_buffer(cld, &cld->cl_buffer_edge_walks, &cld->edge_walks_capacity,
+			table_size, sizeof(cl_uint), CL_MEM_READ_WRITE);
+		check(cl_callres != CL_SUCCESS, "Cannot create edge walks buffer", cl_callres)
+	}
+	if (cld->options.region_stats) {
+		slot_walks = cld->cl_buffer_slot_walks;
+		edge_slots = cld->cl_buffer_edge_walks;
+		cl_callres = clEnqueueFillBuffer(cld->command_queue, slot_walks,
+			&zero, sizeof(cl_uint), 0, table_size * sizeof(cl_uint), 0, NULL, &event);
+		cl_callres = cl_branch_push(cld, cl_callres, event, "fill slot_walks", &walks_cleared);
+		cl_callres |= cl_chain_join(cld, &walks_cleared);
+		release_event(&walks_cleared);
+		check(cl_callres != CL_SUCCESS, "Cannot reset slot walks", cl_callres)
+	}
 
-	clSetKernelArg(build_matrix, 0, sizeof(size_t), (void*)&bmp->image_width);
-	clSetKernelArg(build_matrix, 1, sizeof(size_t), (void*)&bmp->image_height);
-	clSetKernelArg(build_matrix, 2, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
-	clSetKernelArg(build_matrix, 3, sizeof(cl_mem), (void*)&cl_buffer_matrix);
-	clSetKernelArg(build_matrix, 4, sizeof(size_t), (void*)&g->matrix_column_size);
-	clSetKernelArg(build_matrix, 5, sizeof(unsigned char), (void*)&matrix_link_flag_value);
+	// nothing before build_edges touches the table or the state
+	cl_callres = clEnqueueFillBuffer(cld->command_queue, cld->cl_buffer_edge_table,
+		&empty_key, sizeof(cl_ulong), 0, table_size * sizeof(cl_ulong), 0, NULL, &event);
+	cl_callres = cl_branch_push(cld, cl_callres, event, "fill edge_table", &table_cleared);
+	check(cl_callres != CL_SUCCESS, "Cannot reset edge table", cl_callres)
+	cl_callres = clEnqueueFillBuffer(cld->command_queue, cld->cl_buffer_edge_count,
+		&zero, sizeof(cl_uint), 0, sizeof(cld->edge_state), 0, NULL, &event);
+	cl_callres = cl_branch_push(cld, cl_callres, event, "fill edge_count", &state_cleared);
+	cl_callres |= cl_chain_join(cld, &table_cleared);
+	cl_callres |= cl_chain_join(cld, &state_cleared);
+	release_event(&table_cleared);
+	release_event(&state_cleared);
+	check(cl_callres != CL_SUCCESS, "Cannot reset edge table", cl_callres)
+
+	cl_uint table_mask = (cl_uint)(table_size - 1);
+	cl_uint edge_capacity = (cl_uint)table_size;
+	cl_callres |= clSetKernelArg(build_edges, 0, sizeof(size_t), (void*)&bmp->image_width);
+	cl_callres |= clSetKernelArg(build_edges, 1, sizeof(size_t), (void*)&bmp->image_height);
+	cl_callres |= clSetKernelArg(build_edges, 2, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
+	cl_callres |= clSetKernelArg(build_edges, 3, sizeof(cl_mem), (void*)&cld->cl_buffer_edge_table);
+	cl_callres |= clSetKernelArg(build_edges, 4, sizeof(cl_uint), (void*)&table_mask);
+	cl_callres |= clSetKernelArg(build_edges, 5, sizeof(cl_mem), (void*)&cld->cl_buffer_edges);
+	cl_callres |= clSetKernelArg(build_edges, 6, sizeof(cl_mem), (void*)&cld->cl_buffer_edge_count);
+	cl_callres |= clSetKernelArg(build_edges, 7, sizeof(cl_uint), (void*)&edge_capacity);
+	cl_callres |= clSetKernelArg(build_edges, 8, sizeof(cl_uint), (void*)&search_limit);
+	cl_callres |= clSetKernelArg(build_edges, 9, sizeof(cl_mem), (void*)&slot_walks);
+	cl_callres |= clSetKernelArg(build_edges, 10, sizeof(cl_mem), (void*)&edge_slots);
+	check(cl_callres != CL_SUCCESS, "Cannot set build_edges kernel args", cl_callres)
+
+	cl_callres = cl_launch(cld, build_edges, 1, &bmp->mask_size);
+	check(cl_callres != CL_SUCCESS, "Kernel build_edges execution error", cl_callres)
+
+	cl_callres = clEnqueueReadBuffer(cld->command_queue, cld->cl_buffer_edge_count,
+		CL_FALSE, 0, sizeof(cld->edge_state), cld->edge_state, cl_chain_wait(cld), &event);
+	cl_callres = cl_branch_push(cld, cl_callres, event, "read edge_count", &cld->edge_state_ready);
+	check(cl_callres != CL_SUCCESS, "Cannot read edge state", cl_callres)
+
+	clFlush(cld->command_queue);
+	return EXIT_SUCCESS;
+}
 
-	cl_callres = clEnqueueNDRangeKernel(
-		cld->command_queue,//command_queue,
-		build_matrix,
-		1, // dims
-		NULL, // offset
-		&bmp->mask_size, //g size
-		NULL, // l size
-		0, // num events
-		NULL,
-		NULL
-	);
-	//printf("Kernel execution build_matrix: %d;\n", callres);
+// waits for the edge pass, reruns it with a larger table on overflow
+// arena NULL - the caller frees the edges
+static int cl_read_edges(struct cl_data_t* cld, struct bmp_map* bmp, size_t table_size,
+	struct host_arena_t* arena, struct graph_edge_t** edges, size_t* edge_count
+) {
+	cl_int cl_callres = CL_SUCCESS;
+	cl_event event = NULL;
 
-	clFinish(cld->command_queue);
+	for (;;) {
+		cl_callres = cl_branch_wait(&cld->edge_state_ready);
+		check(cl_callres != CL_SUCCESS, "Cannot read edge state", cl_callres)
+		if (!cld->edge_state[1] && cld->edge_state[0] <= table_size) break;
 
-	/*cl_callres = clEnqueueReadBuffer(
-		cld->command_queue, //command_queue
-		cl_buffer_matrix,
-		CL_FALSE,
-		0,
-		(cld->vertex_count + 1) * g->matrix_column_size * sizeof(bitfield_cell),
-		g->matrix,
-		0,
-		NULL,
-		NULL
-	);*/
+		// table full (or a device without 64-bit atomics appended too much)
+		table_size = next_power_of_two(cld->edge_state[0] > 2 * table_size ? cld->edge_state[0] : 2 * table_size);
+		check(cl_enqueue_edges(cld, bmp, table_size) != EXIT_SUCCESS, "Cannot build edges", EXIT_FAILURE)
+	}
 
+	*edge_count = cld->edge_state[0];
+	*edges = (struct graph_edge_t*)host_arena_alloc(arena, (*edge_count + 1) * sizeof(struct graph_edge_t));
+	check(*edges == NULL, "Cannot allocate memory for edges", EXIT_FAILURE)
 
-	cl_callres = clEnqueueReadBuffer(
-		cld->command_queue, //command_queue,
-		cld->cl_buffer_mask, //mask,
-		CL_FALSE,
-		0,
-		bmp->mask_size * sizeof(mask_cell),
-		cld->mask_row,
-		0,
-		NULL,
-		NULL
-	);
+	cl_callres = clEnqueueReadBuffer(cld->command_queue, cld->cl_buffer_edges,
+		CL_TRUE, 0, *edge_count * sizeof(struct graph_edge_t), *edges, cl_chain_wait(cld), &event);
+	cl_callres = cl_chain_push(cld, cl_callres, event, "read edges");
+	if (cl_callres != CL_SUCCESS) {
+		host_arena_free(arena, *edges);
+		*edges = NULL;
+	}
+	check(cl_callres != CL_SUCCESS, "Cannot read edges buffer", cl_callres)
 
-	clFinish(cld->command_queue);
 	return EXIT_SUCCESS;
 }
 
+// planar area graphs have E < 3V, the table keeps a load factor under 1/2
+static size_t cl_edge_table_size(struct cl_data_t* cld) {
+	size_t table_size = next_power_of_two(8 * (cld->vertex_count + 1));
+	if (table_size < 1024) table_size = 1024;
+	if (table_size < cld->edge_table_size) table_size = cld->edge_table_size;
+	return table_size;
+}
+
+int enqueue_edge_list(struct cl_data_t* cld, struct bmp_map* bmp) {
+	check(cl_vertex_count(cld) != EXIT_SUCCESS, "Cannot count areas", EXIT_FAILURE)
+	check(cl_enqueue_edges(cld, bmp, cl_edge_table_size(cld)) != EXIT_SUCCESS, "Cannot build edges", EXIT_FAILURE)
+	return EXIT_SUCCESS;
+}
+
+// the table of the last enqueue_edge_list is cld->edge_table_size
+int read_edge_list(struct cl_data_t* cld, struct bmp_map* bmp, struct graph_edge_t** edges, size_t* edge_count) {
+	return cl_read_edges(cld, bmp, cld->edge_table_size, &cld->arena, edges, edge_count);
+}
+
+int read_mask_rows(struct cl_data_t* cld, struct bmp_map* bmp, size_t y0, size_t rows, mask_cell* dst) {
+	cl_int cl_callres = CL_SUCCESS;
+	cl_event event = NULL;
+
+	cl_callres = clEnqueueReadBuffer(cld->command_queue, cld->cl_buffer_mask,
+		CL_TRUE, y0 * bmp->image_width * sizeof(mask_cell), rows * bmp->image_width * sizeof(mask_cell), dst,
+		cl_chain_wait(cld), &event);
+	cl_callres = cl_chain_push(cld, cl_callres, event, "read mask rows");
+	check(cl_callres != CL_SUCCESS, "Cannot read mask rows", cl_callres)
+	return EXIT_SUCCESS;
+}
+
+// runs on the final mask beside build_edges, vertex_count must be valid
+static int cl_enqueue_region_stats(struct cl_data_t* cld, struct bmp_map* bmp) {
+	cl_int cl_callres = CL_SUCCESS;
+	cl_event event = NULL;
+	cl_kernel region_stats = cld->kernels.region_stats;
+	cl_uint zero = 0;
+	size_t words = (cld->vertex_count + 1) * REGION_STAT_WORDS;
+
+	cl_callres = cl_reserve_buffer(cld, &cld->cl_buffer_region_stats, &cld->region_stats_capacity,
+		words, sizeof(cl_uint), CL_MEM_READ_WRITE);
+	check(cl_callres != CL_SUCCESS, "Cannot create region stats buffer", cl_callres)
+
+	cl_callres = clEnqueueFillBuffer(cld->command_queue, cld->cl_buffer_region_stats,
+		&zero, sizeof(cl_uint), 0, words * sizeof(cl_uint), cl_chain_wait(cld), &event);
+	cl_callres = cl_chain_push(cld, cl_callres, event, "fill region_stats");
+	check(cl_callres != CL_SUCCESS, "Cannot reset region stats", cl_callres)
+
+	cl_callres |= clSetKernelArg(region_stats, 0, sizeof(size_t), (void*)&bmp->image_width);
+	cl_callres |= clSetKernelArg(region_stats, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
+	cl_callres |= clSetKernelArg(region_stats, 2, sizeof(cl_mem), (void*)&cld->cl_buffer_region_stats);
+	check(cl_callres != CL_SUCCESS, "Cannot set region_stats kernel args", cl_callres)
+
+	cl_callres = cl_launch(cld, region_stats, 2, (size_t[2]) { bmp->image_width, bmp->image_height });
+	check(cl_callres != CL_SUCCESS, "Kernel region_stats execution error", cl_callres)
+	clFlush(cld->command_queue);
+	return EXIT_SUCCESS;
+}
+
+// region stats into g, border walks onto the adjacency of sparse graphs
+static int cl_read_region_stats(struct cl_data_t* cld, struct graph_as_row_t* g,
+	const struct graph_edge_t* edges, size_t edge_count
+) {
+	cl_int cl_callres = CL_SUCCESS;
+	cl_event event = NULL;
+	cl_kernel gather_edge_walks = cld->kernels.gather_edge_walks;
+	cl_uint* words = NULL;
+	cl_uint* walks = NULL;
+	int callres = EXIT_SUCCESS;
+
+	// the readbacks stay with the map's arena, graph_link_borders allocates after them
+	words = (cl_uint*)host_arena_alloc(g->arena, (g->vertex_count + 1) * REGION_STAT_WORDS * sizeof(cl_uint));
+	g->region_stats = (struct region_stats_t*)host_arena_calloc(g->arena, g->vertex_count + 1,
+		sizeof(struct region_stats_t));
+	check_goto_temp(!words || !g->region_stats, "Cannot allocate region stats", EXIT_FAILURE)
+
+	cl_callres = clEnqueueReadBuffer(cld->command_queue, cld->cl_buffer_region_stats,
+		CL_TRUE, 0, (g->vertex_count + 1) * REGION_STAT_WORDS * sizeof(cl_uint), words,
+		cl_chain_wait(cld), &event);
+	cl_callres = cl_chain_push(cld, cl_callres, event, "read region_stats");
+	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot read region stats", cl_callres)
+
+	for (size_t v = 1; v < g->vertex_count + 1; v++) {
+		const cl_uint* w = words + v * REGION_STAT_WORDS;
+		struct region_stats_t* r = g->region_stats + v;
+		if (w[0] == 0) continue;
+		r->area = w[0];
+		r->x0 = ~w[1]; r->y0 = ~w[2];
+		r->x1 = w[3]; r->y1 = w[4];
+		r->cx = (double)(w[5] | (uint64_t)w[6] << 32) / r->area;
+		r->cy = (double)(w[7] | (uint64_t)w[8] << 32) / r->area;
+	}
+
+	if (g->storage != GRAPH_SPARSE || edge_count == 0) temp
+
+	cl_callres |= clSetKernelArg(gather_edge_walks, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_slot_walks);
+	cl_callres |= clSetKernelArg(gather_edge_walks, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_edge_walks);
+	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot set gather_edge_walks kernel args", cl_callres)
+	cl_callres = cl_launch(cld, gather_edge_walks, 1, &edge_count);
+	check_goto_temp(cl_callres != CL_SUCCESS, "Kernel gather_edge_walks execution error", cl_callres)
+
+	walks = (cl_uint*)host_arena_alloc(g->arena, edge_count * sizeof(cl_uint));
+	check_goto_temp(walks == NULL, "Cannot allocate edge walks", EXIT_FAILURE)
+	cl_callres = clEnqueueReadBuffer(cld->command_queue, cld->cl_buffer_edge_walks,
+		CL_TRUE, 0, edge_count * sizeof(cl_uint), walks, cl_chain_wait(cld), &event);
+	cl_callres = cl_chain_push(cld, cl_callres, event, "read edge_walks");
+	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot read edge walks", cl_callres)
+
+	check_goto_temp(graph_link_borders(g, edges, walks, edge_count) != EXIT_SUCCESS,
+		"Cannot link border lengths", EXIT_FAILURE)
+	uint64_t border_walks = 0;
+	for (size_t i = 0; i < edge_count; i++) border_walks += walks[i];
+	printf("\n\t< Region stats: %lu regions, %lu links, %llu border walks;\n",
+		(unsigned long)g->vertex_count, (unsigned long)edge_count, (unsigned long long)border_walks);
+
+free_temporary_resources:
+	host_arena_free(g->arena, words);
+	host_arena_free(g->arena, walks);
+	return callres;
+}
+
 void distruct_build_graph(struct graph_as_row_t* g, struct cl_data_t* cld, struct bmp_map* bmp) {
 	distruct_parse_map(cld, bmp);
-	if (g->vertex_row) free(g->vertex_row);
-	if (g->order) free(g->order);
-	if (g->matrix) free(g->matrix);
+	distruct_graph_as_row(g);
+}
+
+void release_map_graph(struct cl_data_t* cld, struct graph_as_row_t* g) {
+	distruct_graph_as_row(g);
+	host_arena_reset(&cld->arena);
 }
 
 int build_graph(struct graph_as_row_t* g, 
 	struct cl_data_t* cld, struct bmp_map* bmp, 
 	unsigned char matrix_link_flag_value
 ) {
-	
-	if (graph_init_as_row(g, cld->vertex_count, matrix_link_flag_value) != EXIT_SUCCESS) {
-		printf("Cannot init graph");
+	struct graph_edge_t* edges = NULL;
+	size_t edge_count = 0;
+	int callres = EXIT_SUCCESS;
+
+	memset(g, 0, sizeof(struct graph_as_row_t));
+
+	if (enqueue_edge_list(cld, bmp) != EXIT_SUCCESS ||
+		(cld->options.region_stats && cl_enqueue_region_stats(cld, bmp) != EXIT_SUCCESS)) {
+		printf("Cannot build edges");
 		distruct_build_graph(g, cld, bmp);
 		return EXIT_FAILURE;
 	}
-	//printf("Inited graph.\n");
 
-	if (cl_build_matrix(g, cld, bmp, matrix_link_flag_value) != EXIT_SUCCESS) {
-		printf("Cannot build matrix");
+	// the vertex rows are allocated while the device looks for edges
+	if (cld->options.graph_storage == GRAPH_SPARSE) {
+		callres = graph_alloc_sparse(g, cld->vertex_count, &cld->arena);
+	}
+	else {
+		callres = graph_init_as_row(g, cld->vertex_count, matrix_link_flag_value, &cld->arena);
+	}
+
+	if (cl_read_edges(cld, bmp, cld->edge_table_size, &cld->arena, &edges, &edge_count) != EXIT_SUCCESS) {
+		printf("Cannot build edges");
+		distruct_build_graph(g, cld, bmp);
+		return EXIT_FAILURE;
+	}
+
+	if (callres == EXIT_SUCCESS) {
+		if (cld->options.graph_storage == GRAPH_SPARSE)
+			callres = graph_link_sparse(g, edges, edge_count);
+		else
+			graph_set_links(g, edges, edge_count, matrix_link_flag_value);
+	}
+	if (callres == EXIT_SUCCESS && cld->options.region_stats)
+		callres = cl_read_region_stats(cld, g, edges, edge_count);
+	host_arena_free(&cld->arena, edges);
+
+	if (callres != EXIT_SUCCESS) {
+		printf("Cannot init graph");
 		distruct_build_graph(g, cld, bmp);
 		return EXIT_FAILURE;
 	}
-	//printf("Builded graph matrix.\n");
 
 	graph_calc_links(g, matrix_link_flag_value);
 
@@ -783,63 +1532,98 @@ int build_graph(struct graph_as_row_t* g,
 	return EXIT_SUCCESS;
 }
 
-int cl_apply_colors(struct cl_data_t* cld, struct bmp_map* bmp, struct graph_as_row_t* g) {
+static int write_color_table(struct cl_data_t* cld, const uint8_t* vertex_color, size_t vertex_count) {
 	cl_int cl_callres = CL_SUCCESS;
-	cl_kernel apply_colors = NULL;
-	uint8_t* vertex_color = NULL;
-	cl_mem cl_buffer_vertex_color;
-
-	vertex_color = (uint8_t*)calloc(g->vertex_count + 1, sizeof(uint8_t));
-	check(vertex_color == NULL, "Cannot allocate vertex to color buffer", EXIT_FAILURE)
+	cl_event event = NULL;
 
+	cl_callres = cl_reserve_buffer(cld, &cld->cl_buffer_vertex_color, &cld->vertex_color_capacity,
+		vertex_count + 1, 1, CL_MEM_READ_ONLY);
+	check(cl_callres != CL_SUCCESS, "Cannot create vertex_color buffer", cl_callres)
 
-	for (size_t vid = 1; vid < g->vertex_count + 1; vid++) {
-		vertex_color[vid] = g->vertex_row[vid].color_id;
-	}
-
-	cl_buffer_vertex_color = clCreateBuffer(
-		cld->context,
-		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-		g->vertex_count + 1,
+	cl_callres = clEnqueueWriteBuffer(
+		cld->command_queue,
+		cld->cl_buffer_vertex_color,
+		CL_TRUE, 0,
+		vertex_count + 1,
 		vertex_color,
-		&cl_callres
+		cl_chain_wait(cld), &event
 	);
-	check(cl_callres != CL_SUCCESS, "Cannot create vertex_color buffer", cl_callres)
-	
+	cl_callres = cl_chain_push(cld, cl_callres, event, "write vertex_color");
+	check(cl_callres != CL_SUCCESS, "Cannot write vertex_color buffer", cl_callres)
+	return EXIT_SUCCESS;
+}
 
+// vertex_color[id] for ids 0..vertex_count, 0 paints black
+int apply_color_table(struct cl_data_t* cld, struct bmp_map* bmp, const uint8_t* vertex_color, size_t vertex_count) {
+	cl_int cl_callres = CL_SUCCESS;
+	cl_kernel apply_colors = cld->kernels.apply_colors;
+
+	if (write_color_table(cld, vertex_color, vertex_count) != EXIT_SUCCESS) return EXIT_FAILURE;
 	
 	//printf("Applying colors to image object\n");
 
-	apply_colors = clCreateKernel(cld->program, "apply_colors", &cl_callres);
-	check(cl_callres != CL_SUCCESS, "Cannot create apply_colors kernel", cl_callres)
-
 	clSetKernelArg(apply_colors, 0, sizeof(cl_mem), (void*)&cld->cl_image_map);
 	clSetKernelArg(apply_colors, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
-	clSetKernelArg(apply_colors, 2, sizeof(cl_mem), (void*)&cl_buffer_vertex_color);
+	clSetKernelArg(apply_colors, 2, sizeof(cl_mem), (void*)&cld->cl_buffer_vertex_color);
+	clSetKernelArg(apply_colors, 3, sizeof(size_t), (void*)&bmp->image_width);
 
-	clFinish(cld->command_queue);
-
-	cl_callres = clEnqueueNDRangeKernel(
-		cld->command_queue,//command_queue,
-		apply_colors,
-		2, NULL, // offset
-		(size_t[2]) {bmp->image_width, bmp->image_height}, //g size
-		NULL, 0, NULL, NULL
-	);
+	cl_callres = cl_launch(cld, apply_colors, 2, (size_t[2]) { bmp->image_width, bmp->image_height });
 	check(cl_callres != CL_SUCCESS, "Kernel apply_colors execution error", cl_callres)
 
-	clFinish(cld->command_queue);
+	clFlush(cld->command_queue);
 	return EXIT_SUCCESS;
 }
 
+// color_ids is the color table as is
+int cl_apply_colors(struct cl_data_t* cld, struct bmp_map* bmp, struct graph_as_row_t* g) {
+	return apply_color_table(cld, bmp, g->color_ids, g->vertex_count);
+}
+
 
 int apply_colors_and_mask(struct cl_data_t* cld, struct bmp_map* bmp, struct graph_as_row_t* g) {
-	cl_int cl_callres = CL_SUCCESS;
-
 	if(g == NULL) cl_debug_output(cld, bmp);
 	else {
 		cl_apply_colors(cld, bmp, g);
 	}
+	return read_colored_map(cld, bmp);
+}
+
+// the painted image back into the bmp, drains the queue
+int read_colored_map(struct cl_data_t* cld, struct bmp_map* bmp) {
+	cl_int cl_callres = CL_SUCCESS;
+	cl_event event = NULL;
+
+	if (cld->image_uses_host_ptr) {
+		// mapping syncs the host pointer, which is the output file itself
+		size_t row_pitch = 0;
+		char* mapped = (char*)clEnqueueMapImage(
+			cld->command_queue,
+			cld->cl_image_map,
+			CL_TRUE,
+			CL_MAP_READ,
+			(size_t[3]) { 0, 0, 0 },
+			(size_t[3]) { bmp->image_width, bmp->image_height, 1 },
+			&row_pitch, NULL,
+			cl_chain_wait(cld), &event, &cl_callres
+		);
+		cl_callres = cl_chain_push(cld, cl_callres, event, "map image");
+		check(cl_callres != CL_SUCCESS, "Cannot map image", cl_callres)
+		if (mapped != bmp->linear_sequence) {
+			for (size_t y = 0; y < bmp->image_height; y++)
+				memcpy(bmp->linear_sequence + y * bmp->image_row_pitch, mapped + y * row_pitch, bmp->image_row_pitch);
+		}
+		cl_callres = clEnqueueUnmapMemObject(cld->command_queue, cld->cl_image_map, mapped,
+			cl_chain_wait(cld), &event);
+		cl_chain_push(cld, cl_callres, event, "unmap image");
+		clFinish(cld->command_queue);
+		cl_chain_reset(cld);
+
+		// the image must not outlive the mapping it wraps
+		release_mem_object(&cld->cl_image_map);
+		cld->image_uses_host_ptr = 0;
+		return EXIT_SUCCESS;
+	}
+
 	cl_callres = clEnqueueReadImage(
 		cld->command_queue, //command_queue,
 		cld->cl_image_map, //map,
@@ -847,9 +1631,104 @@ int apply_colors_and_mask(struct cl_data_t* cld, struct bmp_map* bmp, struct gra
 		(size_t[3]) { 0, 0, 0 },
 		(size_t[3]) { bmp->image_width, bmp->image_height, 1 },
 		bmp->image_row_pitch, 0,
-		bmp->linear_sequence, 0, NULL, NULL
+		bmp->linear_sequence, cl_chain_wait(cld), &event
 	);
+	cl_callres = cl_chain_push(cld, cl_callres, event, "read image");
+	check(cl_callres != CL_SUCCESS, "Cannot read image", cl_callres)
 
 	clFinish(cld->command_queue);
+	cl_chain_reset(cld);
+	return EXIT_SUCCESS;
+}
+
+static int setup_index_buffer(struct cl_data_t* cld, size_t size) {
+	cl_int cl_callres = cl_reserve_buffer(cld, &cld->cl_buffer_indices, &cld->indices_capacity,
+		size, 1, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR);
+	check(cl_callres != CL_SUCCESS, "Cannot create indices buffer", cl_callres)
 	return EXIT_SUCCESS;
+}
+
+// Two chunks are mapped at a time: the next one crosses the bus while the
+// host appends the current one to the file.
+int write_indexed_map(struct cl_data_t* cld, struct bmp_map* bmp, struct graph_as_row_t* g, const char* path) {
+	cl_int cl_callres = CL_SUCCESS;
+	cl_event mapped_ready[2] = { NULL, NULL }, unmapped[2] = { NULL, NULL };
+	unsigned char* mapped[2] = { NULL, NULL };
+	unsigned char palette[INDEX_PALETTE_SIZE][4];
+	struct bmp_indexed_t out;
+	cl_kernel color_indices = cld->kernels.color_indices;
+	cl_uint bits = cld->options.indexed_bits;
+	int callres = EXIT_SUCCESS;
+
+	memset(&out, 0, sizeof(out));
+	size_t row_pitch = bmp_indexed_row_pitch(bmp->image_width, bits);
+	size_t chunk_rows = INDEX_CHUNK_BYTES / row_pitch ? INDEX_CHUNK_BYTES / row_pitch : 1;
+	size_t chunk_count = (bmp->image_height + chunk_rows - 1) / chunk_rows;
+
+	for (size_t i = 0; i < INDEX_PALETTE_SIZE; i++) {
+		tiled_color_pixel(palette[i], i ? (color_id_t)1 << (i - 1) : 0);
+		palette[i][3] = 0;
+	}
+
+	check_goto_temp(write_color_table(cld, g->color_ids, g->vertex_count) != EXIT_SUCCESS,
+		"Cannot write color table", EXIT_FAILURE)
+	check_goto_temp(setup_index_buffer(cld, row_pitch * bmp->image_height) != EXIT_SUCCESS,
+		"Cannot setup indices buffer", EXIT_FAILURE)
+
+	clSetKernelArg(color_indices, 0, sizeof(cl_mem), (void*)&cld->cl_buffer_indices);
+	clSetKernelArg(color_indices, 1, sizeof(cl_mem), (void*)&cld->cl_buffer_mask);
+	clSetKernelArg(color_indices, 2, sizeof(cl_mem), (void*)&cld->cl_buffer_vertex_color);
+	clSetKernelArg(color_indices, 3, sizeof(size_t), (void*)&bmp->image_width);
+	clSetKernelArg(color_indices, 4, sizeof(size_t), (void*)&row_pitch);
+	clSetKernelArg(color_indices, 5, sizeof(cl_uint), (void*)&bits);
+	cl_callres = cl_launch(cld, color_indices, 2, (size_t[2]) { row_pitch, bmp->image_height });
+	check_goto_temp(cl_callres != CL_SUCCESS, "Kernel color_indices execution error", cl_callres)
+
+	check_goto_temp(bmp_indexed_create(&out, path, bmp, bits, (const unsigned char(*)[4])palette,
+		INDEX_PALETTE_SIZE) != EXIT_SUCCESS, "Cannot create indexed output", EXIT_FAILURE)
+
+	for (size_t c = 0; c <= chunk_count; c++) {
+		// c maps chunk c, then writes chunk c - 1
+		if (c < chunk_count) {
+			size_t slot = c % 2, y0 = c * chunk_rows;
+			size_t rows = bmp->image_height - y0 < chunk_rows ? bmp->image_height - y0 : chunk_rows;
+			cl_event event = NULL;
+			mapped[slot] = (unsigned char*)clEnqueueMapBuffer(cld->command_queue, cld->cl_buffer_indices,
+				CL_FALSE, CL_MAP_READ, y0 * row_pitch, rows * row_pitch,
+				cl_chain_wait(cld), &event, &cl_callres);
+			cl_callres = cl_branch_push(cld, cl_callres, event, "map indices", mapped_ready + slot);
+			check_goto_temp(cl_callres != CL_SUCCESS, "Cannot map indices", cl_callres)
+		}
+		if (c > 0) {
+			size_t slot = (c - 1) % 2, y0 = (c - 1) * chunk_rows;
+			size_t rows = bmp->image_height - y0 < chunk_rows ? bmp->image_height - y0 : chunk_rows;
+			cl_event event = NULL;
+			check_goto_temp(cl_branch_wait(mapped_ready + slot) != CL_SUCCESS, "Cannot map indices", EXIT_FAILURE)
+			check_goto_temp(bmp_indexed_write_rows(&out, mapped[slot], rows) != EXIT_SUCCESS,
+				"Cannot write indexed rows", EXIT_FAILURE)
+			cl_callres = clEnqueueUnmapMemObject(cld->command_queue, cld->cl_buffer_indices, mapped[slot],
+				0, NULL, &event);
+			mapped[slot] = NULL;
+			cl_callres = cl_branch_push(cld, cl_callres, event, "unmap indices", unmapped + slot);
+			check_goto_temp(cl_callres != CL_SUCCESS, "Cannot unmap indices", cl_callres)
+		}
+	}
+
+free_temporary_resources:
+	for (size_t slot = 0; slot < 2; slot++) {
+		cl_branch_wait(mapped_ready + slot);
+		if (mapped[slot])
+			clEnqueueUnmapMemObject(cld->command_queue, cld->cl_buffer_indices, mapped[slot], 0, NULL, NULL);
+	}
+	clFinish(cld->command_queue);
+	release_event(unmapped);
+	release_event(unmapped + 1);
+	cl_chain_reset(cld);
+	// the image must not outlive the mapping it wraps
+	if (cld->image_uses_host_ptr) {
+		release_mem_object(&cld->cl_image_map);
+		cld->image_uses_host_ptr = 0;
+	}
+	if (out.file && bmp_indexed_close(&out) != EXIT_SUCCESS) callres = EXIT_FAILURE;
+	return callres;
 }
\ No newline at end of file
@@ -1,3 +1,5 @@
+#pragma once
+
 
 #ifdef _WIN32
 #define _CRT_SECURE_NO_WARNINGS
@@ -7,29 +9,202 @@
 
 #include "map_file.h"
 #include "graph_essentials.h"
+#include "cpu_labeling.h"
+#include "program_cache.h"
+#include "profiler.h"
+#include "kernels_source.h"
 #include "macros.h"
 
+enum labeling_backend_t {
+	LABELING_OPENCL, // label equivalence, runs to convergence
+	LABELING_OPENCL_LEGACY, // premask_area spreading with a fixed timeout
+	LABELING_CPU
+};
+
+struct map_options_t {
+	enum labeling_backend_t labeling_backend;
+	size_t thread_count; // 0 - all cores
+	unsigned char parallel_coloring;
+
+	unsigned char program_cache;
+	const char* program_cache_dir;
+	const char* kernel_file; // NULL - embedded kernels.cl
+
+	struct border_predicate_t border; // zero - BORDER_CHANNEL
+	enum GRAPH_STORAGE graph_storage;
+	size_t edge_search_limit; // 0 - EDGE_SEARCH_LIMIT
+	size_t tile_rows; // 0 - whole map on the device, else strips on the host
+	size_t device_bands; // 0 - one device, else row bands over up to N devices
+	unsigned char numa_bands; // CPU devices split into NUMA sub-devices
+
+	unsigned char batch; // input is a directory or list file, output a directory
+	unsigned char autotune; // sweep launch shapes and devices on the input map first
+	unsigned char region_stats; // per-area stats and shared border lengths with the graph
+	unsigned char indexed_bits; // 0 - 32-bit BGRA output, else an 8 or 4-bit palettized file
+
+	const char* state_file; // region state saved after a full run, read by incremental ones
+	unsigned char incremental; // input: the edited map, output: its previous result
+	const char* diff_file; // changed pixels are non-zero
+	size_t dirty_box[4]; // x0 y0 x1 y1 of the changed pixels, x1 == 0 - not set
+
+	const char* index_file; // region index export, see region_index.h
+	unsigned char index_rle; // the index raster as runs
+
+	struct profiler_t* profiler; // NULL - no events recorded
+	const char* trace_file;
+
+	unsigned char huge_pages; // the host arena on 2 MB pages, see host_arena_t
+};
+
+struct cl_kernels_t {
+	cl_kernel pack_border;
+	cl_kernel set_gid_row;
+	cl_kernel premask_area;
+	cl_kernel normalise_mask_area;
+	cl_kernel apply_parent_gid;
+	cl_kernel normalise_gid;
+	cl_kernel fix_gid;
+	cl_kernel finalize_mask;
+	cl_kernel init_labels;
+	cl_kernel scan_labels;
+	cl_kernel analyse_labels;
+	cl_kernel relabel_mask;
+	cl_kernel count_label_roots;
+	cl_kernel scan_label_blocks;
+	cl_kernel number_label_roots;
+	cl_kernel label_tiles;
+	cl_kernel merge_tile_seams;
+	cl_kernel resolve_labels;
+	cl_kernel build_edges;
+	cl_kernel debug_output;
+	cl_kernel apply_colors;
+	cl_kernel color_indices;
+	cl_kernel gather_edge_walks;
+	cl_kernel region_stats;
+};
+
+#define KERNEL_COUNT (sizeof(struct cl_kernels_t) / sizeof(cl_kernel))
+
+#define CL_POOL_SIZE 16
+
+// Buffers a slot has outgrown, kept for the next slot that asks for one of
+// the same flags; released with the environment.
+struct cl_pool_t {
+	cl_mem buffer[CL_POOL_SIZE];
+	size_t size[CL_POOL_SIZE]; // bytes
+	cl_mem_flags flags[CL_POOL_SIZE];
+	size_t count;
+};
+
 struct cl_data_t {
+	struct map_options_t options;
+
+
 	cl_device_id device;
 	cl_context context;
 	cl_command_queue command_queue;
+	unsigned char out_of_order;
 	cl_program program;
+	struct cl_kernels_t kernels;
 
 	cl_mem cl_image_map;
 	cl_mem cl_buffer_mask;
+	cl_mem cl_buffer_border; // 1 bit per pixel, OpenCL labeling only
 	
 	cl_mem cl_buffer_gid_row_index;
 	cl_mem cl_buffer_gid_row;
+	cl_mem cl_buffer_label_changed;
+	cl_mem cl_buffer_label_blocks;
+	cl_mem cl_buffer_label_total;
+	cl_mem cl_buffer_vertex_color;
+	cl_mem cl_buffer_edges;
+	cl_mem cl_buffer_edge_table;
+	cl_mem cl_buffer_edge_count;
+	cl_mem cl_buffer_indices; // palettized rows of write_indexed_map
+	cl_mem cl_buffer_slot_walks; // build_edges walks per edge table slot, region_stats only
+	cl_mem cl_buffer_edge_walks; // table slot, then walks, per edge
+	cl_mem cl_buffer_region_stats; // REGION_STAT_WORDS per area
+
+	// buffers only grow, in size classes (cl_reserve_buffer), so a batch of
+	// maps reuses them; capacities count elements
+	size_t image_capacity_width;
+	size_t image_capacity_height;
+	size_t mask_capacity;
+	size_t border_capacity; // words
+	size_t gid_row_capacity;
+	size_t label_block_capacity;
+	size_t vertex_color_capacity;
+	size_t edge_table_size; // slots of the last build_edges, a power of two
+	size_t edge_table_capacity;
+	size_t edges_capacity;
+	size_t indices_capacity; // bytes
+	size_t slot_walks_capacity;
+	size_t edge_walks_capacity;
+	size_t region_stats_capacity; // cl_uint words
+	struct cl_pool_t pool;
+	// cl_image_map wraps the current map's pixels and lives for one map only
+	unsigned char image_uses_host_ptr;
+	// the map goes to a private image even where it could be wrapped
+	unsigned char private_image;
+
+	unsigned char queue_profiling; // timestamps without a profiler
+
+	// work-group shape per kernel (cl_kernels_t order), 0 - driver default;
+	// loaded from the device's launch profile, see autotune.h
+	size_t launch_local[KERNEL_COUNT][2];
+	cl_uint launch_dims[KERNEL_COUNT]; // set by the first tunable launch of a kernel
+
+	// Commands wait for the tail of the chain and become the new tail, side
+	// branches (fills, small readbacks) keep their own events and are joined
+	// or waited for where needed; the host waits only on readbacks it uses.
+	cl_event chain;
+	cl_event label_total_ready; // label_total read, vertex_count is valid after it
+	cl_event edge_state_ready;
+	cl_uint label_total;
+	cl_uint edge_state[2]; // edge count, table overflow
 
 	mask_cell* mask_row;
 	size_t vertex_count;
+
+	// host scratch of the current map: labeling, edges, graph and coloring;
+	// batch_run resets it between maps, the environment releases it
+	struct host_arena_t arena;
 };
 
 #define usedcount 1
-#define MAX_KERNEL_FILE_SIZE 0x8FFF
+#define LABEL_TILE_SIZE 16 // label_tiles work-group side, passed to the kernels as LABEL_TILE
+#define KERNEL_BUILD_OPTIONS "-D LABEL_TILE=" stringify_value(LABEL_TILE_SIZE)
+#define LABEL_BLOCK_SIZE 1024 // labels numbered by one work-item in compaction
+#define LABEL_SCAN_GROUP 256 // scan_label_blocks work-group, at most
+#define EDGE_SEARCH_LIMIT 32 // widest border (pixels) still linking two areas
+#define REGION_STAT_WORDS 9 // see the region_stats kernel
+#define INDEX_PALETTE_SIZE 7 // black and the six colors of apply_colors
+#define INDEX_CHUNK_BYTES ((size_t)4 << 20) // indexed rows mapped back at a time
+#define CL_POOL_MIN_CLASS ((size_t)4 << 10) // bytes, the smallest buffer size class
 
-int setup_environment(const char*, struct cl_data_t*, struct bmp_map*);
+int setup_environment(const char*, struct cl_data_t*, struct bmp_map*, const struct map_options_t*);
+int setup_shared_buffers(struct cl_data_t*, struct bmp_map*);
 int parse_map(struct cl_data_t*, struct bmp_map*);
 int apply_colors_and_mask(struct cl_data_t*, struct bmp_map*, struct graph_as_row_t*);
+// apply_colors_and_mask for options.indexed_bits: palette indices made on the
+// device and appended to a new file chunk by chunk, the bmp is only read
+int write_indexed_map(struct cl_data_t*, struct bmp_map*, struct graph_as_row_t*, const char* path);
+// the graph's arrays come from cld->arena, see release_map_graph
 int build_graph(struct graph_as_row_t*, struct cl_data_t*, struct bmp_map*, unsigned char);
-void distruct_environment(struct cl_data_t*, struct bmp_map*);
\ No newline at end of file
+// the graph of build_graph and the host scratch of its map, the environment
+// and its buffers stay for the next map
+void release_map_graph(struct cl_data_t*, struct graph_as_row_t*);
+void init_setup_environment(struct cl_data_t*);
+int list_devices(cl_device_id**, size_t*); // every device of every platform
+void distruct_environment(struct cl_data_t*, struct bmp_map*);
+
+// the steps of build_graph and apply_colors_and_mask for callers that merge
+// several maps into one graph (device_bands.h); the device and the labels
+// stay put, only the edge list, mask rows and color table cross to the host
+int setup_queue(struct cl_data_t*);
+int setup_environment_on_device(const char*, struct cl_data_t*, cl_device_id, const struct map_options_t*);
+int enqueue_edge_list(struct cl_data_t*, struct bmp_map*); // vertex_count is valid after it
+int read_edge_list(struct cl_data_t*, struct bmp_map*, struct graph_edge_t**, size_t*); // from the host arena
+int read_mask_rows(struct cl_data_t*, struct bmp_map*, size_t y0, size_t rows, mask_cell*);
+int apply_color_table(struct cl_data_t*, struct bmp_map*, const uint8_t*, size_t);
+int read_colored_map(struct cl_data_t*, struct bmp_map*);
\ No newline at end of file
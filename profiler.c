@@ -0,0 +1,193 @@
+#include "profiler.h"
+
+#include <string.h>
+
+#define PROFILER_MAX_ROWS 128
+
+struct profiler_row_t {
+	const char* name;
+	enum profiler_track_t track;
+	size_t calls;
+	double total;
+	double max;
+	double wait; // device: start - queued
+};
+
+int profiler_init(struct profiler_t* p) {
+	memset(p, 0, sizeof(struct profiler_t));
+	p->origin = host_wall_time();
+	return EXIT_SUCCESS;
+}
+
+void distruct_profiler(struct profiler_t* p) {
+	for (size_t i = 0; i < p->count; i++)
+		if (p->spans[i].event) clReleaseEvent(p->spans[i].event);
+	free(p->spans);
+	memset(p, 0, sizeof(struct profiler_t));
+}
+
+static struct profiler_span_t* profiler_push(struct profiler_t* p, const char* name, enum profiler_track_t track) {
+	if (p->count == p->capacity) {
+		size_t new_capacity = p->capacity ? p->capacity * 2 : 256;
+		struct profiler_span_t* grown = (struct profiler_span_t*)realloc(p->spans,
+			new_capacity * sizeof(struct profiler_span_t));
+		if (grown == NULL) return NULL;
+		p->spans = grown;
+		p->capacity = new_capacity;
+	}
+	struct profiler_span_t* s = p->spans + p->count++;
+	memset(s, 0, sizeof(struct profiler_span_t));
+	snprintf(s->name, sizeof(s->name), "%s", name);
+	s->track = track;
+	return s;
+}
+
+size_t profiler_begin(struct profiler_t* p, const char* name) {
+	if (p == NULL) return 0;
+	struct profiler_span_t* s = profiler_push(p, name, PROFILER_HOST);
+	if (s == NULL) return (size_t)-1;
+	s->start = s->queued = s->submit = host_wall_time() - p->origin;
+	s->end = s->start;
+	s->recorded = 1;
+	return p->count - 1;
+}
+
+void profiler_end(struct profiler_t* p, size_t span) {
+	if (p == NULL || span >= p->count) return;
+	p->spans[span].end = host_wall_time() - p->origin;
+}
+
+void profiler_add_event(struct profiler_t* p, const char* name, cl_event event) {
+	if (p == NULL || event == NULL) return;
+	struct profiler_span_t* s = profiler_push(p, name, PROFILER_DEVICE);
+	if (s == NULL) return;
+	s->enqueued = host_wall_time();
+	s->event = event;
+	clRetainEvent(event);
+}
+
+void profiler_add_kernel_event(struct profiler_t* p, cl_kernel kernel, cl_event event) {
+	if (p == NULL) return;
+	char name[PROFILER_NAME_SIZE] = "kernel";
+	clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name), name, NULL);
+	name[PROFILER_NAME_SIZE - 1] = 0;
+	profiler_add_event(p, name, event);
+}
+
+int profiler_collect(struct profiler_t* p) {
+	if (p == NULL) return EXIT_SUCCESS;
+	int callres = EXIT_SUCCESS;
+
+	for (size_t i = 0; i < p->count; i++) {
+		struct profiler_span_t* s = p->spans + i;
+		if (s->recorded || s->event == NULL) continue;
+
+		cl_ulong t[4] = { 0, 0, 0, 0 };
+		cl_int cl_callres = clWaitForEvents(1, &s->event);
+		cl_callres |= clGetEventProfilingInfo(s->event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), t, NULL);
+		cl_callres |= clGetEventProfilingInfo(s->event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), t + 1, NULL);
+		cl_callres |= clGetEventProfilingInfo(s->event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), t + 2, NULL);
+		cl_callres |= clGetEventProfilingInfo(s->event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), t + 3, NULL);
+		clReleaseEvent(s->event);
+		s->event = NULL;
+		if (cl_callres != CL_SUCCESS) {
+			callres = EXIT_FAILURE;
+			continue;
+		}
+
+		// the device clock has its own epoch; the queued stamp is taken on
+		// the enqueue call, so the first one pins it to the host clock
+		if (!p->device_aligned) {
+			p->device_offset = s->enqueued - (double)t[0] * 1e-9;
+			p->device_aligned = 1;
+		}
+		double base = p->device_offset - p->origin;
+		s->queued = base + (double)t[0] * 1e-9;
+		s->submit = base + (double)t[1] * 1e-9;
+		s->start = base + (double)t[2] * 1e-9;
+		s->end = base + (double)t[3] * 1e-9;
+		s->recorded = 1;
+	}
+
+	if (callres != EXIT_SUCCESS)
+		printf("\n\t< Some profiling events had no timestamps (queue without profiling?).\n");
+	return callres;
+}
+
+int profiler_write_trace(struct profiler_t* p, const char* path) {
+	if (p == NULL) return EXIT_SUCCESS;
+	FILE* f = fopen(path, "w");
+	check(f == NULL, "Cannot open trace file", EXIT_FAILURE)
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"host\"}},\n", PROFILER_HOST);
+	fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"device\"}}", PROFILER_DEVICE);
+
+	for (size_t i = 0; i < p->count; i++) {
+		struct profiler_span_t* s = p->spans + i;
+		if (!s->recorded) continue;
+
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+			"\"ts\":%.3f,\"dur\":%.3f",
+			s->name, s->track == PROFILER_HOST ? "stage" : "command", s->track,
+			s->start * 1e6, (s->end - s->start) * 1e6);
+		if (s->track == PROFILER_DEVICE)
+			fprintf(f, ",\"args\":{\"queued_us\":%.3f,\"submit_us\":%.3f,\"wait_us\":%.3f}",
+				s->queued * 1e6, s->submit * 1e6, (s->start - s->queued) * 1e6);
+		fprintf(f, "}");
+	}
+
+	fprintf(f, "\n]}\n");
+	int failed = ferror(f);
+	fclose(f);
+	check(failed, "Cannot write trace file", EXIT_FAILURE)
+	return EXIT_SUCCESS;
+}
+
+static int profiler_row_compare(const void* a, const void* b) {
+	const struct profiler_row_t* ra = (const struct profiler_row_t*)a;
+	const struct profiler_row_t* rb = (const struct profiler_row_t*)b;
+	if (ra->track != rb->track) return ra->track < rb->track ? -1 : 1;
+	if (ra->total != rb->total) return ra->total > rb->total ? -1 : 1;
+	return 0;
+}
+
+void profiler_print_summary(struct profiler_t* p) {
+	if (p == NULL) return;
+	struct profiler_row_t rows[PROFILER_MAX_ROWS];
+	size_t row_count = 0;
+
+	for (size_t i = 0; i < p->count; i++) {
+		struct profiler_span_t* s = p->spans + i;
+		if (!s->recorded) continue;
+
+		size_t r = 0;
+		while (r < row_count && (rows[r].track != s->track || strcmp(rows[r].name, s->name) != 0)) r++;
+		if (r == row_count) {
+			if (row_count == PROFILER_MAX_ROWS) continue;
+			memset(rows + r, 0, sizeof(struct profiler_row_t));
+			rows[r].name = s->name;
+			rows[r].track = s->track;
+			row_count++;
+		}
+
+		double duration = s->end - s->start;
+		rows[r].calls++;
+		rows[r].total += duration;
+		if (duration > rows[r].max) rows[r].max = duration;
+		if (s->track == PROFILER_DEVICE) rows[r].wait += s->start - s->queued;
+	}
+
+	qsort(rows, row_count, sizeof(struct profiler_row_t), profiler_row_compare);
+
+	printf("\n\t< Profile (ms):\n\t  %-6s %-28s %8s %12s %10s %10s %12s\n",
+		"track", "name", "calls", "total", "mean", "max", "queue wait");
+	for (size_t r = 0; r < row_count; r++) {
+		printf("\t  %-6s %-28s %8lu %12.3f %10.3f %10.3f",
+			rows[r].track == PROFILER_HOST ? "host" : "device", rows[r].name,
+			(unsigned long)rows[r].calls, rows[r].total * 1e3,
+			rows[r].total * 1e3 / rows[r].calls, rows[r].max * 1e3);
+		if (rows[r].track == PROFILER_DEVICE) printf(" %12.3f\n", rows[r].wait * 1e3);
+		else printf(" %12s\n", "-");
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <CL/opencl.h>
+#include <stdio.h>
+
+#include "host_platform.h"
+#include "macros.h"
+
+#define PROFILER_NAME_SIZE 48
+
+enum profiler_track_t {
+	PROFILER_HOST,
+	PROFILER_DEVICE
+};
+
+// one host stage or one queue command; times are seconds since the profiler origin
+struct profiler_span_t {
+	char name[PROFILER_NAME_SIZE];
+	enum profiler_track_t track;
+	unsigned char recorded; // times below are valid
+	cl_event event; // device spans until collected
+	double enqueued; // host time of the enqueue call, aligns the device clock
+	double queued, submit, start, end;
+};
+
+// Records host stages (host_wall_time) and queue commands (profiling events),
+// exported as a Chrome trace (chrome://tracing, ui.perfetto.dev) and a
+// per-name summary. Every call accepts NULL, so profiling off costs nothing
+// at the call sites.
+struct profiler_t {
+	struct profiler_span_t* spans;
+	size_t count;
+	size_t capacity;
+	double origin;
+	double device_offset; // host seconds minus device seconds, set by the first event
+	unsigned char device_aligned;
+};
+
+int profiler_init(struct profiler_t*);
+void distruct_profiler(struct profiler_t*);
+
+// host stage, returns the span to close with profiler_end
+size_t profiler_begin(struct profiler_t*, const char* name);
+void profiler_end(struct profiler_t*, size_t span);
+
+// records a queue command; the event is retained, the caller keeps its reference
+void profiler_add_event(struct profiler_t*, const char* name, cl_event);
+void profiler_add_kernel_event(struct profiler_t*, cl_kernel, cl_event);
+
+// waits for the recorded commands, reads and releases their events
+int profiler_collect(struct profiler_t*);
+
+int profiler_write_trace(struct profiler_t*, const char* path);
+void profiler_print_summary(struct profiler_t*);
@@ -0,0 +1,221 @@
+#include "program_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define program_cache_hash_seed		0xcbf29ce484222325ULL
+#define program_cache_hash_prime	0x00000100000001b3ULL
+#define program_cache_path_size		1024
+
+struct program_cache_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint64_t binary_size;
+};
+
+// FNV-1a
+uint64_t program_cache_hash(uint64_t hash, const void* data, size_t size) {
+	const unsigned char* p = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= p[i];
+		hash *= program_cache_hash_prime;
+	}
+	return hash;
+}
+
+static uint64_t program_cache_hash_string(uint64_t hash, const char* s) {
+	if (s) hash = program_cache_hash(hash, s, strlen(s));
+	return program_cache_hash(hash, "\n", 1);
+}
+
+static uint64_t program_cache_hash_device_info(uint64_t hash, cl_device_id device, cl_device_info param) {
+	char value[1024] = { 0 };
+	clGetDeviceInfo(device, param, sizeof(value) - 1, value, NULL);
+	return program_cache_hash_string(hash, value);
+}
+
+uint64_t program_cache_device_key(cl_device_id device) {
+	uint64_t hash = program_cache_hash_seed;
+	hash = program_cache_hash_device_info(hash, device, CL_DEVICE_NAME);
+	return program_cache_hash_device_info(hash, device, CL_DRIVER_VERSION);
+}
+
+static uint64_t program_cache_key(cl_device_id device, const char** sources, size_t source_count,
+	const char* build_options
+) {
+	uint64_t hash = program_cache_device_key(device);
+	hash = program_cache_hash_string(hash, build_options);
+
+	uint64_t source_hash = program_cache_hash_seed;
+	for (size_t i = 0; i < source_count; i++)
+		source_hash = program_cache_hash(source_hash, sources[i], strlen(sources[i]));
+
+	return program_cache_hash(hash, &source_hash, sizeof(source_hash));
+}
+
+const char* program_cache_default_dir(void) {
+	const char* dir = getenv("MAP_COLOR_CACHE_DIR");
+	if (dir && *dir) return dir;
+#ifdef _WIN32
+	dir = getenv("TEMP");
+	if (dir == NULL || *dir == 0) dir = getenv("TMP");
+#else
+	dir = getenv("TMPDIR");
+	if (dir == NULL || *dir == 0) dir = "/tmp";
+#endif
+	return (dir && *dir) ? dir : ".";
+}
+
+static int program_cache_load(cl_context context, cl_device_id device, const char* path,
+	uint64_t key, const char* build_options, cl_program* program
+) {
+	struct program_cache_header_t header;
+	unsigned char* binary = NULL;
+	cl_int cl_callres = CL_SUCCESS, binary_status = CL_SUCCESS;
+	int callres = EXIT_FAILURE;
+
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) return EXIT_FAILURE; // plain miss
+
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+		header.magic != PROGRAM_CACHE_MAGIC ||
+		header.version != PROGRAM_CACHE_VERSION ||
+		header.key != key || header.binary_size == 0) temp
+
+	binary = (unsigned char*)malloc((size_t)header.binary_size);
+	if (binary == NULL) temp
+	if (fread(binary, 1, (size_t)header.binary_size, f) != header.binary_size) temp
+
+	size_t binary_size = (size_t)header.binary_size;
+	*program = clCreateProgramWithBinary(
+		context, 1, &device,
+		&binary_size,
+		(const unsigned char**)&binary,
+		&binary_status,
+		&cl_callres
+	);
+	if (cl_callres != CL_SUCCESS || binary_status != CL_SUCCESS) temp
+
+	cl_callres = clBuildProgram(*program, 1, &device, build_options, NULL, NULL);
+	if (cl_callres != CL_SUCCESS) temp
+
+	callres = EXIT_SUCCESS;
+
+free_temporary_resources:
+	if (callres != EXIT_SUCCESS && *program) {
+		clReleaseProgram(*program);
+		*program = NULL;
+	}
+	if (binary) free(binary);
+	fclose(f);
+	return callres;
+}
+
+static int program_cache_store(cl_program program, const char* path, uint64_t key) {
+	struct program_cache_header_t header = { PROGRAM_CACHE_MAGIC, PROGRAM_CACHE_VERSION, key, 0 };
+	char tmp_path[program_cache_path_size + 8];
+	unsigned char* binary = NULL;
+	size_t binary_size = 0;
+	FILE* f = NULL;
+	int callres = EXIT_SUCCESS;
+
+	cl_int cl_callres = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
+		sizeof(size_t), &binary_size, NULL);
+	check_goto_temp(cl_callres != CL_SUCCESS || binary_size == 0, "Cannot get program binary size", cl_callres)
+
+	binary = (unsigned char*)malloc(binary_size);
+	check_goto_temp(binary == NULL, "Cannot allocate memory for program binary", EXIT_FAILURE)
+
+	cl_callres = clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+		sizeof(unsigned char*), &binary, NULL);
+	check_goto_temp(cl_callres != CL_SUCCESS, "Cannot get program binary", cl_callres)
+
+	// write aside and rename, so a concurrent run never sees half a file
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	f = fopen(tmp_path, "wb");
+	check_goto_temp(f == NULL, "Cannot open program cache file", EXIT_FAILURE)
+
+	header.binary_size = binary_size;
+	if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+		fwrite(binary, 1, binary_size, f) != binary_size) {
+		fclose(f); f = NULL;
+		remove(tmp_path);
+		check_goto_temp(1, "Cannot write program cache file", EXIT_FAILURE)
+	}
+	fclose(f); f = NULL;
+
+	remove(path);
+	check_goto_temp(rename(tmp_path, path) != 0, "Cannot rename program cache file", EXIT_FAILURE)
+
+free_temporary_resources:
+	if (binary) free(binary);
+	return callres;
+}
+
+static void program_print_build_log(cl_program program, cl_device_id device) {
+	size_t log_size = 0;
+	if (clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size) != CL_SUCCESS ||
+		log_size == 0) return;
+
+	char* log = (char*)calloc(log_size + 1, sizeof(char));
+	if (log == NULL) return;
+	clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
+	printf("\n%s\n", log);
+	free(log);
+}
+
+static int program_build_source(cl_context context, cl_device_id device, const char** sources,
+	size_t source_count, const char* build_options, cl_program* program
+) {
+	cl_int cl_callres = CL_SUCCESS;
+
+	*program = clCreateProgramWithSource(
+		context,
+		(cl_uint)source_count,
+		sources,
+		NULL, // null terminated
+		&cl_callres
+	);
+	check(cl_callres != CL_SUCCESS, "Cannot create program", cl_callres)
+
+	cl_callres = clBuildProgram(*program, 1, &device, build_options, NULL, NULL);
+	if (cl_callres != CL_SUCCESS) program_print_build_log(*program, device);
+	check(cl_callres != CL_SUCCESS, "Cannot build program", cl_callres)
+
+	return EXIT_SUCCESS;
+}
+
+int program_cache_build(
+	cl_context context,
+	cl_device_id device,
+	const char** sources,
+	size_t source_count,
+	const char* build_options,
+	const char* cache_dir,
+	cl_program* program
+) {
+	char path[program_cache_path_size];
+	uint64_t key = 0;
+
+	*program = NULL;
+
+	if (cache_dir) {
+		key = program_cache_key(device, sources, source_count, build_options);
+		snprintf(path, sizeof(path), "%s/map_color_%016llx.clbin", cache_dir, (unsigned long long)key);
+
+		if (program_cache_load(context, device, path, key, build_options, program) == EXIT_SUCCESS) {
+			printf("\n\t< Program loaded from cache: %s;\n", path);
+			return EXIT_SUCCESS;
+		}
+	}
+
+	if (program_build_source(context, device, sources, source_count, build_options, program) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	// a failed store only costs the next run a rebuild
+	if (cache_dir && program_cache_store(*program, path, key) == EXIT_SUCCESS)
+		printf("\n\t< Program stored to cache: %s;\n", path);
+
+	return EXIT_SUCCESS;
+}
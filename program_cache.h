@@ -0,0 +1,34 @@
+#pragma once
+
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <CL/opencl.h>
+#include <stdint.h>
+
+#include "macros.h"
+
+#define PROGRAM_CACHE_MAGIC		0x4250434Du // 'MCPB'
+#define PROGRAM_CACHE_VERSION	1
+
+// Builds a program for one device. With a cache_dir the compiled binary is
+// stored under a key of device name, driver version, build options and
+// source hash, and loaded with clCreateProgramWithBinary next time.
+// Falls back to the source build on any cache miss or stale binary.
+int program_cache_build(
+	cl_context context,
+	cl_device_id device,
+	const char** sources,
+	size_t source_count,
+	const char* build_options,
+	const char* cache_dir, // NULL - no cache
+	cl_program* program
+);
+
+// default directory: MAP_COLOR_CACHE_DIR, then the temp directory
+const char* program_cache_default_dir(void);
+
+uint64_t program_cache_hash(uint64_t hash, const void* data, size_t size);
+// device name and driver version, also keys the launch profiles (autotune.h)
+uint64_t program_cache_device_key(cl_device_id);
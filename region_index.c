@@ -0,0 +1,196 @@
+#include "region_index.h"
+
+#define region_index_align(V) (((V) + 7) & ~(uint64_t)7)
+#define region_index_run_buffer 4096
+
+static int region_index_pad(FILE* f, uint64_t* position, uint64_t offset) {
+	static const unsigned char zeros[8] = { 0 };
+	size_t pad = (size_t)(offset - *position);
+	if (pad && fwrite(zeros, 1, pad, f) != pad) return EXIT_FAILURE;
+	*position = offset;
+	return EXIT_SUCCESS;
+}
+
+static int region_index_put(FILE* f, uint64_t* position, const void* data, size_t size, size_t count) {
+	if (count && fwrite(data, size, count, f) != count) return EXIT_FAILURE;
+	*position += (uint64_t)size * count;
+	return EXIT_SUCCESS;
+}
+
+static int region_index_compare(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+// runs start where the label changes and at every row start
+static uint64_t region_index_count_runs(const mask_cell* mask, size_t width, size_t height, uint64_t* row_runs) {
+	uint64_t runs = 0;
+	for (size_t y = 0; y < height; y++) {
+		const mask_cell* row = mask + y * width;
+		row_runs[y] = runs;
+		runs++;
+		for (size_t x = 1; x < width; x++) runs += row[x] != row[x - 1];
+	}
+	row_runs[height] = runs;
+	return runs;
+}
+
+static int region_index_put_runs(FILE* f, uint64_t* position, const mask_cell* mask, size_t width, size_t height) {
+	struct region_index_run_t runs[region_index_run_buffer];
+	size_t count = 0;
+
+	for (size_t y = 0; y < height; y++) {
+		const mask_cell* row = mask + y * width;
+		for (size_t x = 0; x < width; x++) {
+			if (x && row[x] == row[x - 1]) continue;
+			runs[count].x = (uint32_t)x;
+			runs[count].label = row[x];
+			if (++count == region_index_run_buffer) {
+				if (region_index_put(f, position, runs, sizeof(runs[0]), count) != EXIT_SUCCESS) return EXIT_FAILURE;
+				count = 0;
+			}
+		}
+	}
+	return region_index_put(f, position, runs, sizeof(runs[0]), count);
+}
+
+int region_index_write(const char* path, size_t width, size_t height, const mask_cell* mask,
+	struct graph_as_row_t* g, unsigned char rle
+) {
+	struct region_index_header_t header;
+	struct region_index_region_t* regions = NULL;
+	uint64_t* adjacency_offsets = NULL;
+	uint64_t* row_runs = NULL;
+	uint64_t* sums = NULL;
+	uint32_t* adjacency = NULL;
+	size_t* dense_offsets = NULL;
+	gid_t* dense_adjacency = NULL;
+	size_t vertex_count = g->vertex_count;
+	uint64_t position = 0;
+	FILE* f = NULL;
+	int callres = EXIT_SUCCESS;
+
+	check(width >= UINT32_MAX || height >= UINT32_MAX, "Map is too large for a region index", EXIT_FAILURE)
+
+	// dense graphs go through a CSR copy, sparse ones are already laid out
+	const size_t* offsets = g->adjacency_offsets;
+	const gid_t* neighbours = g->adjacency;
+	if (g->storage == GRAPH_DENSE) {
+		check_goto_temp(graph_dense_to_sparse(g, &dense_offsets, &dense_adjacency) != EXIT_SUCCESS,
+			"Cannot convert dense graph", EXIT_FAILURE)
+		offsets = dense_offsets;
+		neighbours = dense_adjacency;
+	}
+	size_t adjacency_count = offsets[vertex_count + 1];
+
+	regions = (struct region_index_region_t*)calloc(vertex_count + 1, sizeof(struct region_index_region_t));
+	adjacency_offsets = (uint64_t*)calloc(vertex_count + 2, sizeof(uint64_t));
+	adjacency = (uint32_t*)malloc((adjacency_count + 1) * sizeof(uint32_t));
+	// x and y sums for the centroids, -stats has them already
+	if (g->region_stats == NULL) sums = (uint64_t*)calloc(2 * (vertex_count + 1), sizeof(uint64_t));
+	check_goto_temp(!regions || !adjacency_offsets || !adjacency || (!g->region_stats && !sums),
+		"Cannot allocate region index", EXIT_FAILURE)
+
+	for (size_t y = 0, i = 0; y < height; y++) {
+		for (size_t x = 0; x < width; x++, i++) {
+			mask_cell v = mask[i];
+			if (v > vertex_count) continue;
+			struct region_index_region_t* r = regions + v;
+			if (sums) { sums[2 * v] += x; sums[2 * v + 1] += y; }
+			if (r->pixel_count++ == 0) {
+				r->x0 = (uint32_t)x; r->y0 = (uint32_t)y;
+				r->x1 = (uint32_t)(x + 1); r->y1 = (uint32_t)(y + 1);
+				continue;
+			}
+			if (x < r->x0) r->x0 = (uint32_t)x;
+			if (x + 1 > r->x1) r->x1 = (uint32_t)(x + 1);
+			r->y1 = (uint32_t)(y + 1);
+		}
+	}
+
+	// neighbours ascending per region: graph_link_sparse sorts the sparse rows,
+	// which keeps adjacency_border aligned, only the dense copy is sorted here
+	for (size_t v = 0; v < vertex_count + 2; v++) adjacency_offsets[v] = offsets[v];
+	for (size_t i = 0; i < adjacency_count; i++) adjacency[i] = (uint32_t)neighbours[i];
+	for (size_t v = 1; v < vertex_count + 1; v++) {
+		size_t degree = offsets[v + 1] - offsets[v];
+		if (dense_offsets && degree > 1) qsort(adjacency + offsets[v], degree, sizeof(uint32_t), region_index_compare);
+		color_id_t color_id = g->color_ids[v];
+		regions[v].degree = (uint32_t)degree;
+		regions[v].color = color_id ? (uint8_t)(bitfield_lowest_bit((bitfield_cell)color_id) + 1) : 0;
+	}
+	for (size_t v = 0; v < vertex_count + 1; v++) {
+		struct region_index_region_t* r = regions + v;
+		if (r->pixel_count == 0) continue;
+		if (g->region_stats && v) {
+			r->cx = (float)(g->region_stats[v].cx + 0.5);
+			r->cy = (float)(g->region_stats[v].cy + 0.5);
+		}
+		else if (sums) {
+			r->cx = (float)((double)sums[2 * v] / r->pixel_count + 0.5);
+			r->cy = (float)((double)sums[2 * v + 1] / r->pixel_count + 0.5);
+		}
+	}
+	// border lengths are kept per sparse row, in the same ascending order
+	const uint32_t* border = g->storage == GRAPH_SPARSE ? g->adjacency_border : NULL;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = REGION_INDEX_MAGIC;
+	header.version = REGION_INDEX_VERSION;
+	header.flags = (rle ? REGION_INDEX_RLE : 0) | (border ? REGION_INDEX_BORDERS : 0);
+	header.header_size = sizeof(header);
+	header.width = width;
+	header.height = height;
+	header.vertex_count = vertex_count;
+	header.adjacency_count = adjacency_count;
+	header.regions_offset = region_index_align(sizeof(header));
+	header.adjacency_offsets_offset = region_index_align(header.regions_offset +
+		(vertex_count + 1) * sizeof(struct region_index_region_t));
+	header.adjacency_offset = header.adjacency_offsets_offset + (vertex_count + 2) * sizeof(uint64_t);
+	uint64_t adjacency_end = header.adjacency_offset + adjacency_count * sizeof(uint32_t);
+	if (border) {
+		header.border_offset = adjacency_end;
+		adjacency_end += adjacency_count * sizeof(uint32_t);
+	}
+	header.raster_offset = region_index_align(adjacency_end);
+	if (rle) {
+		row_runs = (uint64_t*)malloc((height + 1) * sizeof(uint64_t));
+		check_goto_temp(row_runs == NULL, "Cannot allocate raster runs", EXIT_FAILURE)
+		header.run_count = region_index_count_runs(mask, width, height, row_runs);
+		header.raster_size = (height + 1) * sizeof(uint64_t) + header.run_count * sizeof(struct region_index_run_t);
+	}
+	else header.raster_size = (uint64_t)width * height * sizeof(mask_cell);
+	header.file_size = header.raster_offset + header.raster_size;
+
+	f = fopen(path, "wb");
+	check_goto_temp(f == NULL, "Cannot open region index", EXIT_FAILURE)
+	int written =
+		region_index_put(f, &position, &header, sizeof(header), 1) == EXIT_SUCCESS &&
+		region_index_pad(f, &position, header.regions_offset) == EXIT_SUCCESS &&
+		region_index_put(f, &position, regions, sizeof(regions[0]), vertex_count + 1) == EXIT_SUCCESS &&
+		region_index_pad(f, &position, header.adjacency_offsets_offset) == EXIT_SUCCESS &&
+		region_index_put(f, &position, adjacency_offsets, sizeof(uint64_t), vertex_count + 2) == EXIT_SUCCESS &&
+		region_index_put(f, &position, adjacency, sizeof(uint32_t), adjacency_count) == EXIT_SUCCESS &&
+		(!border || region_index_put(f, &position, border, sizeof(uint32_t), adjacency_count) == EXIT_SUCCESS) &&
+		region_index_pad(f, &position, header.raster_offset) == EXIT_SUCCESS;
+	if (written && rle) {
+		written = region_index_put(f, &position, row_runs, sizeof(uint64_t), height + 1) == EXIT_SUCCESS &&
+			region_index_put_runs(f, &position, mask, width, height) == EXIT_SUCCESS;
+	}
+	else if (written) written = region_index_put(f, &position, mask, sizeof(mask_cell), width * height) == EXIT_SUCCESS;
+	written &= fclose(f) == 0;
+	check_goto_temp(!written || position != header.file_size, "Cannot write region index", EXIT_FAILURE)
+
+	printf("\n\t< Region index: %s (%lu regions, %lu neighbours, %s raster %.1f MB);\n", path,
+		(unsigned long)vertex_count, (unsigned long)adjacency_count, rle ? "rle" : "raw", header.raster_size / 1e6);
+
+free_temporary_resources:
+	if (regions) free(regions);
+	if (adjacency_offsets) free(adjacency_offsets);
+	if (adjacency) free(adjacency);
+	if (row_runs) free(row_runs);
+	if (sums) free(sums);
+	host_arena_free(g->arena, dense_offsets);
+	host_arena_free(g->arena, dense_adjacency);
+	return callres;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "map_file.h"
+#include "graph_essentials.h"
+
+#define REGION_INDEX_MAGIC		0x5849434Du // 'MCIX'
+#define REGION_INDEX_VERSION	2
+#define REGION_INDEX_RLE		0x1u // raster as runs, see region_index_run_t
+#define REGION_INDEX_BORDERS	0x2u // border[adjacency_count] follows the adjacency
+
+// A read-only export of one colored map for tools that mmap it: every
+// section starts 8-byte aligned at the offset the header names, so a region,
+// its neighbours or a raster row are found without parsing.
+//	header | regions[vertex_count + 1] | adjacency_offsets[vertex_count + 2] |
+//	adjacency[adjacency_count] | [border[adjacency_count]] | raster
+// Region 0 is the border. Neighbours of v are
+// adjacency[adjacency_offsets[v] .. adjacency_offsets[v + 1]), ascending.
+// With REGION_INDEX_BORDERS (-stats, sparse graphs) border[i] is the shared
+// border length of the link adjacency[i], in build_edges walks.
+// Raster: uint32_t labels, width x height in bmp row order, or with
+// REGION_INDEX_RLE uint64_t row_runs[height + 1] followed by the runs, the
+// runs of row y are runs[row_runs[y] .. row_runs[y + 1]).
+struct region_index_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t flags;
+	uint32_t header_size;
+	uint64_t width;
+	uint64_t height;
+	uint64_t vertex_count;
+	uint64_t adjacency_count; // both directions of every edge
+	uint64_t regions_offset;
+	uint64_t adjacency_offsets_offset;
+	uint64_t adjacency_offset;
+	uint64_t border_offset; // REGION_INDEX_BORDERS only
+	uint64_t raster_offset;
+	uint64_t raster_size; // bytes
+	uint64_t run_count; // REGION_INDEX_RLE only
+	uint64_t file_size;
+};
+
+struct region_index_region_t {
+	uint64_t pixel_count;
+	uint32_t x0, y0, x1, y1; // [x0, x1) x [y0, y1), x1 == 0 - no pixels
+	float cx, cy; // centroid, pixel centers at x + 0.5
+	uint32_t degree;
+	uint8_t color; // palette index of -indexed output: 1..6, 0 - none
+	uint8_t reserved[3];
+};
+
+// a row keeps its runs in x order, a run lasts until the next one or the row end
+struct region_index_run_t {
+	uint32_t x;
+	uint32_t label;
+};
+
+int region_index_write(const char* path, size_t width, size_t height, const mask_cell* mask,
+	struct graph_as_row_t*, unsigned char rle);
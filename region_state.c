@@ -0,0 +1,651 @@
+#include "region_state.h"
+#include "tiled_map.h"
+
+#include <string.h>
+
+#define region_path_size	1024
+
+struct region_keys_t {
+	uint64_t* keys;
+	size_t count;
+	size_t capacity;
+};
+
+// working state of one edit
+struct region_edit_t {
+	struct region_state_t* s;
+	const struct bmp_map* source;
+	size_t thread_count;
+	struct border_predicate_t border; // of the saved run
+	struct border_test_t border_test;
+	uint32_t* border_row;
+
+	struct region_box_t dirty; // pixels whose border test changed
+	struct region_box_t window; // dirty pixels, their neighbours and every region those touch
+	unsigned char* touched; // per old id
+	gid_t* recycled; // touched ids ascending, the new regions take them first
+	size_t recycled_count;
+	size_t recycled_used;
+	size_t free_cursor; // ids below it are not free
+
+	mask_cell* labels; // the window labeled on its own
+	size_t label_count;
+	mask_cell* label_id; // window label -> id, 0 - an untouched region keeps its ids
+	gid_t* fresh; // ids of the new regions
+	size_t fresh_count;
+	gid_t* recolored; // old regions the new ones needed a palette color from
+	size_t recolored_count;
+
+	struct region_keys_t removed; // walks near the window before the edit
+	struct region_keys_t added; // and after it
+};
+
+static size_t region_tail_size(uint64_t vertex_count, uint64_t edge_count) {
+	return (size_t)((vertex_count + 1) * (sizeof(struct region_box_t) + 1) +
+		edge_count * (sizeof(struct graph_edge_t) + sizeof(uint32_t)));
+}
+
+static size_t region_mask_bytes(const struct region_state_t* s) {
+	return (size_t)(s->header.width * s->header.height * sizeof(mask_cell));
+}
+
+static int region_box_empty(const struct region_box_t* b) {
+	return b->x1 == 0;
+}
+
+static void region_box_add(struct region_box_t* b, size_t x, size_t y) {
+	if (region_box_empty(b)) {
+		b->x0 = (uint32_t)x; b->y0 = (uint32_t)y;
+		b->x1 = (uint32_t)(x + 1); b->y1 = (uint32_t)(y + 1);
+		return;
+	}
+	if (x < b->x0) b->x0 = (uint32_t)x;
+	if (y < b->y0) b->y0 = (uint32_t)y;
+	if (x + 1 > b->x1) b->x1 = (uint32_t)(x + 1);
+	if (y + 1 > b->y1) b->y1 = (uint32_t)(y + 1);
+}
+
+static void region_box_merge(struct region_box_t* b, const struct region_box_t* o) {
+	if (region_box_empty(o)) return;
+	region_box_add(b, o->x0, o->y0);
+	region_box_add(b, o->x1 - 1, o->y1 - 1);
+}
+
+static int region_grow_vertices(struct region_state_t* s, size_t vertex_count) {
+	if (vertex_count + 1 <= s->vertex_capacity) return EXIT_SUCCESS;
+	size_t capacity = s->vertex_capacity ? s->vertex_capacity : 1024;
+	while (capacity < vertex_count + 1) capacity *= 2;
+
+	struct region_box_t* boxes = (struct region_box_t*)realloc(s->boxes, capacity * sizeof(struct region_box_t));
+	if (boxes) s->boxes = boxes;
+	uint8_t* colors = boxes ? (uint8_t*)realloc(s->colors, capacity) : NULL;
+	if (colors) s->colors = colors;
+	check(!boxes || !colors, "Cannot allocate regions", EXIT_FAILURE)
+
+	memset(s->boxes + s->vertex_capacity, 0, (capacity - s->vertex_capacity) * sizeof(struct region_box_t));
+	memset(s->colors + s->vertex_capacity, REGION_COLOR_NONE, capacity - s->vertex_capacity);
+	s->vertex_capacity = capacity;
+	return EXIT_SUCCESS;
+}
+
+static int region_push_key(struct region_keys_t* k, mask_cell a, mask_cell b) {
+	if (k->count == k->capacity) {
+		size_t capacity = k->capacity ? k->capacity * 2 : 4096;
+		uint64_t* grown = (uint64_t*)realloc(k->keys, capacity * sizeof(uint64_t));
+		check(grown == NULL, "Cannot allocate walk keys", EXIT_FAILURE)
+		k->keys = grown;
+		k->capacity = capacity;
+	}
+	if (a > b) {
+		mask_cell c = a; a = b; b = c;
+	}
+	k->keys[k->count++] = ((uint64_t)a << 32) | b;
+	return EXIT_SUCCESS;
+}
+
+static int region_compare_keys(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+// the build_edges walk from every pixel of the box, over the whole mask
+static int region_walk(const struct region_state_t* s, const struct region_box_t* box, struct region_keys_t* keys) {
+	size_t width = (size_t)s->header.width, height = (size_t)s->header.height;
+	size_t limit = (size_t)s->header.search_limit;
+
+	for (size_t y = box->y0; y < box->y1; y++) {
+		const mask_cell* row = s->mask + y * width;
+		for (size_t x = box->x0; x < box->x1; x++) {
+			mask_cell v = row[x], nv = 0;
+			if (v == 0) continue;
+
+			if (x + 1 < width && row[x + 1] == 0) {
+				size_t steps = width - x - 1;
+				if (steps > limit) steps = limit;
+				for (size_t i = 1; i <= steps && (nv = row[x + i]) == 0; i++);
+				if (nv != 0 && nv != v && region_push_key(keys, v, nv) != EXIT_SUCCESS) return EXIT_FAILURE;
+			}
+
+			nv = 0;
+			if (y + 1 < height && row[x + width] == 0) {
+				size_t steps = height - y - 1;
+				if (steps > limit) steps = limit;
+				for (size_t i = 1; i <= steps && (nv = row[x + i * width]) == 0; i++);
+				if (nv != 0 && nv != v && region_push_key(keys, v, nv) != EXIT_SUCCESS) return EXIT_FAILURE;
+			}
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+// edges + added walks - removed walks, an edge without walks is gone
+static int region_merge_walks(struct region_state_t* s, struct region_keys_t* removed, struct region_keys_t* added) {
+	size_t edge_count = (size_t)s->header.edge_count, capacity = edge_count + added->count;
+	size_t i = 0, r = 0, a = 0, count = 0;
+
+	if (removed->count) qsort(removed->keys, removed->count, sizeof(uint64_t), region_compare_keys);
+	if (added->count) qsort(added->keys, added->count, sizeof(uint64_t), region_compare_keys);
+
+	struct graph_edge_t* edges = (struct graph_edge_t*)malloc((capacity + 1) * sizeof(struct graph_edge_t));
+	uint32_t* walks = (uint32_t*)malloc((capacity + 1) * sizeof(uint32_t));
+	if (!edges || !walks) {
+		if (edges) free(edges);
+		if (walks) free(walks);
+		check(1, "Cannot allocate edges", EXIT_FAILURE)
+	}
+
+#define region_edge_key(E) (((uint64_t)(E).lv << 32) | (E).rv)
+	while (i < edge_count || r < removed->count || a < added->count) {
+		uint64_t key = UINT64_MAX; // lv < rv, never a key
+		if (i < edge_count) key = region_edge_key(s->edges[i]);
+		if (r < removed->count && removed->keys[r] < key) key = removed->keys[r];
+		if (a < added->count && added->keys[a] < key) key = added->keys[a];
+
+		int64_t n = 0;
+		if (i < edge_count && region_edge_key(s->edges[i]) == key) n += s->walks[i++];
+		for (; r < removed->count && removed->keys[r] == key; r++) n--;
+		for (; a < added->count && added->keys[a] == key; a++) n++;
+		if (n <= 0) continue;
+
+		edges[count].lv = (uint32_t)(key >> 32);
+		edges[count].rv = (uint32_t)key;
+		walks[count] = (uint32_t)n;
+		count++;
+	}
+#undef region_edge_key
+
+	if (s->edges) free(s->edges);
+	if (s->walks) free(s->walks);
+	s->edges = edges;
+	s->walks = walks;
+	s->edge_capacity = capacity + 1;
+	s->header.edge_count = count;
+	return EXIT_SUCCESS;
+}
+
+static void region_copy_tail(const struct region_state_t* s, unsigned char* dst) {
+	size_t vertices = (size_t)s->header.vertex_count + 1, edges = (size_t)s->header.edge_count;
+	memcpy(dst, s->boxes, vertices * sizeof(struct region_box_t));
+	dst += vertices * sizeof(struct region_box_t);
+	if (edges) memcpy(dst, s->edges, edges * sizeof(struct graph_edge_t));
+	dst += edges * sizeof(struct graph_edge_t);
+	if (edges) memcpy(dst, s->walks, edges * sizeof(uint32_t));
+	dst += edges * sizeof(uint32_t);
+	memcpy(dst, s->colors, vertices);
+}
+
+static int region_state_write(struct region_state_t* s, const char* path) {
+	size_t tail_size = region_tail_size(s->header.vertex_count, s->header.edge_count);
+	unsigned char* tail = (unsigned char*)malloc(tail_size);
+	FILE* f = NULL;
+	int callres = EXIT_SUCCESS;
+	check(tail == NULL, "Cannot allocate region state", EXIT_FAILURE)
+
+	region_copy_tail(s, tail);
+	s->header.tail_capacity = tail_size;
+
+	f = fopen(path, "wb");
+	check_goto_temp(f == NULL, "Cannot open region state", EXIT_FAILURE)
+	size_t cells = (size_t)(s->header.width * s->header.height);
+	int written = fwrite(&s->header, sizeof(s->header), 1, f) == 1 &&
+		fwrite(s->mask, sizeof(mask_cell), cells, f) == cells &&
+		fwrite(tail, 1, tail_size, f) == tail_size;
+	written &= fclose(f) == 0;
+	check_goto_temp(!written, "Cannot write region state", EXIT_FAILURE)
+
+free_temporary_resources:
+	free(tail);
+	return callres;
+}
+
+static void distruct_region_state(struct region_state_t* s) {
+	host_unmap_file(&s->file);
+	if (s->boxes) free(s->boxes);
+	if (s->colors) free(s->colors);
+	if (s->edges) free(s->edges);
+	if (s->walks) free(s->walks);
+	memset(s, 0, sizeof(struct region_state_t));
+}
+
+static int region_state_load(struct region_state_t* s, const char* path) {
+	memset(s, 0, sizeof(struct region_state_t));
+	// edits patch a private copy, the file only changes in region_state_store
+	check(host_map_file(path, HOST_MAP_PRIVATE, &s->file) != EXIT_SUCCESS, "Cannot open region state", EXIT_FAILURE)
+	check(s->file.size < sizeof(s->header), "Region state is too short", EXIT_FAILURE)
+	memcpy(&s->header, s->file.data, sizeof(s->header));
+	check(s->header.magic != REGION_STATE_MAGIC || s->header.version != REGION_STATE_VERSION,
+		"Not a region state of this version", EXIT_FAILURE)
+
+	size_t mask_bytes = region_mask_bytes(s);
+	size_t vertices = (size_t)s->header.vertex_count + 1, edges = (size_t)s->header.edge_count;
+	check(s->file.size < sizeof(s->header) + mask_bytes + region_tail_size(s->header.vertex_count, edges),
+		"Region state is too short", EXIT_FAILURE)
+	s->mask = (mask_cell*)(s->file.data + sizeof(s->header));
+
+	check(region_grow_vertices(s, vertices - 1) != EXIT_SUCCESS, "Cannot allocate regions", EXIT_FAILURE)
+	s->edges = (struct graph_edge_t*)malloc((edges + 1) * sizeof(struct graph_edge_t));
+	s->walks = (uint32_t*)malloc((edges + 1) * sizeof(uint32_t));
+	check(!s->edges || !s->walks, "Cannot allocate edges", EXIT_FAILURE)
+	s->edge_capacity = edges + 1;
+
+	const unsigned char* p = s->file.data + sizeof(s->header) + mask_bytes;
+	memcpy(s->boxes, p, vertices * sizeof(struct region_box_t));
+	p += vertices * sizeof(struct region_box_t);
+	memcpy(s->edges, p, edges * sizeof(struct graph_edge_t));
+	p += edges * sizeof(struct graph_edge_t);
+	memcpy(s->walks, p, edges * sizeof(uint32_t));
+	p += edges * sizeof(uint32_t);
+	memcpy(s->colors, p, vertices);
+	return EXIT_SUCCESS;
+}
+
+// the whole state under a temporary name, renamed over the old file only once
+// it is complete; the mask is gone afterwards
+static int region_state_store(struct region_state_t* s, const char* path) {
+	char tmp_path[region_path_size];
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	if (region_state_write(s, tmp_path) != EXIT_SUCCESS) {
+		remove(tmp_path);
+		check(1, "Cannot write region state", EXIT_FAILURE)
+	}
+	// the mapping goes first, a mapped file cannot be replaced everywhere
+	host_unmap_file(&s->file);
+	s->mask = NULL;
+	remove(path);
+	check(rename(tmp_path, path) != 0, "Cannot rename region state", EXIT_FAILURE)
+	return EXIT_SUCCESS;
+}
+
+int region_state_save(const char* path, size_t width, size_t height, const mask_cell* mask,
+	const struct graph_as_row_t* g, size_t search_limit, const struct border_predicate_t* border
+) {
+	struct region_state_t s;
+	struct region_keys_t keys = { NULL, 0, 0 }, none = { NULL, 0, 0 };
+	struct region_box_t all = { 0, 0, (uint32_t)width, (uint32_t)height };
+	int callres = EXIT_SUCCESS;
+
+	memset(&s, 0, sizeof(struct region_state_t));
+	check(width >= UINT32_MAX || height >= UINT32_MAX, "Map is too large for a region state", EXIT_FAILURE)
+	s.header.magic = REGION_STATE_MAGIC;
+	s.header.version = REGION_STATE_VERSION;
+	s.header.width = width;
+	s.header.height = height;
+	s.header.search_limit = search_limit;
+	if (border) {
+		s.header.border_mode = (uint32_t)border->mode;
+		s.header.border_tolerance = border->tolerance;
+		memcpy(s.header.border_color, border->color, sizeof(border->color));
+	}
+	s.header.vertex_count = g->vertex_count;
+	s.mask = (mask_cell*)mask;
+
+	check_goto_temp(region_grow_vertices(&s, g->vertex_count) != EXIT_SUCCESS, "Cannot allocate regions", EXIT_FAILURE)
+	for (size_t y = 0, i = 0; y < height; y++) {
+		for (size_t x = 0; x < width; x++, i++) {
+			if (mask[i] && mask[i] <= g->vertex_count) region_box_add(s.boxes + mask[i], x, y);
+		}
+	}
+	for (size_t v = 1; v < g->vertex_count + 1; v++) {
+		color_id_t color_id = g->color_ids[v];
+		s.colors[v] = color_id ? (uint8_t)bitfield_lowest_bit((bitfield_cell)color_id) : REGION_COLOR_NONE;
+	}
+
+	check_goto_temp(region_walk(&s, &all, &keys) != EXIT_SUCCESS, "Cannot walk map borders", EXIT_FAILURE)
+	check_goto_temp(region_merge_walks(&s, &none, &keys) != EXIT_SUCCESS, "Cannot count edges", EXIT_FAILURE)
+
+	check_goto_temp(region_state_store(&s, path) != EXIT_SUCCESS, "Cannot store region state", EXIT_FAILURE)
+	printf("\n\t< Region state: %s (%lu regions, %lu edges);\n", path,
+		(unsigned long)s.header.vertex_count, (unsigned long)s.header.edge_count);
+
+free_temporary_resources:
+	s.mask = NULL; // the caller's
+	distruct_region_state(&s);
+	if (keys.keys) free(keys.keys);
+	return callres;
+}
+
+
+static int region_changed(const struct region_edit_t* e, size_t x, size_t y) {
+	const unsigned char* px = (const unsigned char*)e->source->linear_sequence +
+		y * e->source->image_row_pitch + x * 4;
+	return (e->s->mask[y * e->s->header.width + x] == 0) != border_pixel(&e->border_test, px);
+}
+
+// changed pixels inside the dirty box or the diff image, else anywhere
+static int region_find_dirty(struct region_edit_t* e, const struct map_options_t* options) {
+	size_t width = (size_t)e->s->header.width, height = (size_t)e->s->header.height;
+	struct region_box_t scan = { 0, 0, (uint32_t)width, (uint32_t)height };
+
+	if (options->dirty_box[2]) {
+		scan.x0 = (uint32_t)(options->dirty_box[0] < width ? options->dirty_box[0] : width);
+		scan.y0 = (uint32_t)(options->dirty_box[1] < height ? options->dirty_box[1] : height);
+		scan.x1 = (uint32_t)(options->dirty_box[2] < width ? options->dirty_box[2] : width);
+		scan.y1 = (uint32_t)(options->dirty_box[3] < height ? options->dirty_box[3] : height);
+	}
+	else if (options->diff_file) {
+		struct bmp_map diff;
+		check(bmp_map_open(&diff, options->diff_file, 0) != EXIT_SUCCESS, "Cannot open diff image", EXIT_FAILURE)
+		if (diff.image_width != width || diff.image_height != height) {
+			distruct_bmp_map(&diff);
+			check(1, "Diff image size differs from the map", EXIT_FAILURE)
+		}
+		memset(&scan, 0, sizeof(scan));
+		for (size_t y = 0; y < height; y++) {
+			const unsigned char* px = (const unsigned char*)diff.linear_sequence + y * diff.image_row_pitch;
+			for (size_t x = 0; x < width; x++, px += 4)
+				if (px[0] | px[1] | px[2]) region_box_add(&scan, x, y);
+		}
+		distruct_bmp_map(&diff);
+	}
+
+	// a pixel changed when its border test differs from the saved mask
+	memset(&e->dirty, 0, sizeof(e->dirty));
+	for (size_t y = scan.y0; y < scan.y1; y++) {
+		const mask_cell* row = e->s->mask + y * width;
+		border_pack_row(&e->border_test, (const unsigned char*)e->source->linear_sequence +
+			y * e->source->image_row_pitch + scan.x0 * 4, scan.x1 - scan.x0, e->border_row);
+		for (size_t x = scan.x0, b = 0; x < scan.x1; x++, b++)
+			if ((row[x] == 0) != ((e->border_row[b >> 5] >> (b & 31)) & 1)) region_box_add(&e->dirty, x, y);
+	}
+	return EXIT_SUCCESS;
+}
+
+// A region touching no changed pixel keeps every pixel and its connections,
+// so only the touched ones are labeled again, whole: the window is the dirty
+// box grown by one pixel and by the boxes of the regions found in it.
+static int region_find_window(struct region_edit_t* e) {
+	struct region_state_t* s = e->s;
+	size_t width = (size_t)s->header.width, height = (size_t)s->header.height;
+	size_t vertex_count = (size_t)s->header.vertex_count;
+	struct region_box_t near = e->dirty;
+
+	if (near.x0 > 0) near.x0--;
+	if (near.y0 > 0) near.y0--;
+	if (near.x1 < width) near.x1++;
+	if (near.y1 < height) near.y1++;
+
+	e->touched = (unsigned char*)calloc(vertex_count + 1, 1);
+	check(e->touched == NULL, "Cannot allocate touched regions", EXIT_FAILURE)
+
+	e->window = near;
+	for (size_t y = near.y0; y < near.y1; y++) {
+		for (size_t x = near.x0; x < near.x1; x++) {
+			mask_cell v = s->mask[y * width + x];
+			if (v == 0 || e->touched[v]) continue;
+			e->touched[v] = 1;
+			e->recycled_count++;
+			region_box_merge(&e->window, s->boxes + v);
+		}
+	}
+
+	e->recycled = (gid_t*)malloc((e->recycled_count + 1) * sizeof(gid_t));
+	check(e->recycled == NULL, "Cannot allocate touched regions", EXIT_FAILURE)
+	e->recycled_count = 0;
+	for (size_t v = 1; v < vertex_count + 1; v++)
+		if (e->touched[v]) e->recycled[e->recycled_count++] = v;
+	return EXIT_SUCCESS;
+}
+
+// touched ids first, then ids freed by earlier edits, then new ones
+static int region_take_id(struct region_edit_t* e, mask_cell* id) {
+	struct region_state_t* s = e->s;
+	if (e->recycled_used < e->recycled_count) {
+		*id = (mask_cell)e->recycled[e->recycled_used++];
+		return EXIT_SUCCESS;
+	}
+	for (; e->free_cursor < s->header.vertex_count + 1; e->free_cursor++) {
+		if (region_box_empty(s->boxes + e->free_cursor) && !e->touched[e->free_cursor]) {
+			*id = (mask_cell)e->free_cursor++;
+			return EXIT_SUCCESS;
+		}
+	}
+	check(s->header.vertex_count + 1 >= UINT32_MAX, "Map has too many areas for 32-bit ids", EXIT_FAILURE)
+	check(region_grow_vertices(s, (size_t)s->header.vertex_count + 1) != EXIT_SUCCESS, "Cannot allocate regions", EXIT_FAILURE)
+	*id = (mask_cell)++s->header.vertex_count;
+	e->free_cursor = (size_t)s->header.vertex_count + 1;
+	return EXIT_SUCCESS;
+}
+
+// Within the window a label either is part of an untouched region, all its
+// pixels unchanged and carrying that region's id, or a new region made of
+// changed pixels and touched regions only, which ends inside the window.
+static int region_label_window(struct region_edit_t* e) {
+	struct region_state_t* s = e->s;
+	size_t width = (size_t)s->header.width;
+	size_t ww = e->window.x1 - e->window.x0, wh = e->window.y1 - e->window.y0;
+	unsigned char* seen = NULL;
+	int callres = EXIT_SUCCESS;
+
+	char* pixels = (char*)malloc(ww * wh * 4);
+	e->labels = (mask_cell*)malloc(ww * wh * sizeof(mask_cell));
+	check_goto_temp(pixels == NULL || e->labels == NULL, "Cannot allocate window", EXIT_FAILURE)
+	for (size_t y = 0; y < wh; y++) {
+		memcpy(pixels + y * ww * 4,
+			e->source->linear_sequence + (e->window.y0 + y) * e->source->image_row_pitch + e->window.x0 * 4, ww * 4);
+	}
+	check_goto_temp(cpu_label_map(pixels, ww, wh, e->labels, &e->label_count, e->thread_count, &e->border, NULL) != EXIT_SUCCESS,
+		"Cannot label window", EXIT_FAILURE)
+
+	e->label_id = (mask_cell*)calloc(e->label_count + 1, sizeof(mask_cell));
+	e->fresh = (gid_t*)malloc((e->label_count + 1) * sizeof(gid_t));
+	seen = (unsigned char*)calloc(e->label_count + 1, 1);
+	check_goto_temp(!e->label_id || !e->fresh || !seen, "Cannot allocate window labels", EXIT_FAILURE)
+
+	e->free_cursor = 1;
+	for (size_t y = 0, i = 0; y < wh; y++) {
+		for (size_t x = 0; x < ww; x++, i++) {
+			mask_cell l = e->labels[i];
+			if (l == 0 || seen[l]) continue;
+			seen[l] = 1;
+
+			size_t gx = e->window.x0 + x, gy = e->window.y0 + y;
+			mask_cell old = s->mask[gy * width + gx];
+			if (old && !e->touched[old] && !region_changed(e, gx, gy)) continue;
+			check_goto_temp(region_take_id(e, e->label_id + l) != EXIT_SUCCESS, "Cannot number regions", EXIT_FAILURE)
+			e->fresh[e->fresh_count++] = e->label_id[l];
+		}
+	}
+
+free_temporary_resources:
+	if (pixels) free(pixels);
+	if (seen) free(seen);
+	return callres;
+}
+
+// new ids into the mask, boxes of the touched and new regions again
+static void region_patch_mask(struct region_edit_t* e) {
+	struct region_state_t* s = e->s;
+	size_t width = (size_t)s->header.width;
+	size_t ww = e->window.x1 - e->window.x0, wh = e->window.y1 - e->window.y0;
+
+	for (size_t i = 0; i < e->recycled_count; i++) {
+		memset(s->boxes + e->recycled[i], 0, sizeof(struct region_box_t));
+		s->colors[e->recycled[i]] = REGION_COLOR_NONE;
+	}
+
+	for (size_t y = 0, i = 0; y < wh; y++) {
+		mask_cell* row = s->mask + (e->window.y0 + y) * width + e->window.x0;
+		for (size_t x = 0; x < ww; x++, i++) {
+			mask_cell l = e->labels[i];
+			if (l == 0) row[x] = 0;
+			else if (e->label_id[l]) {
+				row[x] = e->label_id[l];
+				region_box_add(s->boxes + row[x], e->window.x0 + x, e->window.y0 + y);
+			}
+		}
+	}
+}
+
+// fixed colors for every region, the new ones colored around them; a few old
+// ones next to them may be recolored too to keep within the palette
+static int region_recolor(struct region_edit_t* e) {
+	struct region_state_t* s = e->s;
+	struct graph_as_row_t g;
+	int callres = EXIT_SUCCESS;
+
+	memset(&g, 0, sizeof(g));
+	check(graph_init_sparse(&g, (size_t)s->header.vertex_count, s->edges, (size_t)s->header.edge_count, NULL) != EXIT_SUCCESS,
+		"Cannot init graph", EXIT_FAILURE)
+	for (size_t v = 1; v < s->header.vertex_count + 1; v++)
+		g.color_ids[v] = s->colors[v] == REGION_COLOR_NONE ? 0 : (uint8_t)(1u << s->colors[v]);
+
+	check_goto_temp(graph_coloring_subset(&g, e->fresh, e->fresh_count) != EXIT_SUCCESS,
+		"Cannot color new regions", EXIT_FAILURE)
+	for (size_t i = 0; i < e->fresh_count; i++)
+		s->colors[e->fresh[i]] = (uint8_t)bitfield_lowest_bit((bitfield_cell)g.color_ids[e->fresh[i]]);
+
+	for (size_t v = 1; v < s->header.vertex_count + 1; v++) {
+		if (!g.color_ids[v] || s->colors[v] == (uint8_t)bitfield_lowest_bit((bitfield_cell)g.color_ids[v])) continue;
+		if (e->recolored == NULL) {
+			e->recolored = (gid_t*)malloc((size_t)s->header.vertex_count * sizeof(gid_t));
+			check_goto_temp(e->recolored == NULL, "Cannot allocate recolored regions", EXIT_FAILURE)
+		}
+		s->colors[v] = (uint8_t)bitfield_lowest_bit((bitfield_cell)g.color_ids[v]);
+		e->recolored[e->recolored_count++] = v;
+	}
+
+free_temporary_resources:
+	distruct_graph_as_row(&g);
+	return callres;
+}
+
+static void region_paint_window(struct region_edit_t* e, struct bmp_map* output) {
+	struct region_state_t* s = e->s;
+	size_t width = (size_t)s->header.width;
+
+	for (size_t y = e->window.y0; y < e->window.y1; y++) {
+		unsigned char* px = (unsigned char*)output->linear_sequence + y * output->image_row_pitch + e->window.x0 * 4;
+		const mask_cell* row = s->mask + y * width;
+		for (size_t x = e->window.x0; x < e->window.x1; x++, px += 4) {
+			mask_cell v = row[x];
+			tiled_color_pixel(px, v && s->colors[v] != REGION_COLOR_NONE ? (color_id_t)1 << s->colors[v] : 0);
+		}
+	}
+
+	// recolored old regions reach past the window, their boxes are painted whole
+	for (size_t i = 0; i < e->recolored_count; i++) {
+		gid_t v = e->recolored[i];
+		const struct region_box_t* box = s->boxes + v;
+		for (size_t y = box->y0; y < box->y1; y++) {
+			unsigned char* px = (unsigned char*)output->linear_sequence + y * output->image_row_pitch + box->x0 * 4;
+			const mask_cell* row = s->mask + y * width;
+			for (size_t x = box->x0; x < box->x1; x++, px += 4)
+				if (row[x] == v) tiled_color_pixel(px, (color_id_t)1 << s->colors[v]);
+		}
+	}
+}
+
+static void distruct_region_edit(struct region_edit_t* e) {
+	if (e->touched) free(e->touched);
+	if (e->recycled) free(e->recycled);
+	if (e->labels) free(e->labels);
+	if (e->label_id) free(e->label_id);
+	if (e->fresh) free(e->fresh);
+	if (e->recolored) free(e->recolored);
+	if (e->border_row) free(e->border_row);
+	if (e->removed.keys) free(e->removed.keys);
+	if (e->added.keys) free(e->added.keys);
+	memset(e, 0, sizeof(struct region_edit_t));
+}
+
+int region_state_update(const char* input, const char* output, const struct map_options_t* options) {
+	struct region_state_t s;
+	struct region_edit_t e;
+	struct bmp_map source, result;
+	char result_path[region_path_size];
+	unsigned char result_copied = 0;
+	int callres = EXIT_SUCCESS;
+
+	memset(&s, 0, sizeof(s));
+	memset(&e, 0, sizeof(e));
+	bmp_map_init(&source);
+	bmp_map_init(&result);
+	snprintf(result_path, sizeof(result_path), "%s.tmp", output);
+
+	check_goto_temp(region_state_load(&s, options->state_file) != EXIT_SUCCESS, "Cannot load region state", EXIT_FAILURE)
+	check_goto_temp(bmp_map_open(&source, input, 0) != EXIT_SUCCESS, "Cannot open edited map", EXIT_FAILURE)
+	check_goto_temp(bmp_map_open(&result, output, 0) != EXIT_SUCCESS, "Cannot open previous result", EXIT_FAILURE)
+	check_goto_temp(source.image_width != s.header.width || source.image_height != s.header.height ||
+		result.image_width != s.header.width || result.image_height != s.header.height,
+		"Map size differs from the region state", EXIT_FAILURE)
+	distruct_bmp_map(&result);
+
+	e.s = &s;
+	e.source = &source;
+	e.thread_count = options->thread_count;
+	e.border.mode = (enum border_mode_t)s.header.border_mode;
+	e.border.tolerance = s.header.border_tolerance;
+	memcpy(e.border.color, s.header.border_color, sizeof(e.border.color));
+	border_predicate_test(&e.border, &e.border_test);
+	e.border_row = (uint32_t*)malloc(((size_t)s.header.width / 32 + 1) * sizeof(uint32_t));
+	check_goto_temp(e.border_row == NULL, "Cannot allocate border row", EXIT_FAILURE)
+
+	check_goto_temp(region_find_dirty(&e, options) != EXIT_SUCCESS, "Cannot find changed pixels", EXIT_FAILURE)
+	if (region_box_empty(&e.dirty)) {
+		printf("\n\t< No changed pixels;\n");
+		temp
+	}
+	check_goto_temp(region_find_window(&e) != EXIT_SUCCESS, "Cannot find edit window", EXIT_FAILURE)
+	printf("\n\t< Changed: %ux%u at %u,%u; window: %ux%u at %u,%u; touched regions: %lu;\n",
+		e.dirty.x1 - e.dirty.x0, e.dirty.y1 - e.dirty.y0, e.dirty.x0, e.dirty.y0,
+		e.window.x1 - e.window.x0, e.window.y1 - e.window.y0, e.window.x0, e.window.y0,
+		(unsigned long)e.recycled_count);
+
+	check_goto_temp(region_label_window(&e) != EXIT_SUCCESS, "Cannot label window", EXIT_FAILURE)
+
+	// walks that can reach the window start at most search_limit left of or above it
+	struct region_box_t reach = e.window;
+	reach.x0 = reach.x0 > s.header.search_limit ? reach.x0 - (uint32_t)s.header.search_limit : 0;
+	reach.y0 = reach.y0 > s.header.search_limit ? reach.y0 - (uint32_t)s.header.search_limit : 0;
+	check_goto_temp(region_walk(&s, &reach, &e.removed) != EXIT_SUCCESS, "Cannot walk map borders", EXIT_FAILURE)
+	region_patch_mask(&e);
+	check_goto_temp(region_walk(&s, &reach, &e.added) != EXIT_SUCCESS, "Cannot walk map borders", EXIT_FAILURE)
+	check_goto_temp(region_merge_walks(&s, &e.removed, &e.added) != EXIT_SUCCESS, "Cannot patch edges", EXIT_FAILURE)
+
+	check_goto_temp(region_recolor(&e) != EXIT_SUCCESS, "Cannot recolor regions", EXIT_FAILURE)
+	printf("\n\t< New regions: %lu; recolored: %lu; regions: %lu; edges: %lu;\n", (unsigned long)e.fresh_count,
+		(unsigned long)e.recolored_count, (unsigned long)s.header.vertex_count, (unsigned long)s.header.edge_count);
+
+	// nothing is replaced until every step has succeeded: the result is painted
+	// in a copy, the state goes first and the result follows it
+	result_copied = 1;
+	check_goto_temp(host_copy_file(output, result_path) != EXIT_SUCCESS, "Cannot copy previous result", EXIT_FAILURE)
+	check_goto_temp(bmp_map_open(&result, result_path, 1) != EXIT_SUCCESS, "Cannot open result copy", EXIT_FAILURE)
+	region_paint_window(&e, &result);
+	check_goto_temp(bmp_map_put_result(&result) != EXIT_SUCCESS, "Cannot write result", EXIT_FAILURE)
+	distruct_bmp_map(&result);
+	check_goto_temp(region_state_store(&s, options->state_file) != EXIT_SUCCESS, "Cannot store region state", EXIT_FAILURE)
+	// the painted copy matches the new state, it stays whatever happens now
+	result_copied = 0;
+	remove(output);
+	check_goto_temp(rename(result_path, output) != 0, "Cannot rename result", EXIT_FAILURE)
+
+free_temporary_resources:
+	distruct_region_edit(&e);
+	distruct_bmp_map(&source);
+	distruct_bmp_map(&result);
+	distruct_region_state(&s);
+	if (result_copied) remove(result_path);
+	return callres;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "ocl_map_to_graph.h"
+#include "host_platform.h"
+
+#define REGION_STATE_MAGIC		0x5352434Du // 'MCRS'
+#define REGION_STATE_VERSION	2
+#define REGION_COLOR_NONE		0xFF // free id
+
+// The region state of a colored map, kept for incremental runs:
+//	header | mask (width x height labels) | boxes | edges | walks | colors
+// ids are the labels of the mask, an id whose region was edited away stays
+// free (empty box) until an edit reuses it. Every edge counts the build_edges
+// walks that found it, so an edit takes back exactly the walks it changes.
+// Incremental runs test borders the way the saved run did.
+struct region_state_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t width;
+	uint64_t height;
+	uint64_t search_limit;
+	uint32_t border_mode; // border_predicate_t of the saved run
+	uint32_t border_tolerance;
+	uint8_t border_color[4]; // r, g, b, unused
+	uint32_t reserved;
+	uint64_t vertex_count;
+	uint64_t edge_count;
+	uint64_t tail_capacity; // bytes after the mask
+};
+
+// [x0, x1) x [y0, y1), x1 == 0 - empty
+struct region_box_t {
+	uint32_t x0, y0, x1, y1;
+};
+
+struct region_state_t {
+	struct region_state_header_t header;
+	struct host_file_map_t file; // private mapping, the mask is patched in it
+	mask_cell* mask;
+
+	struct region_box_t* boxes; // per id
+	uint8_t* colors; // color index per id
+	size_t vertex_capacity;
+
+	struct graph_edge_t* edges; // lv < rv, ascending
+	uint32_t* walks;
+	size_t edge_capacity;
+};
+
+// after a full run: the mask of the whole map and its colored graph
+int region_state_save(const char* path, size_t width, size_t height, const mask_cell* mask,
+	const struct graph_as_row_t*, size_t search_limit, const struct border_predicate_t*);
+
+// Incremental run. The input is an edit of the map the state describes, the
+// output its previous result. Both the state file and the output are written
+// under temporary names and renamed over the old ones, the state first, only
+// after every step has succeeded. The changed pixels come from
+// options->dirty_box or the non-zero pixels of options->diff_file, else from
+// comparing the input with the state. Only the window around the changed
+// pixels and the regions touching them is labeled again, only walks that can
+// reach the window are taken again, only the new regions are colored (every
+// other region keeps its color) and only the window is painted.
+int region_state_update(const char* input, const char* output, const struct map_options_t*);
@@ -7,30 +7,185 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <time.h>
+#include <string.h>
 #include "ocl_map_to_graph.h"
+#include "batch.h"
+#include "tiled_map.h"
+#include "device_bands.h"
+#include "autotune.h"
+#include "region_state.h"
+#include "region_index.h"
 
 
 #define FATAL(CORE){printf("\nFATAL: %s failed. exiting.\n", CORE); return EXIT_FAILURE;}
 
 #define MSG(S) printf("\n\t> %s\n", S);
 
-int parse_arguments(int argc, char** argv, const char** input, const char** output) {
-	if (argc != 3) {
-		printf("Wrong arguments.\n");
+int parse_arguments(int argc, char** argv, const char** input, const char** output,
+	struct map_options_t* options
+) {
+	size_t positional = 0;
+
+	memset(options, 0, sizeof(struct map_options_t));
+	options->labeling_backend = LABELING_OPENCL;
+	options->program_cache = 1;
+	options->program_cache_dir = program_cache_default_dir();
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-cpu") == 0) {
+			options->labeling_backend = LABELING_CPU;
+		}
+		else if (strcmp(argv[i], "-legacy-labeling") == 0) {
+			options->labeling_backend = LABELING_OPENCL_LEGACY;
+		}
+		else if (strcmp(argv[i], "-border") == 0 && i + 1 < argc) {
+			if (border_predicate_parse(argv[++i], &options->border) != EXIT_SUCCESS) {
+				positional = 0;
+				break;
+			}
+		}
+		else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+			options->thread_count = (size_t)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "-parallel-color") == 0) {
+			options->parallel_coloring = 1;
+		}
+		else if (strcmp(argv[i], "-dense") == 0) {
+			options->graph_storage = GRAPH_DENSE;
+		}
+		else if (strcmp(argv[i], "-edge-limit") == 0 && i + 1 < argc) {
+			options->edge_search_limit = (size_t)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "-tile-rows") == 0 && i + 1 < argc) {
+			options->tile_rows = (size_t)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "-devices") == 0 && i + 1 < argc) {
+			i++;
+			options->device_bands = strcmp(argv[i], "all") == 0 ? SIZE_MAX : (size_t)strtoul(argv[i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "-numa") == 0) {
+			options->numa_bands = 1;
+		}
+		else if (strcmp(argv[i], "-autotune") == 0) {
+			options->autotune = 1;
+		}
+		else if (strcmp(argv[i], "-batch") == 0) {
+			options->batch = 1;
+		}
+		else if (strcmp(argv[i], "-indexed") == 0 && i + 1 < argc) {
+			options->indexed_bits = (unsigned char)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "-index") == 0 && i + 1 < argc) {
+			options->index_file = argv[++i];
+		}
+		else if (strcmp(argv[i], "-index-rle") == 0) {
+			options->index_rle = 1;
+		}
+		else if (strcmp(argv[i], "-stats") == 0) {
+			options->region_stats = 1;
+		}
+		else if (strcmp(argv[i], "-state") == 0 && i + 1 < argc) {
+			options->state_file = argv[++i];
+		}
+		else if (strcmp(argv[i], "-incremental") == 0 && i + 1 < argc) {
+			options->state_file = argv[++i];
+			options->incremental = 1;
+		}
+		else if (strcmp(argv[i], "-dirty") == 0 && i + 4 < argc) {
+			for (size_t k = 0; k < 4; k++) options->dirty_box[k] = (size_t)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "-diff") == 0 && i + 1 < argc) {
+			options->diff_file = argv[++i];
+		}
+		else if (strcmp(argv[i], "-cache-dir") == 0 && i + 1 < argc) {
+			options->program_cache_dir = argv[++i];
+		}
+		else if (strcmp(argv[i], "-no-cache") == 0) {
+			options->program_cache = 0;
+		}
+		else if (strcmp(argv[i], "-huge-pages") == 0) {
+			options->huge_pages = 1;
+		}
+		else if (strcmp(argv[i], "-kernels") == 0 && i + 1 < argc) {
+			options->kernel_file = argv[++i];
+		}
+		else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc) {
+			options->trace_file = argv[++i];
+		}
+		else if (argv[i][0] != '-' && positional == 0) {
+			*input = argv[i]; positional++;
+		}
+		else if (argv[i][0] != '-' && positional == 1) {
+			*output = argv[i]; positional++;
+		}
+		else {
+			positional = 0;
+			break;
+		}
+	}
+
+	// NUMA parts only matter when the map is split over devices
+	if (options->numa_bands && options->device_bands == 0) options->device_bands = SIZE_MAX;
+
+	if (positional != 2) {
+		printf("Wrong arguments.\n"
+			"Usage: %s <input.bmp> <output.bmp> [-cpu | -legacy-labeling] [-threads N]"
+			" [-border channel | exact[:RRGGBB] | distance[:RRGGBB]:T | luma:T]"
+			" [-cache-dir DIR] [-no-cache] [-kernels FILE] [-dense] [-edge-limit N] [-parallel-color]"
+			" [-tile-rows N] [-devices N | all] [-numa] [-autotune] [-indexed 8 | 4] [-state FILE]"
+			" [-index FILE [-index-rle]] [-stats] [-huge-pages]"
+			" [-profile TRACE.json]\n"
+			"       %s -batch <input dir | list file> <output dir> [options]\n"
+			"       %s -incremental STATE <edited.bmp> <previous output.bmp> [-dirty X0 Y0 X1 Y1 | -diff DIFF.bmp]"
+			" [-threads N]\n", argv[0], argv[0], argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	*input = argv[1];
-	*output = argv[2];
+	// the state and the index hold the mask of one whole map run on one device
+	if (((options->state_file && !options->incremental) || options->index_file) &&
+		(options->tile_rows || options->device_bands || options->batch || options->incremental)) {
+		printf("Wrong arguments.\n-state and -index need a whole map run: no -tile-rows, -devices, -numa, -batch"
+			" or -incremental.\n");
+		return EXIT_FAILURE;
+	}
+
+	// the statistics come from the mask of one device
+	if (options->region_stats && (options->tile_rows || options->device_bands)) {
+		printf("Wrong arguments.\n-stats takes no -tile-rows, -devices or -numa.\n");
+		return EXIT_FAILURE;
+	}
+
+	// the host paths paint 32-bit pixels
+	if (options->indexed_bits && ((options->indexed_bits != 8 && options->indexed_bits != 4) ||
+		options->tile_rows || options->device_bands || options->state_file)) {
+		printf("Wrong arguments.\n-indexed takes 8 or 4 and no -tile-rows, -devices, -numa, -state or -incremental.\n");
+		return EXIT_FAILURE;
+	}
 
 	printf("\n\t< input:  %s;"
-		"\n\t< output: %s;\n", *input, *output);
+		"\n\t< output: %s;"
+		"\n\t< labeling: %s;"
+		"\n\t< borders: %s;\n", *input, *output,
+		options->labeling_backend == LABELING_CPU ? "cpu" :
+		options->labeling_backend == LABELING_OPENCL_LEGACY ? "opencl-legacy" : "opencl",
+		options->incremental ? "as saved" : border_predicate_name(&options->border));
 
 	return EXIT_SUCCESS;
 }
 
 
+// device events are collected before the summary, the trace is written last
+int finish_profile(struct profiler_t* profiler, const char* trace_file) {
+	if (profiler == NULL) return EXIT_SUCCESS;
+	profiler_collect(profiler);
+	profiler_print_summary(profiler);
+	int callres = profiler_write_trace(profiler, trace_file);
+	if (callres == EXIT_SUCCESS) printf("\n\t< Trace: %s;\n", trace_file);
+	distruct_profiler(profiler);
+	return callres;
+}
+
+
 int main(int argc, char** argv) {
 
 	const char* input_filename = NULL;
@@ -39,64 +194,192 @@ int main(int argc, char** argv) {
 	struct bmp_map bmp;
 	struct cl_data_t cld;
 	struct graph_as_row_t g;
+	struct map_options_t options;
+	struct profiler_t profiler;
+	size_t span;
 
-	clock_t TIME_ALL, TIME_PARSING, TIME_COLORING;
+	double TIME_ALL, TIME_PARSING, TIME_COLORING;
 
 	MSG("Welcome to map colorer")
 
 	MSG("Parsing arguments...")
-	if (parse_arguments(argc, argv, &input_filename, &output_filename) != EXIT_SUCCESS)
+	if (parse_arguments(argc, argv, &input_filename, &output_filename, &options) != EXIT_SUCCESS)
 		FATAL("parse_input")
 
-	TIME_ALL = clock(); // 
+	if (options.trace_file) {
+		profiler_init(&profiler);
+		options.profiler = &profiler;
+	}
+
+	if (options.batch) {
+		MSG("Running batch...")
+		if (batch_run(input_filename, output_filename, &options) != EXIT_SUCCESS)
+			FATAL("batch_run")
+		if (finish_profile(options.profiler, options.trace_file) != EXIT_SUCCESS)
+			FATAL("finish_profile")
+		MSG("That's all! Thanks!")
+		return EXIT_SUCCESS;
+	}
+
+	TIME_ALL = host_wall_time(); // 
+
+	if (options.incremental) {
+		MSG("Updating the previous result...")
+		span = profiler_begin(options.profiler, "incremental");
+		if (region_state_update(input_filename, output_filename, &options) != EXIT_SUCCESS)
+			FATAL("region_state_update")
+		profiler_end(options.profiler, span);
+		printf("\n\t< Time: all: %fs;\n", host_wall_time() - TIME_ALL);
+		if (finish_profile(options.profiler, options.trace_file) != EXIT_SUCCESS)
+			FATAL("finish_profile")
+		MSG("That's all! Thanks!")
+		return EXIT_SUCCESS;
+	}
 	
 	MSG("Reading bmp source file data...")
-	if (bmp_map_setup(&bmp, input_filename, output_filename) != EXIT_SUCCESS) // 
+	span = profiler_begin(options.profiler, "bmp read");
+	// indexed output is a new file, the source is only read
+	if ((options.indexed_bits ? bmp_map_open(&bmp, input_filename, 0) :
+		bmp_map_setup(&bmp, input_filename, output_filename)) != EXIT_SUCCESS) // 
 		FATAL("bmp_map_setup")
+	profiler_end(options.profiler, span);
+
+	if (options.autotune) {
+		MSG("Tuning launch shapes and devices...")
+		span = profiler_begin(options.profiler, "autotune");
+		if (autotune_map(&bmp, &options) != EXIT_SUCCESS)
+			FATAL("autotune_map")
+		profiler_end(options.profiler, span);
+	}
+
+	if (options.device_bands && !options.tile_rows) {
+		struct band_set_t bands;
+		MSG("Processing map in device bands...")
+		span = profiler_begin(options.profiler, "setup");
+		if (band_set_setup(&bands, &options) != EXIT_SUCCESS)
+			FATAL("band_set_setup")
+		profiler_end(options.profiler, span);
+		span = profiler_begin(options.profiler, "bands");
+		if (band_process_map(&bands, &bmp) != EXIT_SUCCESS)
+			FATAL("band_process_map")
+		profiler_end(options.profiler, span);
+		distruct_band_set(&bands);
+		span = profiler_begin(options.profiler, "write");
+		if (bmp_map_put_result(&bmp) != EXIT_SUCCESS)
+			FATAL("bmp_map_put_result")
+		distruct_bmp_map(&bmp);
+		profiler_end(options.profiler, span);
+		printf("\n\t< Time: all: %fs;\n", host_wall_time() - TIME_ALL);
+		if (finish_profile(options.profiler, options.trace_file) != EXIT_SUCCESS)
+			FATAL("finish_profile")
+		MSG("That's all! Thanks!")
+		return EXIT_SUCCESS;
+	}
 
+	if (options.tile_rows) {
+		MSG("Processing map in strips...")
+		span = profiler_begin(options.profiler, "strips");
+		if (tiled_process_map(&bmp, &options, NULL) != EXIT_SUCCESS)
+			FATAL("tiled_process_map")
+		profiler_end(options.profiler, span);
+		span = profiler_begin(options.profiler, "write");
+		if (bmp_map_put_result(&bmp) != EXIT_SUCCESS)
+			FATAL("bmp_map_put_result")
+		distruct_bmp_map(&bmp);
+		profiler_end(options.profiler, span);
+		printf("\n\t< Time: all: %fs;\n", host_wall_time() - TIME_ALL);
+		if (finish_profile(options.profiler, options.trace_file) != EXIT_SUCCESS)
+			FATAL("finish_profile")
+		MSG("That's all! Thanks!")
+		return EXIT_SUCCESS;
+	}
 	
 	MSG("Setting up environment and shared buffers...")
-	if (setup_environment("kernels.cl", &cld, &bmp) != EXIT_SUCCESS) // 
+	span = profiler_begin(options.profiler, "setup");
+	if (setup_environment(options.kernel_file, &cld, &bmp, &options) != EXIT_SUCCESS) // 
 		FATAL("setup_environment")
+	profiler_end(options.profiler, span);
 
-	TIME_PARSING = clock(); // 
+	TIME_PARSING = host_wall_time(); // 
 
 	MSG("Parsing bmp file to areas...")
+	span = profiler_begin(options.profiler, "labeling");
 	if (parse_map(&cld, &bmp) != EXIT_SUCCESS) //
 		FATAL("parse_map")
+	profiler_end(options.profiler, span);
 	
 	
 	MSG("Building graph according to areas...")
+	span = profiler_begin(options.profiler, "graph init");
 	if (build_graph(&g, &cld, &bmp, 1) != EXIT_SUCCESS)
 		FATAL("build_graph")
+	profiler_end(options.profiler, span);
 	
-	TIME_PARSING = clock() - TIME_PARSING; //
-	TIME_COLORING = clock(); //
+	TIME_PARSING = host_wall_time() - TIME_PARSING; //
+	TIME_COLORING = host_wall_time(); //
 
 	MSG("Coloring the graph...")
-	if (graph_coloring(&g) != EXIT_SUCCESS)
+	span = profiler_begin(options.profiler, "coloring");
+	if ((options.parallel_coloring ?
+		graph_coloring_parallel(&g, options.thread_count) : graph_coloring(&g)) != EXIT_SUCCESS)
 		FATAL("graph_coloring")
+	profiler_end(options.profiler, span);
 
-	TIME_COLORING = clock() - TIME_COLORING;
-	TIME_ALL = clock() - TIME_ALL;
+	TIME_COLORING = host_wall_time() - TIME_COLORING;
+	TIME_ALL = host_wall_time() - TIME_ALL;
+
+	if (options.state_file || options.index_file) {
+		MSG("Exporting regions...")
+		span = profiler_begin(options.profiler, "export");
+		mask_cell* mask = (mask_cell*)malloc(bmp.image_width * bmp.image_height * sizeof(mask_cell));
+		if (mask == NULL || read_mask_rows(&cld, &bmp, 0, bmp.image_height, mask) != EXIT_SUCCESS)
+			FATAL("read_mask_rows")
+		if (options.state_file && region_state_save(options.state_file, bmp.image_width, bmp.image_height, mask, &g,
+			options.edge_search_limit ? options.edge_search_limit : EDGE_SEARCH_LIMIT, &options.border) != EXIT_SUCCESS)
+			FATAL("region_state_save")
+		if (options.index_file && region_index_write(options.index_file, bmp.image_width, bmp.image_height, mask, &g,
+			options.index_rle) != EXIT_SUCCESS)
+			FATAL("region_index_write")
+		free(mask);
+		profiler_end(options.profiler, span);
+	}
+	
+	if (options.indexed_bits) {
+		MSG("Writing indexed colors...")
+		span = profiler_begin(options.profiler, "write indexed");
+		if (write_indexed_map(&cld, &bmp, &g, output_filename) != EXIT_SUCCESS)
+			FATAL("write_indexed_map")
+		profiler_end(options.profiler, span);
+		printf("\n\t< Time: all: %fs; parsing: %fs; coloring: %fs;\n",
+			TIME_ALL, TIME_PARSING, TIME_COLORING);
+		if (finish_profile(options.profiler, options.trace_file) != EXIT_SUCCESS)
+			FATAL("finish_profile")
+		MSG("That's all! Thanks!")
+		return EXIT_SUCCESS;
+	}
 	
 	MSG("Applying colors to mask...")
+	span = profiler_begin(options.profiler, "apply colors");
 	//if (apply_colors_and_mask(&cld, &bmp, NULL) != EXIT_SUCCESS)
 	if (apply_colors_and_mask(&cld, &bmp, &g) != EXIT_SUCCESS)
 		FATAL("apply_colors_and_mask")
+	profiler_end(options.profiler, span);
 	
 	
 	MSG("Putting result to bmp file...")
+	span = profiler_begin(options.profiler, "write");
 	if (bmp_map_put_result(&bmp) != EXIT_SUCCESS)
 		FATAL("bmp_map_put_result")
+	profiler_end(options.profiler, span);
 
 	printf("\n\t< Time: all: %fs; parsing: %fs; coloring: %fs;\n",
-		(float)TIME_ALL / CLOCKS_PER_SEC, (float)TIME_PARSING / CLOCKS_PER_SEC,
-		(float)TIME_COLORING / CLOCKS_PER_SEC);
+		TIME_ALL, TIME_PARSING, TIME_COLORING);
+
+	if (finish_profile(options.profiler, options.trace_file) != EXIT_SUCCESS)
+		FATAL("finish_profile")
 
 	MSG("That's all! Thanks!")
 	
 
 	return EXIT_SUCCESS;
 }
-
@@ -0,0 +1,312 @@
+#include "tiled_map.h"
+
+#include <string.h>
+
+struct tiled_map_t {
+	struct bmp_map* bmp;
+	const struct map_options_t* options;
+	struct host_arena_t* arena;
+	size_t strip_rows;
+	size_t strip_count;
+	size_t search_limit;
+
+	mask_cell* labels; // current strip, the next one right after it
+	size_t* strip_base; // provisional id of the strip's label 0
+
+	// provisional union-find, after tiled_resolve: provisional id -> area id
+	uint32_t* parent;
+	size_t parent_capacity;
+	size_t provisional_count;
+	size_t vertex_count;
+
+	uint64_t* keys; // edge pairs of one strip
+	size_t key_count;
+	size_t key_capacity;
+};
+
+static void tiled_strip_rows(struct tiled_map_t* t, size_t strip, size_t* y0, size_t* y1) {
+	*y0 = strip * t->strip_rows;
+	*y1 = *y0 + t->strip_rows;
+	if (*y1 > t->bmp->image_height) *y1 = t->bmp->image_height;
+}
+
+// labels one strip; resolved maps its labels to area ids
+static int tiled_label_strip(struct tiled_map_t* t, size_t strip, mask_cell* dst, unsigned char resolved) {
+	size_t y0 = 0, y1 = 0, count = 0;
+	tiled_strip_rows(t, strip, &y0, &y1);
+
+	check(cpu_label_map(t->bmp->linear_sequence + y0 * t->bmp->image_row_pitch,
+		t->bmp->image_width, y1 - y0, dst, &count, t->options->thread_count, &t->options->border, t->arena) != EXIT_SUCCESS,
+		"Cannot label strip", (int)strip)
+
+	if (resolved) {
+		size_t base = t->strip_base[strip], cells = (y1 - y0) * t->bmp->image_width;
+		for (size_t i = 0; i < cells; i++) {
+			if (dst[i]) dst[i] = t->parent[base + dst[i]];
+		}
+	}
+	else {
+		t->strip_base[strip] = t->provisional_count;
+		t->provisional_count += count;
+	}
+	return EXIT_SUCCESS;
+}
+
+uint32_t tiled_find(uint32_t* parent, uint32_t p) {
+	while (parent[p] != p) {
+		parent[p] = parent[parent[p]];
+		p = parent[p];
+	}
+	return p;
+}
+
+// the larger root goes under the smaller one, so parent[p] <= p always holds
+void tiled_union(uint32_t* parent, uint32_t a, uint32_t b) {
+	a = tiled_find(parent, a);
+	b = tiled_find(parent, b);
+	if (a < b) parent[b] = a;
+	else if (b < a) parent[a] = b;
+}
+
+// pass 1: provisional ids per strip, seams merged, then compacted to 1..V
+static int tiled_resolve(struct tiled_map_t* t) {
+	size_t width = t->bmp->image_width;
+	uint32_t* seam = (uint32_t*)host_arena_calloc(t->arena, width, sizeof(uint32_t));
+	int callres = EXIT_SUCCESS;
+	check(seam == NULL, "Cannot allocate seam row", EXIT_FAILURE)
+
+	t->provisional_count = 0;
+	for (size_t strip = 0; strip < t->strip_count; strip++) {
+		size_t y0 = 0, y1 = 0;
+		tiled_strip_rows(t, strip, &y0, &y1);
+
+		check_goto_temp(tiled_label_strip(t, strip, t->labels, 0) != EXIT_SUCCESS,
+			"Cannot label map strips", EXIT_FAILURE)
+		check_goto_temp(t->provisional_count >= UINT32_MAX, "Map has too many areas for 32-bit ids", EXIT_FAILURE)
+
+		if (t->provisional_count + 1 > t->parent_capacity) {
+			size_t capacity = t->parent_capacity ? t->parent_capacity : 1024;
+			while (capacity < t->provisional_count + 1) capacity *= 2;
+			uint32_t* grown = (uint32_t*)host_arena_realloc(t->arena, t->parent,
+				t->parent_capacity * sizeof(uint32_t), capacity * sizeof(uint32_t));
+			check_goto_temp(grown == NULL, "Cannot allocate union-find", EXIT_FAILURE)
+			t->parent = grown;
+			t->parent_capacity = capacity;
+		}
+
+		size_t base = t->strip_base[strip];
+		for (size_t p = base + 1; p <= t->provisional_count; p++) t->parent[p] = (uint32_t)p;
+
+		// first row against the last row of the strip above
+		if (strip > 0) {
+			for (size_t x = 0; x < width; x++) {
+				if (seam[x] && t->labels[x])
+					tiled_union(t->parent, seam[x], (uint32_t)(base + t->labels[x]));
+			}
+		}
+
+		const mask_cell* last = t->labels + (y1 - y0 - 1) * width;
+		for (size_t x = 0; x < width; x++)
+			seam[x] = last[x] ? (uint32_t)(base + last[x]) : 0;
+	}
+
+	// roots come before their members, so one ascending pass numbers them
+	t->vertex_count = 0;
+	if (t->parent) t->parent[0] = 0;
+	for (size_t p = 1; p <= t->provisional_count; p++) {
+		uint32_t r = t->parent[p];
+		t->parent[p] = r == p ? (uint32_t)++t->vertex_count : t->parent[r];
+	}
+
+free_temporary_resources:
+	host_arena_free(t->arena, seam);
+	return callres;
+}
+
+static int tiled_push_key(struct tiled_map_t* t, mask_cell a, mask_cell b) {
+	if (t->key_count == t->key_capacity) {
+		size_t capacity = t->key_capacity ? t->key_capacity * 2 : 4096;
+		uint64_t* grown = (uint64_t*)host_arena_realloc(t->arena, t->keys,
+			t->key_capacity * sizeof(uint64_t), capacity * sizeof(uint64_t));
+		check(grown == NULL, "Cannot allocate strip edges", EXIT_FAILURE)
+		t->keys = grown;
+		t->key_capacity = capacity;
+	}
+	if (a > b) {
+		mask_cell c = a; a = b; b = c;
+	}
+	t->keys[t->key_count++] = ((uint64_t)a << 32) | b;
+	return EXIT_SUCCESS;
+}
+
+static int tiled_compare_keys(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+// same walk as the build_edges kernel, rows past the strip come from the next one
+static int tiled_strip_edges(struct tiled_map_t* t, size_t rows, size_t window_rows) {
+	size_t width = t->bmp->image_width;
+	const mask_cell* mask = t->labels;
+
+	t->key_count = 0;
+	for (size_t y = 0; y < rows; y++) {
+		for (size_t x = 0; x < width; x++) {
+			size_t idx = y * width + x;
+			mask_cell v = mask[idx], nv = 0;
+			if (v == 0) continue;
+
+			if (x + 1 < width && mask[idx + 1] == 0) {
+				size_t steps = width - x - 1;
+				if (steps > t->search_limit) steps = t->search_limit;
+				for (size_t i = 1; i <= steps && (nv = mask[idx + i]) == 0; i++);
+				if (nv != 0 && nv != v && tiled_push_key(t, v, nv) != EXIT_SUCCESS) return EXIT_FAILURE;
+			}
+
+			nv = 0;
+			if (y + 1 < window_rows && mask[idx + width] == 0) {
+				size_t steps = window_rows - y - 1;
+				if (steps > t->search_limit) steps = t->search_limit;
+				for (size_t i = 1; i <= steps && (nv = mask[idx + i * width]) == 0; i++);
+				if (nv != 0 && nv != v && tiled_push_key(t, v, nv) != EXIT_SUCCESS) return EXIT_FAILURE;
+			}
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+// pass 2: the edge list, repeats dropped per strip (graph_init_sparse drops the rest)
+static int tiled_collect_edges(struct tiled_map_t* t, struct graph_edge_t** edges, size_t* edge_count) {
+	size_t width = t->bmp->image_width, capacity = 0;
+	*edges = NULL;
+	*edge_count = 0;
+
+	check(tiled_label_strip(t, 0, t->labels, 1) != EXIT_SUCCESS, "Cannot label map strips", EXIT_FAILURE)
+
+	for (size_t strip = 0; strip < t->strip_count; strip++) {
+		size_t y0 = 0, y1 = 0, n0 = 0, n1 = 0;
+		tiled_strip_rows(t, strip, &y0, &y1);
+		if (strip + 1 < t->strip_count) {
+			tiled_strip_rows(t, strip + 1, &n0, &n1);
+			check(tiled_label_strip(t, strip + 1, t->labels + (y1 - y0) * width, 1) != EXIT_SUCCESS,
+				"Cannot label map strips", EXIT_FAILURE)
+		}
+
+		check(tiled_strip_edges(t, y1 - y0, (y1 - y0) + (n1 - n0)) != EXIT_SUCCESS,
+			"Cannot collect strip edges", EXIT_FAILURE)
+
+		if (t->key_count) qsort(t->keys, t->key_count, sizeof(uint64_t), tiled_compare_keys);
+		for (size_t i = 0; i < t->key_count; i++) {
+			if (i && t->keys[i] == t->keys[i - 1]) continue;
+			if (*edge_count == capacity) {
+				size_t grown_capacity = capacity ? capacity * 2 : 4096;
+				struct graph_edge_t* grown = (struct graph_edge_t*)host_arena_realloc(t->arena, *edges,
+					capacity * sizeof(struct graph_edge_t), grown_capacity * sizeof(struct graph_edge_t));
+				check(grown == NULL, "Cannot allocate memory for edges", EXIT_FAILURE)
+				*edges = grown;
+				capacity = grown_capacity;
+			}
+			(*edges)[*edge_count].lv = (uint32_t)(t->keys[i] >> 32);
+			(*edges)[*edge_count].rv = (uint32_t)t->keys[i];
+			(*edge_count)++;
+		}
+
+		// the next strip becomes the current one
+		if (n1 > n0) memmove(t->labels, t->labels + (y1 - y0) * width, (n1 - n0) * width * sizeof(mask_cell));
+	}
+	return EXIT_SUCCESS;
+}
+
+// pass 3: same palette as the apply_colors kernel
+void tiled_color_pixel(unsigned char* px, color_id_t color_id) {
+	const unsigned char d = 0xEE, s = 0x55;
+	unsigned char r = 0, g = 0, b = 0;
+	switch (color_id) {
+	case 1: r = d; g = s; b = s; break;
+	case 2: r = s; g = d; b = s; break;
+	case 4: r = s; g = s; b = d; break;
+	case 8: r = s; g = d; b = d; break;
+	case 16: r = d; g = d; b = s; break;
+	case 32: r = d; g = s; b = d; break;
+	}
+	px[0] = r;
+	px[1] = g;
+	px[2] = b;
+	px[3] = 0xFF;
+}
+
+static int tiled_paint(struct tiled_map_t* t, struct graph_as_row_t* g) {
+	size_t width = t->bmp->image_width;
+
+	for (size_t strip = 0; strip < t->strip_count; strip++) {
+		size_t y0 = 0, y1 = 0;
+		tiled_strip_rows(t, strip, &y0, &y1);
+		check(tiled_label_strip(t, strip, t->labels, 1) != EXIT_SUCCESS, "Cannot label map strips", EXIT_FAILURE)
+
+		unsigned char* pixels = (unsigned char*)t->bmp->linear_sequence + y0 * t->bmp->image_row_pitch;
+		for (size_t i = 0; i < (y1 - y0) * width; i++) {
+			mask_cell v = t->labels[i];
+			tiled_color_pixel(pixels + i * 4, v ? g->color_ids[v] : 0);
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+static void distruct_tiled_map(struct tiled_map_t* t) {
+	host_arena_free(t->arena, t->labels);
+	host_arena_free(t->arena, t->strip_base);
+	host_arena_free(t->arena, t->parent);
+	host_arena_free(t->arena, t->keys);
+	memset(t, 0, sizeof(struct tiled_map_t));
+}
+
+int tiled_process_map(struct bmp_map* bmp, const struct map_options_t* options, struct host_arena_t* arena) {
+	struct tiled_map_t t;
+	struct graph_as_row_t g;
+	struct graph_edge_t* edges = NULL;
+	struct host_arena_mark_t mark = host_arena_mark(arena);
+	size_t edge_count = 0;
+	int callres = EXIT_SUCCESS;
+
+	memset(&t, 0, sizeof(struct tiled_map_t));
+	memset(&g, 0, sizeof(struct graph_as_row_t));
+	t.bmp = bmp;
+	t.options = options;
+	t.arena = arena;
+	t.search_limit = options->edge_search_limit ? options->edge_search_limit : EDGE_SEARCH_LIMIT;
+
+	// a seam walk must not reach past the next strip
+	t.strip_rows = options->tile_rows;
+	if (t.strip_rows < TILE_ROWS_MIN) t.strip_rows = TILE_ROWS_MIN;
+	if (t.strip_rows < t.search_limit) t.strip_rows = t.search_limit;
+	if (t.strip_rows > bmp->image_height) t.strip_rows = bmp->image_height;
+	t.strip_count = (bmp->image_height + t.strip_rows - 1) / t.strip_rows;
+	printf("\n\t< Tiles: %lu strips of %lu rows;\n", (unsigned long)t.strip_count, (unsigned long)t.strip_rows);
+
+	t.labels = (mask_cell*)host_arena_alloc(arena, 2 * t.strip_rows * bmp->image_width * sizeof(mask_cell));
+	t.strip_base = (size_t*)host_arena_calloc(arena, t.strip_count, sizeof(size_t));
+	check_goto_temp(t.labels == NULL || t.strip_base == NULL, "Cannot allocate strip buffers", EXIT_FAILURE)
+
+	check_goto_temp(tiled_resolve(&t) != EXIT_SUCCESS, "Cannot label map", EXIT_FAILURE)
+	printf("\n\t< Areas found: %lu;\n", (unsigned long)t.vertex_count);
+
+	check_goto_temp(tiled_collect_edges(&t, &edges, &edge_count) != EXIT_SUCCESS, "Cannot build edges", EXIT_FAILURE)
+	check_goto_temp(graph_init_sparse(&g, t.vertex_count, edges, edge_count, arena) != EXIT_SUCCESS,
+		"Cannot init graph", EXIT_FAILURE)
+	host_arena_free(arena, edges);
+	edges = NULL;
+	graph_calc_links(&g, 1);
+
+	callres = options->parallel_coloring ?
+		graph_coloring_parallel(&g, options->thread_count) : graph_coloring(&g);
+	check_goto_temp(callres != EXIT_SUCCESS, "Cannot color graph", EXIT_FAILURE)
+
+	check_goto_temp(tiled_paint(&t, &g) != EXIT_SUCCESS, "Cannot apply colors", EXIT_FAILURE)
+
+free_temporary_resources:
+	host_arena_free(arena, edges);
+	distruct_graph_as_row(&g);
+	distruct_tiled_map(&t);
+	host_arena_rewind(arena, mark);
+	return callres;
+}
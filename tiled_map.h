@@ -0,0 +1,27 @@
+#pragma once
+
+#include "ocl_map_to_graph.h"
+#include "cpu_labeling.h"
+#include "host_platform.h"
+
+#define TILE_ROWS_MIN 64
+
+// Out-of-core path for maps whose image, mask or edge table do not fit on the
+// device. The map is cut into strips of tile_rows full-width rows and walked
+// three times, every strip labeled on its own by the native labeler:
+//  1. strip labels get provisional ids, a global union-find joins them across
+//     the strip seams and compacts them to 1..vertex_count;
+//  2. the edge walk runs per strip over the strip plus the labels of the next
+//     one, so crossings near a seam see the same pixels as in the whole map;
+//  3. the colored graph is painted strip by strip into the output mapping.
+// Memory is O(width * tile_rows) plus the graph, whatever the map height.
+// Host buffers come from the arena (NULL - the heap), rewound when done.
+int tiled_process_map(struct bmp_map*, const struct map_options_t*, struct host_arena_t*);
+
+// union-find over provisional ids, also merges the device bands;
+// roots stay the smallest id of their set
+uint32_t tiled_find(uint32_t* parent, uint32_t p);
+void tiled_union(uint32_t* parent, uint32_t a, uint32_t b);
+
+// one pixel in the palette of the apply_colors kernel, color 0 - border
+void tiled_color_pixel(unsigned char* px, color_id_t color_id);
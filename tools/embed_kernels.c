@@ -0,0 +1,58 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Generates kernels_source.c from kernels.cl:
+//	embed_kernels kernels.cl kernels_source.c
+// Every line becomes its own literal, so no compiler string limit is hit.
+
+int main(int argc, char** argv) {
+	FILE* in = NULL;
+	FILE* out = NULL;
+	char line[4096];
+	size_t line_count = 0;
+
+	if (argc != 3) {
+		printf("Usage: %s <kernels.cl> <kernels_source.c>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	in = fopen(argv[1], "r");
+	if (in == NULL) {
+		printf("Cannot open %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	out = fopen(argv[2], "w");
+	if (out == NULL) {
+		printf("Cannot open %s\n", argv[2]);
+		fclose(in);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(out, "// Generated from kernels.cl by tools/embed_kernels.c, do not edit.\n\n");
+	fprintf(out, "#include \"kernels_source.h\"\n\n");
+	fprintf(out, "const char* kernels_source_lines[] = {\n");
+
+	while (fgets(line, sizeof(line), in)) {
+		size_t len = strcspn(line, "\r\n");
+		line[len] = 0;
+		fputs("\t\"", out);
+		for (size_t i = 0; i < len; i++) {
+			if (line[i] == '\\' || line[i] == '"') fputc('\\', out);
+			fputc(line[i], out);
+		}
+		fputs("\\n\",\n", out);
+		line_count++;
+	}
+
+	fprintf(out, "};\n\n");
+	fprintf(out, "const size_t kernels_source_line_count = %lu;\n", (unsigned long)line_count);
+
+	fclose(in);
+	fclose(out);
+	return EXIT_SUCCESS;
+}